@@ -34,6 +34,7 @@
 #include "decimate.h"
 #include "status.h"
 #include "config.h"
+#include "metrics.h"
 
 #define N_serials 20
 uint64_t Serials[N_serials];
@@ -80,6 +81,7 @@ struct sdrstate {
 
   // Sample statistics
   int blocksize;// Number of real samples per packet or twice the number of complex samples per packet
+  uint64_t dropped_samples; // Lost by libairspy, e.g., USB overruns
 
   FILE *status;    // Real-time display in /run (currently unused)
 
@@ -100,6 +102,18 @@ struct sdrstate {
   struct rtp_state rtp; // Real time protocol (RTP) state
   int rtp_type;      // RTP type to indicate sample rate, etc (should be rethought)
 
+  // Optional decimation in the daemon: real A/D stream -> complex baseband at samprate/decimate
+  int decimate;      // 1 (off), 2, 4 or 8
+  int stages;        // log2(decimate)
+  int packet_samples; // Complex samples per output packet
+  struct hb15_state hb_q;            // First stage, Q only; I needs just a delay
+  float i_delay[3];
+  struct hb15_state hb_i[2],hb_q2[2]; // Later stages, complex
+  float *ibuf,*qbuf; // Planar I/Q work buffers
+  uint8_t *obuf;     // Output samples in wire format
+  int bufsize;       // A/D samples the buffers were sized for
+  float out_scale;   // Undoes half-band gain (and, for IQ_FLOAT, scales to +/-1)
+
   pthread_t display_thread;
   pthread_t ncmd_thread;
 };
@@ -125,11 +139,14 @@ double set_correct_freq(struct sdrstate *sdr,double freq);
 void decode_airspy_commands(struct sdrstate *,unsigned char *,int);
 void send_airspy_status(struct sdrstate *,int);
 int rx_callback(airspy_transfer *transfer);
+static int decimate_block(struct sdrstate *sdr,uint8_t const *samples,int count,uint64_t *energy);
+static void send_iq(struct sdrstate *sdr,int count);
 void *display(void *);
 void *ncmd(void *);
 double true_freq(uint64_t freq);
 static void closedown(int a);
 static void set_gain(struct sdrstate *sdr,int gainstep);
+static void airspy_metrics(struct metrics *,void *);
 
 dictionary *Dictionary;
 char const *Name;
@@ -398,7 +415,53 @@ int main(int argc,char *argv[]){
     float const dl = config_getdouble(Dictionary,Name,"agc-low-threshold",-40.0);
     Low_threshold = dB2power(-fabs(dl));
   }
-  fprintf(stdout,"Status TTL %d, Data TTL %d, blocksize %'d samples, %'d bytes\n",Status_ttl,RTP_ttl,sdr->blocksize,3 * sdr->blocksize/2);
+  sdr->decimate = config_getint(Dictionary,Name,"decimate",1);
+  switch(sdr->decimate){
+  case 1:
+    break;
+  case 2:
+  case 4:
+  case 8:
+    {
+      sdr->stages = sdr->decimate == 2 ? 1 : sdr->decimate == 4 ? 2 : 3;
+      char const *format = config_getstring(Dictionary,Name,"decimate-format","float");
+      int sample_bytes;
+      if(strcasecmp(format,"float") == 0){
+	sdr->rtp_type = IQ_FLOAT;
+	sample_bytes = sizeof(complex float);
+	sdr->out_scale = (1.0f / 2048) / (1 << (sdr->stages - 1)); // Full scale = 1.0
+      } else if(strcasecmp(format,"int12") == 0){
+	sdr->rtp_type = IQ_PT12;
+	sample_bytes = 3;
+	sdr->out_scale = 1.0f / (1 << (sdr->stages - 1)); // A/D units
+      } else {
+	fprintf(stdout,"decimate-format %s unknown; use float or int12\n",format);
+	exit(1);
+      }
+      hb15_init(&sdr->hb_q);
+      for(int i=0; i < 2; i++){
+	hb15_init(&sdr->hb_i[i]);
+	hb15_init(&sdr->hb_q2[i]);
+      }
+      // blocksize counts real samples, i.e., twice the complex samples per packet
+      // Otherwise fill the same number of bytes per packet as the undecimated stream, or an Ethernet MTU
+      int const x = config_getint(Dictionary,Name,"blocksize",-1);
+      if(x != -1)
+	sdr->packet_samples = x / 2;
+      else
+	sdr->packet_samples = (RTP_ttl == 0 ? 49152 : 1440) / sample_bytes;
+      fprintf(stdout,"Decimate by %d to %'d Hz complex, %s, %'d samples/packet\n",
+	      sdr->decimate,sdr->samprate / sdr->decimate,format,sdr->packet_samples);
+    }
+    break;
+  default:
+    fprintf(stdout,"decimate = %d invalid; must be 1, 2, 4 or 8\n",sdr->decimate);
+    exit(1);
+  }
+  if(sdr->decimate == 1)
+    fprintf(stdout,"Status TTL %d, Data TTL %d, blocksize %'d samples, %'d bytes\n",Status_ttl,RTP_ttl,sdr->blocksize,3 * sdr->blocksize/2);
+  else
+    fprintf(stdout,"Status TTL %d, Data TTL %d\n",Status_ttl,RTP_ttl);
   sdr->data_dest = config_getstring(Dictionary,Name,"data",NULL);
   // Set up output sockets
   if(sdr->data_dest == NULL){
@@ -491,6 +554,12 @@ int main(int argc,char *argv[]){
   
   if(sdr->status)
     pthread_create(&sdr->display_thread,NULL,display,sdr);
+  {
+    // Optional scrape endpoint for monitoring: [host:]port or a Unix socket path
+    char const * const metrics = config_getstring(Dictionary,Name,"metrics",NULL);
+    if(metrics != NULL)
+      metrics_start(metrics,"ka9q_airspy",airspy_metrics,sdr);
+  }
 
   pthread_create(&sdr->ncmd_thread,NULL,ncmd,sdr);
   ret = airspy_start_rx(sdr->device,rx_callback,sdr);
@@ -658,13 +727,24 @@ void send_airspy_status(struct sdrstate *sdr,int full){
   encode_int32(&bp,LOCK,sdr->frequency_lock);
 
   encode_byte(&bp,DEMOD_TYPE,0); // actually LINEAR_MODE
-  encode_int32(&bp,OUTPUT_SAMPRATE,sdr->samprate);
-  encode_int32(&bp,OUTPUT_CHANNELS,1);
-  encode_int32(&bp,DIRECT_CONVERSION,1);
-  // Receiver inverts spectrum, use lower side
-  encode_float(&bp,HIGH_EDGE,-600000);
-  encode_float(&bp,LOW_EDGE,-0.47 * sdr->samprate); // Should look at the actual filter curves
-  encode_int32(&bp,OUTPUT_BITS_PER_SAMPLE,12); // Always
+  if(sdr->decimate > 1){
+    // Complex, centered on RADIO_FREQUENCY, spectrum already flipped back upright
+    int const samprate = sdr->samprate / sdr->decimate;
+    encode_int32(&bp,OUTPUT_SAMPRATE,samprate);
+    encode_int32(&bp,OUTPUT_CHANNELS,2);
+    encode_int32(&bp,DIRECT_CONVERSION,0); // A/D DC is far outside the passband
+    encode_float(&bp,HIGH_EDGE,+HB15_PASSBAND * samprate);
+    encode_float(&bp,LOW_EDGE,-HB15_PASSBAND * samprate);
+    encode_int32(&bp,OUTPUT_BITS_PER_SAMPLE,sdr->rtp_type == IQ_FLOAT ? 32 : 12);
+  } else {
+    encode_int32(&bp,OUTPUT_SAMPRATE,sdr->samprate);
+    encode_int32(&bp,OUTPUT_CHANNELS,1);
+    encode_int32(&bp,DIRECT_CONVERSION,1);
+    // Receiver inverts spectrum, use lower side
+    encode_float(&bp,HIGH_EDGE,-600000);
+    encode_float(&bp,LOW_EDGE,-0.47 * sdr->samprate); // Should look at the actual filter curves
+    encode_int32(&bp,OUTPUT_BITS_PER_SAMPLE,12); // Always
+  }
 
   encode_eol(&bp);
   int len = bp - packet;
@@ -673,6 +753,23 @@ void send_airspy_status(struct sdrstate *sdr,int full){
 }
 
 
+// Unpack eight of Airspy's 12-bit excess-2048 samples from three 32-bit words
+static inline uint32_t const *unpack8(int s[8],uint32_t const *up){
+  s[0] =  *up >> 20;
+  s[1] =  *up >> 8;
+  s[2] =  *up++ << 4;
+  s[2] |= *up >> 28;
+  s[3] =  *up >> 16;
+  s[4] =  *up >> 4;
+  s[5] =  *up++ << 8;
+  s[5] |= *up >> 24;
+  s[6] =  *up >> 12;
+  s[7] =  *up++;
+  for(int j=0; j < 8; j++)
+    s[j] = (s[j] & 0xfff) - 2048;
+  return up;
+}
+
 int ThreadnameSet;
 // Callback called with incoming receiver data from A/D
 int rx_callback(airspy_transfer *transfer){
@@ -683,28 +780,21 @@ int rx_callback(airspy_transfer *transfer){
   struct sdrstate * const sdr = (struct sdrstate *)transfer->ctx;
   if(transfer->dropped_samples){
     fprintf(stdout,"dropped %'lld\n",(long long)transfer->dropped_samples);
-    sdr->rtp.timestamp += transfer->dropped_samples; // Let 'radio' know to maintain timing
+    sdr->dropped_samples += transfer->dropped_samples;
+    sdr->rtp.timestamp += transfer->dropped_samples / sdr->decimate; // Let 'radio' know to maintain timing
   }
   assert(transfer->sample_type == AIRSPY_SAMPLE_RAW);
+  int decimated = 0;
+  uint64_t in_energy = 0;
+  if(sdr->decimate > 1)
+    decimated = decimate_block(sdr,transfer->samples,transfer->sample_count,&in_energy); // Energy comes free
   if(Software_agc){
     uint32_t const *up = (uint32_t *)transfer->samples;
-    uint64_t in_energy = 0;
-    for(int i=0; i<transfer->sample_count; i+= 8){ // assumes multiple of 8
+    for(int i=0; sdr->decimate == 1 && i<transfer->sample_count; i+= 8){ // assumes multiple of 8
       int s[8];
-      s[0] =  *up >> 20;
-      s[1] =  *up >> 8;
-      s[2] =  *up++ << 4;
-      s[2] |= *up >> 28;
-      s[3] =  *up >> 16;
-      s[4] =  *up >> 4;
-      s[5] =  *up++ << 8;
-      s[5] |= *up >> 24;
-      s[6] =  *up >> 12;
-      s[7] =  *up++;
-      for(int j=0; j < 8; j++){
-	int const x = (s[j] & 0xfff) - 2048; // not actually necessary for s[0]
-	in_energy += x * x;
-      }
+      up = unpack8(s,up);
+      for(int j=0; j < 8; j++)
+	in_energy += s[j] * s[j];
     }
     // Scale by 2 / 2048^2 = 2^-21 for 0 dBFS = full scale sine wave
     float const power = (float)(in_energy >> 21) / transfer->sample_count;
@@ -724,6 +814,10 @@ int rx_callback(airspy_transfer *transfer){
 	printf("Power %.1f dB\n",power2dB(power));
     }
   }
+  if(sdr->decimate > 1){
+    send_iq(sdr,decimated);
+    return 0;
+  }
 
   struct rtp_header rtp;
   memset(&rtp,0,sizeof(rtp));
@@ -772,6 +866,133 @@ int rx_callback(airspy_transfer *transfer){
   return 0;
 }
 
+// Convert a block of real A/D samples to complex baseband at samprate/decimate, in sdr->ibuf and sdr->qbuf
+// Returns the number of complex samples; A/D energy is added to *energy for the AGC
+//
+// The first stage shifts up by Fs/4 (multiplies by j^n), which moves the lower side of the real spectrum,
+// the one 'radio' uses, to baseband right side up. A half-band filter then removes the upper image and
+// we drop every other sample. Because the shift makes I zero on odd samples and Q zero on even samples,
+// I sees only the unity center tap of the filter, i.e., a pure delay, and Q sees only the odd taps.
+// Each further stage is an ordinary hb15 on I and Q separately
+static int decimate_block(struct sdrstate * const sdr,uint8_t const * const samples,int const count,uint64_t * const energy){
+  if(count % 16 != 0){
+    fprintf(stdout,"A/D block of %d samples not a multiple of 16, dropped\n",count);
+    return 0;
+  }
+  if(count > sdr->bufsize){
+    free(sdr->ibuf);
+    free(sdr->qbuf);
+    free(sdr->obuf);
+    sdr->ibuf = malloc(count/2 * sizeof(*sdr->ibuf));
+    sdr->qbuf = malloc(count * sizeof(*sdr->qbuf));
+    sdr->obuf = malloc(count/2 * sizeof(complex float)); // big enough for either format
+    assert(sdr->ibuf != NULL && sdr->qbuf != NULL && sdr->obuf != NULL);
+    sdr->bufsize = count;
+  }
+  float * const ibuf = sdr->ibuf;
+  float * const qbuf = sdr->qbuf;
+  uint32_t const *up = (uint32_t *)samples;
+  uint64_t in_energy = 0;
+
+  // Mixer phase restarts every 4 samples and count is a multiple of 16, so it doesn't need to be carried over
+  for(int i=0; i < count; i += 8){
+    int s[8];
+    up = unpack8(s,up);
+    for(int j=0; j < 8; j++)
+      in_energy += s[j] * s[j];
+
+    // Samples 0-7 multiplied by 1, j, -1, -j, 1, j, -1, -j
+    int const m = i/2; // Output index of s[0]
+    ibuf[m] = sdr->i_delay[0];
+    ibuf[m+1] = sdr->i_delay[1];
+    ibuf[m+2] = sdr->i_delay[2];
+    ibuf[m+3] = s[0];
+    sdr->i_delay[0] = -s[2];
+    sdr->i_delay[1] = s[4];
+    sdr->i_delay[2] = -s[6];
+
+    qbuf[i] = 0;
+    qbuf[i+1] = s[1];
+    qbuf[i+2] = 0;
+    qbuf[i+3] = -s[3];
+    qbuf[i+4] = 0;
+    qbuf[i+5] = s[5];
+    qbuf[i+6] = 0;
+    qbuf[i+7] = -s[7];
+  }
+  *energy += in_energy;
+
+  int n = count / 2;
+  hb15_block(&sdr->hb_q,qbuf,qbuf,n); // In place is safe: output index never passes input
+  for(int stage=1; stage < sdr->stages; stage++){
+    n /= 2;
+    hb15_block(&sdr->hb_i[stage-1],ibuf,ibuf,n);
+    hb15_block(&sdr->hb_q2[stage-1],qbuf,qbuf,n);
+  }
+  return n;
+}
+
+// Send decimated complex samples in sdr->ibuf/qbuf, converted to the output format and split into packets
+static void send_iq(struct sdrstate * const sdr,int const count){
+  float const scale = sdr->out_scale;
+  int sample_bytes;
+  if(sdr->rtp_type == IQ_FLOAT){
+    complex float * const op = (complex float *)sdr->obuf;
+    for(int i=0; i < count; i++)
+      op[i] = CMPLXF(sdr->ibuf[i] * scale,sdr->qbuf[i] * scale);
+    sample_bytes = sizeof(complex float);
+  } else {
+    // Two 12-bit signed integers packed big-endian into 3 bytes
+    uint8_t *op = sdr->obuf;
+    for(int i=0; i < count; i++){
+      int const is = min(2047,max(-2048,(int)lrintf(sdr->ibuf[i] * scale)));
+      int const qs = min(2047,max(-2048,(int)lrintf(sdr->qbuf[i] * scale)));
+      *op++ = is >> 4;
+      *op++ = (is << 4) | ((qs >> 8) & 0xf);
+      *op++ = qs;
+    }
+    sample_bytes = 3;
+  }
+  struct rtp_header rtp;
+  memset(&rtp,0,sizeof(rtp));
+  rtp.version = RTP_VERS;
+  rtp.type = sdr->rtp_type;
+  rtp.ssrc = sdr->rtp.ssrc;
+
+  uint8_t buffer[128]; // larger than biggest possible RTP header
+  struct iovec iov[2];
+  iov[0].iov_base = buffer;
+
+  struct msghdr msg;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  uint8_t *idp = sdr->obuf;
+  int samples = count;
+  while(samples > 0){
+    int const chunk = min(samples,sdr->packet_samples);
+
+    rtp.seq = sdr->rtp.seq++;
+    rtp.timestamp = sdr->rtp.timestamp;
+    uint8_t * const dp = hton_rtp(buffer,&rtp);
+
+    iov[0].iov_len = dp - buffer;
+    iov[1].iov_base = idp;
+    iov[1].iov_len = chunk * sample_bytes;
+    idp += iov[1].iov_len;
+
+    if(sendmsg(sdr->data_sock,&msg,0) == -1){
+      fprintf(stdout,"send: %s\n",strerror(errno));
+    } else {
+      sdr->rtp.packets++;
+      sdr->rtp.bytes += iov[0].iov_len + iov[1].iov_len;
+    }
+    sdr->rtp.timestamp += chunk; // complex samples
+    samples -= chunk;
+  }
+}
+
 // For a requested frequency, give the actual tuning frequency
 // Many thanks to Youssef Touil <youssef@airspy.com> who gave me most of it
 // This "mostly" works except that the calibration correction inside the unit
@@ -821,13 +1042,16 @@ double true_freq(uint64_t freq_hz){
 // All this really works correctly only with a gpsdo
 // Remember, airspy firmware always adds Fs/4 MHz to frequency we give it.
 
+// When decimating, the complex output is centered Fs/4 below where the real stream's frequency would be,
+// so tune that much higher; the reported frequency is the center of the complex output
 double set_correct_freq(struct sdrstate *sdr,double freq){
-  int64_t intfreq = round(freq / (1 + sdr->calibration));
+  double const shift = sdr->decimate > 1 ? sdr->samprate / 4 : 0;
+  int64_t intfreq = round((freq + shift) / (1 + sdr->calibration));
   int ret __attribute__((unused)) = AIRSPY_SUCCESS; // Won't be used when asserts are disabled
   ret = airspy_set_freq(sdr->device,intfreq - sdr->offset);
   assert(ret == AIRSPY_SUCCESS);
   double const tf = true_freq(intfreq);
-  sdr->frequency = tf * (1 + sdr->calibration);
+  sdr->frequency = tf * (1 + sdr->calibration) - shift;
   FILE *fp = fopen(sdr->frequency_file,"w");
   if(fp){
     if(fprintf(fp,"%lf\n",sdr->frequency) < 0)
@@ -879,4 +1103,21 @@ static void set_gain(struct sdrstate *sdr,int gainstep){
   }
 }
 
-
+// Collect function for the metrics endpoint ('metrics =' in our config section)
+static void airspy_metrics(struct metrics * const m,void *arg){
+  struct sdrstate const * const sdr = (struct sdrstate *)arg;
+  metric_family(m,"output_packets_total","counter","RTP data packets sent");
+  metric(m,"output_packets_total",sdr->rtp.packets,"ssrc=\"%u\",section=\"%s\"",sdr->rtp.ssrc,Name);
+  metric_family(m,"output_bytes_total","counter","RTP data bytes sent");
+  metric(m,"output_bytes_total",sdr->rtp.bytes,"ssrc=\"%u\",section=\"%s\"",sdr->rtp.ssrc,Name);
+  metric_family(m,"dropped_samples_total","counter","A/D samples lost by the driver");
+  metric(m,"dropped_samples_total",sdr->dropped_samples,"ssrc=\"%u\",section=\"%s\"",sdr->rtp.ssrc,Name);
+  metric_family(m,"status_packets_total","counter","Status packets sent");
+  metric(m,"status_packets_total",sdr->output_metadata_packets,"ssrc=\"%u\",section=\"%s\"",sdr->rtp.ssrc,Name);
+  metric_family(m,"commands_total","counter","Commands received");
+  metric(m,"commands_total",sdr->commands,"ssrc=\"%u\",section=\"%s\"",sdr->rtp.ssrc,Name);
+  metric_family(m,"frequency_hz","gauge","Tuner frequency");
+  metric(m,"frequency_hz",sdr->frequency,"ssrc=\"%u\",section=\"%s\"",sdr->rtp.ssrc,Name);
+  metric_family(m,"gain_step","gauge","Gain table step, 0-21");
+  metric(m,"gain_step",sdr->gainstep,"ssrc=\"%u\",section=\"%s\"",sdr->rtp.ssrc,Name);
+}
@@ -33,6 +33,7 @@
 #include "decimate.h"
 #include "status.h"
 #include "config.h"
+#include "metrics.h"
 
 #define N_serials 20
 uint64_t Serials[N_serials];
@@ -80,6 +81,7 @@ struct sdrstate {
   int clips;  // Sample clips since last reset
   float power;   // Running estimate of A/D signal power
   float DC;      // DC offset for real samples
+  uint64_t dropped_samples; // Lost by libairspyhf, e.g., USB overruns
 
   int blocksize;// Number of real samples per packet or twice the number of complex samples per packet
 
@@ -125,6 +127,7 @@ void *display(void *);
 void *ncmd(void *arg);
 double true_freq(uint64_t freq);
 static void closedown(int a);
+static void airspyhf_metrics(struct metrics *,void *);
 
 dictionary *Dictionary;
 char const *Name;
@@ -443,6 +446,12 @@ int main(int argc,char *argv[]){
   
   if(sdr->status)
     pthread_create(&sdr->display_thread,NULL,display,sdr);
+  {
+    // Optional scrape endpoint for monitoring: [host:]port or a Unix socket path
+    char const * const metrics = config_getstring(Dictionary,Name,"metrics",NULL);
+    if(metrics != NULL)
+      metrics_start(metrics,"ka9q_airspyhf",airspyhf_metrics,sdr);
+  }
 
   pthread_create(&sdr->ncmd_thread,NULL,ncmd,sdr);
   ret = airspyhf_start(sdr->device,rx_callback,sdr);
@@ -611,6 +620,7 @@ int rx_callback(airspyhf_transfer_t *transfer){
   struct sdrstate * const sdr = (struct sdrstate *)transfer->ctx;
   if(transfer->dropped_samples){
     fprintf(stdout,"dropped %'lld\n",(long long)transfer->dropped_samples);
+    sdr->dropped_samples += transfer->dropped_samples;
     sdr->rtp.timestamp += transfer->dropped_samples; // Let the radio program know
   }
   struct rtp_header rtp;
@@ -698,3 +708,19 @@ static void closedown(int a){
   exit(1);
 }
 
+// Collect function for the metrics endpoint ('metrics =' in our config section)
+static void airspyhf_metrics(struct metrics * const m,void *arg){
+  struct sdrstate const * const sdr = (struct sdrstate *)arg;
+  metric_family(m,"output_packets_total","counter","RTP data packets sent");
+  metric(m,"output_packets_total",sdr->rtp.packets,"ssrc=\"%u\",section=\"%s\"",sdr->rtp.ssrc,Name);
+  metric_family(m,"output_bytes_total","counter","RTP data bytes sent");
+  metric(m,"output_bytes_total",sdr->rtp.bytes,"ssrc=\"%u\",section=\"%s\"",sdr->rtp.ssrc,Name);
+  metric_family(m,"dropped_samples_total","counter","A/D samples lost by the driver");
+  metric(m,"dropped_samples_total",sdr->dropped_samples,"ssrc=\"%u\",section=\"%s\"",sdr->rtp.ssrc,Name);
+  metric_family(m,"status_packets_total","counter","Status packets sent");
+  metric(m,"status_packets_total",sdr->output_metadata_packets,"ssrc=\"%u\",section=\"%s\"",sdr->rtp.ssrc,Name);
+  metric_family(m,"commands_total","counter","Commands received");
+  metric(m,"commands_total",sdr->commands,"ssrc=\"%u\",section=\"%s\"",sdr->rtp.ssrc,Name);
+  metric_family(m,"frequency_hz","gauge","Tuner frequency");
+  metric(m,"frequency_hz",sdr->frequency,"ssrc=\"%u\",section=\"%s\"",sdr->rtp.ssrc,Name);
+}
@@ -12,18 +12,81 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include "misc.h"
 #include "multicast.h"
 #include "radio.h"
+#include "attr.h"
 
 #define PCM_BUFSIZE 480        // 16-bit word count; must fit in Ethernet MTU
 #define PACKETSIZE 2048        // Somewhat larger than Ethernet MTU
 
+struct shm_segment *Shm;
+
 static int pt_from_demod(struct demod *demod){
   return pt_from_info(demod->output.samprate,demod->output.channels);
 }
 
+// Send a finished packet to the network, and to local readers if there's a shared-memory segment
+static int send_packet(struct demod * const demod,unsigned char const * const packet,int const len){
+  if(Shm != NULL){
+    if(demod->output.shm == NULL) // Retried each packet if the rings are all taken; cheap, and one may come free
+      demod->output.shm = shm_ring_get(Shm,demod->output.rtp.ssrc,&demod->output.data_source_address,&demod->output.data_dest_address,&demod->output.shm_missing);
+    shm_send(Shm,demod->output.shm,packet,len);
+  }
+  return send(demod->output.data_fd,packet,len,0);
+}
+
+// Create the demod's output file, <output-dir>/<ssrc>.raw, with the same xattrs as a pcmrecord raw file
+static int open_file(struct demod * const demod){
+  char filename[PATH_MAX];
+  snprintf(filename,sizeof(filename),"%s/%u.raw",demod->output.file_dir,demod->output.rtp.ssrc);
+  int const fd = open(filename,O_WRONLY|O_CREAT|O_TRUNC,0644);
+  if(fd == -1){
+    fprintf(stdout,"can't create %s: %s\n",filename,strerror(errno));
+    demod->output.file_dir[0] = '\0'; // Don't keep trying
+    return -1;
+  }
+  attrprintf(fd,"samplerate","%lu",(unsigned long)demod->output.samprate);
+  attrprintf(fd,"channels","%d",demod->output.channels);
+  attrprintf(fd,"ssrc","%u",demod->output.rtp.ssrc);
+  attrprintf(fd,"sampleformat","s16le");
+  attrprintf(fd,"frequency","%lf",demod->tune.freq);
+  // From a recording, this is when it was recorded
+  long long const unix_ns = demod->frontend->sdr.timestamp + (long long)(UNIX_EPOCH - GPS_UTC_OFFSET) * BILLION;
+  attrprintf(fd,"unixstarttime","%lld.%09lld",unix_ns / BILLION,unix_ns % BILLION);
+  demod->output.file_fd = fd;
+  return 0;
+}
+
+// Write 'count' network-order samples from an RTP payload to the demod's output file, in host order
+// NULL writes silence, so the file stays aligned with the RTP timestamp through muted intervals
+static int write_file(struct demod * const demod,int16_t const *pcm,int count){
+  if(demod->output.file_fd < 3 && open_file(demod) == -1)
+    return -1;
+  while(count > 0){
+    int16_t buf[PCM_BUFSIZE];
+    int const chunk = min(PCM_BUFSIZE,count);
+    for(int i=0; i < chunk; i++)
+      buf[i] = pcm != NULL ? ntohs(*pcm++) : 0;
+    if(write(demod->output.file_fd,buf,chunk * sizeof(*buf)) != chunk * (int)sizeof(*buf)){
+      perror("pcm write");
+      return -1;
+    }
+    count -= chunk;
+  }
+  return 0;
+}
+
+
+// Note how far the demod's output has got, in input filter blocks
+static void output_done(struct demod * const demod){
+  if(demod->filter.out != NULL)
+    demod->output.block = demod->filter.out->blocknum;
+}
 
 // Send 'size' stereo samples, each in a pair of floats
 int send_stereo_output(struct demod * restrict const demod,float const * restrict buffer,int size,int mute){
@@ -32,9 +95,13 @@ int send_stereo_output(struct demod * restrict const demod,float const * restric
     // Increment timestamp
     demod->output.rtp.timestamp += size; // Increase by sample count
     demod->output.silent = 1;
+    if(demod->output.file_dir[0] != '\0')
+      write_file(demod,NULL,2*size);
+    output_done(demod);
     return 0;
   }
 
+  long long const start = timing_now();
   struct rtp_header rtp;
   memset(&rtp,0,sizeof(rtp));
   rtp.type = pt_from_demod(demod);
@@ -61,14 +128,18 @@ int send_stereo_output(struct demod * restrict const demod,float const * restric
       *pcm_buf++ = htons(scaleclip(*buffer++));
 
     dp = (unsigned char *)pcm_buf;
-    int r = send(demod->output.data_fd,&packet,dp - packet,0);
     demod->output.samples += chunk/2; // Count stereo samples
-    if(r <= 0){
+    if(demod->output.file_dir[0] != '\0'){
+      if(write_file(demod,(int16_t *)(dp - sizeof(int16_t) * chunk),chunk) == -1)
+	return -1;
+    } else if(send_packet(demod,packet,dp - packet) <= 0){
       perror("pcm send");
       return -1;
     }
     size -= chunk/2;
   }
+  timing_add(&demod->output.timing,timing_now() - start);
+  output_done(demod);
   return 0;
 }
 
@@ -78,8 +149,12 @@ int send_mono_output(struct demod * restrict const demod,float const * restrict
     // Increment timestamp
     demod->output.rtp.timestamp += size; // Increase by sample count
     demod->output.silent = 1;
+    if(demod->output.file_dir[0] != '\0')
+      write_file(demod,NULL,size);
+    output_done(demod);
     return 0;
   }
+  long long const start = timing_now();
   struct rtp_header rtp;
   memset(&rtp,0,sizeof(rtp));
   rtp.version = RTP_VERS;
@@ -108,14 +183,18 @@ int send_mono_output(struct demod * restrict const demod,float const * restrict
       *pcm_buf++ = htons(scaleclip(*buffer++));
 
     dp = (unsigned char *)pcm_buf;
-    int r = send(demod->output.data_fd,&packet,dp - packet,0);
     demod->output.samples += chunk;
-    if(r <= 0){
+    if(demod->output.file_dir[0] != '\0'){
+      if(write_file(demod,(int16_t *)(dp - sizeof(int16_t) * chunk),chunk) == -1)
+	return -1;
+    } else if(send_packet(demod,packet,dp - packet) <= 0){
       perror("pcm send");
       return -1;
     }
     size -= chunk;
   }
+  timing_add(&demod->output.timing,timing_now() - start);
+  output_done(demod);
   return 0;
 }
 
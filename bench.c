@@ -0,0 +1,794 @@
+// Offline benchmark for the radio DSP chain: no SDR hardware, no multicast input
+// A synthetic front end generates multiple carriers plus noise in one of the front end sample formats
+// and feeds them through the same code as radio (proc_packet(), the input filter and its FFT workers,
+// and the demods), as fast as the slowest demod can keep up, or optionally paced in real time
+// Reports input samples/s, ns per block for each stage, block drops and CPU time per channel,
+// as text or as JSON for tracking regressions from one commit to the next
+// -S times just the status TLV codec instead: field-at-a-time encode_*() and a decode switch against encode_struct()/decode_struct()
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <complex.h>
+#undef I
+#include <pthread.h>
+#include <time.h>
+#include <locale.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if defined(linux)
+#include <bsd/string.h>
+#endif
+#include <fftw3.h>
+
+#include "misc.h"
+#include "multicast.h"
+#include "radio.h"
+#include "filter.h"
+#include "status.h"
+
+// Globals radio.c and friends expect the main program to provide
+int Verbose;
+int Mcast_ttl = 0;
+char const *Modefile = "/usr/local/share/ka9q-radio/modes.conf";
+struct timespec Starttime;
+
+static int const DEFAULT_SAMPRATE = 1920000;  // Divides evenly into all the usual output rates
+static int const DEFAULT_CHANNELS = 10;
+static char const *DEFAULT_MODES = "fm,usb,am";
+static float const DEFAULT_BLOCKTIME = 20.0;
+static int const DEFAULT_OVERLAP = 5;
+static double const DEFAULT_SECONDS = 10;
+static float const DEFAULT_NOISE = -50;       // Total noise power, dBFS
+static double const LO_frequency = 146e6;     // Arbitrary, but demods can't tune to 0 Hz
+static int const Audio_tone = 1000;           // Hz above the carrier for 'tone' signals
+static int const Fm_deviation = 5000;
+static int const Wfm_deviation = 75000;
+
+enum signal_type {
+  SIG_TONE,     // Unmodulated carrier, offset so SSB demods produce a tone
+  SIG_VOICE,    // Voice-like modulation suited to each channel's mode: AM for linear, FM for FM and WFM
+  SIG_NOISE,    // Noise only
+};
+
+struct format {
+  char const *name;
+  int type;             // RTP payload type
+  bool isreal;
+  int samples;          // Per packet, to keep under an Ethernet MTU like the real front ends
+  int bytes;            // Per packet
+};
+static struct format const Formats[] = {
+  { "iq_float", IQ_FLOAT, false, 180, 180 * sizeof(complex float) },
+  { "iq_pt12", IQ_PT12, false, 480, 480 * 3 },
+  { "airspy", AIRSPY_PACKED, true, 960, 960 * 3 / 2 },
+};
+#define NFORMATS (sizeof(Formats)/sizeof(Formats[0]))
+
+struct channel {
+  struct demod *demod;
+  char mode[32];
+  double freq;          // RF
+  double if_freq;       // Relative to the LO, whole Hz so a period is a whole number of cycles
+};
+
+// Voice-like audio: three tones under a 3 Hz syllabic envelope, peak about 1
+// Every component is a whole number of Hz, so one second of it repeats seamlessly
+static double voice(double const t){
+  double const env = 0.5 * (1 + sin(2 * M_PI * 3 * t));
+  double const a = sin(2 * M_PI * 400 * t) + 0.6 * sin(2 * M_PI * 900 * t) + 0.3 * sin(2 * M_PI * 1700 * t);
+  return env * a / 1.9;
+}
+
+// Standard normal deviate, from random() so runs with the same seed are identical
+static double gaussian(void){
+  double u1,u2;
+  do {
+    u1 = (double)random() / RAND_MAX;
+  } while(u1 <= 0);
+  u2 = (double)random() / RAND_MAX;
+  return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+// Generate 'n' samples (one period) of all the carriers plus noise
+// Real formats get the real part of the same analytic signal
+static void generate(complex float * const buf,int const n,int const samprate,struct channel const * const chans,int const nchan,
+		     enum signal_type const sig,float const noise_db){
+  memset(buf,0,n * sizeof(*buf));
+  float const amp = nchan > 0 ? 0.5f / nchan : 0; // Keeps AM peaks of all carriers together inside full scale
+  if(sig != SIG_NOISE){
+    // The same program material on every channel
+    float * const audio = malloc(n * sizeof(*audio));
+    assert(audio != NULL);
+    for(int i=0; i < n; i++)
+      audio[i] = voice((double)i / samprate);
+    for(int c=0; c < nchan; c++){
+      struct demod const * const demod = chans[c].demod;
+      double const f = chans[c].if_freq + (sig == SIG_TONE ? Audio_tone : 0);
+      int const dev = demod->demod_type == WFM_DEMOD ? Wfm_deviation : Fm_deviation;
+      bool const fm = sig == SIG_VOICE && demod->demod_type != LINEAR_DEMOD;
+      bool const am = sig == SIG_VOICE && demod->demod_type == LINEAR_DEMOD;
+      double phase = 0;
+      for(int i=0; i < n; i++){
+	double a = amp;
+	double freq = f;
+	if(am)
+	  a *= 1 + 0.8 * audio[i];
+	else if(fm)
+	  freq += dev * audio[i];
+	buf[i] += a * csincos(phase);
+	phase += 2 * M_PI * freq / samprate;
+	if(phase > M_PI)
+	  phase -= 2 * M_PI;
+	else if(phase < -M_PI)
+	  phase += 2 * M_PI;
+      }
+    }
+    free(audio);
+  }
+  float const sigma = sqrtf(dB2power(noise_db) / 2); // Per component
+  for(int i=0; i < n; i++){
+    float const re = sigma * gaussian();
+    float const im = sigma * gaussian();
+    buf[i] += CMPLXF(re,im);
+  }
+}
+
+static int clip12(float const x){
+  int const s = lrintf(x * 2047);
+  return s > 2047 ? 2047 : s < -2048 ? -2048 : s;
+}
+
+// Encode one packet's worth of payload in the front end's format; exactly inverts the decoding in proc_packet()
+static void encode(uint8_t *dp,complex float const * const s,struct format const * const fmt){
+  switch(fmt->type){
+  case IQ_FLOAT:
+    memcpy(dp,s,fmt->samples * sizeof(*s));
+    break;
+  case IQ_PT12:     // Two 12-bit signed integers, big endian, left justified in 16 bits after decoding
+    for(int i=0; i < fmt->samples; i++){
+      int const r = clip12(crealf(s[i]));
+      int const q = clip12(cimagf(s[i]));
+      *dp++ = r >> 4;
+      *dp++ = (r << 4) | ((q >> 8) & 0xf);
+      *dp++ = q;
+    }
+    break;
+  case AIRSPY_PACKED: // Eight 12-bit excess-2048 real samples in three native-order 32-bit words
+    {
+      uint32_t *up = (uint32_t *)dp;
+      for(int i=0; i < fmt->samples; i += 8){
+	uint32_t u[8];
+	for(int j=0; j < 8; j++)
+	  u[j] = (clip12(crealf(s[i+j])) + 2048) & 0xfff;
+	*up++ = u[0] << 20 | u[1] << 8 | u[2] >> 4;
+	*up++ = (u[2] & 0xf) << 28 | u[3] << 16 | u[4] << 4 | u[5] >> 8;
+	*up++ = (u[5] & 0xff) << 24 | u[6] << 12 | u[7];
+      }
+    }
+    break;
+  }
+}
+
+static double cpu_seconds(clockid_t const id){
+  struct timespec ts;
+  if(clock_gettime(id,&ts) != 0)
+    return NAN;
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static double elapsed(struct timespec const * const start,struct timespec const * const end){
+  return (end->tv_sec - start->tv_sec) + 1e-9 * (end->tv_nsec - start->tv_nsec);
+}
+
+// JSON numbers can't be NaN or infinite
+static void json_number(FILE *fp,char const * const name,double const x,bool const comma){
+  if(isfinite(x))
+    fprintf(fp,"\"%s\":%.6g%s",name,x,comma ? "," : "");
+  else
+    fprintf(fp,"\"%s\":null%s",name,comma ? "," : "");
+}
+
+// Front end status fields for the codec benchmark, the same set radio sends for each front end
+static struct status_field const Bench_schema[] = {
+  STATUS_FIELD(GPS_TIME,struct frontend,SF_INT,sdr.timestamp),
+  STATUS_FIELD(DESCRIPTION,struct frontend,SF_STRING,sdr.description),
+  STATUS_FIELD(INPUT_DATA_SOURCE_SOCKET,struct frontend,SF_SOCKET,input.data_source_address),
+  STATUS_FIELD(INPUT_DATA_DEST_SOCKET,struct frontend,SF_SOCKET,input.data_dest_address),
+  STATUS_FIELD(INPUT_METADATA_SOURCE_SOCKET,struct frontend,SF_SOCKET,input.metadata_source_address),
+  STATUS_FIELD(INPUT_METADATA_DEST_SOCKET,struct frontend,SF_SOCKET,input.metadata_dest_address),
+  STATUS_FIELD(INPUT_SSRC,struct frontend,SF_UINT,input.rtp.ssrc),
+  STATUS_FIELD(INPUT_SAMPRATE,struct frontend,SF_INT,sdr.samprate),
+  STATUS_FIELD(INPUT_METADATA_PACKETS,struct frontend,SF_UINT,input.metadata_packets),
+  STATUS_FIELD(INPUT_DATA_PACKETS,struct frontend,SF_INT,input.rtp.packets),
+  STATUS_FIELD(INPUT_SAMPLES,struct frontend,SF_UINT,input.samples),
+  STATUS_FIELD(INPUT_DROPS,struct frontend,SF_INT,input.rtp.drops),
+  STATUS_FIELD(INPUT_DUPES,struct frontend,SF_INT,input.rtp.dupes),
+  STATUS_FIELD(FIRST_LO_FREQUENCY,struct frontend,SF_DOUBLE,sdr.frequency),
+  STATUS_FIELD(LOW_EDGE,struct frontend,SF_FLOAT,sdr.min_IF),
+  STATUS_FIELD(HIGH_EDGE,struct frontend,SF_FLOAT,sdr.max_IF),
+  STATUS_FIELD(LOCK,struct frontend,SF_BOOL,sdr.lock),
+  { EOL },
+};
+
+// The same fields the old way, in the same (type) order so the packets can be compared
+static int encode_by_hand(unsigned char * const packet,struct frontend const * const f){
+  unsigned char *bp = packet;
+  *bp++ = 0;
+  encode_int64(&bp,GPS_TIME,f->sdr.timestamp);
+  encode_string(&bp,DESCRIPTION,f->sdr.description,strlen(f->sdr.description));
+  encode_socket(&bp,INPUT_DATA_SOURCE_SOCKET,&f->input.data_source_address);
+  encode_socket(&bp,INPUT_DATA_DEST_SOCKET,&f->input.data_dest_address);
+  encode_socket(&bp,INPUT_METADATA_SOURCE_SOCKET,&f->input.metadata_source_address);
+  encode_socket(&bp,INPUT_METADATA_DEST_SOCKET,&f->input.metadata_dest_address);
+  encode_int32(&bp,INPUT_SSRC,f->input.rtp.ssrc);
+  encode_int32(&bp,INPUT_SAMPRATE,f->sdr.samprate);
+  encode_int64(&bp,INPUT_METADATA_PACKETS,f->input.metadata_packets);
+  encode_int64(&bp,INPUT_DATA_PACKETS,f->input.rtp.packets);
+  encode_int64(&bp,INPUT_SAMPLES,f->input.samples);
+  encode_int64(&bp,INPUT_DROPS,f->input.rtp.drops);
+  encode_int64(&bp,INPUT_DUPES,f->input.rtp.dupes);
+  encode_double(&bp,FIRST_LO_FREQUENCY,f->sdr.frequency);
+  encode_float(&bp,LOW_EDGE,f->sdr.min_IF);
+  encode_float(&bp,HIGH_EDGE,f->sdr.max_IF);
+  encode_byte(&bp,LOCK,f->sdr.lock);
+  encode_eol(&bp);
+  return bp - packet;
+}
+
+static void decode_by_hand(unsigned char const * const buffer,int const length,struct frontend * const f){
+  unsigned char const *cp = buffer;
+  while(cp - buffer < length){
+    enum status_type const type = *cp++;
+    if(type == EOL)
+      break;
+    unsigned int const optlen = *cp++;
+    if(cp - buffer + optlen > length)
+      break;
+    switch(type){
+    case DESCRIPTION:
+      decode_string(cp,optlen,f->sdr.description,sizeof(f->sdr.description));
+      break;
+    case GPS_TIME:
+      f->sdr.timestamp = decode_int(cp,optlen);
+      break;
+    case INPUT_DATA_SOURCE_SOCKET:
+      decode_socket(&f->input.data_source_address,cp,optlen);
+      break;
+    case INPUT_DATA_DEST_SOCKET:
+      decode_socket(&f->input.data_dest_address,cp,optlen);
+      break;
+    case INPUT_METADATA_SOURCE_SOCKET:
+      decode_socket(&f->input.metadata_source_address,cp,optlen);
+      break;
+    case INPUT_METADATA_DEST_SOCKET:
+      decode_socket(&f->input.metadata_dest_address,cp,optlen);
+      break;
+    case INPUT_SSRC:
+      f->input.rtp.ssrc = decode_int(cp,optlen);
+      break;
+    case INPUT_SAMPRATE:
+      f->sdr.samprate = decode_int(cp,optlen);
+      break;
+    case INPUT_METADATA_PACKETS:
+      f->input.metadata_packets = decode_int(cp,optlen);
+      break;
+    case INPUT_DATA_PACKETS:
+      f->input.rtp.packets = decode_int(cp,optlen);
+      break;
+    case INPUT_SAMPLES:
+      f->input.samples = decode_int(cp,optlen);
+      break;
+    case INPUT_DROPS:
+      f->input.rtp.drops = decode_int(cp,optlen);
+      break;
+    case INPUT_DUPES:
+      f->input.rtp.dupes = decode_int(cp,optlen);
+      break;
+    case FIRST_LO_FREQUENCY:
+      f->sdr.frequency = decode_double(cp,optlen);
+      break;
+    case LOW_EDGE:
+      f->sdr.min_IF = decode_float(cp,optlen);
+      break;
+    case HIGH_EDGE:
+      f->sdr.max_IF = decode_float(cp,optlen);
+      break;
+    case LOCK:
+      f->sdr.lock = decode_int(cp,optlen);
+      break;
+    default:
+      break;
+    }
+    cp += optlen;
+  }
+}
+
+static double ns_per(struct timespec const * const start,struct timespec const * const end,long const n){
+  return 1e9 * elapsed(start,end) / n;
+}
+
+// Time the status codec both ways on a typical front end status packet
+static void status_bench(long const iterations,bool const json){
+  static struct frontend f,g; // Too big for the stack
+  strlcpy(f.sdr.description,"radio-bench synthetic front end",sizeof(f.sdr.description));
+  f.sdr.timestamp = 1350000000LL * BILLION;
+  f.sdr.samprate = DEFAULT_SAMPRATE;
+  f.sdr.frequency = LO_frequency;
+  f.sdr.min_IF = -0.45 * DEFAULT_SAMPRATE;
+  f.sdr.max_IF = 0.45 * DEFAULT_SAMPRATE;
+  f.sdr.lock = true;
+  f.input.rtp.ssrc = 1234;
+  f.input.rtp.packets = 123456789;
+  f.input.rtp.drops = 12;
+  f.input.metadata_packets = 98765;
+  f.input.samples = 123456789012LL;
+  {
+    struct sockaddr_in * const sin = (struct sockaddr_in *)&f.input.data_dest_address;
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(0xefa00001); // 239.160.0.1
+    sin->sin_port = htons(5004);
+    memcpy(&f.input.metadata_dest_address,sin,sizeof(*sin));
+    ((struct sockaddr_in *)&f.input.metadata_dest_address)->sin_port = htons(5006);
+  }
+  unsigned char a[PKTSIZE],b[PKTSIZE];
+  int const alen = encode_by_hand(a,&f);
+  unsigned char *bp = b;
+  *bp++ = 0;
+  encode_struct(&bp,Bench_schema,&f);
+  encode_eol(&bp);
+  int const blen = bp - b;
+  if(alen != blen || memcmp(a,b,alen) != 0){
+    fprintf(stderr,"encode_struct() output differs from encode_*(): %d vs %d bytes\n",blen,alen);
+    exit(1);
+  }
+  struct timespec t0,t1,t2,t3,t4;
+  clock_gettime(CLOCK_MONOTONIC,&t0);
+  for(long i=0; i < iterations; i++){
+    f.input.rtp.packets++; // So the compiler can't hoist anything
+    encode_by_hand(a,&f);
+  }
+  clock_gettime(CLOCK_MONOTONIC,&t1);
+  for(long i=0; i < iterations; i++){
+    f.input.rtp.packets++;
+    bp = b;
+    *bp++ = 0;
+    encode_struct(&bp,Bench_schema,&f);
+    encode_eol(&bp);
+  }
+  clock_gettime(CLOCK_MONOTONIC,&t2);
+  for(long i=0; i < iterations; i++)
+    decode_by_hand(a+1,alen-1,&g);
+  clock_gettime(CLOCK_MONOTONIC,&t3);
+  for(long i=0; i < iterations; i++)
+    decode_struct(b+1,blen-1,Bench_schema,&g);
+  clock_gettime(CLOCK_MONOTONIC,&t4);
+
+  if(json){
+    fprintf(stdout,"{\"status_bytes\":%d,",blen);
+    json_number(stdout,"encode_fields_ns",ns_per(&t0,&t1,iterations),true);
+    json_number(stdout,"encode_struct_ns",ns_per(&t1,&t2,iterations),true);
+    json_number(stdout,"decode_switch_ns",ns_per(&t2,&t3,iterations),true);
+    json_number(stdout,"decode_struct_ns",ns_per(&t3,&t4,iterations),false);
+    fprintf(stdout,"}\n");
+  } else {
+    fprintf(stdout,"status packet %d bytes, %'ld iterations\n",blen,iterations);
+    fprintf(stdout,"encode: %.0f ns field at a time, %.0f ns encode_struct()\n",ns_per(&t0,&t1,iterations),ns_per(&t1,&t2,iterations));
+    fprintf(stdout,"decode: %.0f ns switch, %.0f ns decode_struct()\n",ns_per(&t2,&t3,iterations),ns_per(&t3,&t4,iterations));
+  }
+}
+
+static void usage(char const * const name){
+  fprintf(stderr,"Usage: %s [-r samprate] [-f iq_float|iq_pt12|airspy] [-n channels] [-m mode[,mode...]] [-g voice|tone|noise]\n"
+	  "  [-N noise_dBFS] [-t seconds] [-b blocktime_ms] [-o overlap] [-w fft_workers] [-T fft_threads] [-e executor_threads]\n"
+	  "  [-M modefile] [-s seed] [-l label] [-H] [-p] [-j] [-v]\n"
+	  "       %s -S iterations [-j]\n",name,name);
+  exit(1);
+}
+
+int main(int argc,char *argv[]){
+  setlocale(LC_ALL,getenv("LANG") != NULL ? getenv("LANG") : "en_US.UTF-8");
+  clock_gettime(CLOCK_REALTIME,&Starttime);
+
+  int samprate = DEFAULT_SAMPRATE;
+  struct format const *fmt = &Formats[0];
+  int nchan = DEFAULT_CHANNELS;
+  char const *modes = DEFAULT_MODES;
+  enum signal_type sig = SIG_VOICE;
+  float noise_db = DEFAULT_NOISE;
+  double seconds = DEFAULT_SECONDS;
+  int overlap = DEFAULT_OVERLAP;
+  unsigned int seed = 1;
+  char const *label = NULL;
+  bool paced = false;
+  bool json = false;
+  long status_iterations = 0;
+  Blocktime = DEFAULT_BLOCKTIME;
+
+  int c;
+  while((c = getopt(argc,argv,"r:f:n:m:g:N:t:b:o:w:T:e:M:s:l:S:Hpjv")) != -1){
+    switch(c){
+    case 'r':
+      samprate = strtol(optarg,NULL,0);
+      break;
+    case 'f':
+      fmt = NULL;
+      for(unsigned int i=0; i < NFORMATS; i++){
+	if(strcasecmp(optarg,Formats[i].name) == 0)
+	  fmt = &Formats[i];
+      }
+      if(fmt == NULL){
+	fprintf(stderr,"Unknown format %s\n",optarg);
+	usage(argv[0]);
+      }
+      break;
+    case 'n':
+      nchan = strtol(optarg,NULL,0);
+      break;
+    case 'm':
+      modes = optarg;
+      break;
+    case 'g':
+      if(strcasecmp(optarg,"voice") == 0)
+	sig = SIG_VOICE;
+      else if(strcasecmp(optarg,"tone") == 0)
+	sig = SIG_TONE;
+      else if(strcasecmp(optarg,"noise") == 0)
+	sig = SIG_NOISE;
+      else
+	usage(argv[0]);
+      break;
+    case 'N':
+      noise_db = -fabsf(strtof(optarg,NULL));
+      break;
+    case 't':
+      seconds = strtod(optarg,NULL);
+      break;
+    case 'b':
+      Blocktime = fabsf(strtof(optarg,NULL));
+      break;
+    case 'o':
+      overlap = strtol(optarg,NULL,0);
+      break;
+    case 'w':
+      Fft_workers = strtol(optarg,NULL,0);
+      break;
+    case 'T':
+      Nthreads = strtol(optarg,NULL,0);
+      break;
+    case 'e':
+      Executor_threads = strtol(optarg,NULL,0);
+      break;
+    case 'M':
+      Modefile = optarg;
+      break;
+    case 's':
+      seed = strtoul(optarg,NULL,0);
+      break;
+    case 'l':
+      label = optarg;
+      break;
+    case 'S':
+      status_iterations = strtol(optarg,NULL,0);
+      break;
+    case 'H':
+      Hugepages = 1;
+      break;
+    case 'p':
+      paced = true;
+      break;
+    case 'j':
+      json = true;
+      break;
+    case 'v':
+      Verbose++;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if(status_iterations > 0){
+    status_bench(status_iterations,json);
+    exit(0);
+  }
+  if(samprate <= 0 || nchan < 0 || seconds <= 0 || overlap < 2 || Blocktime <= 0)
+    usage(argv[0]);
+  srandom(seed);
+  // Progress goes to stderr so stdout can be redirected straight into a results file
+  FILE * const progress = json ? stderr : stdout;
+
+  fftwf_init_threads();
+  fftwf_make_planner_thread_safe();
+  fftwf_import_system_wisdom();
+
+  // The synthetic front end
+  struct frontend * const frontend = &Frontends[Nfrontends++];
+  strlcpy(frontend->name,"bench",sizeof(frontend->name));
+  pthread_mutex_init(&frontend->sdr.status_mutex,NULL);
+  pthread_cond_init(&frontend->sdr.status_cond,NULL);
+  frontend->input.data_fd = frontend->input.ctl_fd = frontend->input.status_fd = -1;
+  frontend->spectrum.fd = -1;
+  strlcpy(frontend->sdr.description,"radio-bench synthetic front end",sizeof(frontend->sdr.description));
+  frontend->sdr.samprate = samprate;
+  frontend->sdr.frequency = LO_frequency;
+  frontend->sdr.gain = 1;
+  frontend->sdr.isreal = fmt->isreal;
+  frontend->sdr.bitspersample = fmt->type == IQ_FLOAT ? 32 : 12;
+  if(fmt->isreal){
+    frontend->sdr.min_IF = 0;
+    frontend->sdr.max_IF = samprate / 2;
+  } else {
+    frontend->sdr.min_IF = -samprate / 2;
+    frontend->sdr.max_IF = samprate / 2;
+  }
+  int const L = llroundf(samprate * Blocktime / 1000);
+  int const M = L / (overlap - 1) + 1; // The classic geometry; radio may time others
+  frontend->L = L;
+  frontend->M = M;
+  frontend->in = create_filter_input(L,M,fmt->isreal ? REAL : COMPLEX);
+  if(frontend->in == NULL){
+    fprintf(stderr,"Input filter setup failed\n");
+    exit(1);
+  }
+  pthread_t n0_thread;
+  pthread_create(&n0_thread,NULL,estimate_n0,frontend);
+
+  // Demod output goes to a local UDP socket that's never read, so the send path costs what it normally does
+  int const sink_fd = socket(AF_INET,SOCK_DGRAM,0);
+  int const data_fd = socket(AF_INET,SOCK_DGRAM,0);
+  {
+    struct sockaddr_in sin;
+    memset(&sin,0,sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sin);
+    if(sink_fd < 0 || data_fd < 0 || bind(sink_fd,(struct sockaddr *)&sin,sizeof(sin)) != 0
+       || getsockname(sink_fd,(struct sockaddr *)&sin,&len) != 0 || connect(data_fd,(struct sockaddr *)&sin,len) != 0){
+      perror("output socket");
+      exit(1);
+    }
+  }
+
+  // Channels evenly spaced across the usable band, modes taken from the list in rotation
+  struct channel * const chans = calloc(nchan > 0 ? nchan : 1,sizeof(*chans));
+  assert(chans != NULL);
+  double const band_low = fmt->isreal ? 0.02 * samprate : -0.45 * samprate;
+  double const band_high = fmt->isreal ? 0.48 * samprate : 0.45 * samprate;
+  {
+    char *modelist = strdup(modes);
+    char *saveptr = NULL;
+    char *mode = strtok_r(modelist,",",&saveptr);
+    for(int i=0; i < nchan; i++){
+      if(mode == NULL){
+	strlcpy(modelist,modes,strlen(modes)+1);
+	mode = strtok_r(modelist,",",&saveptr);
+      }
+      struct channel * const ch = &chans[i];
+      strlcpy(ch->mode,mode,sizeof(ch->mode));
+      mode = strtok_r(NULL,",",&saveptr);
+
+      ch->if_freq = round(band_low + (i + 0.5) * (band_high - band_low) / nchan);
+      if(ch->if_freq == 0)
+	ch->if_freq = 1;
+      ch->freq = LO_frequency + ch->if_freq;
+
+      struct demod * const demod = alloc_demod();
+      if(demod == NULL)
+	exit(1);
+      demod->frontend = frontend;
+      demod->tp1 = demod->tp2 = NAN;
+      demod->output.samprate = 48000;
+      if(preset_mode(demod,ch->mode) == -1){
+	fprintf(stderr,"mode %s invalid\n",ch->mode);
+	exit(1);
+      }
+      demod->output.rtp.ssrc = i + 1;
+      demod->output.data_fd = data_fd;
+      demod->output.rtcp_fd = demod->output.sap_fd = -1;
+      set_freq(demod,ch->freq);
+      ch->demod = demod;
+    }
+    free(modelist);
+  }
+
+  // One period of input, encoded into RTP packets; the feed loops over it
+  int const spp = fmt->samples;
+  int const period = (samprate / spp) * spp; // About a second
+  int const npackets = period / spp;
+  int const pktsize = RTP_MIN_SIZE + fmt->bytes;
+  uint8_t * const packets = malloc((size_t)npackets * pktsize);
+  assert(packets != NULL);
+  {
+    struct timespec t0,t1;
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    complex float * const buf = malloc(period * sizeof(*buf));
+    assert(buf != NULL);
+    generate(buf,period,samprate,chans,nchan,sig,noise_db);
+    for(int p=0; p < npackets; p++)
+      encode(packets + (size_t)p * pktsize + RTP_MIN_SIZE,buf + (size_t)p * spp,fmt);
+    free(buf);
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    fprintf(progress,"%'d Hz %s, %d channel%s (%s), L %'d M %'d N %'d; generated in %.1f s\n",
+	    samprate,fmt->name,nchan,nchan == 1 ? "" : "s",modes,L,M,L + M - 1,elapsed(&t0,&t1));
+  }
+
+  // Start the demods and wait for each to have its filter, so the feed doesn't start without them
+  for(int i=0; i < nchan; i++)
+    start_demod(chans[i].demod);
+  for(int tries = 0; tries < 1000; tries++){
+    int ready = 0;
+    for(int i=0; i < nchan; i++)
+      ready += chans[i].demod->filter.out != NULL;
+    if(ready == nchan)
+      break;
+    usleep(10000);
+  }
+
+  // Feed
+  struct filter_in * const master = frontend->in;
+  long long const total = llround(seconds * samprate);
+  long long fed = 0;
+  uint16_t seq = 0;
+  uint32_t timestamp = 0;
+  struct rtp_header rtp;
+  memset(&rtp,0,sizeof(rtp));
+  rtp.version = RTP_VERS;
+  rtp.type = fmt->type;
+  rtp.ssrc = 1;
+
+  struct timespec start,end;
+  double const cpu_start = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID);
+  double const feed_start = cpu_seconds(CLOCK_THREAD_CPUTIME_ID);
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  while(fed < total){
+    for(int p=0; p < npackets && fed < total; p++){
+      if(paced){
+	// Real time: drops show whether the demods keep up
+	long long const due = (long long)((double)fed * BILLION / samprate);
+	struct timespec when = start;
+	when.tv_sec += due / BILLION;
+	when.tv_nsec += due % BILLION;
+	normalize_time(&when);
+	clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&when,NULL);
+      } else
+	wait_for_demods(frontend,spp); // Don't get so far ahead that the slowest demod would drop a block
+      uint8_t * const pkt = packets + (size_t)p * pktsize;
+      rtp.seq = seq++;
+      rtp.timestamp = timestamp;
+      timestamp += spp;
+      hton_rtp(pkt,&rtp);
+      proc_packet(frontend,pkt,pktsize);
+      fed += spp;
+    }
+  }
+  double const feed_cpu = cpu_seconds(CLOCK_THREAD_CPUTIME_ID) - feed_start;
+  // Let the FFT workers and then the demods finish the last blocks
+  for(int tries = 0; tries < 10000; tries++){
+    if(master->blocknum == master->jobnum && slowest_demod(frontend,master->blocknum) == master->blocknum)
+      break;
+    usleep(1000);
+  }
+  clock_gettime(CLOCK_MONOTONIC,&end);
+  double const wall = elapsed(&start,&end);
+  double const cpu = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+
+  // Collect
+  unsigned long long const blocks = master->jobnum;
+  unsigned long long fft_blocks = 0;
+  long long fft_ns = 0;
+  double fft_cpu = 0;
+  for(int i=0; i < master->fft_workers; i++){
+    fft_blocks += master->workers[i].blocks;
+    fft_ns += master->workers[i].busy_ns;
+    clockid_t id;
+    if(pthread_getcpuclockid(master->workers[i].thread,&id) == 0)
+      fft_cpu += cpu_seconds(id);
+  }
+  long long total_drops = 0;
+  double sum_filter = 0,sum_demod = 0,sum_cpu = 0;
+  int nfilter = 0,ndemod = 0;
+  struct {
+    unsigned long long blocks;
+    int drops;
+    double filter_ns,demod_ns,cpu;
+  } * const stats = calloc(nchan > 0 ? nchan : 1,sizeof(*stats));
+  assert(stats != NULL);
+  for(int i=0; i < nchan; i++){
+    struct demod const * const demod = chans[i].demod;
+    struct filter_out const * const f = demod->filter.out;
+    stats[i].filter_ns = stats[i].demod_ns = stats[i].cpu = NAN;
+    if(f != NULL){
+      stats[i].blocks = f->blocks;
+      stats[i].drops = f->block_drops;
+      total_drops += f->block_drops;
+      if(f->blocks > 0){
+	stats[i].filter_ns = (double)f->busy_ns / f->blocks;
+	sum_filter += stats[i].filter_ns;
+	nfilter++;
+      }
+    }
+    clockid_t id;
+    if(!demod->task && demod->demod_thread != (pthread_t)0 && pthread_getcpuclockid(demod->demod_thread,&id) == 0){
+      stats[i].cpu = cpu_seconds(id);
+      sum_cpu += stats[i].cpu;
+      if(stats[i].blocks > 0){
+	// Everything the thread did but the output filter, including the send
+	// The filter time is wall clock, so on an overloaded machine it can exceed the thread's CPU time
+	stats[i].demod_ns = 1e9 * stats[i].cpu / stats[i].blocks - (isfinite(stats[i].filter_ns) ? stats[i].filter_ns : 0);
+	if(stats[i].demod_ns < 0)
+	  stats[i].demod_ns = 0;
+	sum_demod += stats[i].demod_ns;
+	ndemod++;
+      }
+    }
+  }
+  if(Executor_threads > 0 && nchan > 0){
+    // No thread of their own; share out what the rest of the process didn't use
+    double const each = (cpu - feed_cpu - fft_cpu - sum_cpu) / nchan;
+    for(int i=0; i < nchan; i++){
+      if(isnan(stats[i].cpu))
+	stats[i].cpu = each;
+    }
+  }
+  double const input_ns = blocks > 0 ? 1e9 * feed_cpu / blocks : NAN;
+  double const fft_per_block = fft_blocks > 0 ? (double)fft_ns / fft_blocks : NAN;
+  double const filter_per_block = nfilter > 0 ? sum_filter / nfilter : NAN;
+  double const demod_per_block = ndemod > 0 ? sum_demod / ndemod : NAN;
+  double const rate = fed / wall;
+
+  if(json){
+    FILE * const fp = stdout;
+    fprintf(fp,"{");
+    if(label != NULL)
+      fprintf(fp,"\"label\":\"%s\",",label);
+    fprintf(fp,"\"config\":{\"samprate\":%d,\"format\":\"%s\",\"channels\":%d,\"modes\":\"%s\",\"signal\":\"%s\","
+	    "\"blocktime_ms\":%g,\"overlap\":%d,\"L\":%d,\"M\":%d,\"N\":%d,\"fft_workers\":%d,\"fft_threads\":%d,"
+	    "\"executor_threads\":%d,\"seconds\":%g,\"paced\":%s,\"seed\":%u,\"pages\":%d},",
+	    samprate,fmt->name,nchan,modes,sig == SIG_VOICE ? "voice" : sig == SIG_TONE ? "tone" : "noise",
+	    Blocktime,overlap,L,M,L + M - 1,master->fft_workers,Nthreads,Executor_threads,seconds,paced ? "true" : "false",seed,master->pages);
+    fprintf(fp,"\"samples\":%lld,\"blocks\":%llu,",fed,blocks);
+    json_number(fp,"elapsed_s",wall,true);
+    json_number(fp,"samples_per_sec",rate,true);
+    json_number(fp,"realtime_factor",rate / samprate,true);
+    json_number(fp,"cpu_s",cpu,true);
+    fprintf(fp,"\"stages\":{");
+    json_number(fp,"input_ns_per_block",input_ns,true);
+    json_number(fp,"fft_ns_per_block",fft_per_block,true);
+    json_number(fp,"filter_ns_per_block",filter_per_block,true);
+    json_number(fp,"demod_ns_per_block",demod_per_block,false);
+    fprintf(fp,"},\"block_drops\":%lld,\"input_stalls\":%llu,\"channels\":[",total_drops,master->input_stalls);
+    for(int i=0; i < nchan; i++){
+      fprintf(fp,"%s{\"ssrc\":%u,\"mode\":\"%s\",\"frequency\":%.0f,\"blocks\":%llu,\"drops\":%d,",
+	      i == 0 ? "" : ",",chans[i].demod->output.rtp.ssrc,chans[i].mode,chans[i].freq,stats[i].blocks,stats[i].drops);
+      json_number(fp,"filter_ns_per_block",stats[i].filter_ns,true);
+      json_number(fp,"demod_ns_per_block",stats[i].demod_ns,true);
+      json_number(fp,"cpu_s",stats[i].cpu,true);
+      json_number(fp,"snr_db",power2dB(chans[i].demod->sig.snr),false); // Sanity check that it's really demodulating
+      fprintf(fp,"}");
+    }
+    fprintf(fp,"]}\n");
+  } else {
+    fprintf(stdout,"%'lld samples in %.3f s: %'.0f samples/s, %.2f x real time; %.3f s CPU\n",
+	    fed,wall,rate,rate / samprate,cpu);
+    fprintf(stdout,"per block: input %'.0f ns, forward FFT %'.0f ns (%d worker%s), output filter %'.0f ns, demod %'.0f ns\n",
+	    input_ns,fft_per_block,master->fft_workers,master->fft_workers == 1 ? "" : "s",filter_per_block,demod_per_block);
+    fprintf(stdout,"%'llu blocks, %'lld dropped by demods, %'llu input stalls; FFT buffers on %s pages\n",blocks,total_drops,master->input_stalls,
+	    master->pages == PAGES_HUGETLB ? "huge" : master->pages == PAGES_TRANSPARENT ? "transparent huge" : "normal");
+    if(Verbose || nchan <= 20){
+      fprintf(stdout,"%6s %-6s %15s %10s %6s %12s %12s %9s %7s\n","ssrc","mode","frequency","blocks","drops","filter ns","demod ns","cpu s","snr dB");
+      for(int i=0; i < nchan; i++)
+	fprintf(stdout,"%6u %-6s %'15.0f %'10llu %'6d %'12.0f %'12.0f %9.3f %7.1f\n",
+		chans[i].demod->output.rtp.ssrc,chans[i].mode,chans[i].freq,stats[i].blocks,stats[i].drops,
+		stats[i].filter_ns,stats[i].demod_ns,stats[i].cpu,power2dB(chans[i].demod->sig.snr));
+    }
+  }
+  fflush(stdout);
+  // The demod threads never exit on their own
+  exit(0);
+}
@@ -63,6 +63,10 @@ float Blocktime;
 int Ctl_fd,Status_fd;
 uint64_t Metadata_packets;
 uint64_t Block_drops;
+// Processing time by stage from the status stream, ns: median, 99th percentile, max
+enum { STAGE_INGEST, STAGE_FFT, STAGE_FILTER, STAGE_DEMOD, STAGE_OUTPUT, NSTAGES };
+static char const *Stage_names[NSTAGES] = { "ingest/pkt", "FFT", "filter", "demod", "output" };
+long long Stage_time[NSTAGES][3];
 
 int Verbose;
 int Resized;
@@ -80,7 +84,7 @@ int control_preset_mode(struct demod *demod,unsigned char **bpp,const char * con
 
 WINDOW *Tuning_win,*Sig_win,*Info_win,*Filtering_win,*Demodulator_win,
   *Options_win,*Fe_win,*Modes_win,*Debug_win,
-  *Data_win,*Status_win,*Output_win;
+  *Data_win,*Status_win,*Output_win,*Timing_win;
 
 static void display_tuning(WINDOW *tuning,struct demod const *demod);
 static void display_info(WINDOW *w,int row,int col,struct demod const *demod);
@@ -91,6 +95,7 @@ static void display_fe(WINDOW *fe,struct demod const *demod);
 static void display_options(WINDOW *options,struct demod const *demod);
 static void display_modes(WINDOW *modes,struct demod const *demod);
 static void display_output(WINDOW *output,struct demod const *demod);
+static void display_timing(WINDOW *timing);
 static int process_keyboard(struct demod *,unsigned char **bpp,int c);
 static void process_mouse(struct demod *demod,unsigned char **bpp);
 static int decode_radio_status(struct demod *demod,unsigned char const *buffer,int length);
@@ -257,6 +262,7 @@ struct windef {
   {&Filtering_win,15,22},
   {&Fe_win,15,45},
   {&Output_win,11,45},
+  {&Timing_win,8,45},
   {&Debug_win,8,109},
 };
 #define NWINS (sizeof(Windefs) / sizeof(Windefs[0]))
@@ -530,6 +536,7 @@ int main(int argc,char *argv[]){
     display_options(Options_win,demod);
     display_modes(Modes_win,demod);
     display_output(Output_win,demod);
+    display_timing(Timing_win);
     
     if(Debug_win){
       touchwin(Debug_win); // since we're not redrawing it every cycle
@@ -1186,6 +1193,9 @@ int decode_radio_status(struct demod *demod,unsigned char const *buffer,int leng
     case SQUELCH_CLOSE:
       demod->squelch_close = dB2power(decode_float(cp,optlen));
       break;
+    case INGEST_TIME_P50 ... OUTPUT_TIME_MAX:
+      Stage_time[(type - INGEST_TIME_P50) / 3][(type - INGEST_TIME_P50) % 3] = decode_int(cp,optlen);
+      break;
     default: // ignore others
       break;
     }
@@ -1482,6 +1492,24 @@ void display_output(WINDOW *w,struct demod const *demod){
   wnoutrefresh(w);
 }
 
+// Where radio's time goes for this channel, microseconds
+void display_timing(WINDOW *w){
+  if(w == NULL)
+    return;
+
+  int row = 1;
+  int col = 1;
+  wmove(w,row,col);
+  wclrtobot(w);
+  mvwprintw(w,row++,col,"%-12s%10s%10s%10s","","p50 us","p99 us","max us");
+  for(int i=0; i < NSTAGES; i++)
+    mvwprintw(w,row++,col,"%-12s%'10.1f%'10.1f%'10.1f",Stage_names[i],
+	      1e-3 * Stage_time[i][0],1e-3 * Stage_time[i][1],1e-3 * Stage_time[i][2]);
+  box(w,0,0);
+  mvwaddstr(w,0,1,"Processing time");
+  wnoutrefresh(w);
+}
+
 void display_options(WINDOW *w,struct demod const *demod){
   if(w == NULL)
     return;
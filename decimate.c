@@ -7,6 +7,19 @@
 #include <assert.h>
 #include "decimate.h"
 
+// Kaiser-windowed (beta = 5) sinc half-band, coefficients for taps +/-7, 5, 3, 1
+// Center tap is unity, so DC gain is 2
+static float const Hb15_coeffs[4] = {
+  -0.0033386971, 0.0344658837, -0.1383031490, 0.6081293292
+};
+
+// Set up a 15-tap half-band decimator with the standard coefficients and empty history
+void hb15_init(struct hb15_state *state){
+  assert(state != NULL);
+  memset(state,0,sizeof(*state));
+  memcpy(state->coeffs,Hb15_coeffs,sizeof(state->coeffs));
+}
+
 // Pick up vectorized versions if available
 #if defined(__SSSE3__)
 #if 0 // messages apparently treated as warnings
@@ -7,8 +7,12 @@ struct hb15_state {
   float odd_samples[4];
   float old_odd_samples[4];
 };
+void hb15_init(struct hb15_state *state);
 void hb15_block(struct hb15_state *state,float *output,float *input,int cnt);
 void hb3_block(float *state,float *output,float *input,int cnt);
 
+// Usable fraction of the output sample rate (+/-) after an hb15 decimation stage:
+// flat within 0.1 dB, and anything that aliases into it is at least 40 dB down
+#define HB15_PASSBAND 0.29
 
 #endif
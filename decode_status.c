@@ -33,8 +33,8 @@ void *sdr_status(void *arg){
     clock_gettime(CLOCK_REALTIME,&now);
     if(now.tv_sec >= next_fe_poll.tv_sec || (now.tv_sec == next_fe_poll.tv_sec && now.tv_nsec >= next_fe_poll.tv_nsec)){
       // Poll front end
-      if(Frontend.input.ctl_fd > 2)
-	send_poll(Frontend.input.ctl_fd,0);
+      if(frontend->input.ctl_fd > 2)
+	send_poll(frontend->input.ctl_fd,0);
       random_time(&next_fe_poll,fe_poll_interval,random_interval);
     }
     fd_set fdset;
@@ -84,6 +84,37 @@ void *sdr_status(void *arg){
 }
 
 
+// Front end status fields that map directly onto struct frontend
+static struct status_field const Fe_schema[] = {
+  STATUS_FIELD(COMMAND_TAG,struct frontend,SF_UINT,sdr.command_tag),
+  STATUS_FIELD(CMD_CNT,struct frontend,SF_UINT,sdr.commands),
+  STATUS_FIELD(GPS_TIME,struct frontend,SF_INT,sdr.timestamp),
+  STATUS_FIELD(DESCRIPTION,struct frontend,SF_STRING,sdr.description),
+  STATUS_FIELD(INPUT_DATA_SOURCE_SOCKET,struct frontend,SF_SOCKET,input.data_source_address),
+  STATUS_FIELD(INPUT_DATA_DEST_SOCKET,struct frontend,SF_SOCKET,input.data_dest_address),
+  STATUS_FIELD(INPUT_METADATA_SOURCE_SOCKET,struct frontend,SF_SOCKET,input.metadata_source_address),
+  STATUS_FIELD(INPUT_METADATA_DEST_SOCKET,struct frontend,SF_SOCKET,input.metadata_dest_address),
+  STATUS_FIELD(INPUT_SSRC,struct frontend,SF_UINT,input.rtp.ssrc),
+  STATUS_FIELD(INPUT_METADATA_PACKETS,struct frontend,SF_UINT,input.metadata_packets),
+  STATUS_FIELD(INPUT_DATA_PACKETS,struct frontend,SF_INT,input.rtp.packets),
+  STATUS_FIELD(INPUT_SAMPLES,struct frontend,SF_UINT,input.samples),
+  STATUS_FIELD(INPUT_DROPS,struct frontend,SF_INT,input.rtp.drops),
+  STATUS_FIELD(INPUT_DUPES,struct frontend,SF_INT,input.rtp.dupes),
+  STATUS_FIELD(OUTPUT_DATA_DEST_SOCKET,struct frontend,SF_SOCKET,input.data_dest_address),
+  STATUS_FIELD(OUTPUT_SAMPRATE,struct frontend,SF_INT,sdr.samprate),
+  STATUS_FIELD(LNA_GAIN,struct frontend,SF_UINT,sdr.lna_gain),
+  STATUS_FIELD(MIXER_GAIN,struct frontend,SF_UINT,sdr.mixer_gain),
+  STATUS_FIELD(IF_GAIN,struct frontend,SF_UINT,sdr.if_gain),
+  STATUS_FIELD(DIRECT_CONVERSION,struct frontend,SF_BOOL,sdr.direct_conversion),
+  STATUS_FIELD(RADIO_FREQUENCY,struct frontend,SF_DOUBLE,sdr.frequency),
+  STATUS_FIELD(FIRST_LO_FREQUENCY,struct frontend,SF_DOUBLE,sdr.frequency),
+  STATUS_FIELD(LOW_EDGE,struct frontend,SF_FLOAT,sdr.min_IF),
+  STATUS_FIELD(HIGH_EDGE,struct frontend,SF_FLOAT,sdr.max_IF),
+  STATUS_FIELD(LOCK,struct frontend,SF_BOOL,sdr.lock),
+  STATUS_FIELD(OUTPUT_BITS_PER_SAMPLE,struct frontend,SF_INT,sdr.bitspersample),
+  { EOL },
+};
+
 // Decode status messages from front end
 // Used by both radio and control
 int decode_fe_status(struct frontend *frontend,unsigned char *buffer,int length){
@@ -98,89 +129,20 @@ int decode_fe_status(struct frontend *frontend,unsigned char *buffer,int length)
     if(cp - buffer + optlen >= length)
       break; // invalid length; we can't continue to scan
 
+    if(decode_field(Fe_schema,frontend,type,cp,optlen)){
+      cp += optlen;
+      continue;
+    }
+    // Those needing conversion, or that don't live in struct frontend itself
     switch(type){
-    case EOL: // Shouldn't get here
-      goto done;
-    case DESCRIPTION:
-      decode_string(cp,optlen,frontend->sdr.description,sizeof(frontend->sdr.description));
-      break;
-    case COMMAND_TAG:
-      frontend->sdr.command_tag = decode_int(cp,optlen);
-      break;
-    case CMD_CNT:
-      frontend->sdr.commands = decode_int(cp,optlen);
-      break;
-    case GPS_TIME:
-      frontend->sdr.timestamp = decode_int(cp,optlen);
-      break;
-    case INPUT_DATA_SOURCE_SOCKET:
-      decode_socket(&frontend->input.data_source_address,cp,optlen);
-      break;
-    case INPUT_DATA_DEST_SOCKET:
-      decode_socket(&frontend->input.data_dest_address,cp,optlen);
-      break;
-    case INPUT_METADATA_SOURCE_SOCKET:
-      decode_socket(&frontend->input.metadata_source_address,cp,optlen);
-      break;
-    case INPUT_METADATA_DEST_SOCKET:
-      decode_socket(&frontend->input.metadata_dest_address,cp,optlen);
-      break;
-    case INPUT_SSRC:
-      frontend->input.rtp.ssrc = decode_int(cp,optlen);
-      break;
-    case INPUT_DATA_PACKETS:
-      frontend->input.rtp.packets = decode_int(cp,optlen);
-      break;
-    case INPUT_METADATA_PACKETS:
-      frontend->input.metadata_packets = decode_int(cp,optlen);
-      break;
-    case INPUT_SAMPLES:
-      frontend->input.samples = decode_int(cp,optlen);
-      break;
-    case INPUT_DROPS:
-      frontend->input.rtp.drops = decode_int(cp,optlen);
-      break;
-    case INPUT_DUPES:
-      frontend->input.rtp.dupes = decode_int(cp,optlen);
-      break;
-    case OUTPUT_DATA_DEST_SOCKET:
-      decode_socket(&frontend->input.data_dest_address,cp,optlen);
-      break;
-    case OUTPUT_SAMPRATE:
-      frontend->sdr.samprate = decode_int(cp,optlen);
-      break;
-    case RADIO_FREQUENCY:
-      frontend->sdr.frequency = decode_double(cp,optlen);
-      break;
 #if 0 // Deprecated
     case OUTPUT_LEVEL:
       frontend->sdr.output_level = dB2power(decode_double(cp,optlen));
       break;
 #endif
-    case LOCK:
-      frontend->sdr.lock = decode_int(cp,optlen);
-      break;
-    case FIRST_LO_FREQUENCY:
-      frontend->sdr.frequency = decode_double(cp,optlen);
-      break;
-    case LNA_GAIN:
-      frontend->sdr.lna_gain = decode_int(cp,optlen);
-      break;
-    case MIXER_GAIN:
-      frontend->sdr.mixer_gain = decode_int(cp,optlen);
-      break;
-    case IF_GAIN:
-      frontend->sdr.if_gain = decode_int(cp,optlen);
-      break;
     case GAIN:
       frontend->sdr.gain = dB2voltage(decode_float(cp,optlen));
       break;
-    case LOW_EDGE:
-      frontend->sdr.min_IF = decode_float(cp,optlen);
-      break;
-    case HIGH_EDGE:
-      frontend->sdr.max_IF = decode_float(cp,optlen);
-      break;
     case FILTER_BLOCKSIZE:
       if(frontend->in != NULL)
 	frontend->in->ilen = decode_int(cp,optlen);
@@ -198,18 +160,11 @@ int decode_fe_status(struct frontend *frontend,unsigned char *buffer,int length)
 	  frontend->sdr.isreal = 0;
       }
       break;
-    case OUTPUT_BITS_PER_SAMPLE:
-      frontend->sdr.bitspersample = decode_int(cp,optlen);
-      break;
-    case DIRECT_CONVERSION:
-      frontend->sdr.direct_conversion = decode_int(cp,optlen);
-      break;
     default:
       break;
     }
     cp += optlen;
   }
-  done:;
 
   if(frontend->sdr.samprate != 0 && frontend->sdr.min_IF == 0 && frontend->sdr.max_IF == 0){
     // Not initialized; avoid assertion fails by defaulting to +/- Fs/2
@@ -0,0 +1,141 @@
+// Wideband activity detector for radio
+// Scans a band in the front end's forward FFT, which we compute anyway, for channels whose power
+// stands well above the noise floor estimated by estimate_n0(), and starts a demod on each busy channel.
+// The demods are clones of a template and are killed by demod_reaper() 'hold' seconds after activity stops,
+// so idle channels cost nothing instead of each needing its own squelched demod thread
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <math.h>
+#include <complex.h>
+#undef I
+
+#include "misc.h"
+#include "multicast.h"
+#include "radio.h"
+#include "filter.h"
+
+// SSRC for a detected channel: its frequency in Hz, or in kHz if that won't fit
+static uint32_t chan_ssrc(double const freq){
+  return freq < 4294967295. ? (uint32_t)llround(freq) : (uint32_t)llround(freq / 1000);
+}
+
+// Find the active demod with this SSRC; caller holds Demod_mutex
+static struct demod *find_demod(uint32_t const ssrc){
+  for(int i=0; i < Demod_list_length; i++){
+    if(Demod_list[i].inuse && Demod_list[i].output.rtp.ssrc == ssrc)
+      return &Demod_list[i];
+  }
+  return NULL;
+}
+
+// Make sure channel 'i' has a demod, starting one if necessary, and restart its self-destruct timer
+static void service_channel(struct detector * const d,int const i){
+  uint32_t const ssrc = chan_ssrc(d->chan[i].freq);
+
+  pthread_mutex_lock(&Demod_mutex);
+  struct demod *demod = find_demod(ssrc);
+  if(demod != NULL){
+    if(demod->detector == d)
+      set_demod_lifetime(demod,d->hold);
+    // else a configured or client-created demod already has this channel; leave it alone
+    pthread_mutex_unlock(&Demod_mutex);
+    return;
+  }
+  pthread_mutex_unlock(&Demod_mutex);
+
+  demod = alloc_demod();
+  if(demod == NULL)
+    return;
+  memcpy(demod,d->template,sizeof(*demod));
+  demod->inuse = 1;
+  demod->demod_thread = (pthread_t)0;
+  demod->filter.out = NULL;
+  demod->output.rtp.ssrc = ssrc;
+  demod->output.file_fd = -1;
+  demod->output.shm = NULL;
+  demod->detector = d;
+  set_freq(demod,d->chan[i].freq);
+  start_demod(demod);
+  set_demod_lifetime(demod,d->hold);
+  d->spawned++;
+  if(Verbose)
+    fprintf(stdout,"[%s] activity on %'.3lf Hz, started ssrc %u\n",d->name,d->chan[i].freq,ssrc);
+}
+
+void *detector_run(void *arg){
+  struct detector * const d = (struct detector *)arg;
+  assert(d != NULL);
+  {
+    char name[100];
+    snprintf(name,sizeof(name),"det %s",d->name);
+    pthread_setname(name);
+  }
+  struct frontend * const frontend = d->frontend;
+  struct filter_in * const master = frontend->in;
+  assert(master != NULL);
+
+  bool const isreal = master->in_type == REAL;
+  int const N = master->ilen + master->impulse_length - 1;
+  float const hz_per_bin = (float)frontend->sdr.samprate / N;
+  // Bins covered by the template's filter, relative to the channel center
+  int const first = floorf(d->template->filter.min_IF / hz_per_bin);
+  int const last = ceilf(d->template->filter.max_IF / hz_per_bin);
+  int const nb = last - first + 1;
+  int const blocks_per_sec = lrintf((float)frontend->sdr.samprate / master->ilen);
+  unsigned int blocknum = 0;
+  int blocks = 0;
+
+  while(1){
+    pthread_mutex_lock(&master->filter_mutex);
+    while(blocknum == master->blocknum)
+      pthread_cond_wait(&master->filter_cond,&master->filter_mutex);
+    if(blocknum == 0 || (int)(master->blocknum - blocknum) > ND - master->fft_workers)
+      blocknum = master->blocknum - 1; // Fell behind (or just started)
+    pthread_mutex_unlock(&master->filter_mutex);
+
+    complex float const * const fdomain = master->fdomain[blocknum % ND];
+    blocknum++;
+    if(frontend->n0 <= 0)
+      continue; // Noise estimate not ready yet
+
+    // Expected noise in one bin; inverse of the scaling in estimate_n0()
+    float const bin_noise = frontend->n0 * master->bins * frontend->sdr.samprate / (isreal ? 4 : 2);
+    float const chan_noise = nb * bin_noise;
+    double const lo = frontend->sdr.frequency;
+    bool const service = (++blocks >= blocks_per_sec); // Refresh demod lifetimes about once a second
+    if(service)
+      blocks = 0;
+
+    for(int i=0; i < d->nchan; i++){
+      double const ifreq = d->chan[i].freq - lo;
+      // Only channels the front end already covers; a detector never retunes it
+      if(ifreq + d->template->filter.min_IF < frontend->sdr.min_IF
+	 || ifreq + d->template->filter.max_IF > frontend->sdr.max_IF){
+	d->chan[i].ratio = 0;
+	d->chan[i].active = false;
+	continue;
+      }
+      int const center = lrint(ifreq / hz_per_bin);
+      float energy = 0;
+      for(int b = center + first; b <= center + last; b++){
+	int bin = isreal ? abs(b) : (b < 0 ? b + master->bins : b);
+	if(bin >= 0 && bin < master->bins)
+	  energy += cnrmf(fdomain[bin]);
+      }
+      d->chan[i].ratio += d->alpha * (energy / chan_noise - d->chan[i].ratio);
+
+      bool const was_active = d->chan[i].active;
+      if(!was_active && d->chan[i].ratio > d->on)
+	d->chan[i].active = true;
+      else if(was_active && d->chan[i].ratio < d->off)
+	d->chan[i].active = false; // Stop refreshing; the reaper gets it 'hold' seconds from now
+
+      if(d->chan[i].active && (!was_active || service))
+	service_channel(d,i);
+    }
+  }
+  return NULL;
+}
@@ -162,6 +162,13 @@ void dump_metadata(unsigned char *buffer,int length){
     case FILTER_FIR_LENGTH:
       printf("filter M %'llu",(long long unsigned)decode_int(cp,optlen));
       break;
+    case FILTER_PAGES:
+      {
+	static char const *kinds[] = { "normal", "transparent huge requested", "huge" };
+	unsigned int const k = decode_int(cp,optlen);
+	printf("filter pages %s",k < sizeof(kinds)/sizeof(kinds[0]) ? kinds[k] : "?");
+      }
+      break;
     case NOISE_BANDWIDTH:
       printf("noise BW %'g Hz",decode_float(cp,optlen));
       break;
@@ -300,6 +307,17 @@ void dump_metadata(unsigned char *buffer,int length){
     case SQUELCH_CLOSE:
       printf("squelch close %.1f",decode_float(cp,optlen));
       break;
+    case INGEST_TIME_P50 ... OUTPUT_TIME_MAX:
+      {
+	static char const *stages[] = { "ingest", "fft", "filter", "demod", "output" };
+	static char const *stats[] = { "p50", "p99", "max" };
+	int const i = type - INGEST_TIME_P50;
+	printf("%s %s %'lld ns",stages[i / 3],stats[i % 3],(long long)decode_int(cp,optlen));
+      }
+      break;
+    case OUTPUT_SHM:
+      printf("shm %s",decode_string(cp,optlen,sbuf,sizeof(sbuf)));
+      break;
     default:
       printf("unknown type %d length %d",type,optlen);
       break;
@@ -0,0 +1,192 @@
+// Task-based demod executor for radio
+// Optional alternative to a thread per demod: when a front end publishes a block, each of its demods
+// becomes a task on a ready queue, and a fixed pool of threads runs one block of each and moves on.
+// With hundreds of channels this replaces hundreds of threads, their stacks and the wakeup storm
+// on the filter condition variable with a few threads that never block on the filter.
+// Enabled with 'executor-threads =' in [global]; WFM, with its own internal filters, still gets a thread
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <complex.h>
+#undef I
+
+#include "misc.h"
+#include "radio.h"
+#include "filter.h"
+
+int Executor_threads; // 0 = thread per demod
+
+static pthread_mutex_t Exec_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Exec_cond = PTHREAD_COND_INITIALIZER;  // Ready queue not empty
+static pthread_cond_t Exec_idle = PTHREAD_COND_INITIALIZER;  // A task finished a block
+static struct demod *Ready_head,*Ready_tail;
+static bool Started;
+
+// Caller holds Exec_mutex
+static void enqueue(struct demod * const demod){
+  demod->task_queued = true;
+  demod->task_next = NULL;
+  if(Ready_tail != NULL)
+    Ready_tail->task_next = demod;
+  else
+    Ready_head = demod;
+  Ready_tail = demod;
+}
+
+// Does this task have a block waiting? Plain reads; a stale answer only means "not yet"
+static bool block_ready(struct demod const * const demod){
+  struct filter_out const * const slave = demod->filter.out;
+  return slave != NULL && slave->blocknum != slave->master->blocknum;
+}
+
+// Called by the front end's FFT after it publishes each block
+static void publish(struct filter_in * const master,void * const arg){
+  struct frontend * const frontend = (struct frontend *)arg;
+  assert(frontend != NULL && frontend->in == master);
+  bool any = false;
+  pthread_mutex_lock(&Exec_mutex);
+  for(struct demod *demod = frontend->tasks; demod != NULL; demod = demod->tasks_next){
+    if(!demod->task_queued && !demod->task_busy){
+      enqueue(demod);
+      any = true;
+    }
+  }
+  if(any)
+    pthread_cond_broadcast(&Exec_cond);
+  pthread_mutex_unlock(&Exec_mutex);
+}
+
+// Caller holds Exec_mutex
+static void unlink_task(struct demod * const demod){
+  for(struct demod **pp = &demod->frontend->tasks; *pp != NULL; pp = &(*pp)->tasks_next){
+    if(*pp == demod){
+      *pp = demod->tasks_next;
+      break;
+    }
+  }
+  if(demod->task_queued){
+    struct demod *prev = NULL;
+    for(struct demod *d = Ready_head; d != NULL; prev = d, d = d->task_next){
+      if(d == demod){
+	if(prev != NULL)
+	  prev->task_next = d->task_next;
+	else
+	  Ready_head = d->task_next;
+	if(Ready_tail == d)
+	  Ready_tail = prev;
+	break;
+      }
+    }
+  }
+  demod->tasks_next = demod->task_next = NULL;
+  demod->task = demod->task_queued = false;
+}
+
+static void *exec_thread(void *arg){
+  {
+    char name[100];
+    snprintf(name,sizeof(name),"exec %d",(int)(intptr_t)arg);
+    pthread_setname(name);
+  }
+  pthread_mutex_lock(&Exec_mutex);
+  while(1){
+    while(Ready_head == NULL)
+      pthread_cond_wait(&Exec_cond,&Exec_mutex);
+    struct demod * const demod = Ready_head;
+    Ready_head = demod->task_next;
+    if(Ready_head == NULL)
+      Ready_tail = NULL;
+    demod->task_next = NULL;
+    demod->task_queued = false;
+    demod->task_busy = true;
+    pthread_mutex_unlock(&Exec_mutex);
+
+    // Never call a block function without a block waiting; it would sleep in execute_filter_output()
+    int r = 1;
+    if(block_ready(demod)){
+      switch(demod->demod_type){
+      case LINEAR_DEMOD:
+	r = linear_block(demod);
+	break;
+      case FM_DEMOD:
+	r = fm_block(demod);
+	break;
+      default:
+	break;
+      }
+    }
+    pthread_mutex_lock(&Exec_mutex);
+    demod->task_busy = false;
+    if(r == -1){
+      // Lost its output stream; like a demod thread exiting
+      unlink_task(demod);
+    } else if(r == 0 && block_ready(demod) && !demod->task_queued){
+      enqueue(demod); // Still behind; yield to the others, then catch up
+    }
+    pthread_cond_broadcast(&Exec_idle);
+  }
+  return NULL;
+}
+
+// Run a demod as a task; -1 if its type needs a thread of its own
+int exec_start(struct demod * const demod){
+  assert(demod != NULL);
+  struct frontend * const frontend = demod->frontend;
+  int r;
+  switch(demod->demod_type){
+  case LINEAR_DEMOD:
+    r = linear_setup(demod);
+    break;
+  case FM_DEMOD:
+    r = fm_setup(demod);
+    break;
+  default:
+    return -1;
+  }
+  if(r != 0)
+    return 0; // Already complained; like a demod thread that quits right away
+
+  pthread_mutex_lock(&Exec_mutex);
+  if(!Started){
+    for(int i=0; i < Executor_threads; i++){
+      pthread_t t;
+      pthread_create(&t,NULL,exec_thread,(void *)(intptr_t)i);
+    }
+    Started = true;
+  }
+  if(frontend->in->publish == NULL){
+    frontend->in->publish_arg = frontend;
+    frontend->in->publish = publish;
+  }
+  demod->task = true;
+  demod->task_queued = demod->task_busy = false;
+  demod->task_next = NULL;
+  demod->tasks_next = frontend->tasks;
+  frontend->tasks = demod;
+  pthread_mutex_unlock(&Exec_mutex);
+  return 0;
+}
+
+// Take a demod off the executor, waiting for any block in progress; its filter is left for the caller
+void exec_stop(struct demod * const demod){
+  assert(demod != NULL);
+  pthread_mutex_lock(&Exec_mutex);
+  bool found = false;
+  for(struct demod *d = demod->frontend->tasks; d != NULL; d = d->tasks_next){
+    if(d == demod){
+      found = true;
+      break;
+    }
+  }
+  if(found){
+    while(demod->task_busy)
+      pthread_cond_wait(&Exec_idle,&Exec_mutex);
+    unlink_task(demod);
+  } else {
+    // Never started, stopped on its own, or just a copy of a task's flags
+    demod->task = demod->task_queued = demod->task_busy = false;
+    demod->task_next = demod->tasks_next = NULL;
+  }
+  pthread_mutex_unlock(&Exec_mutex);
+}
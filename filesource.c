@@ -0,0 +1,265 @@
+// File front end for radio: an I/Q recording in place of the multicast stream from a front end
+// Reads raw files with their xattrs (as written by iqrecord) or the framed format of recfile.h (iqrecord -c)
+// and feeds them to the input filter as fast as the demods can take them, so a day of archived I/Q
+// can be demodulated again, on other frequencies or with different DSP, in much less than a day
+// Nothing is dropped: the reader waits for the slowest demod instead (see wait_for_demods())
+// Time comes from the recording, not the system clock: sdr.timestamp advances with the samples read,
+// and the demods' RTP timestamps and RTCP reports follow it
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#if defined(linux)
+#include <bsd/string.h>
+#endif
+
+#include "misc.h"
+#include "attr.h"
+#include "recfile.h"
+#include "radio.h"
+#include "filter.h"
+
+static int const Frames_per_packet = 1024; // Also limited to one block, so wait_for_demods() sees every block boundary
+
+struct file_source {
+  char path[PATH_MAX];
+  int fd;
+  bool recfile;                 // Framed format; otherwise raw samples
+  struct recfile_reader reader;
+  int channels;                 // 1 = real, 2 = complex
+  int bitspersample;            // 8, 12 or 16
+  int type;                     // RTP payload type handed to proc_packet()
+  long long start;              // Time of first sample, nanoseconds since GPS epoch
+  uint64_t samples;             // Sample frames fed, including gaps
+};
+
+static pthread_mutex_t Done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int Files_done;
+
+// Unix time, nanoseconds, to GPS time as carried in sdr.timestamp
+static long long unix_to_gps(long long const ns){
+  return ns - (long long)(UNIX_EPOCH - GPS_UTC_OFFSET) * BILLION;
+}
+
+// Same table as iqplay
+static int pt_from_format(int const channels,int const bitspersample){
+  switch(bitspersample){
+  case 8:
+    return channels == 1 ? REAL_PT8 : IQ_PT8;
+  case 12:
+    return channels == 1 ? REAL_PT12 : IQ_PT12;
+  case 16:
+    return channels == 1 ? PCM_MONO_PT : PCM_STEREO_PT;
+  default:
+    return -1;
+  }
+}
+
+// Open the recording and fill in what a front end's status stream would otherwise tell us
+// The front end is locked at the recording's frequency; demods outside it just wait
+int open_file_source(struct frontend * const frontend,char const * const path){
+  struct file_source * const fs = calloc(1,sizeof(*fs));
+  assert(fs != NULL);
+  strlcpy(fs->path,path,sizeof(fs->path));
+  fs->fd = open(path,O_RDONLY);
+  if(fs->fd == -1){
+    fprintf(stdout,"[%s] can't open %s: %s\n",frontend->name,path,strerror(errno));
+    free(fs);
+    return -1;
+  }
+  long samprate = 0;
+  double frequency = 0;
+  float min_IF = NAN, max_IF = NAN;
+  long long start = 0;
+  uint32_t ssrc = 0;
+  if(recfile_is_recfile(fs->fd)){
+    if(recfile_open(&fs->reader,fs->fd) == -1){
+      fprintf(stdout,"[%s] %s: can't read recording header\n",frontend->name,path);
+      close(fs->fd);
+      free(fs);
+      return -1;
+    }
+    fs->recfile = true;
+    samprate = fs->reader.info.samprate;
+    frequency = fs->reader.info.frequency;
+    fs->channels = fs->reader.info.channels;
+    fs->bitspersample = fs->reader.info.bitspersample;
+    start = fs->reader.info.start_time;
+    ssrc = fs->reader.info.ssrc;
+  } else {
+    fs->channels = 2;
+    fs->bitspersample = 16;
+    attrscanf(fs->fd,"samplerate","%ld",&samprate);
+    attrscanf(fs->fd,"frequency","%lf",&frequency);
+    attrscanf(fs->fd,"channels","%d",&fs->channels);
+    attrscanf(fs->fd,"bitspersample","%d",&fs->bitspersample);
+    attrscanf(fs->fd,"ssrc","%u",&ssrc);
+    attrscanf(fs->fd,"min_IF","%f",&min_IF);
+    attrscanf(fs->fd,"max_IF","%f",&max_IF);
+    double t = 0;
+    if(attrscanf(fs->fd,"unixstarttime","%lf",&t) == 1)
+      start = llround(t * BILLION);
+  }
+  fs->type = pt_from_format(fs->channels,fs->bitspersample);
+  if(samprate <= 0 || fs->type == -1){
+    fprintf(stdout,"[%s] %s: unknown sample rate or unsupported format (%d channels, %d bits)\n",
+	    frontend->name,path,fs->channels,fs->bitspersample);
+    if(fs->recfile)
+      recfile_close(&fs->reader);
+    close(fs->fd);
+    free(fs);
+    return -1;
+  }
+  if(start == 0){
+    // No start time recorded; pretend it started now
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME,&ts);
+    start = (long long)ts.tv_sec * BILLION + ts.tv_nsec;
+  }
+  fs->start = unix_to_gps(start);
+
+  pthread_mutex_lock(&frontend->sdr.status_mutex);
+  frontend->sdr.samprate = samprate;
+  frontend->sdr.frequency = frequency;
+  frontend->sdr.isreal = fs->channels == 1;
+  frontend->sdr.bitspersample = fs->bitspersample;
+  if(isnan(min_IF) || isnan(max_IF)){
+    // Assume the whole band is usable
+    frontend->sdr.min_IF = frontend->sdr.isreal ? 0 : -samprate/2;
+    frontend->sdr.max_IF = samprate/2;
+  } else {
+    frontend->sdr.min_IF = min_IF;
+    frontend->sdr.max_IF = max_IF;
+  }
+  frontend->sdr.timestamp = fs->start;
+  frontend->sdr.lock = true;
+  snprintf(frontend->sdr.description,sizeof(frontend->sdr.description),"file %s",path);
+  frontend->input.rtp.ssrc = ssrc;
+  frontend->input.file = fs;
+  pthread_cond_broadcast(&frontend->sdr.status_cond);
+  pthread_mutex_unlock(&frontend->sdr.status_mutex);
+  return 0;
+}
+
+// Feed 'nframes' host-order sample frames (NULL for zeroes) to the input filter, one RTP packet at a time
+// 12-bit real samples are decoded in pairs, 3 bytes at a time (see proc_packet()), so every packet holds
+// whole pairs; an odd frame at the end is sent with a zero after it
+static void feed(struct frontend * const frontend,uint8_t const *samples,int nframes){
+  struct file_source * const fs = frontend->input.file;
+  int const frame_bits = fs->channels * fs->bitspersample;
+  int const align = frame_bits % 8 == 0 ? 1 : 2; // Frames per whole byte
+  int const maxframes = min(Frames_per_packet,frontend->in->ilen) / align * align;
+  struct rtp_header rtp;
+  memset(&rtp,0,sizeof(rtp));
+  rtp.version = RTP_VERS;
+  rtp.type = fs->type;
+  rtp.ssrc = frontend->input.rtp.ssrc;
+
+  while(nframes > 0){
+    int const chunk = min(nframes,maxframes);
+    int const frames = (chunk + align - 1) / align * align; // More than chunk only at the very end
+    int const bytes = frames * frame_bits / 8;
+    uint8_t packet[PKTSIZE];
+    rtp.seq = frontend->input.rtp.seq;             // Next expected by rtp_process(), so never a gap
+    rtp.timestamp = frontend->input.rtp.timestamp;
+    uint8_t * const dp = hton_rtp(packet,&rtp);
+    if(samples == NULL){
+      memset(dp,0,bytes);
+    } else if(fs->bitspersample == 16){
+      // Recorded in host order, sent in network order
+      int16_t const *sp = (int16_t const *)samples;
+      int16_t *op = (int16_t *)dp;
+      for(int i=0; i < chunk * fs->channels; i++)
+	op[i] = htons(sp[i]);
+    } else {
+      int const have = (chunk * frame_bits + 7) / 8;
+      memcpy(dp,samples,have); // 8 bits, or 12 bits already packed big-endian
+      if(frames > chunk){
+	dp[have-1] &= 0xf0; // Our last sample ends in the high half of this byte
+	memset(dp + have,0,bytes - have);
+      }
+    }
+    wait_for_demods(frontend,frames);
+    proc_packet(frontend,packet,(dp - packet) + bytes);
+    fs->samples += frames;
+    frontend->sdr.timestamp = fs->start + (long long)(fs->samples * (double)BILLION / frontend->sdr.samprate);
+    if(samples != NULL)
+      samples += (chunk * frame_bits) / 8;
+    nframes -= chunk;
+  }
+}
+
+// Replaces proc_samples() for a file front end; started once the configured demods are running
+void *file_source(void *arg){
+  struct frontend * const frontend = (struct frontend *)arg;
+  assert(frontend != NULL);
+  struct file_source * const fs = frontend->input.file;
+  assert(fs != NULL);
+  {
+    char name[100];
+    snprintf(name,sizeof(name),"file %s",frontend->name);
+    pthread_setname(name);
+  }
+  int const frame_bits = fs->channels * fs->bitspersample;
+  int const bufsize = (RECFILE_MAX_FRAMES * frame_bits + 7) / 8;
+  uint8_t * const buffer = malloc(bufsize);
+  assert(buffer != NULL);
+
+  struct timespec start,end;
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  if(fs->recfile){
+    struct recfile_frame frame;
+    while(recfile_read(&fs->reader,&frame,buffer,bufsize) == 1){
+      if(frame.type == RECFILE_DATA)
+	feed(frontend,buffer,frame.nframes);
+      else if(frame.type == RECFILE_GAP)
+	feed(frontend,NULL,frame.nframes); // Zeroes keep the demods' output aligned with the recording's time
+    }
+    recfile_close(&fs->reader);
+  } else {
+    int r;
+    while((r = pipefill(fs->fd,buffer,bufsize)) > 0)
+      feed(frontend,buffer,(8 * r) / frame_bits);
+    if(r < 0)
+      fprintf(stdout,"[%s] %s: %s\n",frontend->name,fs->path,strerror(errno));
+  }
+  close(fs->fd);
+  fs->fd = -1;
+
+  // Flush the last partial block, then wait for the FFT workers, and for every demod to send its output
+  // for the last block; give up after 10 s on one that's stuck
+  struct filter_in const * const master = frontend->in;
+  if(master->wcnt > 0)
+    feed(frontend,NULL,master->ilen - master->wcnt);
+  for(int tries = 0; tries < 10000; tries++){
+    if(master->blocknum == master->jobnum && slowest_output(frontend,master->blocknum) == master->blocknum)
+      break;
+    usleep(1000);
+  }
+  clock_gettime(CLOCK_MONOTONIC,&end);
+  double const wall = (end.tv_sec - start.tv_sec) + 1e-9 * (end.tv_nsec - start.tv_nsec);
+  double const duration = (double)fs->samples / frontend->sdr.samprate;
+  fprintf(stdout,"[%s] %s: %'llu samples, %.1f sec in %.1f sec, %.1fx real time\n",
+	  frontend->name,fs->path,(unsigned long long)fs->samples,duration,wall,wall > 0 ? duration / wall : 0);
+  free(buffer);
+
+  // When every front end was a file, the job is done
+  pthread_mutex_lock(&Done_mutex);
+  bool const all = ++Files_done == Nfrontends;
+  pthread_mutex_unlock(&Done_mutex);
+  if(all){
+    fprintf(stdout,"all recordings processed, exiting\n");
+    fflush(stdout);
+    exit(0);
+  }
+  return NULL;
+}
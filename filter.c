@@ -6,8 +6,6 @@
 // Complex input and transfer functions, complex or real output
 // Copyright 2017, Phil Karn, KA9Q, karn@ka9q.net
 
-#undef DUAL_FFT_THREAD
-
 #define _GNU_SOURCE 1
 #include <assert.h>
 #include <stdlib.h>
@@ -24,12 +22,196 @@
 #include "filter.h"
 
 int Nthreads = 1; 
+int Fft_workers = 1; // Forward FFT worker threads per filter_in, up to MAX_FFT_WORKERS
+int Hugepages;       // Put large buffers on 2 MB pages
+
+// Large buffers, e.g., the frequency domain ring of a wideband front end, are read by every demod
+// on every block, and on 4 KB pages the TLB misses show up in the multiply loop. With Hugepages set,
+// anything at least Big_buffer long is mapped directly: from the explicit huge page pool if the
+// administrator reserved one, else as ordinary memory marked for transparent huge pages.
+// The pages aren't touched here, so the kernel puts each one on the NUMA node of the thread that first
+// writes it: an FFT worker for fdomain[], the thread feeding the filter for the input ring
+#define HUGE_PAGE (2UL << 20)
+static size_t const Big_buffer = HUGE_PAGE / 2; // Smaller ones would waste too much of a page
+struct big_buffer {
+  struct big_buffer *next;
+  void *p;
+  size_t size;
+};
+static struct big_buffer *Big_buffers;
+static pthread_mutex_t Big_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#if defined(MADV_HUGEPAGE)
+// Is transparent huge page support built in and not turned off? Checked once
+static int thp_available(void){
+  static int available = -1;
+  if(available == -1){
+    char buf[128] = "";
+    int const fd = open("/sys/kernel/mm/transparent_hugepage/enabled",O_RDONLY);
+    if(fd != -1){
+      ssize_t const n = read(fd,buf,sizeof(buf)-1);
+      buf[n > 0 ? n : 0] = '\0';
+      close(fd);
+    }
+    available = buf[0] != '\0' && strstr(buf,"[never]") == NULL;
+  }
+  return available;
+}
+#endif
+
+// Allocate 'bytes' for a filter buffer, noting in *kind what kind of pages it got
+static void *big_alloc(size_t const bytes,enum page_kind * const kind){
+  *kind = PAGES_NORMAL;
+  if(!Hugepages || bytes < Big_buffer)
+    return fftwf_malloc(bytes);
+
+  size_t const size = (bytes + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+  void *p = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+  p = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+  if(p != MAP_FAILED)
+    *kind = PAGES_HUGETLB;
+#endif
+#if defined(MADV_HUGEPAGE)
+  if(p == MAP_FAILED){
+    // No reserved pool, or it's used up. Map an extra page so we can trim to a 2 MB boundary;
+    // khugepaged can only use whole aligned 2 MB extents
+    uint8_t * const q = mmap(NULL,size + HUGE_PAGE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if(q != MAP_FAILED){
+      uint8_t * const aligned = (uint8_t *)(((uintptr_t)q + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+      if(aligned > q)
+	munmap(q,aligned - q);
+      if(aligned + size < q + size + HUGE_PAGE)
+	munmap(aligned + size,q + size + HUGE_PAGE - (aligned + size));
+      p = aligned;
+      // Otherwise it's just ordinary pages that happen to be mapped directly
+      if(thp_available() && madvise(p,size,MADV_HUGEPAGE) == 0)
+	*kind = PAGES_TRANSPARENT;
+    }
+  }
+#endif
+  if(p == MAP_FAILED)
+    return fftwf_malloc(bytes);
+
+  struct big_buffer * const b = malloc(sizeof(*b));
+  assert(b != NULL);
+  b->p = p;
+  b->size = size;
+  pthread_mutex_lock(&Big_mutex);
+  b->next = Big_buffers;
+  Big_buffers = b;
+  pthread_mutex_unlock(&Big_mutex);
+  return p;
+}
+
+// Free a buffer from big_alloc(), whichever way it was allocated
+static void big_free(void * const p){
+  if(p == NULL)
+    return;
+  struct big_buffer *b = NULL;
+  pthread_mutex_lock(&Big_mutex);
+  for(struct big_buffer **bp = &Big_buffers; *bp != NULL; bp = &(*bp)->next){
+    if((*bp)->p == p){
+      b = *bp;
+      *bp = b->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&Big_mutex);
+  if(b == NULL){
+    fftwf_free(p);
+    return;
+  }
+  munmap(b->p,b->size);
+  free(b);
+}
+
+#if !defined(NDEBUG)
+// malloc_usable_size() for a buffer from big_alloc(); only in assertions
+static size_t big_size(void * const p){
+  size_t size = 0;
+  pthread_mutex_lock(&Big_mutex);
+  for(struct big_buffer const *b = Big_buffers; b != NULL; b = b->next){
+    if(b->p == p){
+      size = b->size;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&Big_mutex);
+  return size != 0 ? size : malloc_usable_size(p);
+}
+#endif
 
 static inline int modulo(int x,int const m){
   x = x < 0 ? x + m : x;
   return x > m ? x - m : x;
 }
 
+// FFTW plans shared by every filter of the same size and kind, run with the new-array execute functions
+// on buffers from fftwf_alloc_*(), which all have the alignment the plans were made for.
+// Saves each output filter its own reverse plan, and each filter design its two planning calls
+enum plan_kind {
+  PLAN_FORWARD_INPLACE,   // complex, in place
+  PLAN_REVERSE_INPLACE,   // complex, in place
+  PLAN_REVERSE,           // complex, out of place
+  PLAN_R2C,               // out of place
+  PLAN_C2R,               // out of place; destroys its input
+};
+struct plan_cache {
+  struct plan_cache *next;
+  enum plan_kind kind;
+  int N;                  // Time domain points
+  fftwf_plan plan;
+};
+static struct plan_cache *Plan_cache;
+static pthread_mutex_t Plan_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Plans are never freed; there are only ever a few sizes
+static fftwf_plan get_plan(enum plan_kind const kind,int const N){
+  pthread_mutex_lock(&Plan_mutex);
+  for(struct plan_cache *pc = Plan_cache; pc != NULL; pc = pc->next){
+    if(pc->kind == kind && pc->N == N){
+      pthread_mutex_unlock(&Plan_mutex);
+      return pc->plan;
+    }
+  }
+  // Plan on scratch buffers so nobody's data is overwritten
+  complex float * const a = fftwf_alloc_complex(N);
+  complex float * const b = fftwf_alloc_complex(N);
+  assert(a != NULL && b != NULL);
+  fftwf_plan_with_nthreads(1); // Too small to benefit from multithreading
+  fftwf_plan plan = NULL;
+  switch(kind){
+  case PLAN_FORWARD_INPLACE:
+    plan = fftwf_plan_dft_1d(N,a,a,FFTW_FORWARD,FFTW_ESTIMATE);
+    break;
+  case PLAN_REVERSE_INPLACE:
+    plan = fftwf_plan_dft_1d(N,a,a,FFTW_BACKWARD,FFTW_ESTIMATE);
+    break;
+  case PLAN_REVERSE:
+    plan = fftwf_plan_dft_1d(N,a,b,FFTW_BACKWARD,FFTW_ESTIMATE);
+    break;
+  case PLAN_R2C:
+    plan = fftwf_plan_dft_r2c_1d(N,(float *)b,a,FFTW_ESTIMATE);
+    break;
+  case PLAN_C2R:
+    plan = fftwf_plan_dft_c2r_1d(N,a,(float *)b,FFTW_ESTIMATE);
+    break;
+  }
+  assert(plan != NULL);
+  fftwf_free(a);
+  fftwf_free(b);
+  struct plan_cache * const pc = calloc(1,sizeof(*pc));
+  assert(pc != NULL);
+  pc->kind = kind;
+  pc->N = N;
+  pc->plan = plan;
+  pc->next = Plan_cache;
+  Plan_cache = pc;
+  pthread_mutex_unlock(&Plan_mutex);
+  return plan;
+}
+
 
 // Create fast convolution filters
 // The filters are now in two parts, filter_in (the master) and filter_out (the slave)
@@ -73,11 +255,14 @@ struct filter_in *create_filter_input(int const L,int const M, enum filtertype c
 
 
   struct filter_in * const master = calloc(1,sizeof(struct filter_in));
-  for(int i=0; i < ND; i++)
-    master->fdomain[i] = fftwf_alloc_complex(bins);
-
   assert(master != NULL);
   assert(master != (void *)-1);
+  master->pages = PAGES_HUGETLB; // Lowered to the worst we actually get
+  for(int i=0; i < ND; i++){
+    enum page_kind kind;
+    master->fdomain[i] = big_alloc(bins * sizeof(*master->fdomain[i]),&kind);
+    master->pages = min(master->pages,kind);
+  }
   master->bins = bins;
   master->in_type = in_type;
   master->ilen = L;
@@ -95,24 +280,55 @@ struct filter_in *create_filter_input(int const L,int const M, enum filtertype c
     assert(0); // shouldn't happen
     return NULL;
   case COMPLEX:
-    master->input_buffer.c = fftwf_alloc_complex(N);
+    {
+      enum page_kind kind;
+      master->input_buffer.c = big_alloc(N * sizeof(*master->input_buffer.c),&kind);
+      master->pages = min(master->pages,kind);
+    }
     master->input_buffer.r = NULL; // Catch erroneous uses
-    assert(malloc_usable_size(master->input_buffer.c) >= N * sizeof(*master->input_buffer.c));
+    assert(big_size(master->input_buffer.c) >= N * sizeof(*master->input_buffer.c));
     memset(master->input_buffer.c, 0, (M-1)*sizeof(*master->input_buffer.c)); // Clear earlier state
     master->input.c = master->input_buffer.c + M - 1;
+    master->input_ring[0] = master->input_buffer;
     master->fwd_plan = fftwf_plan_dft_1d(N, master->input_buffer.c, master->fdomain[0], FFTW_FORWARD, FFTW_ESTIMATE);
     break;
   case REAL:
     master->input_buffer.c = NULL;
-    master->input_buffer.r = fftwf_alloc_real(N);
-    assert(malloc_usable_size(master->input_buffer.r) >= N * sizeof(*master->input_buffer.r));
+    {
+      enum page_kind kind;
+      master->input_buffer.r = big_alloc(N * sizeof(*master->input_buffer.r),&kind);
+      master->pages = min(master->pages,kind);
+    }
+    assert(big_size(master->input_buffer.r) >= N * sizeof(*master->input_buffer.r));
     memset(master->input_buffer.r, 0, (M-1)*sizeof(*master->input_buffer.r)); // Clear earlier state
     master->input.r = master->input_buffer.r + M - 1;
+    master->input_ring[0] = master->input_buffer;
     master->fwd_plan = fftwf_plan_dft_r2c_1d(N, master->input_buffer.r, master->fdomain[0], FFTW_ESTIMATE);
     break;
   }
   return master;
 }
+// Deleted output filters are kept here and handed back by create_filter_output() for the same master, length and type,
+// saving the buffer allocations and FFTW planning when demods come and go (e.g., started and reaped by a detector)
+#define FILTER_POOL_SIZE 64
+static struct filter_out *Filter_pool;
+static int Filter_pool_count;
+static pthread_mutex_t Filter_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void release_response(complex float *response);
+static float response_noise_gain(struct filter_out const *slave,complex float const *response);
+
+// Release a deleted (or pooled) output filter's resources for good
+static void free_filter_output(struct filter_out * const slave){
+  pthread_mutex_destroy(&slave->response_mutex);
+  // rev_plan is shared
+  big_free(slave->output_buffer.c);
+  big_free(slave->output_buffer.r);
+  release_response(slave->response);
+  big_free(slave->f_fdomain);
+  free(slave);
+}
+
 // Set up output (slave) side of filter (possibly one of several sharing the same input master)
 // These output filters should be deleted before their masters
 // Segfault will occur if filter_in is deleted and execute_filter_output is executed
@@ -125,7 +341,31 @@ struct filter_out *create_filter_output(struct filter_in * master,complex float
   if(olen > master->ilen)
     return NULL; // Interpolation not yet supported
   
-  struct filter_out * const slave = calloc(1,sizeof(*slave));
+  struct filter_out *slave = NULL;
+  pthread_mutex_lock(&Filter_pool_mutex);
+  for(struct filter_out **pp = &Filter_pool; *pp != NULL; pp = &(*pp)->pool_next){
+    if((*pp)->master == master && (*pp)->olen == olen && (*pp)->out_type == out_type){
+      slave = *pp;
+      *pp = slave->pool_next;
+      Filter_pool_count--;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&Filter_pool_mutex);
+  if(slave != NULL){
+    // Buffers and plan are already the right size; just reset the state
+    slave->pool_next = NULL;
+    slave->response = response;
+    slave->noise_gain = response != NULL ? noise_gain(slave) : NAN;
+    slave->block_drops = 0;
+    slave->blocks = 0;
+    slave->busy_ns = 0;
+    memset(&slave->timing,0,sizeof(slave->timing));
+    slave->rcnt = 0;
+    slave->blocknum = master->blocknum;
+    return slave;
+  }
+  slave = calloc(1,sizeof(*slave));
   if(slave == NULL)
     return NULL;
   // Share all but output fft bins, response, output and output type
@@ -141,163 +381,187 @@ struct filter_out *create_filter_output(struct filter_in * master,complex float
     slave->noise_gain = noise_gain(slave);
   else
     slave->noise_gain = NAN;
-  
-  // Usually too small to benefit from multithreading
-  fftwf_plan_with_nthreads(1);
+
+  enum page_kind kind; // Not reported; only wideband outputs are big enough to get huge pages
   switch(slave->out_type){
   default:
   case COMPLEX:
   case CROSS_CONJ:
     slave->bins = osize; // Same as total number of time domain points
-    slave->f_fdomain = fftwf_alloc_complex(slave->bins);
-    slave->output_buffer.c = fftwf_alloc_complex(osize);
+    slave->f_fdomain = big_alloc(slave->bins * sizeof(*slave->f_fdomain),&kind);
+    slave->output_buffer.c = big_alloc(osize * sizeof(*slave->output_buffer.c),&kind);
     assert(slave->output_buffer.c != NULL);
     slave->output_buffer.r = NULL; // catch erroneous references
     slave->output.c = slave->output_buffer.c + osize - olen;
-    slave->rev_plan = fftwf_plan_dft_1d(osize,slave->f_fdomain,slave->output_buffer.c,FFTW_BACKWARD,FFTW_ESTIMATE);
+    slave->rev_plan = get_plan(PLAN_REVERSE,osize);
     break;
   case REAL:
     slave->bins = osize / 2 + 1;
-    slave->f_fdomain = fftwf_alloc_complex(slave->bins);
+    slave->f_fdomain = big_alloc(slave->bins * sizeof(*slave->f_fdomain),&kind);
     assert(slave->f_fdomain != NULL);    
     
-    slave->output_buffer.r = fftwf_alloc_real(osize);
+    slave->output_buffer.r = big_alloc(osize * sizeof(*slave->output_buffer.r),&kind);
     assert(slave->output_buffer.r != NULL);
     slave->output_buffer.c = NULL;
     slave->output.r = slave->output_buffer.r + osize - olen;
-    slave->rev_plan = fftwf_plan_dft_c2r_1d(osize,slave->f_fdomain,slave->output_buffer.r,FFTW_ESTIMATE);
+    slave->rev_plan = get_plan(PLAN_C2R,osize);
     break;
   }
   slave->blocknum = master->blocknum;
   return slave;
 }
 
-// Thread that actually performs the forward FFT
-// Allows the thread running execute_filter_input() to continue
-// processing the next input block in parallel on another core
-// Frees the input buffer and the job descriptor when done
+// Forward FFT worker thread, one of f->fft_workers
+// Takes the next block handed over by execute_filter_input(), transforms it into its slot
+// of the frequency domain ring, then waits for all earlier blocks to be published before publishing it.
+// With more than one worker, consecutive blocks are transformed concurrently on different cores
+// so the block rate is no longer limited by how fast one core can do an FFT
 void *run_fft(void *p){
   pthread_detach(pthread_self());
-  pthread_setname("fft");
-
-  struct filter_in *f = (struct filter_in *)p;
+  struct fft_worker * const w = (struct fft_worker *)p;
+  assert(w != NULL);
+  struct filter_in * const f = w->master;
   assert(f != NULL);
   assert(f->fwd_plan != NULL);
-
+  {
+    char name[100];
+    snprintf(name,sizeof(name),"fft %d",w->index);
+    pthread_setname(name);
+  }
   while(1){
-    // take job descriptor from head of queue
     pthread_mutex_lock(&f->queue_mutex);
-    while(f->job_queue == NULL)
+    while(f->fft_next == f->jobnum)
       pthread_cond_wait(&f->queue_cond,&f->queue_mutex);
-    
-    struct fft_job *job = f->job_queue;
-    f->job_queue = job->next;
-    int const jobnum = f->jobnum++;
+    unsigned int const jobnum = f->fft_next++;
     pthread_mutex_unlock(&f->queue_mutex);
-    
-    if(job->input != NULL){
-      switch(f->in_type){
-      case COMPLEX:
-      case CROSS_CONJ:
-	fftwf_execute_dft(f->fwd_plan,job->input,f->fdomain[jobnum % ND]);
-	break;
-      case REAL:
-	fftwf_execute_dft_r2c(f->fwd_plan,job->input,f->fdomain[jobnum % ND]);
-	break;
-      default:
-	break;
-      }
-      free(job->input); job->input = NULL;
+
+    struct timespec start,done;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    switch(f->in_type){
+    case COMPLEX:
+    case CROSS_CONJ:
+      fftwf_execute_dft(f->fwd_plan,f->input_ring[jobnum % ND].c,f->fdomain[jobnum % ND]);
+      break;
+    case REAL:
+      fftwf_execute_dft_r2c(f->fwd_plan,f->input_ring[jobnum % ND].r,f->fdomain[jobnum % ND]);
+      break;
+    default:
+      break;
     }
+    clock_gettime(CLOCK_MONOTONIC,&done);
+    long long const busy = (done.tv_sec - start.tv_sec) * BILLION + done.tv_nsec - start.tv_nsec;
+    w->blocks++;
+    w->busy_ns += busy;
+    timing_add(&w->timing,busy);
+    if(busy > w->max_ns)
+      w->max_ns = busy;
 
     pthread_mutex_lock(&f->filter_mutex);
-#ifdef DUAL_FFT_THREAD
-    // Wait for any previous pending jobs to finish, if they got out of sequence due to scheduling
-    // Still works if only one thread is running, but let's avoid the theoretical deadlock anyway
-    while(jobnum != f->blocknum + 1)
+    // Publish in order; a later block may have finished first
+    while(f->blocknum != jobnum)
       pthread_cond_wait(&f->filter_cond,&f->filter_mutex);
-#endif
-    // Signal listeners that we're done
     f->blocknum = jobnum + 1;
+    // Wakes slaves, any worker holding the next block, and the writer if it's waiting for an input buffer
     pthread_cond_broadcast(&f->filter_cond);
     pthread_mutex_unlock(&f->filter_mutex);
-    free(job); job = NULL;
+    if(f->publish != NULL)
+      (*f->publish)(f,f->publish_arg);
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    w->wait_ns += (start.tv_sec - done.tv_sec) * BILLION + start.tv_nsec - done.tv_nsec;
   }
   return NULL; // not reached
 }
 
+// Allocate the rest of the input ring and start the FFT workers, on first use
+static int start_fft_workers(struct filter_in * const f){
+  int const N = f->ilen + f->impulse_length - 1;
+  for(int i=1; i < ND; i++){
+    enum page_kind kind;
+    if(f->in_type == REAL)
+      f->input_ring[i].r = big_alloc(N * sizeof(*f->input_ring[i].r),&kind);
+    else
+      f->input_ring[i].c = big_alloc(N * sizeof(*f->input_ring[i].c),&kind);
+    f->pages = min(f->pages,kind);
+  }
+  int const nworkers = Fft_workers < 1 ? 1 : Fft_workers > MAX_FFT_WORKERS ? MAX_FFT_WORKERS : Fft_workers;
+  for(int i=0; i < nworkers; i++){
+    struct fft_worker * const w = &f->workers[i];
+    w->master = f;
+    w->index = i;
+    pthread_create(&w->thread,NULL,run_fft,w);
+  }
+  f->fft_workers = nworkers;
+  return nworkers;
+}
 
 int execute_filter_input(struct filter_in * const f){
   assert(f != NULL);
   if(f == NULL)
     return -1;
 
-  // Start FFT thread if not already running
-  if(f->fft_thread == (pthread_t)0)
-    pthread_create(&f->fft_thread,NULL,run_fft,f);
-#if DUAL_FFT_THREAD
-  // Experimental: create second FFT processing thread
-  // Only really useful if FFT cannot be completed in one frame time
-  // Otherwise the scheduler usually gives the job to the same thread, and the other sits idle
-  if(f->fft_thread2 == (pthread_t)0)
-    pthread_create(&f->fft_thread2,NULL,run_fft,f);    
-#endif
-
-  // We now use the FFTW3 functions that specify the input and output arrays
-  // Execute the FFT in a detached thread so we can process more input data while the FFT executes
-  struct fft_job * const job = calloc(1,sizeof(struct fft_job));
-
-  switch(f->in_type){
-  default:
-  case CROSS_CONJ:
-  case COMPLEX:
-    job->input = f->input_buffer.c;
-    break;
-  case REAL:
-    job->input = f->input_buffer.r;
-    break;
+  if(f->inline_fft){
+    // No thread handoff: transform in place, then do overlap-save on the same buffer
+    unsigned int const jobnum = f->jobnum++;
+    int const M = f->impulse_length;
+    switch(f->in_type){
+    default:
+    case COMPLEX:
+      fftwf_execute_dft(f->fwd_plan,f->input_buffer.c,f->fdomain[jobnum % ND]);
+      memmove(f->input_buffer.c,f->input_buffer.c + f->ilen,(M-1)*sizeof(*f->input_buffer.c));
+      break;
+    case REAL:
+      fftwf_execute_dft_r2c(f->fwd_plan,f->input_buffer.r,f->fdomain[jobnum % ND]);
+      memmove(f->input_buffer.r,f->input_buffer.r + f->ilen,(M-1)*sizeof(*f->input_buffer.r));
+      break;
+    }
+    f->wcnt = 0;
+    pthread_mutex_lock(&f->filter_mutex);
+    f->blocknum = jobnum + 1;
+    pthread_cond_broadcast(&f->filter_cond);
+    pthread_mutex_unlock(&f->filter_mutex);
+    if(f->publish != NULL)
+      (*f->publish)(f,f->publish_arg);
+    return 0;
   }
-  assert(job->input != NULL); // Should already be allocated in create_filter_input, or in our last call
+  if(f->fft_workers == 0)
+    start_fft_workers(f);
+
+  // The block just filled is f->jobnum, in input_ring[jobnum % ND]
+  // Before handing it off, set up the next input buffer and perform the overlap-and-save
+  // operation for fast convolution. The next buffer is free once its previous occupant,
+  // ND blocks back, has been transformed and published
+  unsigned int const jobnum = f->jobnum;
+  unsigned int const next = jobnum + 1;
+  pthread_mutex_lock(&f->filter_mutex);
+  if((int)(next - f->blocknum) >= ND){
+    f->input_stalls++;
+    while((int)(next - f->blocknum) >= ND)
+      pthread_cond_wait(&f->filter_cond,&f->filter_mutex);
+  }
+  pthread_mutex_unlock(&f->filter_mutex);
 
-  // Set up next input buffer and perform overlap-and-save operation for fast convolution
-  // Although it would decrease latency to notify the fft thead first, that would set up a race condition
-  // since the FFT thread frees its input buffer on completion
-  int const N = f->ilen + f->impulse_length - 1;
+  int const M = f->impulse_length;
   switch(f->in_type){
   default:
+  case CROSS_CONJ:
   case COMPLEX:
-    {
-      complex float * const newbuf = fftwf_alloc_complex(N);
-      memmove(newbuf,f->input_buffer.c + f->ilen,(f->impulse_length-1)*sizeof(*f->input_buffer.c));
-      f->input_buffer.c = newbuf;
-      f->input.c = f->input_buffer.c + f->impulse_length -1;
-    }
+    memcpy(f->input_ring[next % ND].c,f->input_buffer.c + f->ilen,(M-1)*sizeof(*f->input_buffer.c));
+    f->input_buffer.c = f->input_ring[next % ND].c;
+    f->input.c = f->input_buffer.c + M - 1;
     break;
   case REAL:
-    {
-      float * const newbuf = fftwf_alloc_real(N);
-      memmove(newbuf,f->input_buffer.r + f->ilen,(f->impulse_length-1)*sizeof(*f->input_buffer.r));
-      f->input_buffer.r = newbuf;
-      f->input.r = f->input_buffer.r + f->impulse_length -1;
-    }
+    memcpy(f->input_ring[next % ND].r,f->input_buffer.r + f->ilen,(M-1)*sizeof(*f->input_buffer.r));
+    f->input_buffer.r = f->input_ring[next % ND].r;
+    f->input.r = f->input_buffer.r + M - 1;
     break;
   }
   f->wcnt = 0; // In case it's not already reset to 0
 
-  // Append job to queue, wake FFT thread
+  // Hand the block to the workers
   pthread_mutex_lock(&f->queue_mutex);
-  struct fft_job *jp_prev = NULL;
-  for(struct fft_job *jp = f->job_queue; jp != NULL; jp = jp->next)
-    jp_prev = jp;
-
-  if(jp_prev)
-    jp_prev->next = job;
-  else
-    f->job_queue = job; // Head of list
-
-  pthread_cond_signal(&f->queue_cond); // Alert FFT thread
+  f->jobnum = next;
+  pthread_cond_signal(&f->queue_cond);
   pthread_mutex_unlock(&f->queue_mutex);
-
   return 0;
 }
 
@@ -311,9 +575,10 @@ int execute_filter_output_idle(struct filter_out * const slave){
   pthread_mutex_lock(&master->filter_mutex); // Protect access to master->blocknum
   while(slave->blocknum == master->blocknum)
     pthread_cond_wait(&master->filter_cond,&master->filter_mutex);
-  if((int)(master->blocknum - slave->blocknum) > ND){
+  int const depth = ND - master->fft_workers; // The workers may be overwriting the oldest slots
+  if((int)(master->blocknum - slave->blocknum) > depth){
     // Fell behind
-    slave->block_drops += (int)(master->blocknum - slave->blocknum) - ND;
+    slave->block_drops += (int)(master->blocknum - slave->blocknum) - depth;
     slave->blocknum = master->blocknum;
   } else
     slave->blocknum++;
@@ -342,7 +607,7 @@ int execute_filter_output(struct filter_out * const slave,int const rotate){
   assert(slave->bins > 0);
 
   // DC and positive frequencies up to nyquist frequency are same for all types
-  assert(malloc_usable_size(slave->f_fdomain) >= slave->bins * sizeof(*slave->f_fdomain));
+  assert(big_size(slave->f_fdomain) >= slave->bins * sizeof(*slave->f_fdomain));
 
   // Wait for new block of data
   // master->blocknum is the next block that the master will produce
@@ -350,9 +615,10 @@ int execute_filter_output(struct filter_out * const slave,int const rotate){
   while(slave->blocknum == master->blocknum)
     pthread_cond_wait(&master->filter_cond,&master->filter_mutex);
   // We don't modify the master's output data, we create our own
-  if((int)(master->blocknum - slave->blocknum) > ND){
+  int const depth = ND - master->fft_workers; // The workers may be overwriting the oldest slots
+  if((int)(master->blocknum - slave->blocknum) > depth){
     // Fell behind, catch up
-    slave->block_drops += (int)(master->blocknum - slave->blocknum) - ND;
+    slave->block_drops += (int)(master->blocknum - slave->blocknum) - depth;
     slave->blocknum = master->blocknum - 1;
   }
   complex float const * const fdomain = master->fdomain[slave->blocknum % ND];
@@ -360,10 +626,12 @@ int execute_filter_output(struct filter_out * const slave,int const rotate){
   pthread_mutex_unlock(&master->filter_mutex); 
 
   assert(fdomain != NULL);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC,&start);
 
   pthread_mutex_lock(&slave->response_mutex); // Protect access to response[] array
   assert(malloc_usable_size(slave->response) >= slave->bins * sizeof(*slave->response));
-  assert(malloc_usable_size(slave->f_fdomain) >= slave->bins * sizeof(*slave->f_fdomain));
+  assert(big_size(slave->f_fdomain) >= slave->bins * sizeof(*slave->f_fdomain));
 
   // Apply frequency response curve
   // Frequency domain is always complex, but the sizes depend on the time domain input/output being real or complex
@@ -501,7 +769,7 @@ int execute_filter_output(struct filter_out * const slave,int const rotate){
   pthread_mutex_unlock(&slave->response_mutex); // release response[]
   if(slave->out_type == CROSS_CONJ){
     // hack for ISB; forces negative frequencies onto I, positive onto Q
-    assert(malloc_usable_size(slave->f_fdomain) >= slave->bins * sizeof(*slave->f_fdomain));
+    assert(big_size(slave->f_fdomain) >= slave->bins * sizeof(*slave->f_fdomain));
     for(int p=1,dn=slave->bins-1; p < slave->bins; p++,dn--){
       complex float const pos = slave->f_fdomain[p];
       complex float const neg = slave->f_fdomain[dn];
@@ -510,7 +778,16 @@ int execute_filter_output(struct filter_out * const slave,int const rotate){
       slave->f_fdomain[dn] = neg - conjf(pos);
     }
   }
-  fftwf_execute(slave->rev_plan); // Note: c2r version destroys f_fdomain[]
+  if(slave->out_type == REAL)
+    fftwf_execute_dft_c2r(slave->rev_plan,slave->f_fdomain,slave->output_buffer.r); // Note: destroys f_fdomain[]
+  else
+    fftwf_execute_dft(slave->rev_plan,slave->f_fdomain,slave->output_buffer.c);
+  struct timespec done;
+  clock_gettime(CLOCK_MONOTONIC,&done);
+  long long const busy = (done.tv_sec - start.tv_sec) * BILLION + done.tv_nsec - start.tv_nsec;
+  slave->blocks++;
+  slave->busy_ns += busy;
+  timing_add(&slave->timing,busy);
   return 0;
 }
 
@@ -523,15 +800,29 @@ int delete_filter_input(struct filter_in ** p){
   if(master == NULL)
     return -1;
   
-  if(master->fft_thread)
-    pthread_cancel(master->fft_thread);
-  if(master->fft_thread2)
-    pthread_cancel(master->fft_thread2);
+  for(int i=0; i < master->fft_workers; i++)
+    pthread_cancel(master->workers[i].thread);
 
   fftwf_destroy_plan(master->fwd_plan);
-  fftwf_free(master->input_buffer.c);
+  for(int i=0; i < ND; i++){
+    big_free(master->input_ring[i].c);
+    big_free(master->input_ring[i].r);
+  }
   for(int i=0; i < ND; i++)
-    fftwf_free(master->fdomain[i]);
+    big_free(master->fdomain[i]);
+
+  // Pooled outputs can't outlive their master
+  pthread_mutex_lock(&Filter_pool_mutex);
+  for(struct filter_out **pp = &Filter_pool; *pp != NULL;){
+    struct filter_out * const slave = *pp;
+    if(slave->master == master){
+      *pp = slave->pool_next;
+      Filter_pool_count--;
+      free_filter_output(slave);
+    } else
+      pp = &slave->pool_next;
+  }
+  pthread_mutex_unlock(&Filter_pool_mutex);
   free(master);
   *p = NULL;
   return 0;
@@ -544,13 +835,23 @@ int delete_filter_output(struct filter_out **p){
   if(slave == NULL)
     return 1;
   
-  pthread_mutex_destroy(&slave->response_mutex);
-  fftwf_destroy_plan(slave->rev_plan);  
-  fftwf_free(slave->output_buffer.c);
-  fftwf_free(slave->response);
-  fftwf_free(slave->f_fdomain);
-  free(slave);
   *p = NULL;
+  // Drop the response; keep everything else for the next create_filter_output() like it
+  pthread_mutex_lock(&slave->response_mutex);
+  release_response(slave->response);
+  slave->response = NULL;
+  pthread_mutex_unlock(&slave->response_mutex);
+
+  pthread_mutex_lock(&Filter_pool_mutex);
+  if(Filter_pool_count < FILTER_POOL_SIZE){
+    slave->pool_next = Filter_pool;
+    Filter_pool = slave;
+    Filter_pool_count++;
+    slave = NULL;
+  }
+  pthread_mutex_unlock(&Filter_pool_mutex);
+  if(slave != NULL)
+    free_filter_output(slave);
   return 0;
 }
 
@@ -633,15 +934,12 @@ int window_filter(int const L,int const M,complex float * const response,float c
 
   const int N = L + M - 1;
   assert(malloc_usable_size(response) >= N * sizeof(*response));
-  // fftw_plan can overwrite its buffers, so we're forced to make a temp. Ugh.
+  // Work in an aligned temp; the caller's response may not match the cached plans' alignment
   complex float * const buffer = fftwf_alloc_complex(N);
-  fftwf_plan fwd_filter_plan = fftwf_plan_dft_1d(N,buffer,buffer,FFTW_FORWARD,FFTW_ESTIMATE);
-  fftwf_plan rev_filter_plan = fftwf_plan_dft_1d(N,buffer,buffer,FFTW_BACKWARD,FFTW_ESTIMATE);
 
   // Convert to time domain
   memcpy(buffer,response,N * sizeof(*buffer));
-  fftwf_execute(rev_filter_plan);
-  fftwf_destroy_plan(rev_filter_plan);
+  fftwf_execute_dft(get_plan(PLAN_REVERSE_INPLACE,N),buffer,buffer);
 #if 0
   fprintf(stderr,"window_filter raw time domain\n");
   for(int n=0; n < N; n++){
@@ -672,8 +970,7 @@ int window_filter(int const L,int const M,complex float * const response,float c
 #endif
   
   // Now back to frequency domain
-  fftwf_execute(fwd_filter_plan);
-  fftwf_destroy_plan(fwd_filter_plan);
+  fftwf_execute_dft(get_plan(PLAN_FORWARD_INPLACE,N),buffer,buffer);
 
 #if 0
   fprintf(stderr,"window_filter filter response amplitude\n");
@@ -703,15 +1000,10 @@ int window_rfilter(int const L,int const M,complex float * const response,float
   assert(buffer != NULL);
   float * const timebuf = fftwf_alloc_real(N);
   assert(timebuf != NULL);
-  fftwf_plan fwd_filter_plan = fftwf_plan_dft_r2c_1d(N,timebuf,buffer,FFTW_ESTIMATE);
-  assert(fwd_filter_plan != NULL);
-  fftwf_plan rev_filter_plan = fftwf_plan_dft_c2r_1d(N,buffer,timebuf,FFTW_ESTIMATE);
-  assert(rev_filter_plan != NULL);
 
   // Convert to time domain
   memcpy(buffer,response,(N/2+1)*sizeof(*buffer));
-  fftwf_execute(rev_filter_plan);
-  fftwf_destroy_plan(rev_filter_plan);
+  fftwf_execute_dft_c2r(get_plan(PLAN_C2R,N),buffer,timebuf);
 #if 0
   fprintf(stderr,"window_rfilter impulse response after IFFT before windowing\n");
   for(int n=0;n< M;n++)
@@ -736,8 +1028,7 @@ int window_rfilter(int const L,int const M,complex float * const response,float
 #endif
   
   // Now back to frequency domain
-  fftwf_execute(fwd_filter_plan);
-  fftwf_destroy_plan(fwd_filter_plan);
+  fftwf_execute_dft_r2c(get_plan(PLAN_R2C,N),timebuf,buffer);
   fftwf_free(timebuf);
   memcpy(response,buffer,(N/2+1)*sizeof(*response));
   fftwf_free(buffer);
@@ -754,11 +1045,16 @@ int window_rfilter(int const L,int const M,complex float * const response,float
 float const noise_gain(struct filter_out const * const slave){
   if(slave == NULL)
     return NAN;
+  return response_noise_gain(slave,slave->response);
+}
+
+// Same, for a response not (yet) installed in the slave
+static float response_noise_gain(struct filter_out const * const slave,complex float const * const response){
   struct filter_in const * const master = slave->master;
 
   float sum = 0;
   for(int i=0;i<slave->bins;i++)
-    sum += cnrmf(slave->response[i]);
+    sum += cnrmf(response[i]);
 
   // the factor N compensates for the unity gain scaling
   // Amplitude is pre-scaled 1/N for the concatenated (FFT/IFFT) round trip, so the overall power
@@ -772,6 +1068,66 @@ float const noise_gain(struct filter_out const * const slave){
 }
 
 
+// Responses designed by set_filter() are cached and shared by every output filter with the same design,
+// so identical channels, and clients hopping back and forth between a few bandwidths, don't redesign them
+// Shared responses are never modified; release_response() drops a reference
+struct response_cache {
+  struct response_cache *next;
+  enum filtertype out_type;
+  int bins;
+  int olen;
+  int master_bins;                   // Sets the gain
+  float low,high,kaiser_beta;
+  float noise_gain;
+  int refs;
+  complex float *response;
+};
+#define RESPONSE_CACHE_SIZE 256      // Unreferenced designs kept for reuse
+static struct response_cache *Response_cache;
+static int Response_cache_count;
+static pthread_mutex_t Response_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Caller holds Response_mutex
+static struct response_cache *find_response(struct filter_out const * const slave,float const low,float const high,float const kaiser_beta){
+  for(struct response_cache *rp = Response_cache; rp != NULL; rp = rp->next){
+    if(rp->out_type == slave->out_type && rp->bins == slave->bins && rp->olen == slave->olen
+       && rp->master_bins == slave->master->bins && rp->low == low && rp->high == high && rp->kaiser_beta == kaiser_beta)
+      return rp;
+  }
+  return NULL;
+}
+
+// Drop a reference to a response; one that isn't from the cache (e.g., supplied to create_filter_output()) is just freed
+static void release_response(complex float * const response){
+  if(response == NULL)
+    return;
+  pthread_mutex_lock(&Response_mutex);
+  struct response_cache *rp;
+  for(rp = Response_cache; rp != NULL; rp = rp->next){
+    if(rp->response == response)
+      break;
+  }
+  if(rp != NULL){
+    rp->refs--;
+    // Keep it for the next user unless the cache is full; then drop unreferenced entries
+    if(Response_cache_count > RESPONSE_CACHE_SIZE){
+      for(struct response_cache **pp = &Response_cache; *pp != NULL;){
+	struct response_cache * const e = *pp;
+	if(e->refs == 0){
+	  *pp = e->next;
+	  fftwf_free(e->response);
+	  free(e);
+	  Response_cache_count--;
+	} else
+	  pp = &e->next;
+      }
+    }
+  }
+  pthread_mutex_unlock(&Response_mutex);
+  if(rp == NULL)
+    fftwf_free(response);
+}
+
 // This can occasionally be called with slave == NULL at startup, so don't abort
 // NB: 'low' and 'high' are *fractional* frequencies relative to the output sample rate, i.e., -0.5 < f < +0.5
 int set_filter(struct filter_out * const slave,float low,float high,float const kaiser_beta){
@@ -790,6 +1146,15 @@ int set_filter(struct filter_out * const slave,float low,float high,float const
   if(fabsf(high) > 0.5)
     high = (high > 0 ? +1 : -1) * 0.5;
 
+  pthread_mutex_lock(&Response_mutex);
+  struct response_cache *rp = find_response(slave,low,high,kaiser_beta);
+  if(rp != NULL){
+    rp->refs++;
+    pthread_mutex_unlock(&Response_mutex);
+    goto swap;
+  }
+  pthread_mutex_unlock(&Response_mutex);
+
  // Total number of time domain points
   int const N = (slave->out_type == REAL) ? 2 * (slave->bins - 1) : slave->bins;
   int const L = slave->olen;
@@ -819,13 +1184,43 @@ int set_filter(struct filter_out * const slave,float low,float high,float const
     window_filter(L,M,response,kaiser_beta);
   }
 
+  {
+    struct response_cache * const new = calloc(1,sizeof(*new));
+    assert(new != NULL);
+    new->out_type = slave->out_type;
+    new->bins = slave->bins;
+    new->olen = slave->olen;
+    new->master_bins = slave->master->bins;
+    new->low = low;
+    new->high = high;
+    new->kaiser_beta = kaiser_beta;
+    new->response = response;
+    new->refs = 1;
+    pthread_mutex_lock(&Response_mutex);
+    rp = find_response(slave,low,high,kaiser_beta);
+    if(rp != NULL){
+      // Somebody else designed it while we were; use theirs
+      rp->refs++;
+      pthread_mutex_unlock(&Response_mutex);
+      fftwf_free(response);
+      free(new);
+    } else {
+      new->noise_gain = response_noise_gain(slave,response);
+      new->next = Response_cache;
+      Response_cache = new;
+      Response_cache_count++;
+      rp = new;
+      pthread_mutex_unlock(&Response_mutex);
+    }
+  }
+ swap:;
   // Hot swap with existing response, if any, using mutual exclusion
   pthread_mutex_lock(&slave->response_mutex);
   complex float * const tmp = slave->response;
-  slave->response = response;
-  slave->noise_gain = noise_gain(slave);
+  slave->response = rp->response;
+  slave->noise_gain = rp->noise_gain;
   pthread_mutex_unlock(&slave->response_mutex);
-  fftwf_free(tmp);
+  release_response(tmp);
 
   return 0;
 }
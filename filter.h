@@ -12,6 +12,8 @@
 #include <complex.h>
 #include <fftw3.h>
 
+#include "misc.h"
+
 // Input can be REAL or COMPLEX
 // Output can be REAL, COMPLEX or CROSS_CONJ, i.e., COMPLEX with special cross conjugation for ISB
 enum filtertype {
@@ -21,11 +23,6 @@ enum filtertype {
   REAL,
 };
 
-struct fft_job {
-  struct fft_job *next;
-  void *input;
-};
-
 // Input and output arrays can be either complex or real
 // Used to be a union, but was prone to errors
 struct rc {
@@ -33,29 +30,60 @@ struct rc {
   complex float * restrict c;
 };
 
-#define ND 4
+// Where a filter's large buffers came from
+enum page_kind {
+  PAGES_NORMAL,       // fftwf_malloc()
+  PAGES_TRANSPARENT,  // Huge pages requested with MADV_HUGEPAGE; whether they're backed is up to the kernel
+  PAGES_HUGETLB,      // Explicit 2 MB pages from the reserved pool (vm.nr_hugepages)
+};
+
+#define ND 8                // Frequency domain blocks kept for slaves; also the input ring size. Power of 2
+#define MAX_FFT_WORKERS (ND/2)
+
+// One forward FFT worker thread of a filter_in, with its timing stats
+struct fft_worker {
+  pthread_t thread;
+  struct filter_in *master;
+  int index;
+  unsigned long long blocks;         // FFTs executed
+  long long busy_ns;                 // Total time in FFTW
+  long long max_ns;                  // Longest single FFT
+  long long wait_ns;                 // Time spent waiting to publish in order behind an earlier block
+  struct timing timing;              // Per FFT, for the status channel
+};
+
 struct filter_in {
   enum filtertype in_type;           // REAL or COMPLEX
   int ilen;                          // Length of user portion of input buffer, aka 'L'
   int bins;                          // Total number of frequency bins. Complex: L + M - 1;  Real: (L + M - 1)/2 + 1
   int impulse_length;                // Length of filter impulse response, aka 'M'
   int wcnt;                          // Samples written to unexecuted input buffer
-  struct rc input_buffer;            // Actual time-domain input buffer, length N = L + M - 1
+  struct rc input_buffer;            // Time-domain input buffer being filled, length N = L + M - 1; one of input_ring[]
   struct rc input;                   // Beginning of user input area, length L
+  struct rc input_ring[ND];          // Preallocated input buffers; block j is filled in input_ring[j % ND]
   fftwf_plan fwd_plan;               // FFT (time -> frequency)
 
   unsigned int blocknum;             // Data sequence number, used to notify slaves of new data
   pthread_mutex_t filter_mutex;      // Synchronization for sequence number
   pthread_cond_t filter_cond;
 
-  pthread_t fft_thread;
-  pthread_t fft_thread2;
-  int jobnum;
-  struct fft_job *job_queue;         // queue of input block for FFT thread
-  pthread_mutex_t queue_mutex;       // Synchronization for input queue
+  // Forward FFTs are run by a pool of worker threads, which may finish out of order
+  // but publish blocks to the slaves strictly in order by advancing blocknum
+  struct fft_worker workers[MAX_FFT_WORKERS];
+  int fft_workers;                   // Number running, 0 until first block (or always, with inline_fft)
+  unsigned int jobnum;               // Blocks handed to the workers
+  unsigned int fft_next;             // Next block for a worker to take
+  pthread_mutex_t queue_mutex;       // Synchronization for jobnum and fft_next
   pthread_cond_t queue_cond;
+  unsigned long long input_stalls;   // Times the writer had to wait for a free input buffer
 
   complex float *fdomain[ND];
+  enum page_kind pages;              // Worst case over fdomain[] and input_ring[]
+  int inline_fft;                    // Do forward FFT in caller's thread, e.g., for many small filters
+
+  // Optional, called (without locks held) each time a block is published, e.g., to schedule the slaves
+  void (*publish)(struct filter_in *,void *);
+  void *publish_arg;
 };
 struct filter_out {
   struct filter_in * restrict master;
@@ -71,7 +99,11 @@ struct filter_out {
   unsigned int blocknum;             // Last sequence number received from master, used for synchronization
   float noise_gain;                  // Filter gain on uniform noise (ratio < 1)
   int block_drops;                   // Lost frequency domain blocks, e.g., from late scheduling of slave thread
+  unsigned long long blocks;         // Blocks executed
+  long long busy_ns;                 // Time spent executing them, not counting the wait for the master
+  struct timing timing;              // Same, per block
   int rcnt;                          // Samples read from output buffer
+  struct filter_out *pool_next;      // Free list of deleted outputs, for reuse by create_filter_output()
 };
 
 
@@ -134,5 +166,7 @@ static inline complex float read_cfilter(struct filter_out * restrict const f,in
 }
 
 extern int Nthreads;
+extern int Fft_workers;
+extern int Hugepages;
 
 #endif
@@ -36,6 +36,7 @@
 #include "misc.h"
 #include "status.h"
 #include "multicast.h"
+#include "metrics.h"
 
 struct sdrstate {
   // Stuff for sending commands
@@ -91,11 +92,13 @@ int Mcast_ttl = 1; // Don't send fast IQ streams beyond the local network by def
 int IP_tos = 48; // AF12 left shifted 2 bits
 char *Name;
 char Metadata_dest[1024];
+char const *Metrics; // Scrape endpoint, if any
 
 struct option const Options[] =
   {
    {"iface", required_argument, NULL, 'A'},
    {"device", required_argument, NULL, 'I'},
+   {"metrics", required_argument, NULL, 'M'},
    {"name", required_argument, NULL, 'N'},
    {"ssrc", required_argument, NULL, 'S'},
    {"ttl", required_argument, NULL, 'T'},
@@ -107,7 +110,7 @@ struct option const Options[] =
    {"verbose", no_argument, NULL, 'v'},
    {NULL, 0, NULL, 0},
   };
-char const Optstring[] = "A:I:N:S:T:b:f:p:v";
+char const Optstring[] = "A:I:M:N:S:T:b:f:p:v";
 
 
 // Global variables
@@ -144,6 +147,7 @@ int get_adc(short *,int);
 void *display(void *);
 void *ncmd(void *);
 static void closedown(int a);
+static void funcube_metrics(struct metrics *,void *);
 
 int main(int argc,char *argv[]){
   struct sdrstate * const sdr = &FCD;
@@ -185,6 +189,9 @@ int main(int argc,char *argv[]){
     case 'I':
       Device = strtol(optarg,NULL,0);
       break;
+    case 'M':
+      Metrics = optarg;
+      break;
     case 'N':
       Name = optarg;
       break;
@@ -356,6 +363,8 @@ int main(int argc,char *argv[]){
     time(&tt);
     Rtp.ssrc = tt & 0xffffffff; // low 32 bits of clock time
   }
+  if(Metrics != NULL)
+    metrics_start(Metrics,"ka9q_funcube",funcube_metrics,sdr);
   fprintf(stderr,"uid %d; device %d; dest %s; blocksize %d; RTP SSRC %u; status file %s\n",getuid(),Device,Metadata_dest,Blocksize,Rtp.ssrc,Status_filename);
   // Gain and phase corrections. These will be updated every block
   float gain_q = 1;
@@ -926,4 +935,19 @@ static void closedown(int a){
   exit(1);
 }
 
-
+// Collect function for the metrics endpoint (--metrics)
+static void funcube_metrics(struct metrics * const m,void *arg){
+  struct sdrstate const * const sdr = (struct sdrstate *)arg;
+  metric_family(m,"output_packets_total","counter","RTP data packets sent");
+  metric(m,"output_packets_total",Rtp.packets,"ssrc=\"%u\",device=\"%d\"",Rtp.ssrc,Device);
+  metric_family(m,"output_bytes_total","counter","RTP data bytes sent");
+  metric(m,"output_bytes_total",Rtp.bytes,"ssrc=\"%u\",device=\"%d\"",Rtp.ssrc,Device);
+  metric_family(m,"overflows_total","counter","A/D input overflows");
+  metric(m,"overflows_total",sdr->overflows,"ssrc=\"%u\",device=\"%d\"",Rtp.ssrc,Device);
+  metric_family(m,"status_packets_total","counter","Status packets sent");
+  metric(m,"status_packets_total",Output_metadata_packets,"ssrc=\"%u\",device=\"%d\"",Rtp.ssrc,Device);
+  metric_family(m,"commands_total","counter","Commands received");
+  metric(m,"commands_total",Commands,"ssrc=\"%u\",device=\"%d\"",Rtp.ssrc,Device);
+  metric_family(m,"frequency_hz","gauge","Tuner frequency");
+  metric(m,"frequency_hz",sdr->frequency,"ssrc=\"%u\",device=\"%d\"",Rtp.ssrc,Device);
+}
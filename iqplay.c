@@ -25,6 +25,7 @@
 #include "multicast.h"
 #include "attr.h"
 #include "status.h"
+#include "recfile.h"
 
 
 int Verbose;
@@ -51,10 +52,13 @@ int Nctl_sock = -1;
 int Channels;
 int Bitspersample;
 float Min_IF,Max_IF;
+double Speed = 1;   // Playback rate relative to real time; 0 = as fast as possible
+double Start;       // Seconds into recording to begin (framed recordings only)
 
 
 void send_iqplay_status(int full);
 int playfile(int,int,int);
+int playrecfile(int,int,int);
 void *ncmd(void *);
 
 
@@ -72,10 +76,12 @@ struct option const Options[] =
    {"iptos", required_argument, NULL, 'p'},
    {"ip-tos", required_argument, NULL, 'p'},    
    {"samprate", required_argument, NULL, 'r'},
+   {"speed", required_argument, NULL, 's'},
+   {"start", required_argument, NULL, 't'},
    {"verbose", no_argument, NULL, 'v'},
    {NULL, 0, NULL, 0},
   };
-char const Optstring[] = "A:D:R:S:T:b:f:vr:";
+char const Optstring[] = "A:D:R:S:T:b:f:vr:s:t:";
 
 
 int main(int argc,char *argv[]){
@@ -132,6 +138,14 @@ int main(int argc,char *argv[]){
     case 'b':
       Blocksize = strtol(optarg,NULL,0);
       break;
+    case 's':
+      Speed = strtod(optarg,NULL);
+      if(Speed < 0)
+	Speed = 0;
+      break;
+    case 't':
+      Start = strtod(optarg,NULL);
+      break;
     case 'f': // Used only if there's no tag on a file, or for stdin
       Frequency = strtod(optarg,NULL);
       break;
@@ -230,8 +244,48 @@ int main(int argc,char *argv[]){
   exit(0);
 }
 
+// RTP payload type for a sample format, -1 if unsupported
+static int pt_from_format(int channels,int bitspersample){
+  switch(bitspersample){
+  case 8:
+    return channels == 1 ? REAL_PT8 : IQ_PT8;
+  case 12:
+    return channels == 1 ? REAL_PT12 : IQ_PT12;
+  case 16:
+    return channels == 1 ? PCM_MONO_PT : PCM_STEREO_PT;
+  default:
+    return -1;
+  }
+}
+
+// Wait until sked_time nanoseconds after start, scaled by Speed
+static void wait_until(struct timespec const *start,double sked_time){
+  if(Speed == 0)
+    return;
+  sked_time /= Speed;
+  while(1){
+    // Nanoseconds since start
+    struct timespec tv,diff;
+    clock_gettime(CLOCK_REALTIME,&tv);
+    time_sub(&diff,&tv,start);
+    double rt = 1000000000. * diff.tv_sec + diff.tv_nsec;
+    if(rt >= sked_time)
+      break;
+    if(sked_time > rt + 100000){
+      double const wait = sked_time - rt;
+      struct timespec ts;
+      ts.tv_sec = wait / 1e9;
+      ts.tv_nsec = wait - 1e9 * ts.tv_sec;
+      nanosleep(&ts,NULL);
+    }
+  }
+}
+
 // Play I/Q file with descriptor 'fd' on network socket 'sock'
 int playfile(int sock,int fd,int blocksize){
+  if(recfile_is_recfile(fd))
+    return playrecfile(sock,fd,blocksize);
+
   attrscanf(fd,"samplerate","%ld",&Samprate);
   attrscanf(fd,"frequency","%lf",&Frequency);
   attrscanf(fd,"bitspersample","%d",&Bitspersample);
@@ -322,6 +376,128 @@ int playfile(int sock,int fd,int blocksize){
   return 0;
 }
 
+// Send nframes sample frames of host-order samples as one RTP packet
+static void send_block(int sock,struct rtp_header *rtp_header,unsigned char const *block,int nframes){
+  int const bytes = (nframes * Channels * Bitspersample + 7) / 8;
+  unsigned char output_buffer[bytes + 256];
+
+  rtp_header->seq = Rtp_state.seq++;
+  rtp_header->timestamp = Rtp_state.timestamp;
+  unsigned char *dp = hton_rtp(output_buffer,rtp_header);
+  memcpy(dp,block,bytes);
+  if(Bitspersample == 16){
+    signed short *sp = (signed short *)dp;
+    float p = 0;
+    for(int n=0; n < nframes * Channels; n++){
+      p += (float)sp[n] * (float)sp[n];
+      sp[n] = htons(sp[n]);
+    }
+    Power = p / (32767. * 32767. * nframes);
+  }
+  dp += bytes;
+  if(send(sock,output_buffer,dp - output_buffer,0) == -1)
+    perror("send");
+  Rtp_state.packets++;
+  Rtp_state.timestamp += nframes;
+}
+
+// Play a framed (optionally compressed) recording from pcmrecord -c or iqrecord -c
+// Gaps in the recording become jumps in the RTP timestamp, just as they arrived originally
+int playrecfile(int sock,int fd,int blocksize){
+  struct recfile_reader reader;
+  if(recfile_open(&reader,fd) == -1){
+    fprintf(stderr,"%s: can't read recording header\n",Description);
+    return -1;
+  }
+  Samprate = reader.info.samprate;
+  Frequency = reader.info.frequency;
+  Channels = reader.info.channels;
+  Bitspersample = reader.info.bitspersample;
+  Rtp_state.ssrc = reader.info.ssrc;
+
+  if(Verbose)
+    fprintf(stderr,": fd %d, %'ld samp/s, RF LO %'.1lf Hz, %d seek points\n",fd,Samprate,Frequency,reader.index.count);
+
+  struct rtp_header rtp_header;
+  memset(&rtp_header,0,sizeof(rtp_header));
+  rtp_header.version = RTP_VERS;
+  int const type = pt_from_format(Channels,Bitspersample);
+  if(type == -1){
+    fprintf(stderr,"unsupported bits per sample %d\n",Bitspersample);
+    recfile_close(&reader);
+    return -1;
+  }
+  rtp_header.type = type;
+  rtp_header.ssrc = Rtp_state.ssrc;
+  // Start partway in, using the index
+  uint64_t skip = 0;
+  if(Start > 0){
+    uint64_t const target = Start * Samprate;
+    skip = target - recfile_seek(&reader,target);
+  }
+  int const frame_bits = Channels * Bitspersample;
+  int const block_bytes = (blocksize * frame_bits + 7) / 8;
+  unsigned char block[block_bytes];
+  int block_frames = 0;
+  unsigned char frame_buf[(RECFILE_MAX_FRAMES * frame_bits + 7) / 8];
+  int first = 1;
+
+  struct timespec start_time;
+  clock_gettime(CLOCK_REALTIME,&start_time);
+  double const dt = 1000000000. / Samprate; // nanosec per sample frame
+  double sked_time = 0;
+
+  struct recfile_frame frame;
+  int r;
+  while((r = recfile_read(&reader,&frame,frame_buf,sizeof(frame_buf))) == 1){
+    uint64_t const discard = min(skip,(uint64_t)frame.nframes);
+    skip -= discard;
+    if(first){
+      Rtp_state.timestamp = frame.timestamp + discard;
+      first = 0;
+    }
+    if(frame.type == RECFILE_GAP){
+      // Send any partial block, then jump the timestamp over the gap without sending anything
+      if(block_frames > 0){
+	wait_until(&start_time,sked_time);
+	send_block(sock,&rtp_header,block,block_frames);
+	sked_time += block_frames * dt;
+	block_frames = 0;
+      }
+      Rtp_state.timestamp += frame.nframes - discard;
+      sked_time += (frame.nframes - discard) * dt;
+      continue;
+    }
+    if(frame.type != RECFILE_DATA)
+      continue;
+
+    int nframes = frame.nframes - discard;
+    unsigned char const *fp = frame_buf + (discard * frame_bits) / 8;
+    while(nframes > 0){
+      int const chunk = min(nframes,blocksize - block_frames);
+      memcpy(block + (block_frames * frame_bits) / 8,fp,(chunk * frame_bits + 7) / 8);
+      block_frames += chunk;
+      fp += (chunk * frame_bits) / 8;
+      nframes -= chunk;
+      if(block_frames < blocksize)
+	break;
+
+      wait_until(&start_time,sked_time);
+      send_block(sock,&rtp_header,block,blocksize);
+      sked_time += blocksize * dt;
+      block_frames = 0;
+    }
+  }
+  if(block_frames > 0){
+    wait_until(&start_time,sked_time);
+    send_block(sock,&rtp_header,block,block_frames);
+  }
+  if(r == -1)
+    fprintf(stderr,"%s: damaged frame at offset %lld\n",Description,(long long)reader.offset);
+  recfile_close(&reader);
+  return 0;
+}
+
 
 // Thread to send metadata and process commands
 void *ncmd(void *arg){
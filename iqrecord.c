@@ -28,7 +28,9 @@
 
 #include "radio.h"
 #include "attr.h"
+#include "misc.h"
 #include "multicast.h"
+#include "recfile.h"
 
 // Largest Ethernet packet
 // Normally this would be <1500,
@@ -51,8 +53,21 @@ char *Input;
 char *Status;
 char *Filedir;
 struct frontend Frontend;
+int Compress;      // Write compressed framed file (see recfile.h)
+
+// State for compressed recordings
+FILE *Fp;
+off_t File_offset;
+struct recfile_index Index;
+uint64_t Position;          // Sample frames so far, including gaps
+unsigned char *Pending;     // Samples not yet written in a frame
+int Npending;               // Frames in Pending
+uint32_t Pending_ts;
+unsigned char *Frame_buffer;
 
 void cleanup(void);
+void closedown(int);
+void record_frames(uint32_t timestamp,unsigned char const *samples,int nframes,int skipped);
 
 int main(int argc,char *argv[]){
   char *locale;
@@ -62,8 +77,11 @@ int main(int argc,char *argv[]){
   // Defaults
   Quiet = 0;
   int c;
-  while((c = getopt(argc,argv,"D:S:l:r:qd:v")) != EOF){
+  while((c = getopt(argc,argv,"D:S:l:r:qd:vc")) != EOF){
     switch(c){
+    case 'c':
+      Compress = 1;
+      break;
     case 'D':
       Filedir = optarg;
       break;
@@ -87,7 +105,7 @@ int main(int argc,char *argv[]){
       Verbose++;
       break;
     default:
-      fprintf(stderr,"Usage: %s -I iq multicast address [-l locale] [-d duration][-q][-v]\n",argv[0]);
+      fprintf(stderr,"Usage: %s -I iq multicast address [-l locale] [-d duration][-c][-q][-v]\n",argv[0]);
       exit(1);
       break;
     }
@@ -135,9 +153,9 @@ int main(int argc,char *argv[]){
     struct stat statbuf;
     
     if(Filedir)
-      snprintf(filename,sizeof(filename),"%s/iqrecord-%.1lfHz-%u-%d",Filedir,Frontend.sdr.frequency,Frontend.input.rtp.ssrc,suffix);
+      snprintf(filename,sizeof(filename),"%s/iqrecord-%.1lfHz-%u-%d%s",Filedir,Frontend.sdr.frequency,Frontend.input.rtp.ssrc,suffix,Compress ? ".rec" : "");
     else
-      snprintf(filename,sizeof(filename),"iqrecord-%.1lfHz-%u-%d",Frontend.sdr.frequency,Frontend.input.rtp.ssrc,suffix);
+      snprintf(filename,sizeof(filename),"iqrecord-%.1lfHz-%u-%d%s",Frontend.sdr.frequency,Frontend.input.rtp.ssrc,suffix,Compress ? ".rec" : "");
     if(stat(filename,&statbuf) == -1 && errno == ENOENT)
       break;
   }
@@ -178,8 +196,31 @@ int main(int argc,char *argv[]){
   clock_gettime(CLOCK_REALTIME,&ts);
   attrprintf(fd,"unixstarttime","%ld.%09ld",(long)ts.tv_sec,(long)ts.tv_nsec);
 
+  if(Compress){
+    int const channels = Frontend.sdr.isreal ? 1 : 2;
+    struct recfile_info info;
+    memset(&info,0,sizeof(info));
+    info.samprate = Frontend.sdr.samprate;
+    info.ssrc = Frontend.input.rtp.ssrc;
+    info.channels = channels;
+    info.bitspersample = Frontend.sdr.bitspersample;
+    info.frequency = Frontend.sdr.frequency;
+    info.start_time = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    unsigned char header[RECFILE_HEADER_SIZE];
+    File_offset = recfile_encode_header(header,&info);
+    fwrite(header,1,File_offset,fp);
+    attrprintf(fd,"format","recfile");
+
+    Pending = malloc(recfile_max_data(RECFILE_MAX_FRAMES,channels,Frontend.sdr.bitspersample));
+    Frame_buffer = malloc(recfile_max_data(RECFILE_MAX_FRAMES,channels,Frontend.sdr.bitspersample));
+    assert(Pending != NULL && Frame_buffer != NULL);
+    Fp = fp;
+  }
+
   // Graceful signal catch
   signal(SIGPIPE,SIG_IGN);
+  signal(SIGINT,closedown);
+  signal(SIGTERM,closedown);
   atexit(cleanup);
 
 
@@ -218,6 +259,18 @@ int main(int argc,char *argv[]){
       (Frontend.sdr.isreal ? Frontend.sdr.bitspersample : 2 * Frontend.sdr.bitspersample);
     off_t offset = rtp_process(&rtp_state,&rtp,sample_count);
 
+    if(Compress){
+      if(offset >= 0){ // Drop late or duplicate packets; frames are in timestamp order
+	if(Frontend.sdr.bitspersample == 16){
+	  // Store 16-bit samples in host order so they can be compressed
+	  for(int n = 0; n < size / 2; n++)
+	    samples[n] = ntohs(samples[n]);
+	}
+	record_frames(rtp.timestamp,dp,sample_count,offset);
+      }
+      t += (double)sample_count / Frontend.sdr.samprate;
+      continue;
+    }
     // The seek offset relative to the current position in the file is the signed (modular) difference between
     // the actual and expected RTP timestamps. This should automatically handle
     // 32-bit RTP timestamp wraps, which occur every ~1 days at 48 kHz and only 6 hr @ 192 kHz
@@ -231,6 +284,73 @@ int main(int argc,char *argv[]){
   }
 }
  
+// Write out the pending samples as one frame
+static void flush_frames(void){
+  if(Npending == 0)
+    return;
+  int const channels = Frontend.sdr.isreal ? 1 : 2;
+  recfile_index_note(&Index,Position,File_offset,Pending_ts,Frontend.sdr.samprate);
+  int const n = recfile_encode_data(Frame_buffer,recfile_max_data(Npending,channels,Frontend.sdr.bitspersample),
+				    Pending_ts,Pending,Npending,channels,Frontend.sdr.bitspersample);
+  fwrite(Frame_buffer,1,n,Fp);
+  File_offset += n;
+  Position += Npending;
+  Npending = 0;
+}
+
+// Bytes taken by nframes packed sample frames; 12-bit real samples come two to 3 bytes
+static inline int packed_bytes(int const nframes){
+  int const channels = Frontend.sdr.isreal ? 1 : 2;
+  return (nframes * channels * Frontend.sdr.bitspersample + 7) / 8;
+}
+
+// Add samples to a compressed recording, first noting any frames skipped by the network
+void record_frames(uint32_t timestamp,unsigned char const *samples,int nframes,int skipped){
+  if(skipped > 0){
+    flush_frames();
+    unsigned char gap[RECFILE_FRAME_HEADER_SIZE];
+    recfile_index_note(&Index,Position,File_offset,timestamp - skipped,Frontend.sdr.samprate);
+    int const n = recfile_encode_gap(gap,timestamp - skipped,skipped);
+    fwrite(gap,1,n,Fp);
+    File_offset += n;
+    Position += skipped;
+  }
+  while(nframes > 0){
+    // Packed samples can only be appended on a byte boundary, i.e., after an even number of 12-bit real samples
+    if(packed_bytes(Npending) * 8 != Npending * (Frontend.sdr.isreal ? 1 : 2) * Frontend.sdr.bitspersample)
+      flush_frames();
+    if(Npending == 0)
+      Pending_ts = timestamp;
+    int chunk = min(nframes,RECFILE_MAX_FRAMES - Npending);
+    if(chunk < nframes && packed_bytes(1) * 8 != (Frontend.sdr.isreal ? 1 : 2) * Frontend.sdr.bitspersample)
+      chunk &= ~1; // Keep the split on a byte boundary too; Npending is even here, so chunk is at least 2
+    memcpy(Pending + packed_bytes(Npending),samples,packed_bytes(chunk));
+    Npending += chunk;
+    samples += packed_bytes(chunk);
+    timestamp += chunk;
+    nframes -= chunk;
+    if(Npending == RECFILE_MAX_FRAMES)
+      flush_frames();
+  }
+}
+
+void closedown(int a){
+  exit(1); // Will call cleanup()
+}
+
 void cleanup(void){
+  if(Fp == NULL)
+    return;
+  // Finish compressed recording with its seek index
+  flush_frames();
+  unsigned char *buf = malloc(recfile_index_size(&Index));
+  if(buf != NULL){
+    int const n = recfile_encode_index(buf,&Index,File_offset);
+    fwrite(buf,1,n,Fp);
+    free(buf);
+  }
+  fclose(Fp);
+  Fp = NULL;
+  recfile_index_free(&Index);
 }
 
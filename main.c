@@ -32,6 +32,7 @@
 #include "filter.h"
 #include "status.h"
 #include "config.h"
+#include "metrics.h"
 
 // Config constants & defaults
 static char const *Wisdom_file = "/var/lib/ka9q-radio/wisdom";
@@ -41,8 +42,23 @@ static int const DEFAULT_MCAST_TTL = 1;
 static float const DEFAULT_BLOCKTIME = 20.0;
 static int const DEFAULT_OVERLAP = 5;
 static int const DEFAULT_FFT_THREADS = 1;
+static int const DEFAULT_FFT_WORKERS = 1;
+static int const DEFAULT_SPECTRUM_BINS = 1024;
+static float const DEFAULT_SPECTRUM_RATE = 10.0; // Frames/sec
+static float const DEFAULT_DETECT_ON = 10.0;     // dB above noise in channel
+static float const DEFAULT_DETECT_OFF = 6.0;
+static int const DEFAULT_DETECT_HOLD = 5;         // sec
+static float const DEFAULT_DETECT_AVERAGE = 0.1;  // sec
+static int Ndetectors;
 static int const DEFAULT_SAMPRATE = 48000;
+static int const DEFAULT_SHM_RINGS = 64;          // Streams in shared memory beyond the configured channels
+static int const DEFAULT_SHM_SIZE = 1 << 20;      // Bytes per ring, about 10 s of 48 kHz mono PCM
+static int const Geometry_candidates = 8;   // Max FFT sizes timed per front end
+static double const Geometry_bench_time = 0.02; // Seconds spent timing each one
+static int const Max_rates = 32;            // Distinct output sample rates per front end
+static int const Max_startup_threads = 16;  // Demods started in parallel by loadconfig()
 char const *Modefile = "/usr/local/share/ka9q-radio/modes.conf";
+static char const *Frontend_prefix = "frontend:"; // Config sections defining additional front ends
 
 // Command line and environ params
 int Verbose;
@@ -56,6 +72,7 @@ struct {
   int samprate;
   char const *data;
   char const *mode;
+  char const *output_dir;
   float gain;
 } Default;
 
@@ -66,7 +83,7 @@ int SAP_enable;
 static int Overlap;
 char const *Name;
 
-static struct timespec Starttime;      // System clock at timestamp 0, for RTCP
+struct timespec Starttime;             // System clock at timestamp 0, for RTCP
 pthread_t Status_thread;
 pthread_t Demod_reaper_thread;
 struct sockaddr_storage Metadata_source_address;   // Source of SDR metadata
@@ -76,9 +93,51 @@ uint64_t Metadata_packets;
 uint32_t Command_tag;
 uint64_t Commands;
 
+// loadconfig()'s startup plan
+struct output_dest {          // One per distinct 'data =' destination
+  char const *name;
+  char const *sname;          // First section sending there, for the mDNS service name
+  struct frontend const *frontend;
+  int base_address;
+  struct sockaddr_storage dest_address;
+  struct sockaddr_storage source_address;
+  int data_fd;
+  int rtcp_fd;
+};
+struct section_plan {
+  char const *sname;
+  struct demod *template;     // Not on the demod list
+  struct output_dest *dest;
+  char const *band;           // 'detect =', if a detector template
+  int first;                  // Its channels in the channel plan
+  int count;
+  int started;
+};
+struct channel_plan {
+  struct section_plan *section;
+  double freq;
+  uint32_t ssrc;              // 0 with freq == 0: dynamic demod template
+  struct demod *demod;        // Once started
+};
+struct startup_queue {        // Shared by the start_channels() threads
+  struct channel_plan *channels;
+  int nchannels;
+  int next;
+  pthread_mutex_t mutex;
+};
+enum { STAGE_PARSE, STAGE_ANNOUNCE, STAGE_SOCKETS, STAGE_DEMODS, STAGE_READY, STAGES };
+
 static void closedown(int);
-static int setup_frontend(char const *arg);
+static int setup_frontend(struct frontend *frontend,char const *name,char const *arg,bool file,int const *rates,int nrates);
+static int setup_mcast_input(struct frontend *frontend,char const *arg);
+static int setup_spectrum(struct frontend *frontend,char const *sname);
+static int setup_detector(struct demod *template,char const *sname,char const *band);
+static int frontend_rates(char const *name,bool is_default,int *rates,int maxrates);
+static int choose_geometry(struct frontend const *frontend,int L,int const *rates,int nrates);
 static int loadconfig(char const *file);
+static struct demod *parse_section(char const *sname);
+static void *open_dest(void *arg);
+static void *start_channels(void *arg);
 
 // The main program sets up the demodulator parameter defaults,
 // overwrites them with command-line arguments and/or state file settings,
@@ -163,128 +222,523 @@ int main(int argc,char *argv[]){
   exit(0);
 }
 
-static int Frontend_started;
+static int FFTW_started;
+
+// Set up one front end: its status and control sockets, status thread, input filter,
+// and the threads that ingest its samples and estimate its noise floor
+// Each front end is independent; demods bind to one of them by name
+// With 'file' set, 'arg' is a recording to read instead (see filesource.c); loadconfig() starts it once the demods are running
+static int setup_frontend(struct frontend * const frontend,char const * const name,char const *arg,bool const file,int const *rates,int const nrates){
+  if(!FFTW_started){
+    // Shared by all front ends, so only do this once
+    fftwf_init_threads();
+    fftwf_make_planner_thread_safe();
+    int r = fftwf_import_system_wisdom();
+    fprintf(stdout,"fftwf_import_system_wisdom() %s\n",r == 1 ? "succeeded" : "failed");
+    r = fftwf_import_wisdom_from_filename(Wisdom_file);
+    fprintf(stdout,"fftwf_import_wisdom_from_filename(%s) %s\n",Wisdom_file,r == 1 ? "succeeded" : "failed");
+    FFTW_started++;
+  }
+  strlcpy(frontend->name,name,sizeof(frontend->name));
+  frontend->sdr.gain = 1; // In case it's never sent by front end
+
+  pthread_mutex_init(&frontend->sdr.status_mutex,NULL);
+  pthread_cond_init(&frontend->sdr.status_cond,NULL);
+
+  if(file){
+    strlcpy(frontend->input.metadata_dest_string,arg,sizeof(frontend->input.metadata_dest_string));
+    frontend->input.status_fd = frontend->input.ctl_fd = frontend->input.data_fd = -1;
+    if(open_file_source(frontend,arg) == -1)
+      return -1;
+    fprintf(stdout,"[%s] front end recording %s, %'.3lf Hz\n",frontend->name,arg,frontend->sdr.frequency);
+  } else if(setup_mcast_input(frontend,arg) == -1)
+    return -1;
 
-static int setup_frontend(char const *arg){
-  if(Frontend_started)
-    return 0;  // Only do this once
-  Frontend.sdr.gain = 1; // In case it's never sent by front end
+  fprintf(stdout,"[%s] input sample rate %'d Hz, %s; block time %.1f ms, %.1f Hz\n",
+	  frontend->name,frontend->sdr.samprate,frontend->sdr.isreal ? "real" : "complex",Blocktime,1000./Blocktime);
+  fflush(stdout);
+
+  // Create input filter now that we know the parameters
+  // FFT and filter sizes now computed from specified block duration and sample rate
+  // L = input data block size
+  // M = filter impulse response duration
+  // N = FFT size = L + M - 1
+  int L = (long long)llroundf(frontend->sdr.samprate * Blocktime / 1000); // Blocktime is in milliseconds
+  int M = choose_geometry(frontend,L,rates,nrates);
+  frontend->L = L;
+  frontend->M = M;
+  frontend->in = create_filter_input(L,M, frontend->sdr.isreal ? REAL : COMPLEX);
+  if(frontend->in == NULL){
+    fprintf(stdout,"Input filter setup failed\n");
+    return -1;
+  }
 
-  fftwf_init_threads();
-  fftwf_make_planner_thread_safe();
-  int r = fftwf_import_system_wisdom();
-  fprintf(stdout,"fftwf_import_system_wisdom() %s\n",r == 1 ? "succeeded" : "failed");
-  r = fftwf_import_wisdom_from_filename(Wisdom_file);
-  fprintf(stdout,"fftwf_import_wisdom_from_filename(%s) %s\n",Wisdom_file,r == 1 ? "succeeded" : "failed");
+  // Launch procsamp to process incoming samples and execute the forward FFT
+  if(!file){
+    pthread_t procsamp_thread;
+    pthread_create(&procsamp_thread,NULL,proc_samples,frontend);
+  }
 
-  pthread_mutex_init(&Frontend.sdr.status_mutex,NULL);
-  pthread_cond_init(&Frontend.sdr.status_cond,NULL);
+  // Launch thread to estimate noise spectral density N0
+  // Is this always necessary? It's not always used
+  pthread_t n0_thread;
+  pthread_create(&n0_thread,NULL,estimate_n0,frontend);
+  return 0;
+}
 
-  Frontend.input.status_fd = -1;
+// Multicast input: the front end's status and control sockets, its status thread, and its data socket
+// Blocks until the front end's status says where its data goes
+static int setup_mcast_input(struct frontend * const frontend,char const * const arg){
+  frontend->input.status_fd = -1;
 
-  strlcpy(Frontend.input.metadata_dest_string,arg,sizeof(Frontend.input.metadata_dest_string));
+  strlcpy(frontend->input.metadata_dest_string,arg,sizeof(frontend->input.metadata_dest_string));
   {
     char iface[1024];
-    resolve_mcast(Frontend.input.metadata_dest_string,&Frontend.input.metadata_dest_address,DEFAULT_STAT_PORT,iface,sizeof(iface));
-    Frontend.input.status_fd = listen_mcast(&Frontend.input.metadata_dest_address,iface);
+    resolve_mcast(frontend->input.metadata_dest_string,&frontend->input.metadata_dest_address,DEFAULT_STAT_PORT,iface,sizeof(iface));
+    frontend->input.status_fd = listen_mcast(&frontend->input.metadata_dest_address,iface);
 
-    if(Frontend.input.status_fd < 3){
-      fprintf(stdout,"%s: Can't set up SDR status socket\n",Frontend.input.metadata_dest_string);
+    if(frontend->input.status_fd < 3){
+      fprintf(stdout,"%s: Can't set up SDR status socket\n",frontend->input.metadata_dest_string);
       return -1;
     }
-    Frontend.input.ctl_fd = connect_mcast(&Frontend.input.metadata_dest_address,iface,Mcast_ttl,IP_tos);
+    frontend->input.ctl_fd = connect_mcast(&frontend->input.metadata_dest_address,iface,Mcast_ttl,IP_tos);
   }
 
-  if(Frontend.input.ctl_fd < 3){
-    fprintf(stdout,"%s: Can't set up SDR control socket\n",Frontend.input.metadata_dest_string);
+  if(frontend->input.ctl_fd < 3){
+    fprintf(stdout,"%s: Can't set up SDR control socket\n",frontend->input.metadata_dest_string);
     return -1;
   }
   {
     char addrtmp[256];
     addrtmp[0] = 0;
-    switch(Frontend.input.metadata_dest_address.ss_family){
+    switch(frontend->input.metadata_dest_address.ss_family){
     case AF_INET:
       {
-	struct sockaddr_in *sin = (struct sockaddr_in *)&Frontend.input.metadata_dest_address;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&frontend->input.metadata_dest_address;
 	inet_ntop(AF_INET,&sin->sin_addr,addrtmp,sizeof(addrtmp));
       }
       break;
     case AF_INET6:
       {
-	struct sockaddr_in6 *sin = (struct sockaddr_in6 *)&Frontend.input.metadata_dest_address;
+	struct sockaddr_in6 *sin = (struct sockaddr_in6 *)&frontend->input.metadata_dest_address;
 	inet_ntop(AF_INET6,&sin->sin6_addr,addrtmp,sizeof(addrtmp));
       }
       break;
     }
-    fprintf(stdout,"Front end control stream %s (%s)\n",Frontend.input.metadata_dest_string,addrtmp);
+    fprintf(stdout,"[%s] front end control stream %s (%s)\n",frontend->name,frontend->input.metadata_dest_string,addrtmp);
   }    
   // Start status thread - will also listen for SDR commands
   if(Verbose)
     fprintf(stdout,"Starting front end status thread\n");
-  pthread_create(&Frontend.status_thread,NULL,sdr_status,&Frontend);
+  pthread_create(&frontend->status_thread,NULL,sdr_status,frontend);
 
   // We must acquire a status stream before we can proceed further
-  pthread_mutex_lock(&Frontend.sdr.status_mutex);
-  while(Frontend.sdr.samprate == 0 || Frontend.input.data_dest_address.ss_family == 0)
-    pthread_cond_wait(&Frontend.sdr.status_cond,&Frontend.sdr.status_mutex);
-  pthread_mutex_unlock(&Frontend.sdr.status_mutex);
+  pthread_mutex_lock(&frontend->sdr.status_mutex);
+  while(frontend->sdr.samprate == 0 || frontend->input.data_dest_address.ss_family == 0)
+    pthread_cond_wait(&frontend->sdr.status_cond,&frontend->sdr.status_mutex);
+  pthread_mutex_unlock(&frontend->sdr.status_mutex);
 
   {
     char addrtmp[256];
     addrtmp[0] = 0;
-    switch(Frontend.input.data_dest_address.ss_family){
+    switch(frontend->input.data_dest_address.ss_family){
     case AF_INET:
       {
-	struct sockaddr_in *sin = (struct sockaddr_in *)&Frontend.input.data_dest_address;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&frontend->input.data_dest_address;
 	inet_ntop(AF_INET,&sin->sin_addr,addrtmp,sizeof(addrtmp));
       }
       break;
     case AF_INET6:
       {
-	struct sockaddr_in6 *sin = (struct sockaddr_in6 *)&Frontend.input.data_dest_address;
+	struct sockaddr_in6 *sin = (struct sockaddr_in6 *)&frontend->input.data_dest_address;
 	inet_ntop(AF_INET6,&sin->sin6_addr,addrtmp,sizeof(addrtmp));
       }
       break;
     }
-    fprintf(stdout,"Front end data stream %s\n",addrtmp);
+    fprintf(stdout,"[%s] front end data stream %s\n",frontend->name,addrtmp);
   }  
-  fprintf(stdout,"Input sample rate %'d Hz, %s; block time %.1f ms, %.1f Hz\n",
-	  Frontend.sdr.samprate,Frontend.sdr.isreal ? "real" : "complex",Blocktime,1000./Blocktime);
-  fflush(stdout);
-
   // Input socket for I/Q data from SDR, set from OUTPUT_DEST_SOCKET in SDR metadata
-  Frontend.input.data_fd = listen_mcast(&Frontend.input.data_dest_address,NULL);
-  if(Frontend.input.data_fd < 3){
+  frontend->input.data_fd = listen_mcast(&frontend->input.data_dest_address,NULL);
+  if(frontend->input.data_fd < 3){
     fprintf(stdout,"Can't set up IF input\n");
     return -1;
   }
-  // Create input filter now that we know the parameters
-  // FFT and filter sizes now computed from specified block duration and sample rate
-  // L = input data block size
-  // M = filter impulse response duration
-  // N = FFT size = L + M - 1
-  // Note: no checking that N is an efficient FFT blocksize; choose your parameters wisely
-  int L = (long long)llroundf(Frontend.sdr.samprate * Blocktime / 1000); // Blocktime is in milliseconds
-  int M = L / (Overlap - 1) + 1;
-  Frontend.in = create_filter_input(L,M, Frontend.sdr.isreal ? REAL : COMPLEX);
-  if(Frontend.in == NULL){
-    fprintf(stdout,"Input filter setup failed\n");
-    return -1;
+  return 0;
+}
+
+// Time one forward FFT of size N, seconds. Planned the same way as create_filter_input() does it
+static double time_fft(int const N,bool const isreal){
+  fftwf_plan_with_nthreads(Nthreads);
+  fftwf_plan plan;
+  void *in,*out;
+  if(isreal){
+    in = fftwf_alloc_real(N);
+    out = fftwf_alloc_complex(N/2+1);
+    memset(in,0,N * sizeof(float));
+    plan = fftwf_plan_dft_r2c_1d(N,in,out,FFTW_ESTIMATE);
+  } else {
+    in = fftwf_alloc_complex(N);
+    out = fftwf_alloc_complex(N);
+    memset(in,0,N * sizeof(fftwf_complex));
+    plan = fftwf_plan_dft_1d(N,in,out,FFTW_FORWARD,FFTW_ESTIMATE);
   }
+  fftwf_execute(plan); // Warm up caches
+  struct timespec start,now;
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  int runs = 0;
+  double elapsed;
+  do {
+    fftwf_execute(plan);
+    runs++;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    elapsed = (now.tv_sec - start.tv_sec) + 1e-9 * (now.tv_nsec - start.tv_nsec);
+  } while(elapsed < Geometry_bench_time && runs < 1000);
+  fftwf_destroy_plan(plan);
+  fftwf_free(in);
+  fftwf_free(out);
+  return elapsed / runs;
+}
 
-  // Launch procsamp to process incoming samples and execute the forward FFT
-  pthread_t procsamp_thread;
-  pthread_create(&procsamp_thread,NULL,proc_samples,NULL);
+// Pick the impulse length M, and thus the FFT size N = L + M - 1, for a block of L new samples
+// The classic choice M = L/(Overlap-1) + 1 may give an N with large prime factors, so we also consider
+// every N with only factors of 2, 3, 5 and 7 between that and 2L that
+//   - gives every output sample rate an integral IFFT size (N * rate / samprate), and
+//   - keeps the tuning step of compute_tuning() no coarser than the classic geometry's
+// and time each one. Longer M only means a longer impulse response is allowed, so any of them will do
+static int choose_geometry(struct frontend const * const frontend,int const L,int const *rates,int const nrates){
+  int const samprate = frontend->sdr.samprate;
+  int const M0 = L / (Overlap - 1) + 1;
+  int const N0 = L + M0 - 1;
+  double const max_step = (double)(N0 / gcd(N0,L)) / N0; // Tuning step of classic geometry, as fraction of samprate
 
-  // Launch thread to estimate noise spectral density N0
-  // Is this always necessary? It's not always used
-  pthread_t n0_thread;
-  pthread_create(&n0_thread,NULL,estimate_n0,NULL);
+  int candidates[Geometry_candidates];
+  int ncand = 0;
+  candidates[ncand++] = N0; // Always in the running
+  for(int N = nextfastfft(N0 - 1); N > 0 && N <= 2 * L && ncand < Geometry_candidates; N = nextfastfft(N)){
+    if(N == N0)
+      continue;
+    if((double)(N / gcd(N,L)) / N > max_step)
+      continue; // Tuning too coarse
+    bool ok = true;
+    for(int i=0; i < nrates; i++){
+      if(((long long)N * rates[i]) % samprate != 0){
+	ok = false;
+	break;
+      }
+    }
+    if(ok)
+      candidates[ncand++] = N;
+  }
+  int best = N0;
+  double best_time = 0;
+  for(int i=0; i < ncand; i++){
+    double const t = time_fft(candidates[i],frontend->sdr.isreal);
+    if(Verbose)
+      fprintf(stdout,"[%s] L %'d M %'d N %'d: %.1f us\n",frontend->name,L,candidates[i] - L + 1,candidates[i],1e6 * t);
+    if(i == 0 || t < best_time){
+      best = candidates[i];
+      best_time = t;
+    }
+  }
+  fprintf(stdout,"[%s] overlap-save geometry L %'d M %'d N %'d (%s), forward FFT %.1f us; %d candidate%s\n",
+	  frontend->name,L,best - L + 1,best,nextfastfft(best - 1) == (uint32_t)best ? "2/3/5/7-smooth" : "has large factors",
+	  1e6 * best_time,ncand,ncand == 1 ? "" : "s");
+  return best - L + 1;
+}
+
+// Output sample rates of the demod sections bound to a front end, so its geometry can accommodate them all
+// Sections without 'frontend =' bind to the default (first) front end
+static int frontend_rates(char const * const name,bool const is_default,int * const rates,int const maxrates){
+  int nrates = 0;
+  rates[nrates++] = Default.samprate; // Dynamic demods
+  int const nsect = iniparser_getnsec(Dictionary);
+  for(int sect = 0; sect < nsect; sect++){
+    char const * const sname = iniparser_getsecname(Dictionary,sect);
+    if(strcmp(sname,"global") == 0 || strncmp(sname,Frontend_prefix,strlen(Frontend_prefix)) == 0)
+      continue;
+    if(config_getboolean(Dictionary,sname,"disable",0))
+      continue;
+    char const * const fname = config_getstring(Dictionary,sname,"frontend",NULL);
+    if(fname == NULL ? !is_default : strcasecmp(fname,name) != 0)
+      continue;
+    int rate = Default.samprate;
+    char const * const mode = config_getstring(Dictionary,sname,"mode",Default.mode);
+    if(mode != NULL && strlen(mode) > 0){
+      // Some modes force a rate (e.g., wfm)
+      struct demod *demod = calloc(1,sizeof(*demod));
+      demod->output.samprate = Default.samprate;
+      if(preset_mode(demod,mode) == 0)
+	rate = demod->output.samprate;
+      free(demod);
+    }
+    char const * const cp = config_getstring(Dictionary,sname,"samprate",NULL);
+    if(cp)
+      rate = labs(strtol(cp,NULL,0));
+    int i;
+    for(i=0; i < nrates; i++)
+      if(rates[i] == rate)
+	break;
+    if(i == nrates && rate > 0 && nrates < maxrates)
+      rates[nrates++] = rate;
+  }
+  return nrates;
+}
+
+// Optional averaged spectrum stream from a front end's forward FFT, configured in its section
+static int setup_spectrum(struct frontend * const frontend,char const * const sname){
+  frontend->spectrum.fd = -1;
+  char const * const dest = config_getstring(Dictionary,sname,"spectrum",NULL);
+  if(dest == NULL)
+    return 0;
+  frontend->spectrum.bins = config_getint(Dictionary,sname,"spectrum-bins",DEFAULT_SPECTRUM_BINS);
+  frontend->spectrum.rate = fabs(config_getdouble(Dictionary,sname,"spectrum-rate",DEFAULT_SPECTRUM_RATE));
+  if(frontend->spectrum.rate == 0)
+    frontend->spectrum.rate = DEFAULT_SPECTRUM_RATE;
+  frontend->spectrum.format = config_getint(Dictionary,sname,"spectrum-format",8) == 16 ? 16 : 8;
+  strlcpy(frontend->spectrum.dest_string,dest,sizeof(frontend->spectrum.dest_string));
+  frontend->spectrum.ssrc = (uint32_t)config_getdouble(Dictionary,sname,"spectrum-ssrc",ElfHashString(frontend->spectrum.dest_string));
+
+  char iface[1024];
+  resolve_mcast(frontend->spectrum.dest_string,&frontend->spectrum.dest_address,DEFAULT_RTP_PORT,iface,sizeof(iface));
+  frontend->spectrum.fd = connect_mcast(&frontend->spectrum.dest_address,iface,Mcast_ttl,IP_tos);
+  if(frontend->spectrum.fd < 3){
+    fprintf(stdout,"[%s] can't set up spectrum output to %s\n",sname,frontend->spectrum.dest_string);
+    return -1;
+  }
+  char service_name[1024];
+  snprintf(service_name,sizeof(service_name),"%s spectrum (%s)",frontend->name,frontend->spectrum.dest_string);
+  char description[1024];
+  snprintf(description,sizeof(description),"input=%s",frontend->input.metadata_dest_string);
+  avahi_start(service_name,"_rtp._udp",DEFAULT_RTP_PORT,frontend->spectrum.dest_string,ElfHashString(frontend->spectrum.dest_string),description);
+  fprintf(stdout,"[%s] spectrum to %s: %d bins, %.1f frames/sec, %d bits\n",sname,frontend->spectrum.dest_string,
+	  frontend->spectrum.bins,frontend->spectrum.rate,frontend->spectrum.format);
+  pthread_create(&frontend->spectrum.thread,NULL,spectrum_send,frontend);
+  return 0;
+}
+
+// Set up a wideband activity detector using 'template' for the demods it starts
+// band = "low high", the first and last channel centers
+static int setup_detector(struct demod * const template,char const * const sname,char const * const band){
+  char *list = strdup(band);
+  char *saveptr = NULL;
+  char const * const lowp = strtok_r(list," \t",&saveptr);
+  char const * const highp = strtok_r(NULL," \t",&saveptr);
+  double const low = lowp ? parse_frequency(lowp) : 0;
+  double const high = highp ? parse_frequency(highp) : 0;
+  free(list);
+  char const * const rp = config_getstring(Dictionary,sname,"raster",NULL);
+  double const raster = rp ? parse_frequency(rp) : 0;
+  if(low <= 0 || high < low || raster <= 0){
+    fprintf(stdout,"[%s]: 'detect = low high' and 'raster =' needed\n",sname);
+    return -1;
+  }
+  struct detector * const d = calloc(1,sizeof(*d));
+  strlcpy(d->name,sname,sizeof(d->name));
+  d->frontend = template->frontend;
+  d->template = template;
+  d->low = low;
+  d->high = high;
+  d->raster = raster;
+  d->on = dB2power(config_getfloat(Dictionary,sname,"detect-on",DEFAULT_DETECT_ON));
+  d->off = dB2power(config_getfloat(Dictionary,sname,"detect-off",DEFAULT_DETECT_OFF));
+  if(d->off > d->on)
+    d->off = d->on;
+  d->hold = abs(config_getint(Dictionary,sname,"detect-hold",DEFAULT_DETECT_HOLD));
+  if(d->hold == 0)
+    d->hold = 1; // A lifetime of 0 means forever
+  float const average = fabsf(config_getfloat(Dictionary,sname,"detect-average",DEFAULT_DETECT_AVERAGE));
+  d->alpha = average > .001f * Blocktime ? .001f * Blocktime / average : 1;
+  d->nchan = (int)floor((high - low) / raster + 0.5) + 1;
+  d->chan = calloc(d->nchan,sizeof(*d->chan));
+  for(int i=0; i < d->nchan; i++)
+    d->chan[i].freq = low + i * raster;
 
-  Frontend_started++; // Only do this once!!
+  fprintf(stdout,"[%s] detector: %'d channels %'.3lf - %'.3lf Hz on %'.3lf Hz raster, on %.1f dB off %.1f dB, hold %d s\n",
+	  sname,d->nchan,low,low + (d->nchan - 1) * raster,raster,power2dB(d->on),power2dB(d->off),d->hold);
+  Ndetectors++;
+  pthread_create(&d->thread,NULL,detector_run,d);
   return 0;
 }
 
+static double elapsed_ms(struct timespec const * const start,struct timespec const * const end){
+  return 1000. * (end->tv_sec - start->tv_sec) + 1e-6 * (end->tv_nsec - start->tv_nsec);
+}
+
+// Resolve and open the sockets for one output destination; run in parallel for all of them
+static void *open_dest(void * const arg){
+  struct output_dest * const dest = (struct output_dest *)arg;
+  pthread_setname("startup");
+  char iface[1024];
+  resolve_mcast(dest->name,&dest->dest_address,DEFAULT_RTP_PORT,iface,sizeof(iface));
+  dest->data_fd = connect_mcast(&dest->dest_address,iface,Mcast_ttl,IP_tos);
+  if(dest->data_fd < 3){
+    fprintf(stdout,"can't set up PCM output to %s\n",dest->name);
+    return NULL;
+  }
+  socklen_t len = sizeof(dest->source_address);
+  getsockname(dest->data_fd,(struct sockaddr *)&dest->source_address,&len);
+  // RTCP Real Time Control Protocol daemon is optional
+  if(RTCP_enable){
+    dest->rtcp_fd = setup_mcast(dest->name,NULL,1,Mcast_ttl,IP_tos,1); // RTP port number + 1
+    if(dest->rtcp_fd < 3)
+      fprintf(stdout,"can't set up RTCP output to %s\n",dest->name);
+  }
+  return NULL;
+}
+
+// Start demods from the channel plan until it's exhausted; several of these run at once
+static void *start_channels(void * const arg){
+  struct startup_queue * const q = (struct startup_queue *)arg;
+  pthread_setname("startup");
+  while(1){
+    pthread_mutex_lock(&q->mutex);
+    int const i = q->next++;
+    pthread_mutex_unlock(&q->mutex);
+    if(i >= q->nchannels)
+      break;
+    struct channel_plan * const cp = &q->channels[i];
+    if(cp->section->dest->data_fd < 3)
+      continue;
+    struct demod * const demod = alloc_demod();
+    if(demod == NULL)
+      continue; // alloc_demod() complains
+    memcpy(demod,cp->section->template,sizeof(*demod));
+    demod->output.rtp.ssrc = cp->ssrc;
+    // Initialization all done, start it up
+    set_freq(demod,cp->freq);
+    start_demod(demod);
+    cp->demod = demod;
+    if(Verbose)
+      fprintf(stdout,"started %'.3lf Hz\n",cp->freq);
+  }
+  return NULL;
+}
+
+// Parse one channel section into a template for the demods it starts
+// Everything but the output sockets, frequency and SSRC; returns NULL if the section is unusable
+static struct demod *parse_section(char const * const sname){
+  char const * const global = "global";
+  // Bind to a front end, by default the first one
+  char const * const fname = config_getstring(Dictionary,sname,"frontend",NULL);
+  struct frontend * const frontend = lookup_frontend(fname);
+  if(frontend == NULL){
+    fprintf(stdout,"[%s]: unknown front end %s\n",sname,fname);
+    return NULL;
+  }
+  // Not on the demod list; each demod started from it is a copy
+  struct demod * const demod = calloc(1,sizeof(*demod));
+  assert(demod != NULL);
+  demod->inuse = 1; // So copies are marked in use from the start
+  demod->frontend = frontend;
+  strlcpy(demod->section,sname,sizeof(demod->section));
+  // Set nonzero defaults
+  demod->tp1 = demod->tp2 = NAN;
+  demod->output.samprate = Default.samprate;
+  
+  // load presets from mode table, overwriting/merging with defaults
+  char const * const mode = config_getstring(Dictionary,sname,"mode",Default.mode);
+  if(mode == NULL || strlen(mode) == 0){
+    fprintf(stdout,"'mode =' missing and not set in [%s]\n",global);
+    free(demod);
+    return NULL;
+  }
+  if(preset_mode(demod,mode) == -1){
+    fprintf(stdout,"'mode = %s' invalid\n",mode);
+    free(demod);
+    return NULL;
+  }
+  
+  // Override any defaults
+  {
+    char const *cp = config_getstring(Dictionary,sname,"samprate",NULL);
+    if(cp)
+      demod->output.samprate = labs(strtol(cp,NULL,0));
+  }
+  demod->output.channels = abs(config_getint(Dictionary,sname,"channels",demod->output.channels)); // value loaded from mode table
+  if(demod->output.channels < 1 || demod->output.channels > 2){
+    fprintf(stdout,"Invalid channel count: %d\n",demod->output.channels);
+    free(demod);
+    return NULL;
+  }
+  {
+    char const *cp = config_getstring(Dictionary,sname,"headroom",NULL);
+    if(cp)
+      demod->output.headroom = dB2voltage(-fabs(strtof(cp,NULL)));
+  }
+  demod->tune.shift = config_getdouble(Dictionary,sname,"shift",demod->tune.shift); // value loaded from mode table
+  {
+    char const *cp = config_getstring(Dictionary,sname,"squelch-open",NULL);
+    if(cp)
+      demod->squelch_open = dB2power(strtof(cp,NULL));
+    
+    cp = config_getstring(Dictionary,sname,"squelch-close",NULL);
+    if(cp)
+      demod->squelch_close = dB2power(strtof(cp,NULL));
+    else
+      demod->squelch_close = demod->squelch_open * 0.794; // - 1 dB
+  }
+  {
+    char const * const status = config_getstring(Dictionary,sname,"status",NULL);
+    if(status){
+      fprintf(stdout,"note: 'status =' now set in [global] section only\n");
+    }
+  }
+
+  char const * const data = config_getstring(Dictionary,sname,"data",Default.data);
+  if(data == NULL){
+    fprintf(stdout,"'data =' missing and not set in [%s]\n",global);
+    free(demod);
+    return NULL;
+  }
+  // Write PCM to files instead of multicasting it, e.g., when running offline from a recording
+  // 'data =' still names the stream for status, RTCP and SAP
+  {
+    char const * const dir = config_getstring(Dictionary,sname,"output-dir",Default.output_dir);
+    if(dir != NULL)
+      strlcpy(demod->output.file_dir,dir,sizeof(demod->output.file_dir));
+    demod->output.file_fd = -1;
+  }
+  {
+    const char *cp = config_getstring(Dictionary,sname,"low",NULL);
+    if(cp)
+      demod->filter.min_IF = strtof(cp,NULL);
+  }    
+  {
+    const char *cp = config_getstring(Dictionary,sname,"high",NULL);
+    if(cp)
+      demod->filter.max_IF = strtof(cp,NULL);
+  }    
+  {
+    const char *cp = config_getstring(Dictionary,sname,"recover",NULL);
+    if(cp)
+      demod->linear.recovery_rate = dB2voltage(fabsf(strtof(cp,NULL) * .001f * Blocktime));
+  }
+  {
+    const char *cp = config_getstring(Dictionary,sname,"hang-time",NULL);
+    if(cp)
+      demod->linear.hangtime = fabsf(strtof(cp,NULL)) / (.001f * Blocktime);  // time in seconds -> time in blocks
+  }
+  {
+    const char *cp = config_getstring(Dictionary,sname,"threshold",NULL);
+    if(cp)
+      demod->linear.threshold = dB2voltage(-fabsf(strtof(cp,NULL)));
+  }    
+  {
+    const char *cp = config_getstring(Dictionary,sname,"gain",NULL);
+    if(cp)
+      demod->output.gain = dB2voltage(-fabsf(strtof(cp,NULL)));
+  }    
+  demod->linear.env = config_getboolean(Dictionary,sname,"envelope",demod->linear.env);
+  demod->output.rtp.ssrc = (uint32_t)config_getdouble(Dictionary,sname,"ssrc",0); // Default to 0 to trigger auto gen from freq
+  demod->linear.loop_bw = fabs(config_getdouble(Dictionary,sname,"loop-bw",demod->linear.loop_bw));
+  demod->linear.pll = config_getboolean(Dictionary,sname,"pll",demod->linear.pll);
+  demod->linear.square = config_getboolean(Dictionary,sname,"square",demod->linear.square);
+  if(demod->linear.square)
+    demod->linear.pll = 1; // Square implies PLL on
+  
+  return demod;
+}
+
 static int loadconfig(char const * const file){
   if(file == NULL || strlen(file) == 0)
     return -1;
@@ -309,22 +763,65 @@ static int loadconfig(char const * const file){
     Blocktime = fabs(config_getdouble(Dictionary,global,"blocktime",DEFAULT_BLOCKTIME));
     Overlap = abs(config_getint(Dictionary,global,"overlap",DEFAULT_OVERLAP));
     Nthreads = config_getint(Dictionary,global,"fft-threads",DEFAULT_FFT_THREADS);
+    Fft_workers = config_getint(Dictionary,global,"fft-workers",DEFAULT_FFT_WORKERS); // Concurrent forward FFTs per front end
+    Hugepages = config_getboolean(Dictionary,global,"hugepages",0); // 2 MB pages for large FFT buffers
+    Executor_threads = config_getint(Dictionary,global,"executor-threads",0); // 0: a thread per demod
     RTCP_enable = config_getboolean(Dictionary,global,"rtcp",0);
     SAP_enable = config_getboolean(Dictionary,global,"sap",0);
     Default.samprate = config_getint(Dictionary,global,"samprate",DEFAULT_SAMPRATE);
     Modefile = config_getstring(Dictionary,global,"mode-file",Modefile);
     Default.data = config_getstring(Dictionary,global,"data",NULL);
     Default.mode = config_getstring(Dictionary,global,"mode",NULL);
+    Default.output_dir = config_getstring(Dictionary,global,"output-dir",NULL);
     Wisdom_file = config_getstring(Dictionary,global,"wisdom-file",Wisdom_file);
 
-    char const * const input = config_getstring(Dictionary,global,"input",NULL);
-    if(input == NULL){
-      // Mandatory
-      fprintf(stdout,"input not specified in [%s]\n",global);
-      exit(1);
+    // Front ends: the one named by 'input =' in [global] (if any) comes first and is the default,
+    // followed by any [frontend:NAME] sections. At least one is mandatory
+    // 'file =' instead of 'input =' reads a recording as fast as the demods can go, for offline processing
+    char const * const file = config_getstring(Dictionary,global,"file",NULL);
+    char const * const input = file != NULL ? file : config_getstring(Dictionary,global,"input",NULL);
+    int rates[Max_rates];
+    if(input != NULL){
+      int const nrates = frontend_rates(global,true,rates,Max_rates);
+      if(setup_frontend(&Frontends[Nfrontends],global,input,file != NULL,rates,nrates) == -1){
+	fprintf(stdout,"Front end setup of %s failed\n",input);
+	exit(1);
+      }
+      setup_spectrum(&Frontends[Nfrontends],global);
+      Nfrontends++;
     }
-    if(setup_frontend(input) == -1){
-      fprintf(stdout,"Front end setup of %s failed\n",input);
+    int const nsect = iniparser_getnsec(Dictionary);
+    for(int sect = 0; sect < nsect; sect++){
+      char const * const sname = iniparser_getsecname(Dictionary,sect);
+      if(strncmp(sname,Frontend_prefix,strlen(Frontend_prefix)) != 0)
+	continue;
+      if(config_getboolean(Dictionary,sname,"disable",0))
+	continue;
+      char const * const fname = sname + strlen(Frontend_prefix);
+      char const * const ffile = config_getstring(Dictionary,sname,"file",NULL);
+      char const * const finput = ffile != NULL ? ffile : config_getstring(Dictionary,sname,"input",NULL);
+      if(finput == NULL || strlen(fname) == 0){
+	fprintf(stdout,"[%s]: front end needs a name and 'input =' or 'file ='\n",sname);
+	exit(1);
+      }
+      if(lookup_frontend(fname) != NULL){
+	fprintf(stdout,"[%s]: duplicate front end name\n",sname);
+	exit(1);
+      }
+      if(Nfrontends == MAX_FRONTENDS){
+	fprintf(stdout,"[%s]: too many front ends, max %d\n",sname,MAX_FRONTENDS);
+	exit(1);
+      }
+      int const nrates = frontend_rates(fname,Nfrontends == 0,rates,Max_rates);
+      if(setup_frontend(&Frontends[Nfrontends],fname,finput,ffile != NULL,rates,nrates) == -1){
+	fprintf(stdout,"Front end setup of %s failed\n",finput);
+	exit(1);
+      }
+      setup_spectrum(&Frontends[Nfrontends],sname);
+      Nfrontends++;
+    }
+    if(Nfrontends == 0){
+      fprintf(stdout,"no front end: 'input =' or 'file =' not specified in [%s] and no [%sNAME] sections\n",global,Frontend_prefix);
       exit(1);
     }
     char const * const status = config_getstring(Dictionary,global,"status",NULL); // Status/command thread for all demodulators
@@ -334,7 +831,7 @@ static int loadconfig(char const * const file){
       char service_name[1024];
       snprintf(service_name,sizeof(service_name),"%s radio (%s)",Name,status);
       char description[1024];
-      snprintf(description,sizeof(description),"input=%s",input);
+      snprintf(description,sizeof(description),"input=%s",Frontends[0].input.metadata_dest_string);
       avahi_start(service_name,"_ka9q-ctl._udp",DEFAULT_STAT_PORT,Metadata_dest_string,ElfHashString(Metadata_dest_string),description);
       base_address += 16;
       char iface[1024];
@@ -353,160 +850,67 @@ static int loadconfig(char const * const file){
     }
   }
 
-  // Process sections other than global
-  int const nsect = iniparser_getnsec(Dictionary);
+  // Startup runs in stages so that nothing slow is done once per channel:
+  // parse every section into a plan, announce each distinct output destination, open its sockets,
+  // then start the demods in parallel and wait until they're all running
+  struct timespec t0,t1;
+  clock_gettime(CLOCK_MONOTONIC,&t0);
+  double stage_ms[STAGES] = {0};
+
+  // Stage 1: parse sections into templates and channel lists
+  int nsections = 0;
+  struct channel_plan *channels = NULL;
+  int nchannels = 0;
+  int ndests = 0;
 
+  int const nsect = iniparser_getnsec(Dictionary);
+  struct section_plan * const sections = calloc(nsect + 1,sizeof(*sections)); // Never moves, so channels can point into it
+  struct output_dest * const dests = calloc(nsect + 1,sizeof(*dests));
+  assert(sections != NULL && dests != NULL);
   for(int sect = 0; sect < nsect; sect++){
     char const * const sname = iniparser_getsecname(Dictionary,sect);
-    if(strcmp(sname,global) == 0)
+    if(strcmp(sname,global) == 0 || strncmp(sname,Frontend_prefix,strlen(Frontend_prefix)) == 0)
       continue; // Already processed above
 
     fprintf(stdout,"Processing [%s]\n",sname);
-    {
-      int const d = config_getboolean(Dictionary,sname,"disable",0);
-      if(d)
-	continue; // section is disabled
-    }
+    if(config_getboolean(Dictionary,sname,"disable",0))
+      continue; // section is disabled
 
-    // Structure is created and initialized before being put on list
-    struct demod *demod = alloc_demod();
-    // Set nonzero defaults
-    demod->tp1 = demod->tp2 = NAN;
-    demod->output.samprate = Default.samprate;
-    
-    // load presets from mode table, overwriting/merging with defaults
-    char const * const mode = config_getstring(Dictionary,sname,"mode",Default.mode);
-    if(mode == NULL || strlen(mode) == 0){
-      fprintf(stdout,"'mode =' missing and not set in [%s]\n",global);
-      free_demod(&demod);
-      continue;
-    }
-    if(preset_mode(demod,mode) == -1){
-      fprintf(stdout,"'mode = %s' invalid\n",mode);
-      free_demod(&demod);
-      continue;
-    }
-    
-    // Override any defaults
-    {
-      char const *cp = config_getstring(Dictionary,sname,"samprate",NULL);
-      if(cp)
-	demod->output.samprate = labs(strtol(cp,NULL,0));
-    }
-    demod->output.channels = abs(config_getint(Dictionary,sname,"channels",demod->output.channels)); // value loaded from mode table
-    if(demod->output.channels < 1 || demod->output.channels > 2){
-      fprintf(stdout,"Invalid channel count: %d\n",demod->output.channels);
-      free_demod(&demod);
+    struct demod * const demod = parse_section(sname);
+    if(demod == NULL)
       continue;
-    }
-    {
-      char const *cp = config_getstring(Dictionary,sname,"headroom",NULL);
-      if(cp)
-	demod->output.headroom = dB2voltage(-fabs(strtof(cp,NULL)));
-    }
-    demod->tune.shift = config_getdouble(Dictionary,sname,"shift",demod->tune.shift); // value loaded from mode table
-    {
-      char const *cp = config_getstring(Dictionary,sname,"squelch-open",NULL);
-      if(cp)
-	demod->squelch_open = dB2power(strtof(cp,NULL));
-      
-      cp = config_getstring(Dictionary,sname,"squelch-close",NULL);
-      if(cp)
-	demod->squelch_close = dB2power(strtof(cp,NULL));
-      else
-	demod->squelch_close = demod->squelch_open * 0.794; // - 1 dB
-    }
-    {
-      char const * const status = config_getstring(Dictionary,sname,"status",NULL);
-      if(status){
-	fprintf(stdout,"note: 'status =' now set in [global] section only\n");
-      }
-    }
 
+    // Sections sending to the same place share its sockets and its mDNS announcement
     char const * const data = config_getstring(Dictionary,sname,"data",Default.data);
-    if(data == NULL){
-      fprintf(stdout,"'data =' missing and not set in [%s]\n",global);
-      free_demod(&demod);
-      continue;
-    }
-    strlcpy(demod->output.data_dest_string,data,sizeof(demod->output.data_dest_string));
-    // There can be multiple senders to an output stream, so let avahi suppress the duplicate addresses
-    char service_name[1024];
-    snprintf(service_name,sizeof(service_name),"%s radio (%s)",sname,data);
-    char description[1024];
-    snprintf(description,sizeof(description),"pcm-source=%s",formatsock(&Frontend.input.data_dest_address));
-    avahi_start(service_name,"_rtp._udp",5004,demod->output.data_dest_string,ElfHashString(demod->output.data_dest_string),description);
-    base_address += 16;
-    char iface[1024];
-    resolve_mcast(demod->output.data_dest_string,&demod->output.data_dest_address,DEFAULT_RTP_PORT,iface,sizeof(iface));
-    demod->output.data_fd = connect_mcast(&demod->output.data_dest_address,iface,Mcast_ttl,IP_tos);
-    if(demod->output.data_fd < 3){
-      fprintf(stdout,"can't set up PCM output to %s\n",demod->output.data_dest_string);
-      continue;
-    } else {
-      socklen_t len = sizeof(demod->output.data_source_address);
-      getsockname(demod->output.data_fd,(struct sockaddr *)&demod->output.data_source_address,&len);
-    }
-    
-    if(SAP_enable){
-      // Highly experimental, off by default
-      char sap_dest[] = "224.2.127.254:9875"; // sap.mcast.net
-      demod->output.sap_fd = setup_mcast(sap_dest,NULL,1,Mcast_ttl,IP_tos,0);
-      if(demod->output.sap_fd < 3)
-	fprintf(stdout,"Can't set up SAP output to %s\n",sap_dest);
-      else
-	pthread_create(&demod->sap_thread,NULL,sap_send,demod);
-    }
-     // RTCP Real Time Control Protocol daemon is optional
-    if(RTCP_enable){
-      demod->output.rtcp_fd = setup_mcast(demod->output.data_dest_string,NULL,1,Mcast_ttl,IP_tos,1); // RTP port number + 1
-      if(demod->output.rtcp_fd < 3)
-	fprintf(stdout,"can't set up RTCP output to %s\n",demod->output.data_dest_string);
-      else
-	pthread_create(&demod->rtcp_thread,NULL,rtcp_send,demod);
-    }
-    {
-      const char *cp = config_getstring(Dictionary,sname,"low",NULL);
-      if(cp)
-	demod->filter.min_IF = strtof(cp,NULL);
-    }    
-    {
-      const char *cp = config_getstring(Dictionary,sname,"high",NULL);
-      if(cp)
-	demod->filter.max_IF = strtof(cp,NULL);
-    }    
-    {
-      const char *cp = config_getstring(Dictionary,sname,"recover",NULL);
-      if(cp)
-	demod->linear.recovery_rate = dB2voltage(fabsf(strtof(cp,NULL) * .001f * Blocktime));
+    struct output_dest *dest = NULL;
+    for(int i=0; i < ndests; i++){
+      if(strcmp(dests[i].name,data) == 0){
+	dest = &dests[i];
+	break;
+      }
     }
-    {
-      const char *cp = config_getstring(Dictionary,sname,"hang-time",NULL);
-      if(cp)
-	demod->linear.hangtime = fabsf(strtof(cp,NULL)) / (.001f * Blocktime);  // time in seconds -> time in blocks
+    if(dest == NULL){
+      dest = &dests[ndests++];
+      dest->name = data;
+      dest->sname = sname;
+      dest->frontend = demod->frontend;
+      dest->base_address = base_address;
+      dest->data_fd = dest->rtcp_fd = -1;
+      base_address += 16;
     }
-    {
-      const char *cp = config_getstring(Dictionary,sname,"threshold",NULL);
-      if(cp)
-	demod->linear.threshold = dB2voltage(-fabsf(strtof(cp,NULL)));
-    }    
-    {
-      const char *cp = config_getstring(Dictionary,sname,"gain",NULL);
-      if(cp)
-	demod->output.gain = dB2voltage(-fabsf(strtof(cp,NULL)));
-    }    
-    demod->linear.env = config_getboolean(Dictionary,sname,"envelope",demod->linear.env);
-    demod->output.rtp.ssrc = (uint32_t)config_getdouble(Dictionary,sname,"ssrc",0); // Default to 0 to trigger auto gen from freq
-    demod->linear.loop_bw = fabs(config_getdouble(Dictionary,sname,"loop-bw",demod->linear.loop_bw));
-    demod->linear.pll = config_getboolean(Dictionary,sname,"pll",demod->linear.pll);
-    demod->linear.square = config_getboolean(Dictionary,sname,"square",demod->linear.square);
-    if(demod->linear.square)
-      demod->linear.pll = 1; // Square implies PLL on
-    
+    struct section_plan * const sp = &sections[nsections++];
+    sp->sname = sname;
+    sp->template = demod;
+    sp->dest = dest;
+    sp->band = config_getstring(Dictionary,sname,"detect",NULL);
+    sp->first = nchannels;
+    if(sp->band != NULL)
+      continue; // Detector template; it starts its own demods
+
     // Process frequency/frequencies
     // To work around iniparser's limited line length, we look for multiple keywords
     // "freq", "freq0", "freq1", etc, up to "freq9"
-    int nfreq = 0;
+    uint32_t ssrc = demod->output.rtp.ssrc; // Explicit SSRC applies only to the first frequency
     for(int ff = -1; ff < 10; ff++){
       char fname[10];
       if(ff == -1)
@@ -529,142 +933,196 @@ static int loadconfig(char const * const file){
 	  fprintf(stdout,"can't parse frequency %s\n",tok);
 	  continue;
 	}
-	demod->tune.freq = f;
-
 	// If not explicitly specified, generate SSRC in decimal using frequency in Hz
-	if(demod->output.rtp.ssrc == 0){
-	  if(f == 0){
-	    if(Dynamic_demod){
-	      free_demod(&Dynamic_demod);
-	    }
-	    // Template for dynamically created demods
-	    Dynamic_demod = demod;
-	    fprintf(stdout,"dynamic demod template created\n");
-	  } else {
-	    for(char const *cp = tok ; cp != NULL && *cp != '\0' ; cp++){
-	      if(isdigit(*cp)){
-		demod->output.rtp.ssrc *= 10;
-		demod->output.rtp.ssrc += *cp - '0';
-	      }
+	// With neither, it's the template for dynamically created demods
+	if(ssrc == 0 && f != 0){
+	  for(char const *cp = tok ; cp != NULL && *cp != '\0' ; cp++){
+	    if(isdigit(*cp)){
+	      ssrc *= 10;
+	      ssrc += *cp - '0';
 	    }
 	  }
 	}
-	// Initialization all done, start it up
-	set_freq(demod,demod->tune.freq);
-	start_demod(demod);
-	nfreq++;
-	ndemods++;
-	if(Verbose)
-	  fprintf(stdout,"started %'.3lf Hz\n",demod->tune.freq);
-
-	// Set up for next demod
-	struct demod *ndemod = alloc_demod();
-	if(ndemod == NULL){
-	  fprintf(stdout,"alloc_demod() failed, quitting\n");
-	  break;
-	}
-	// Copy everything to next demod except filter, demod thread ID, freq and ssrc
-	memcpy(ndemod,demod,sizeof(*ndemod));
-	ndemod->filter.out = NULL;
-	ndemod->demod_thread = (pthread_t)0;
-	ndemod->tune.freq = 0;
-	ndemod->output.rtp.ssrc = 0;
-	demod = ndemod;
-	ndemod = NULL;
+	channels = realloc(channels,(nchannels + 1) * sizeof(*channels));
+	assert(channels != NULL);
+	struct channel_plan * const cp = &channels[nchannels++];
+	cp->section = sp;
+	cp->freq = f;
+	cp->ssrc = ssrc;
+	cp->demod = NULL;
+	ssrc = 0;
       }
       free(freq_list);
       freq_list = NULL;
     }
-    free_demod(&demod); // last one wasn't needed
-    fprintf(stdout,"%d demodulators started\n",nfreq);
+    sp->count = nchannels - sp->first;
   }
-  // Start the status thread after all the receivers have been created so it doesn't contend for the demod list lock
-  if(Ctl_fd >= 3 && Status_fd >= 3){
-    pthread_create(&Status_thread,NULL,radio_status,NULL);
-    pthread_create(&Demod_reaper_thread,NULL,demod_reaper,NULL);
+  // Optional shared-memory copy of every PCM stream for consumers on this host, e.g., shm = /ka9q-radio
+  // A name with another '/' is a file path instead, e.g., on a hugetlbfs mount
+  // Enough rings for every configured channel plus some dynamic ones, unless told otherwise
+  {
+    char const * const shm = config_getstring(Dictionary,global,"shm",NULL);
+    if(shm != NULL){
+      int const nrings = config_getint(Dictionary,global,"shm-rings",nchannels + DEFAULT_SHM_RINGS);
+      if(nrings < nchannels)
+	fprintf(stdout,"shm-rings = %d is less than the %d channels configured; the rest won't be in shared memory, and readers will stay on the network\n",
+		nrings,nchannels);
+      Shm = shm_create(shm,nrings,config_getint(Dictionary,global,"shm-size",DEFAULT_SHM_SIZE));
+      if(Shm != NULL)
+	fprintf(stdout,"PCM streams also in shared memory %s, %d rings\n",shm,nrings);
+    }
   }
-  iniparser_freedict(Dictionary);
-  Dictionary = NULL;
-  return ndemods;
-}
+  clock_gettime(CLOCK_MONOTONIC,&t1);
+  stage_ms[STAGE_PARSE] = elapsed_ms(&t0,&t1);
 
-// RTP control protocol sender task
-void *rtcp_send(void *arg){
-  struct demod const *demod = (struct demod *)arg;
-  if(demod == NULL)
-    pthread_exit(NULL);
+  // Stage 2: announce all the destinations at once, so the mDNS registrations overlap
+  // instead of each section waiting for its own name to resolve
+  t0 = t1;
+  for(int i=0; i < ndests; i++){
+    struct output_dest * const dest = &dests[i];
+    // There can be multiple senders to an output stream, so let avahi suppress the duplicate addresses
+    char service_name[1024];
+    snprintf(service_name,sizeof(service_name),"%s radio (%s)",dest->sname,dest->name);
+    char description[1024];
+    snprintf(description,sizeof(description),"pcm-source=%s",formatsock(&dest->frontend->input.data_dest_address));
+    avahi_start(service_name,"_rtp._udp",5004,dest->name,ElfHashString(dest->name),description);
+  }
+  clock_gettime(CLOCK_MONOTONIC,&t1);
+  stage_ms[STAGE_ANNOUNCE] = elapsed_ms(&t0,&t1);
 
+  // Stage 3: resolve and open each destination's sockets, all in parallel since resolution can block
+  t0 = t1;
   {
-    char name[100];
-    snprintf(name,sizeof(name),"rtcp %u",demod->output.rtp.ssrc);
-    pthread_setname(name);
+    pthread_t threads[ndests > 0 ? ndests : 1];
+    for(int i=0; i < ndests; i++)
+      pthread_create(&threads[i],NULL,open_dest,&dests[i]);
+    for(int i=0; i < ndests; i++)
+      pthread_join(threads[i],NULL);
   }
+  int sap_fd = -1;
+  if(SAP_enable){
+    // Highly experimental, off by default
+    char sap_dest[] = "224.2.127.254:9875"; // sap.mcast.net
+    sap_fd = setup_mcast(sap_dest,NULL,1,Mcast_ttl,IP_tos,0);
+    if(sap_fd < 3)
+      fprintf(stdout,"Can't set up SAP output to %s\n",sap_dest);
+  }
+  for(int i=0; i < nsections; i++){
+    struct demod * const template = sections[i].template;
+    struct output_dest const * const dest = sections[i].dest;
+    strlcpy(template->output.data_dest_string,dest->name,sizeof(template->output.data_dest_string));
+    template->output.data_dest_address = dest->dest_address;
+    template->output.data_source_address = dest->source_address;
+    template->output.data_fd = dest->data_fd;
+    template->output.rtcp_fd = dest->rtcp_fd;
+    template->output.sap_fd = sap_fd;
+  }
+  clock_gettime(CLOCK_MONOTONIC,&t1);
+  stage_ms[STAGE_SOCKETS] = elapsed_ms(&t0,&t1);
 
-  while(1){
-
-    if(demod->output.rtp.ssrc == 0) // Wait until it's set by output RTP subsystem
-      goto done;
-    unsigned char buffer[4096]; // much larger than necessary
-    memset(buffer,0,sizeof(buffer));
-    
-    // Construct sender report
-    struct rtcp_sr sr;
-    memset(&sr,0,sizeof(sr));
-    sr.ssrc = demod->output.rtp.ssrc;
-
-    // Construct NTP timestamp
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME,&ts);
-    double runtime = (ts.tv_sec - Starttime.tv_sec) + (ts.tv_nsec - Starttime.tv_nsec)/1000000000.;
-
-    long long now_time = ((long long)ts.tv_sec + NTP_EPOCH)<< 32;
-    now_time += ((long long)ts.tv_nsec << 32) / 1000000000;
-
-    sr.ntp_timestamp = now_time;
-    // The zero is to remind me that I start timestamps at zero, but they could start anywhere
-    sr.rtp_timestamp = 0 + runtime * demod->output.samprate;
-    sr.packet_count = demod->output.rtp.seq;
-    sr.byte_count = demod->output.rtp.bytes;
-    
-    unsigned char *dp = gen_sr(buffer,sizeof(buffer),&sr,NULL,0);
-
-    // Construct SDES
-    struct rtcp_sdes sdes[4];
-    
-    // CNAME
-    char hostname[1024];
-    gethostname(hostname,sizeof(hostname));
-    char *string = NULL;
-    int sl = asprintf(&string,"radio@%s",hostname);
-    if(sl > 0 && sl <= 255){
-      sdes[0].type = CNAME;
-      strlcpy(sdes[0].message,string,sizeof(sdes[0].message));
-      sdes[0].mlen = strlen(sdes[0].message);
-    }
-    if(string){
-      free(string); string = NULL;
+  // Stage 4: start the demods, in parallel
+  t0 = t1;
+  for(int i=0; i < nsections; i++){
+    struct section_plan * const sp = &sections[i];
+    if(sp->dest->data_fd < 3)
+      continue; // Already complained
+    if(sp->band == NULL)
+      continue;
+    // The detector's own copy of the template stays out of the demod table so status and metrics don't list it
+    struct demod * const demod = malloc(sizeof(*demod));
+    if(demod == NULL)
+      break;
+    memcpy(demod,sp->template,sizeof(*demod));
+    if(setup_detector(demod,sp->sname,sp->band) == -1)
+      free(demod);
+  }
+  int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  if(nworkers > Max_startup_threads)
+    nworkers = Max_startup_threads;
+  if(nworkers > nchannels)
+    nworkers = nchannels;
+  if(nworkers < 1)
+    nworkers = 1;
+  struct startup_queue queue = {
+    .channels = channels,
+    .nchannels = nchannels,
+    .next = 0,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+  };
+  {
+    pthread_t threads[nworkers];
+    for(int i=0; i < nworkers; i++)
+      pthread_create(&threads[i],NULL,start_channels,&queue);
+    for(int i=0; i < nworkers; i++)
+      pthread_join(threads[i],NULL);
+  }
+  // Things only done once per section, in config order
+  for(int i=0; i < nchannels; i++){
+    struct channel_plan * const cp = &channels[i];
+    struct demod *demod = cp->demod;
+    if(demod == NULL)
+      continue;
+    ndemods++;
+    cp->section->started++;
+    if(cp->freq == 0 && cp->ssrc == 0){
+      if(Dynamic_demod)
+	free_demod(&Dynamic_demod);
+      // Template for dynamically created demods
+      Dynamic_demod = demod;
+      fprintf(stdout,"dynamic demod template created\n");
     }
+    // RTCP sender reports for every stream, SAP once per section; both are optional
+    start_reports(demod,true,i == cp->section->first);
+  }
+  clock_gettime(CLOCK_MONOTONIC,&t1);
+  stage_ms[STAGE_DEMODS] = elapsed_ms(&t0,&t1);
 
-    sdes[1].type = NAME;
-    strlcpy(sdes[1].message,"KA9Q Radio Program",sizeof(sdes[1].message));
-    sdes[1].mlen = strlen(sdes[1].message);
-    
-    sdes[2].type = EMAIL;
-    strlcpy(sdes[2].message,"karn@ka9q.net",sizeof(sdes[2].message));
-    sdes[2].mlen = strlen(sdes[2].message);
+  // Stage 5: readiness barrier; every demod has its filter (or has given up)
+  t0 = t1;
+  {
+    int const starting = wait_demods_ready(5000);
+    if(starting > 0)
+      fprintf(stdout,"%d demods still starting after 5 sec\n",starting);
+  }
+  clock_gettime(CLOCK_MONOTONIC,&t1);
+  stage_ms[STAGE_READY] = elapsed_ms(&t0,&t1);
 
-    sdes[3].type = TOOL;
-    strlcpy(sdes[3].message,"KA9Q Radio Program",sizeof(sdes[3].message));
-    sdes[3].mlen = strlen(sdes[3].message);
-    
-    dp = gen_sdes(dp,sizeof(buffer) - (dp-buffer),demod->output.rtp.ssrc,sdes,4);
+  for(int i=0; i < nsections; i++){
+    if(sections[i].band == NULL)
+      fprintf(stdout,"[%s] %d demodulators started\n",sections[i].sname,sections[i].started);
+    free(sections[i].template);
+  }
+  fprintf(stdout,"startup %.1f ms: parse %.1f, announce %.1f, sockets %.1f (%d destinations), demods %.1f (%d threads), ready %.1f\n",
+	  stage_ms[STAGE_PARSE] + stage_ms[STAGE_ANNOUNCE] + stage_ms[STAGE_SOCKETS] + stage_ms[STAGE_DEMODS] + stage_ms[STAGE_READY],
+	  stage_ms[STAGE_PARSE],stage_ms[STAGE_ANNOUNCE],stage_ms[STAGE_SOCKETS],ndests,
+	  stage_ms[STAGE_DEMODS],nworkers,stage_ms[STAGE_READY]);
+  free(channels);
+  free(sections);
+  free(dests);
+
+  // Start the status thread after all the receivers have been created so it doesn't contend for the demod list lock
+  if(Ctl_fd >= 3 && Status_fd >= 3)
+    pthread_create(&Status_thread,NULL,radio_status,NULL);
+  if((Ctl_fd >= 3 && Status_fd >= 3) || Ndetectors > 0)
+    pthread_create(&Demod_reaper_thread,NULL,demod_reaper,NULL);
 
+  // Optional scrape endpoint for monitoring: [host:]port or a Unix socket path
+  char const * const metrics = config_getstring(Dictionary,global,"metrics",NULL);
+  if(metrics != NULL)
+    metrics_start(metrics,"ka9q_radio",radio_metrics,NULL);
 
-    send(demod->output.rtcp_fd,buffer,dp-buffer,0);
-  done:;
-    usleep(1000000);
+  // Recordings start only now, so no demod misses the beginning
+  for(int i=0; i < Nfrontends; i++){
+    if(Frontends[i].input.file != NULL){
+      pthread_t file_thread;
+      pthread_create(&file_thread,NULL,file_source,&Frontends[i]);
+    }
   }
+  iniparser_freedict(Dictionary);
+  Dictionary = NULL;
+  return ndemods;
 }
+
 static void closedown(int a){
   fprintf(stdout,"Received signal %d, exiting\n",a);
   int r = fftwf_export_wisdom_to_filename(Wisdom_file);
@@ -0,0 +1,275 @@
+// Local metrics endpoint: a tiny HTTP/1.0 server for Prometheus-style scrapers
+// One thread per program answers one request at a time; it rebuilds the text snapshot by
+// calling the program's collect function no more than once a second, so a busy scraper costs
+// the program almost nothing and the threads doing real work never see it
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#if defined(linux)
+#include <bsd/string.h>
+#endif
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "misc.h"
+#include "metrics.h"
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0 // macOS; SO_NOSIGPIPE is set on each connection instead
+#endif
+
+static long long const Min_interval = BILLION; // Rebuild the snapshot no more often than this, ns
+
+struct metrics_server {
+  int fd;                 // Listening socket
+  char const *prefix;
+  void (*collect)(struct metrics *,void *);
+  void *arg;
+};
+
+// Append to the snapshot, growing it as needed
+static void append(struct metrics * const m,char const * const fmt,...){
+  while(1){
+    va_list ap;
+    va_start(ap,fmt);
+    int const n = vsnprintf(m->buf + m->len,m->size - m->len,fmt,ap);
+    va_end(ap);
+    if(n < 0)
+      return;
+    if(m->len + n < m->size){
+      m->len += n;
+      return;
+    }
+    m->size = 2 * (m->size + n);
+    m->buf = realloc(m->buf,m->size);
+    assert(m->buf != NULL);
+  }
+}
+
+void metric_family(struct metrics * const m,char const * const name,char const * const type,char const * const help){
+  append(m,"# HELP %s_%s %s\n",m->prefix,name,help);
+  append(m,"# TYPE %s_%s %s\n",m->prefix,name,type);
+}
+
+void metric(struct metrics * const m,char const * const name,double const value,char const * const labels,...){
+  append(m,"%s_%s",m->prefix,name);
+  if(labels != NULL){
+    append(m,"{");
+    va_list ap;
+    va_start(ap,labels);
+    char *text = NULL;
+    if(vasprintf(&text,labels,ap) >= 0){
+      append(m,"%s",text);
+      free(text);
+    }
+    va_end(ap);
+    append(m,"}");
+  }
+  if(isnan(value))
+    append(m," NaN\n");
+  else if(isinf(value))
+    append(m," %cInf\n",value > 0 ? '+' : '-');
+  else if(value == rint(value) && fabs(value) < 1e15)
+    append(m," %.0f\n",value); // Counters stay exact
+  else
+    append(m," %.7g\n",value);
+}
+
+// Metrics every program gets
+static void process_metrics(struct metrics * const m){
+  struct rusage ru;
+  if(getrusage(RUSAGE_SELF,&ru) == 0){
+    metric_family(m,"cpu_seconds_total","counter","User and system CPU time");
+    metric(m,"cpu_seconds_total",ru.ru_utime.tv_sec + 1e-6 * ru.ru_utime.tv_usec
+	   + ru.ru_stime.tv_sec + 1e-6 * ru.ru_stime.tv_usec,NULL);
+  }
+}
+
+static void respond(int const fd,char const * const status,char const * const type,char const * const body,size_t const len){
+  char header[256];
+  int const hlen = snprintf(header,sizeof(header),
+			    "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+			    status,type,(unsigned long)len);
+  if(send(fd,header,hlen,MSG_NOSIGNAL) != hlen)
+    return;
+  size_t sent = 0;
+  while(body != NULL && sent < len){
+    ssize_t const r = send(fd,body + sent,len - sent,MSG_NOSIGNAL);
+    if(r <= 0)
+      return; // Client went away, or stalled past the send timeout
+    sent += r;
+  }
+}
+
+static void *metrics_serve(void *arg){
+  struct metrics_server * const s = (struct metrics_server *)arg;
+  assert(s != NULL);
+  pthread_setname("metrics");
+
+  struct metrics snap;
+  memset(&snap,0,sizeof(snap));
+  snap.prefix = s->prefix;
+  long long last = 0;
+  while(1){
+    int const fd = accept(s->fd,NULL,NULL);
+    if(fd == -1){
+      if(errno != EINTR)
+	usleep(100000); // Out of descriptors, etc; don't spin
+      continue;
+    }
+    // Don't let a stuck client hold up everyone else
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+#if defined(SO_NOSIGPIPE)
+    int const one = 1;
+    setsockopt(fd,SOL_SOCKET,SO_NOSIGPIPE,&one,sizeof(one));
+#endif
+
+    // Read through the end of the request header; the body, if any, is ignored
+    char request[2048];
+    int len = 0;
+    while(len < (int)sizeof(request) - 1){
+      int const r = recv(fd,request + len,sizeof(request) - 1 - len,0);
+      if(r <= 0)
+	break;
+      len += r;
+      request[len] = '\0';
+      if(strstr(request,"\r\n\r\n") != NULL || strstr(request,"\n\n") != NULL)
+	break;
+    }
+    request[len] = '\0';
+    char method[16],path[256];
+    if(sscanf(request,"%15s %255s",method,path) != 2){
+      close(fd);
+      continue;
+    }
+    char const *text = "text/plain; charset=utf-8";
+    bool const head = strcmp(method,"HEAD") == 0;
+    if(!head && strcmp(method,"GET") != 0){
+      respond(fd,"405 Method Not Allowed",text,NULL,0);
+    } else if(strcmp(path,"/metrics") != 0 && strcmp(path,"/") != 0){
+      respond(fd,"404 Not Found",text,NULL,0);
+    } else {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC,&now);
+      long long const t = (long long)now.tv_sec * BILLION + now.tv_nsec;
+      if(snap.buf == NULL || t - last >= Min_interval){
+	snap.len = 0;
+	(*s->collect)(&snap,s->arg);
+	process_metrics(&snap);
+	last = t;
+      }
+      respond(fd,"200 OK","text/plain; version=0.0.4; charset=utf-8",head ? NULL : snap.buf,snap.len);
+    }
+    close(fd);
+  }
+  return NULL;
+}
+
+// Listen on a Unix socket path
+static int listen_unix(char const * const path){
+  struct sockaddr_un sun;
+  memset(&sun,0,sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  if(strlcpy(sun.sun_path,path,sizeof(sun.sun_path)) >= sizeof(sun.sun_path)){
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  int const fd = socket(AF_UNIX,SOCK_STREAM,0);
+  if(fd == -1)
+    return -1;
+  unlink(path); // Left over from an earlier run
+  if(bind(fd,(struct sockaddr *)&sun,sizeof(sun)) == -1 || listen(fd,8) == -1){
+    int const e = errno;
+    close(fd);
+    errno = e;
+    return -1;
+  }
+  return fd;
+}
+
+// Listen on [host:]port; IPv6 hosts go in brackets, e.g., [::]:9100
+static int listen_tcp(char const * const target){
+  char host[256];
+  char const *port;
+  char const * const colon = strrchr(target,':');
+  if(colon == NULL){
+    strlcpy(host,"localhost",sizeof(host)); // Local by default; anything else has to be asked for
+    port = target;
+  } else {
+    char const *hp = target;
+    int hlen = colon - target;
+    if(hlen >= 2 && hp[0] == '[' && hp[hlen-1] == ']'){
+      hp++;
+      hlen -= 2;
+    }
+    if(hlen >= (int)sizeof(host))
+      hlen = sizeof(host) - 1;
+    memcpy(host,hp,hlen);
+    host[hlen] = '\0';
+    port = colon + 1;
+  }
+  struct addrinfo hints;
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  struct addrinfo *results = NULL;
+  int const ecode = getaddrinfo(strlen(host) > 0 ? host : NULL,port,&hints,&results);
+  if(ecode != 0){
+    fprintf(stdout,"metrics: %s: %s\n",target,gai_strerror(ecode));
+    errno = EINVAL;
+    return -1;
+  }
+  int fd = -1;
+  for(struct addrinfo *ap = results; ap != NULL; ap = ap->ai_next){
+    fd = socket(ap->ai_family,ap->ai_socktype,ap->ai_protocol);
+    if(fd == -1)
+      continue;
+    int const reuse = 1;
+    setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&reuse,sizeof(reuse));
+    if(bind(fd,ap->ai_addr,ap->ai_addrlen) == 0 && listen(fd,8) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(results);
+  return fd;
+}
+
+int metrics_start(char const * const target,char const * const prefix,void (*collect)(struct metrics *,void *),void * const arg){
+  assert(target != NULL && prefix != NULL && collect != NULL);
+  int const fd = strchr(target,'/') != NULL ? listen_unix(target) : listen_tcp(target);
+  if(fd == -1){
+    fprintf(stdout,"metrics: can't listen on %s: %s\n",target,strerror(errno));
+    return -1;
+  }
+  struct metrics_server * const s = calloc(1,sizeof(*s));
+  assert(s != NULL);
+  s->fd = fd;
+  s->prefix = prefix;
+  s->collect = collect;
+  s->arg = arg;
+  pthread_t thread;
+  if(pthread_create(&thread,NULL,metrics_serve,s) != 0){
+    close(fd);
+    free(s);
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
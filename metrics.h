@@ -0,0 +1,32 @@
+// Local metrics endpoint shared by radio, opus, pcmrecord and the SDR daemons
+// Serves the program's counters over HTTP in the Prometheus text exposition format, so a fleet
+// can be scraped without decoding the binary status multicast
+#ifndef _METRICS_H
+#define _METRICS_H 1
+
+#include <stddef.h>
+
+// Text of one snapshot, built by the program's collect function
+struct metrics {
+  char *buf;
+  size_t len;
+  size_t size;
+  char const *prefix;   // Prepended to every metric name, e.g., "ka9q_radio"
+};
+
+// Start a thread answering "GET /metrics" on 'target': [host:]port for TCP (localhost if no host),
+// or a path (anything with a '/') for a Unix socket, e.g., curl --unix-socket /run/radio/metrics.sock http://localhost/metrics
+// collect(m,arg) is called only from that thread, and at most once a second; requests in between get the last snapshot.
+// It should just read the counters the program already keeps, so nothing in the packet paths waits on it
+// Returns -1 if the socket can't be set up
+int metrics_start(char const *target,char const *prefix,void (*collect)(struct metrics *,void *),void *arg);
+
+// Begin a metric family; all its samples must follow before the next family
+// type is "counter" or "gauge"; counter names should end in _total
+void metric_family(struct metrics *m,char const *name,char const *type,char const *help);
+
+// One sample. 'labels' is a printf format for the label list without braces, e.g., "ssrc=\"%u\",section=\"%s\"",
+// or NULL for none. Label values are not escaped, so they mustn't contain '"' or '\'
+void metric(struct metrics *m,char const *name,double value,char const *labels,...) __attribute__ ((format (printf,4,5)));
+
+#endif
@@ -320,6 +320,44 @@ uint32_t ElfHashString(const char *s){
   return ElfHash((unsigned char *)s,strlen(s));
 }
 
+// Estimate the p'th quantile (0-1) of a stage's time, ns, interpolating within the power-of-two bucket
+long long timing_percentile(struct timing const * const t,double const p){
+  uint32_t hist[TIMING_BUCKETS];
+  uint64_t total = 0;
+  for(int i=0; i < TIMING_BUCKETS; i++)
+    total += hist[i] = t->hist[i]; // Snapshot; the writer may be updating it
+  if(total == 0)
+    return 0;
+  double const target = p * total;
+  double cum = 0;
+  for(int i=0; i < TIMING_BUCKETS; i++){
+    if(hist[i] == 0)
+      continue;
+    if(cum + hist[i] >= target){
+      double const lo = i == 0 ? 0 : (double)(1LL << i);
+      double const hi = (double)(1LL << (i+1));
+      long long const q = llround(lo + (hi - lo) * (target - cum) / hist[i]);
+      long long const m = timing_max(t);
+      return m > 0 && q > m ? m : q; // Never above the largest actually seen
+    }
+    cum += hist[i];
+  }
+  return timing_max(t);
+}
+
+long long timing_max(struct timing const * const t){
+  return t->max_ns > t->prev_max_ns ? t->max_ns : t->prev_max_ns;
+}
+
+// Combine the histograms of several threads doing the same stage, e.g., the forward FFT workers
+void timing_merge(struct timing * const sum,struct timing const * const t){
+  for(int i=0; i < TIMING_BUCKETS; i++)
+    sum->hist[i] += t->hist[i];
+  long long const m = timing_max(t);
+  if(m > sum->max_ns)
+    sum->max_ns = m;
+}
+
 
 
 #if __APPLE__
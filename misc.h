@@ -18,6 +18,7 @@
 #include <complex.h>
 #include <math.h> // Get M_PI
 #include <stdlib.h> // for ldiv()
+#include <time.h>
 
 // I *hate* this sort of pointless, stupid, gratuitous incompatibility that
 // makes a lot of code impossible to read and debug
@@ -103,6 +104,16 @@ static inline void time_add(struct timespec *result,struct timespec const *a, st
 		(void) (&_x == &_y);	\
 		_x > _y ? _x : _y; })
 
+// Greatest common divisor, e.g., for checking FFT and block size compatibility
+static inline long long gcd(long long a,long long b){
+  while(b != 0){
+    long long const t = a % b;
+    a = b;
+    b = t;
+  }
+  return a < 0 ? -a : a;
+}
+
 #define M_1_2PI (0.5 * M_1_PI) // fraction of a rotation in one radian
 #define DEGPRA (180./M_PI)
 #define RAPDEG (M_PI/180.)
@@ -120,6 +131,43 @@ static inline void time_add(struct timespec *result,struct timespec const *a, st
 #define cis(x) csincos(x)
 #define cispi(x) csincospi(x)
 
+// Histogram of the time one processing stage takes, e.g., per block, for the status channel
+// Written only by the thread doing the work and read without locks, so a reader may see it mid-update; good enough for display
+// Buckets are powers of two in nanoseconds. Every TIMING_WINDOW samples the counts are halved,
+// so the percentiles follow the last few thousand samples rather than the whole run
+#define TIMING_BUCKETS 32 // Up to 2^32 ns, about 4 sec
+#define TIMING_WINDOW 1024
+struct timing {
+  uint32_t hist[TIMING_BUCKETS];
+  uint32_t count;          // Samples since the last halving
+  long long max_ns;        // Largest since the last halving
+  long long prev_max_ns;   // Largest in the window before that
+};
+
+static inline long long timing_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (long long)ts.tv_sec * BILLION + ts.tv_nsec;
+}
+static inline void timing_add(struct timing * const t,long long const ns){
+  int b = ns < 2 ? 0 : 63 - __builtin_clzll(ns);
+  if(b >= TIMING_BUCKETS)
+    b = TIMING_BUCKETS - 1;
+  t->hist[b]++;
+  if(ns > t->max_ns)
+    t->max_ns = ns;
+  if(++t->count >= TIMING_WINDOW){
+    for(int i=0; i < TIMING_BUCKETS; i++)
+      t->hist[i] >>= 1;
+    t->prev_max_ns = t->max_ns;
+    t->max_ns = 0;
+    t->count = TIMING_WINDOW/2;
+  }
+}
+long long timing_percentile(struct timing const *t,double p);
+long long timing_max(struct timing const *t);
+void timing_merge(struct timing *sum,struct timing const *t);
+
 extern int Verbose;
 extern char const *Months[12];
 
@@ -33,6 +33,7 @@
 #include "misc.h"
 #include "multicast.h"
 #include "iir.h"
+#include "session.h"
 
 
 // Global config variables
@@ -49,7 +50,8 @@ static int List_audio;               // List audio output devices and exit
 int Verbose;                  // Verbosity flag
 static int Quiet;                    // Disable curses
 static int Quiet_mode;               // Toggle screen activity after starting
-static float Playout = 100;
+static float Playout = 100;          // Initial playout delay, ms; the whole delay with --fixed-playout
+static int Fixed_playout;            // Don't adapt the playout delay to the jitter
 static int Start_muted;
 static int Auto_position;
 
@@ -76,7 +78,15 @@ static struct timespec Last_error_time;
 static int Position; // auto-position streams
 static int Auto_sort;
 
+// Adaptive playout
+static float const Jitter_factor = 4;       // Playout delay covers this many times the interarrival jitter
+static float const Min_playout = 20;        // ms
+static float const Max_playout = 1000;      // ms
+static int const Min_jitter_packets = 50;   // Use the initial delay until the jitter estimate has settled
+static float const Max_conceal = 0.1;       // Longest gap filled in by loss concealment, sec; longer ones are left silent
+
 struct session {
+  struct session_entry entry; // Hash table linkage
   struct sockaddr_storage sender;
   char *dest;
 
@@ -93,7 +103,16 @@ struct session {
   long long start_rptr;     // First output callback read pointer in stream, or after reset
   long long timestamp_upper; // Upper bits of virtual timestamp (if greater than 2^32)
   volatile long long wptr;           // current write pointer into output PCM buffer
-  int playout;              // Initial playout delay, samples
+  int playout;              // Playout delay for the current talk spurt, samples
+  uint32_t next_timestamp;  // Expected timestamp of the next packet, for finding the length of a gap
+
+  // Interarrival jitter, RFC 3550 sec 6.4.1; updated by sockproc() as packets arrive
+  float jitter;             // sec
+  long long last_arrival;   // Monotonic ns of the last in-sequence arrival
+  uint32_t last_timestamp;
+  uint16_t last_seq;
+  int jitter_init;
+  long long spike;          // Delay that would have saved the most recent late packet, samples; decays each talk spurt
 
   float bounce[MAXSIZE][2]; // This is uncomfortably large for the stack on some machines
   OpusDecoder *opus;        // Opus codec decoder handle, if needed
@@ -112,6 +131,7 @@ struct session {
   unsigned long long lates;
   unsigned long long earlies;
   unsigned long long resets;
+  unsigned long long concealed; // Frames filled in by Opus PLC/FEC or PCM repetition
 
   int terminate;            // Set to cause thread to terminate voluntarily
   int muted;
@@ -121,7 +141,8 @@ struct session {
 };
 #define NSESSIONS 1500
 static int Nsessions;
-static struct session *Sessions[NSESSIONS];
+static struct session *Sessions[NSESSIONS]; // In display order
+static struct session_table Session_table;  // For fast lookup by sender and SSRC
 
 static void cleanup(void);
 static void closedown(int);
@@ -138,13 +159,14 @@ static char const *lookupid(uint32_t ssrc);
 static float make_position(int);
 
 
-static char Optstring[] = "LR:vI:qu:p:ar:S";
+static char Optstring[] = "FLR:vI:qu:p:ar:S";
 static struct  option Options[] = {
    {"pcm_in", required_argument, NULL, 'I'},
    {"opus_in", required_argument, NULL, 'I'},
    {"list-audio", no_argument, NULL, 'L'},
    {"audio-dev", required_argument, NULL, 'R'},
    {"autosort", no_argument, NULL, 'S'},
+   {"fixed-playout", no_argument, NULL, 'F'},
    {"auto-position", no_argument, NULL, 'a'},
    {"playout", required_argument, NULL, 'p'},
    {"quiet", no_argument, NULL, 'q'},
@@ -202,8 +224,11 @@ int main(int argc,char * const argv[]){
     case 'S':
       Auto_sort++;
       break;
+    case 'F':
+      Fixed_playout++;
+      break;
     default:
-      fprintf(stderr,"Usage: %s [-a] [-v] [-q] [-L] [-u update] [-R audio_device] [-p|-P playout_delay_ms] [-r samprate] -I mcast_address [-I mcast_address]\n",argv[0]);
+      fprintf(stderr,"Usage: %s [-a] [-v] [-q] [-L] [-u update] [-R audio_device] [-p|-P playout_delay_ms] [-F] [-r samprate] -I mcast_address [-I mcast_address]\n",argv[0]);
       exit(1);
     }
   }
@@ -304,6 +329,7 @@ int main(int argc,char * const argv[]){
 
   pthread_mutex_init(&Output_mutex,NULL);
   pthread_mutex_init(&Sess_mutex,NULL);
+  session_table_init(&Session_table,NSESSIONS,0);
 
   // Spawn one thread per address
   // All have to succeed in resolving their targets or we'll exit
@@ -331,6 +357,24 @@ int main(int argc,char * const argv[]){
   exit(0);
 }
 
+// Update the session's interarrival jitter estimate with a newly arrived packet, as in RFC 3550 sec 6.4.1
+// Only consecutive packets count, so silence between talk spurts and reordering don't look like jitter
+// Caller holds sp->qmutex
+static void update_jitter(struct session * const sp,struct packet const * const pkt){
+  long long const arrival = timing_now();
+  int const samprate = samprate_from_pt(pkt->rtp.type);
+  if(sp->jitter_init && samprate > 0 && !pkt->rtp.marker && (uint16_t)(pkt->rtp.seq - sp->last_seq) == 1){
+    double const d = 1e-9 * (arrival - sp->last_arrival) - (double)(int32_t)(pkt->rtp.timestamp - sp->last_timestamp) / samprate;
+    sp->jitter += (fabs(d) - sp->jitter) / 16;
+  }
+  if(!sp->jitter_init || (int16_t)(pkt->rtp.seq - sp->last_seq) > 0){
+    sp->last_arrival = arrival;
+    sp->last_timestamp = pkt->rtp.timestamp;
+    sp->last_seq = pkt->rtp.seq;
+    sp->jitter_init = 1;
+  }
+}
+
 static void *sockproc(void *arg){
 
   char *mcast_address_text = (char *)arg;
@@ -431,7 +475,8 @@ static void *sockproc(void *arg){
     struct packet *q_prev = NULL;
     struct packet *qe = NULL;
     pthread_mutex_lock(&sp->qmutex);
-    for(qe = sp->queue; qe && pkt->rtp.seq >= qe->rtp.seq; q_prev = qe,qe = qe->next)
+    update_jitter(sp,pkt);
+    for(qe = sp->queue; qe && (int16_t)(pkt->rtp.seq - qe->rtp.seq) >= 0; q_prev = qe,qe = qe->next)
       ;
     
     pkt->next = qe;
@@ -467,7 +512,126 @@ static void decode_task_cleanup(void *arg){
   }
 }
 
+// Where a sample with this RTP timestamp goes in the output buffer
+static long long timestamp_wptr(struct session const * const sp,uint32_t const timestamp,int const upsample){
+  return sp->start_rptr + upsample * (sp->timestamp_upper + timestamp - sp->start_timestamp) + sp->playout;
+}
+
+// How much longer to hold a packet that skips ahead in sequence, in case the missing ones were only
+// reordered or delayed: until just before it has to play. 0 means decode it now
+// Caller holds sp->qmutex
+static long long hold_time(struct session const * const sp,struct packet const * const pkt){
+  if(sp->reset || pkt->rtp.marker || (int16_t)(pkt->rtp.seq - sp->rtp_state.seq) <= 0)
+    return 0;
+  int const samprate = samprate_from_pt(pkt->rtp.type);
+  if(samprate <= 0)
+    return 0;
+  // Leave an audio callback's worth to decode it and conceal the gap
+  long long const slack = timestamp_wptr(sp,pkt->rtp.timestamp,Samprate / samprate) - Rptr - Latency * Samprate;
+  return slack > 0 ? slack * BILLION / Samprate : 0;
+}
+
+// Playout delay for the next talk spurt, samples at the output rate
+// Enough for Jitter_factor times the interarrival jitter plus a frame and an audio callback,
+// or for the most recent late packet, whichever is more
+static int playout_target(struct session const * const sp){
+  if(Fixed_playout || sp->packets < Min_jitter_packets)
+    return Playout * Samprate / 1000;
+  float const frame = sp->samprate > 0 ? (float)sp->frame_size / sp->samprate : 0;
+  float target = (Jitter_factor * sp->jitter + frame + Latency) * Samprate;
+  if(target < sp->spike)
+    target = sp->spike;
+  target = max(target,Min_playout * Samprate / 1000);
+  target = min(target,Max_playout * Samprate / 1000);
+  return target;
+}
+
+// Remember how much more delay a late packet needed, for the next talk spurt
+static void note_late(struct session * const sp,long long const wptr){
+  long long const needed = sp->playout + (Rptr - wptr) + Latency * Samprate;
+  if(needed > sp->spike)
+    sp->spike = needed;
+}
+
+// Mix the first 'frames' of the bounce buffer into the output buffer at wptr, scaled
+// Caller holds Output_mutex
+static void mix(struct session const * const sp,long long const wptr,int const frames,int const upsample,float const scale){
+  /* Compute gains and delays for stereo imaging
+     Extreme gain differences can make the source sound like it's inside an ear
+     This can be uncomfortable in good headphones with extreme panning
+     -6dB for each channel in the center
+     when full to one side or the other, that channel is +6 dB and the other is -inf dB */
+  float const left_gain = scale * sp->gain * (1 - sp->pan)/2;
+  float const right_gain = scale * sp->gain * (1 + sp->pan)/2;
+  /* Delay less favored channel 0 - 1.5 ms max (determined
+     empirically) This is really what drives source localization
+     in humans The effect is so dramatic even with equal levels
+     you have to remove one earphone to convince yourself that the
+     levels really are the same */
+  int const left_delay = (sp->pan > 0) ? round(sp->pan * .0015 * Samprate) : 0; // Delay left channel
+  int const right_delay = (sp->pan < 0) ? round(-sp->pan * .0015 * Samprate) : 0; // Delay right channel
+
+  assert(left_delay >= 0 && right_delay >= 0);
+
+  // Mix bounce buffer into output buffer read by portaudio callback
+  unsigned int left_index = wptr + left_delay;
+  unsigned int right_index = wptr + right_delay;
+  for(int i=0; i < frames; i++){
+    // Not the cleanest way to upsample the sample rate, but it works
+    for(int j=0; j < upsample; j++){
+      Output_buffer[left_index++ & (BUFFERSIZE-1)][0] += sp->bounce[i][0] * left_gain;
+      Output_buffer[right_index++ & (BUFFERSIZE-1)][1] += sp->bounce[i][1] * right_gain;
+    }
+  }
+}
+
+// Fill in 'lost' samples (at the stream's rate) missing just before pkt, assuming the lost packets
+// were the same length as the last one we got
+// Opus: the decoder's loss concealment, except that the frame just before pkt comes from pkt's in-band FEC if it has any
+// PCM: the last frame received, repeated and fading out. Must be called before pkt is decoded into the bounce buffer
+static void conceal(struct session * const sp,struct packet const * const pkt,int const lost,int const upsample){
+  int const frame = sp->frame_size;
+  if(frame <= 0 || lost <= 0 || lost > Max_conceal * samprate_from_pt(pkt->rtp.type))
+    return;
+  long long wptr = timestamp_wptr(sp,pkt->rtp.timestamp - lost,upsample);
+  if(wptr < Rptr)
+    return; // Too late to fill it anyway
+
+  if(sp->type == OPUS_PT){
+    if(sp->opus == NULL || lost % frame != 0)
+      return; // The decoder can only conceal whole frames
+    int const nframes = lost / frame;
+    for(int k=0; k < nframes; k++){
+      int const fec = (k == nframes - 1);
+      // Run even when muted to keep the decoder's state in step
+      int const samples = opus_decode_float(sp->opus,fec ? pkt->data : NULL,fec ? pkt->len : 0,sp->bounce[0],frame,fec);
+      if(samples > 0 && !sp->muted){
+	pthread_mutex_lock(&Output_mutex);
+	mix(sp,wptr,samples,upsample,1.0);
+	pthread_mutex_unlock(&Output_mutex);
+      }
+      wptr += upsample * frame;
+      sp->concealed++;
+    }
+  } else {
+    float scale = 1;
+    for(int done = 0; done < lost; done += frame){
+      if(!sp->muted){
+	pthread_mutex_lock(&Output_mutex);
+	mix(sp,wptr,min(frame,lost - done),upsample,scale);
+	pthread_mutex_unlock(&Output_mutex);
+      }
+      wptr += upsample * frame;
+      scale *= 0.5; // -6 dB each repetition
+      sp->concealed++;
+    }
+  }
+}
+
 // Thread to decode incoming RTP packets for each session
+// Packets come off the queue (sorted by sequence number) as soon as they're next in sequence;
+// one that skips ahead is held until just before it has to play, and only then is the gap
+// taken as lost and concealed
 static void *decode_task(void *arg){
   struct session *sp = (struct session *)arg;
   assert(sp);
@@ -482,32 +646,59 @@ static void *decode_task(void *arg){
 
   int late_rate = 0;
   int consec_futures = 0;
+  int consec_olds = 0;
 
   // Main loop; run until asked to quit
   while(!sp->terminate){
 
     struct packet *pkt = NULL;
-    // Wait for packet to appear on queue
-    struct timespec ts,increment;
-    clock_gettime(CLOCK_REALTIME,&ts);
-    increment.tv_sec = 0;
-    increment.tv_nsec = 100000000; // 100 ms
-    time_add(&ts,&ts,&increment);
+    // Wait for a packet we can decode
+    struct timespec ts;
     pthread_mutex_lock(&sp->qmutex);
-    while(!sp->queue){
-      int r = pthread_cond_timedwait(&sp->qcond,&sp->qmutex,&ts); // Wait 100 ms max so we pick up terminates
-      if(r != 0){
-	if(r == EINVAL)
-	  Invalids++;
-	pthread_mutex_unlock(&sp->qmutex);
-	goto endloop;// restart loop, checking terminate flag
+    while(1){
+      long long wait = 100000000; // Wait 100 ms max so we pick up terminates
+      if(sp->queue){
+	long long const hold = hold_time(sp,sp->queue);
+	if(hold <= 0){
+	  pkt = sp->queue;
+	  sp->queue = pkt->next;
+	  pkt->next = NULL;
+	  break;
+	}
+	wait = min(wait,hold);
       }
+      clock_gettime(CLOCK_REALTIME,&ts);
+      struct timespec increment;
+      increment.tv_sec = wait / BILLION;
+      increment.tv_nsec = wait % BILLION;
+      time_add(&ts,&ts,&increment);
+      int r = pthread_cond_timedwait(&sp->qcond,&sp->qmutex,&ts);
+      if(r == EINVAL)
+	Invalids++;
+      if(sp->terminate || (r != 0 && !sp->queue))
+	break;
     }
-    pkt = sp->queue;
-    sp->queue = pkt->next;
-    pkt->next = NULL;
     pthread_mutex_unlock(&sp->qmutex);
+    if(pkt == NULL)
+      goto endloop; // restart loop, checking terminate flag
+    clock_gettime(CLOCK_REALTIME,&ts);
+
     sp->packets++; // Count all packets, regardless of type
+    int const gap = (int16_t)(pkt->rtp.seq - sp->rtp_state.seq);
+    if(gap < 0 && !pkt->rtp.marker && !sp->reset){
+      // Older than one already played or concealed; too late to use
+      // Many in a row probably means the sender restarted, so start over
+      if(++consec_olds < 10){
+	int const samprate = samprate_from_pt(pkt->rtp.type);
+	if(samprate > 0)
+	  note_late(sp,timestamp_wptr(sp,pkt->rtp.timestamp,Samprate / samprate));
+	sp->lates++;
+	goto endloop;
+      }
+      sp->reset = 1;
+    }
+    consec_olds = 0;
+    int const same_type = sp->type == pkt->rtp.type;
     if(sp->type != pkt->rtp.type) // Handle transitions both ways
       sp->type = pkt->rtp.type;
 
@@ -516,14 +707,19 @@ static void *decode_task(void *arg){
     if(sp->samprate != 0)
       upsample = Samprate / sp->samprate; // Upsample lower PCM samprates to 48 kHz output (should be cleaner)
 
-    if(pkt->rtp.seq != sp->rtp_state.seq){
+    int do_conceal = 0;
+    if(gap != 0){
       if(!pkt->rtp.marker){
-	sp->rtp_state.drops++; // Avoid spurious drops when session is recreated after silence
+	sp->rtp_state.drops += gap > 0 ? gap : 1; // Avoid spurious drops when session is recreated after silence
 	Last_error_time = ts;
       }
-      if(sp->opus)
+      // A short gap within a talk spurt is filled in; otherwise start the decoder over
+      if(gap > 0 && !pkt->rtp.marker && !sp->reset && same_type)
+	do_conceal = 1;
+      else if(sp->opus)
 	opus_decoder_ctl(sp->opus,OPUS_RESET_STATE); // Reset decoder
-    } else {
+    }
+    if(gap == 0 || do_conceal){
       /* Handle wraparound in timestamp (unlikely but possible in long-lived stream)
 	 This can still fail if there's an outage more than 2^31 samples long without a mark (seems unlikely)
 	 Do only when packet is in sequence as heuristic check */
@@ -538,6 +734,8 @@ static void *decode_task(void *arg){
       sp->active = 0; // reset active
       reset_session(sp,pkt->rtp.timestamp); // Updates sp->wptr
     }
+    if(do_conceal)
+      conceal(sp,pkt,(int32_t)(pkt->rtp.timestamp - sp->next_timestamp),upsample);
 
     // decode Opus or PCM into bounce buffer
     if(sp->type == OPUS_PT){
@@ -576,7 +774,7 @@ static void *decode_task(void *arg){
 	sp->bandwidth = 20;
 	break;
       }
-      int samples = opus_decode_float(sp->opus,pkt->data,pkt->len,sp->bounce[0],sizeof(sp->bounce),0); // fec?
+      int samples = opus_decode_float(sp->opus,pkt->data,pkt->len,sp->bounce[0],MAXSIZE,0);
       if(samples != sp->frame_size)
 	fprintf(stderr,"samples %d frame-size %d\n",samples,sp->frame_size);
 
@@ -591,9 +789,11 @@ static void *decode_task(void *arg){
       sp->frame_size = pkt->len / (sizeof(int16_t) * sp->channels); // mono/stereo samples in frame
       if(sp->frame_size <= 0)
 	goto endloop;
+      if(sp->frame_size > MAXSIZE)
+	sp->frame_size = MAXSIZE;
 
       signed short *data_ints = (signed short *)&pkt->data[0];	
-      for(int i=0; i < sp->frame_size && i < MAXSIZE; i++){
+      for(int i=0; i < sp->frame_size; i++){
 	assert((void *)data_ints >= (void *)&pkt->data[0] && (void *)data_ints < (void *)(&pkt->data[0] + pkt->len));
 	float left = SCALE * (signed short)ntohs(*data_ints++);
 	float right;
@@ -606,14 +806,17 @@ static void *decode_task(void *arg){
 	sp->bounce[i][1] = right;
       }
     }
+    sp->next_timestamp = pkt->rtp.timestamp + sp->frame_size;
+
     /* Find where to write in circular output buffer
      * This is updated even when muted so the activity display will work */
-    sp->wptr = sp->start_rptr + upsample * (sp->timestamp_upper + pkt->rtp.timestamp - sp->start_timestamp) + sp->playout;
+    sp->wptr = timestamp_wptr(sp,pkt->rtp.timestamp,upsample);
     // Protect Output_buffer and Rptr, which are modified in portaudio callback
     pthread_mutex_lock(&Output_mutex);
 
     if(sp->wptr < Rptr){
       sp->lates++;
+      note_late(sp,sp->wptr);
       // More than 2 lates in 10 packets triggers a reset
       if((late_rate += 10) < 20){
 	pthread_mutex_unlock(&Output_mutex);
@@ -636,41 +839,13 @@ static void *decode_task(void *arg){
     if(sp->reset)
       reset_session(sp,pkt->rtp.timestamp); // Updates sp->wptr
 
-    if(!sp->muted){
-      /* Compute gains and delays for stereo imaging
-	 Extreme gain differences can make the source sound like it's inside an ear
-	 This can be uncomfortable in good headphones with extreme panning
-	 -6dB for each channel in the center
-	 when full to one side or the other, that channel is +6 dB and the other is -inf dB */
-      float const left_gain = sp->gain * (1 - sp->pan)/2;
-      float const right_gain = sp->gain * (1 + sp->pan)/2;
-      /* Delay less favored channel 0 - 1.5 ms max (determined
-	 empirically) This is really what drives source localization
-	 in humans The effect is so dramatic even with equal levels
-	 you have to remove one earphone to convince yourself that the
-	 levels really are the same */
-      int const left_delay = (sp->pan > 0) ? round(sp->pan * .0015 * Samprate) : 0; // Delay left channel
-      int const right_delay = (sp->pan < 0) ? round(-sp->pan * .0015 * Samprate) : 0; // Delay right channel
-
-      assert(left_delay >= 0 && right_delay >= 0);
-
-      // Mix bounce buffer into output buffer read by portaudio callback
-      unsigned int left_index = sp->wptr + left_delay;
-      unsigned int right_index = sp->wptr + right_delay;
-      for(int i=0; i < sp->frame_size; i++){
-	// Not the cleanest way to upsample the sample rate, but it works
-	for(int j=0; j < upsample; j++){
-	  Output_buffer[left_index++ & (BUFFERSIZE-1)][0] += sp->bounce[i][0] * left_gain;
-	  Output_buffer[right_index++ & (BUFFERSIZE-1)][1] += sp->bounce[i][1] * right_gain;
-	}
-      }
-    }
+    if(!sp->muted)
+      mix(sp,sp->wptr,sp->frame_size,upsample,1.0);
+
     pthread_mutex_unlock(&Output_mutex); // Done with Output_buffer and Rptr
     // Count samples and frames and advance write pointer even when muted
     sp->tot_active += (float)sp->frame_size / sp->samprate;
     sp->active += (float)sp->frame_size / sp->samprate;
-    free(pkt);
-    pkt = NULL;
 
     if(sp->frame_size > 0){
       sp->wptr += upsample * sp->frame_size; // increase displayed queue in status screen
@@ -684,6 +859,8 @@ static void *decode_task(void *arg){
 #endif
     }
   endloop:;
+    free(pkt);
+    pkt = NULL;
   }
   sp->terminate = -1; // debug
   pthread_cleanup_pop(1);
@@ -727,6 +904,7 @@ static void *display(void *arg){
       printw("\u21de\u21df select prev/next session page\n");
       printw("d delete session\n");
       printw("r reset playout buffer\n");
+      printw("f toggle fixed/adaptive playout delay\n");
       printw("m mute current session\n");
       printw("M mute all sessions\n");      
       printw("u unmute current session\n");
@@ -750,13 +928,13 @@ static void *display(void *arg){
       // First header line
       printw("                                                     ------- Activity --------");
       if(Verbose)
-	printw(" Play  ----Codec----     ---------------RTP--------------------------");	
+	printw(" Play  ----Codec---- --Jitter buffer-     ---------------RTP--------------------------");
       printw("\n");    
       
       // Second header line
       printw("  dB Pan     SSRC ID                                 Total   Current      Idle");
       if(Verbose)
-	printw(" Queue Type ms ch BW     packets resets drops lates early Source/Dest");
+	printw(" Queue Type ms ch BW Delay  Jit   PLC     packets resets drops lates early Source/Dest");
       printw("\n");
       
       if(Auto_sort)
@@ -767,6 +945,10 @@ static void *display(void *arg){
       /* This mutex protects Sessions[] and Nsessions. Instead of holding the
 	 lock for the entire display loop, we make a copy.
       */
+      // What the listener hears is the playout delay plus whatever the audio device adds
+      PaStreamInfo const * const info = Pa_GetStreamInfo(Pa_Stream);
+      double const device_latency = info != NULL ? info->outputLatency : 0;
+
       struct session *Sessions_copy[NSESSIONS];
       int Nsessions_copy;
       pthread_mutex_lock(&Sess_mutex);
@@ -817,6 +999,10 @@ static void *display(void *arg){
 		 (1000 * sp->frame_size/sp->samprate), // frame size, ms
 		 sp->channels,
 		 sp->bandwidth); // Bandwidth, kHz 
+	  printw("%6.0f%5.1f%'6llu",
+		 1000 * ((double)sp->playout / Samprate + device_latency), // Effective latency, ms
+		 1000 * sp->jitter,    // Interarrival jitter, ms
+		 sp->concealed);       // Frames filled in
 	  
 	  printw("%'12lu",sp->packets);
 	  printw("%'7llu",sp->resets);
@@ -845,7 +1031,10 @@ static void *display(void *arg){
 	// Time since last packet drop on any channel
 	if(Start_unix_time.tv_sec != Last_error_time.tv_sec)
 	  printw("Error-free seconds: %'.1lf\n",ts.tv_sec - Last_error_time.tv_sec + 1e-9 * (ts.tv_nsec - Last_error_time.tv_nsec));
-	printw("Initial playout time: %.0f ms\n",Playout);
+	if(Fixed_playout)
+	  printw("Fixed playout time: %.0f ms\n",Playout);
+	else
+	  printw("Adaptive playout, initial time: %.0f ms\n",Playout);
       }      
     }
 
@@ -986,6 +1175,9 @@ static void *display(void *arg){
       if(current >= 0)
 	Sessions[current]->muted = 1;
       break;
+    case 'f': // Toggle adaptive playout; applies from each session's next talk spurt
+      Fixed_playout = !Fixed_playout;
+      break;
     case 'r':
       // Reset playout queue
       if(current >= 0)
@@ -1020,7 +1212,9 @@ static void reset_session(struct session * const sp,uint32_t timestamp){
   sp->start_rptr = Rptr;
   sp->start_timestamp = timestamp; // Resynch as if new stream
   sp->timestamp_upper = 0;
-  sp->playout = Playout * Samprate/1000;
+  // The delay changes only here, between talk spurts or on a resync, so audio within a spurt never jumps
+  sp->playout = playout_target(sp);
+  sp->spike /= 2;
   sp->wptr = Rptr + sp->playout;
 }
 
@@ -1082,17 +1276,13 @@ static int sort_session_total(void){
 
 
 static struct session *lookup_session(const struct sockaddr_storage *sender,const uint32_t ssrc){
-  for(int i = 0; i < Nsessions; i++){
-    struct session *sp = Sessions[i];
-    if(sp->ssrc == ssrc && memcmp(&sp->sender,sender,sizeof(*sender)) == 0){
-      // Found it.
-      return sp;
-    }
-  }
-  return NULL;
+  return session_lookup(&Session_table,sender,ssrc,0);
 }
 // Create a new session, partly initialize
 static struct session *create_session(struct sockaddr_storage const *sender,uint32_t ssrc){
+  if(Nsessions >= NSESSIONS)
+    return NULL; // Display table full
+
   struct session * const sp = calloc(1,sizeof(*sp));
 
   if(sp == NULL)
@@ -1104,6 +1294,7 @@ static struct session *create_session(struct sockaddr_storage const *sender,uint
 
   // Put at end of list
   Sessions[Nsessions++] = sp;
+  session_insert(&Session_table,&sp->entry,sp,sender,ssrc,0);
   return sp;
 }
 
@@ -1116,6 +1307,7 @@ static int close_session(struct session **p){
   assert(Nsessions > 0);
   
   // Remove from table
+  session_remove(&Session_table,&sp->entry);
   for(int i = 0; i < Nsessions; i++){
     if(Sessions[i] == sp){
       Nsessions--;
@@ -34,6 +34,7 @@
 #define IQ_PT (97)    // NON-standard payload type for my raw I/Q stream - 16 bit little endian
 #define IQ_PT8 (98)   // NON-standard payload type for my raw I/Q stream - 8 bit version
 #define IQ_FLOAT (99) // 32-bit float complex
+#define SPECTRUM_PT (100) // NON-standard payload type for radio's averaged spectrum frames
 #define AX25_PT (96)  // NON-standard paylaod type for my raw AX.25 frames
 #define PCM_MONO_PT (11)          // 48 kHz (or other) flat mono baseband audio OR real-only IF stream
 #define PCM_STEREO_PT (10)        // 48 kHz (or other) flat stereo baseband audio OR I/Q baseband audio OR I/Q IF stream
@@ -14,6 +14,9 @@
 #include <unistd.h>
 #include <limits.h>
 #include <string.h>
+#if defined(linux)
+#include <bsd/string.h>
+#endif
 #include <opus/opus.h>
 #include <netdb.h>
 #include <locale.h>
@@ -27,15 +30,17 @@
 #include "multicast.h"
 #include "status.h"
 #include "iir.h"
+#include "session.h"
+#include "metrics.h"
+#include "shm.h"
 
 #define BUFFERSIZE 16384  // Big enough for 120 ms @ 48 kHz stereo (11,520 16-bit samples)
 
 struct session {
-  struct session *prev;       // Linked list pointers
-  struct session *next; 
+  struct session_entry entry; // Session table linkage
   int type;                 // input RTP type (10,11)
   
-  struct sockaddr sender;
+  struct sockaddr_storage sender;
   char addr[NI_MAXHOST];    // RTP Sender IP address
   char port[NI_MAXSERV];    // RTP Sender source port
 
@@ -90,24 +95,28 @@ pthread_cond_t Input_ready_cond;
 
 int Status_fd = -1;           // Reading from radio status
 int Status_out_fd = -1;       // Writing to radio status
-int Input_fd = -1;            // Multicast receive socket
 int Output_fd = -1;           // Multicast receive socket
-struct session *Sessions;
-pthread_mutex_t Session_protect;
+struct session_table Sessions;
 uint64_t Output_packets;
 char *Name;
 char *Output;
 char *Input;
 char *Status;
+char *Metrics;                // Scrape endpoint, if any
+char Shm_name[256];           // radio's shared-memory segment, from --shm or its status; protected by Input_ready_mutex
+int Shm_fixed;                // Given with --shm, so radio's status doesn't override it
+int Input_ready;              // PCM_dest_address is known; protected by Input_ready_mutex
+struct shm_input PCM_input;   // Main thread only
 
 void closedown(int);
-struct session *lookup_session(const struct sockaddr *,uint32_t);
-struct session *create_session(void);
+struct session *create_session(struct sockaddr_storage const *,uint32_t);
 int close_session(struct session **);
 int send_samples(struct session *sp);
+int receive(void *,int,struct sockaddr_storage *);
 void *input(void *arg);
 void *encode(void *arg);
 void *status(void *);
+void opus_metrics(struct metrics *,void *);
 
 struct option Options[] =
   {
@@ -130,11 +139,13 @@ struct option Options[] =
    {"tos", required_argument, NULL, 'p'},
    {"iptos", required_argument, NULL, 'p'},
    {"ip-tos", required_argument, NULL, 'p'},    
+   {"metrics", required_argument, NULL, 'M'},
+   {"shm", required_argument, NULL, 'H'},
    {NULL, 0, NULL, 0},
 
   };
    
-char Optstring[] = "A:B:I:N:R:S:T:fo:vxp:";
+char Optstring[] = "A:B:H:I:M:N:R:S:T:fo:vxp:";
 
 struct sockaddr_storage Status_dest_address;
 struct sockaddr_storage Status_input_source_address;
@@ -157,9 +168,16 @@ int main(int argc,char * const argv[]){
     case 'B':
       Opus_blocktime = strtol(optarg,NULL,0);
       break;
+    case 'H':
+      strlcpy(Shm_name,optarg,sizeof(Shm_name));
+      Shm_fixed = 1;
+      break;
     case 'I':
       Input = optarg;
       break;
+    case 'M':
+      Metrics = optarg;
+      break;
     case 'N':
       Name = optarg;
       break;
@@ -194,7 +212,7 @@ int main(int argc,char * const argv[]){
       Application = OPUS_APPLICATION_VOIP;
       break;
     default:
-      fprintf(stderr,"Usage: %s [-l|-V] [-x] [-v] [-f] [-p tos] [-o bitrate] [-B blocktime] [-N name] [-T ttl] [-A iface] [-I input_mcast_address | -S input_status_address] -R output_mcast_address\n",argv[0]);
+      fprintf(stderr,"Usage: %s [-l|-V] [-x] [-v] [-f] [-p tos] [-o bitrate] [-B blocktime] [-N name] [-T ttl] [-A iface] [-M [host:]port|path] [-H shm-segment] [-I input_mcast_address | -S input_status_address] -R output_mcast_address\n",argv[0]);
       exit(1);
     }
   }
@@ -215,25 +233,25 @@ int main(int argc,char * const argv[]){
     exit(1);
   }
   
+  pthread_mutex_init(&Input_ready_mutex,NULL);
+  pthread_cond_init(&Input_ready_cond,NULL);
+  PCM_input.fd = -1;
   char iface[1024];
   if(Input){
     resolve_mcast(Input,&PCM_dest_address,DEFAULT_RTP_PORT,iface,sizeof(iface));
-    Input_fd = listen_mcast(&PCM_dest_address,NULL); // Port address already in place
-
-    if(Input_fd == -1){
+    if(shm_input_init(&PCM_input,Shm_name,&PCM_dest_address,NULL,-1) == -1){ // Port address already in place
       fprintf(stderr,"Can't resolve input PCM group %s\n",Input);
       Input = NULL; // but maybe the status will work, if specified
-    }
+    } else
+      Input_ready = 1;
   }
 
   if(Status){
-    pthread_mutex_init(&Input_ready_mutex,NULL);
-    pthread_cond_init(&Input_ready_cond,NULL);
     pthread_create(&Status_thread,NULL,status,NULL);
 
     // Wait until the status thread discovers the input PCM stream
     pthread_mutex_lock(&Input_ready_mutex);
-    while(Input_fd == -1)
+    while(!Input_ready)
       pthread_cond_wait(&Input_ready_cond,&Input_ready_mutex);
     pthread_mutex_unlock(&Input_ready_mutex);
   } else if(Input == NULL){
@@ -241,8 +259,6 @@ int main(int argc,char * const argv[]){
     exit(1);
   }
 
-  assert(Input_fd != -1);
-
   char service_name[1024];
   snprintf(service_name,sizeof(service_name),"%s (%s)",Name,Output);
   char description[1024];
@@ -270,7 +286,9 @@ int main(int argc,char * const argv[]){
   signal(SIGTERM,closedown);
   signal(SIGPIPE,SIG_IGN);
 
-  pthread_mutex_init(&Session_protect,NULL);
+  session_table_init(&Sessions,256,0); // Encoder threads time out on their own
+  if(Metrics != NULL)
+    metrics_start(Metrics,"ka9q_opus",opus_metrics,NULL);
   
   // Loop forever processing and dispatching incoming PCM packets
   // Process incoming RTP packets, demux to per-SSRC thread
@@ -285,16 +303,7 @@ int main(int argc,char * const argv[]){
     pkt->len = 0;
     
     struct sockaddr_storage sender;
-    socklen_t socksize = sizeof(sender);
-    int size = recvfrom(Input_fd,&pkt->content,sizeof(pkt->content),0,(struct sockaddr *)&sender,&socksize);
-    
-    if(size == -1){
-      if(errno != EINTR){ // Happens routinely, e.g., when window resized
-	perror("recvfrom");
-	usleep(1000);
-      }
-      continue;  // Reuse current buffer
-    }
+    int size = receive(&pkt->content,sizeof(pkt->content),&sender);
     if(size <= RTP_MIN_SIZE)
       continue; // Must be big enough for RTP header and at least some data
     
@@ -310,7 +319,7 @@ int main(int argc,char * const argv[]){
       continue; // Used to be an assert, but would be triggered by bogus packets
     
     // Find appropriate session; create new one if necessary
-    struct session *sp = lookup_session((const struct sockaddr *)&sender,pkt->rtp.ssrc);
+    struct session *sp = session_lookup(&Sessions,&sender,pkt->rtp.ssrc,0);
     if(!sp){
       // Not found
       int const samprate = samprate_from_pt(pkt->rtp.type);
@@ -320,12 +329,11 @@ int main(int argc,char * const argv[]){
       if(channels == 0)
 	continue; // Unknown channels
 
-      sp = create_session();
+      sp = create_session(&sender,pkt->rtp.ssrc);
       assert(sp != NULL);
       // Initialize
       getnameinfo((struct sockaddr *)&sender,sizeof(sender),sp->addr,sizeof(sp->addr),
 		    sp->port,sizeof(sp->port),NI_NOFQDN|NI_DGRAM);
-      memcpy(&sp->sender,&sender,sizeof(struct sockaddr));
       sp->rtp_state_out.ssrc = sp->rtp_state_in.ssrc = pkt->rtp.ssrc;
       sp->rtp_state_in.seq = pkt->rtp.seq; // Can cause a spurious drop indication if # pcm pkts != # opus pkts
       sp->rtp_state_in.timestamp = pkt->rtp.timestamp;
@@ -362,6 +370,23 @@ int main(int argc,char * const argv[]){
 }
 
 
+// Next PCM packet, from radio's shared memory once we know where it is, otherwise from the multicast group
+// Picks up any new group or segment the status thread found first. Returns its size, 0 if none came or on error
+int receive(void *buf,int bufsize,struct sockaddr_storage *sender){
+  pthread_mutex_lock(&Input_ready_mutex);
+  if(memcmp(&PCM_input.dest,&PCM_dest_address,sizeof(PCM_input.dest)) != 0 || strcmp(PCM_input.name,Shm_name) != 0){
+    shm_input_close(&PCM_input);
+    shm_input_init(&PCM_input,Shm_name,&PCM_dest_address,NULL,-1); // A failure is retried in shm_input_recv()
+  }
+  pthread_mutex_unlock(&Input_ready_mutex);
+  int const size = shm_input_recv(&PCM_input,buf,bufsize,sender,1000);
+  if(size == -1){
+    usleep(100000); // Can't join the group; try again
+    return 0;
+  }
+  return size;
+}
+
 // Monitor and report to radio status channel (only if specified)
 void * status(void *p){
   pthread_detach(pthread_self());
@@ -381,7 +406,7 @@ void * status(void *p){
     len = sizeof(Local_status_source_address);
     getsockname(Status_out_fd,(struct sockaddr *)&Local_status_source_address,&len);
   }
-  if(Input_fd == -1){
+  if(!Input_ready){
     // Timeout reads so we'll poll until we get a radio status message wth the PCM stream socket
     struct timeval timeout;
     timeout.tv_sec = 1;
@@ -448,18 +473,10 @@ void * status(void *p){
 	    if(Verbose)
 	      fprintf(stderr,"Listening for PCM on %s\n",formatsock(&dest_temp));
 
-	    int const fd = listen_mcast(&dest_temp,NULL); // Port address already in place
-	    if(fd == -1){
-	      if(Verbose){
-		fprintf(stderr,"Multicast listen on %s failed\n",formatsock(&dest_temp));
-	      }
-	      break;
-	    }
+	    // The main thread joins it, or finds it in shared memory
 	    pthread_mutex_lock(&Input_ready_mutex);
-	    if(Input_fd != -1)
-	      close(Input_fd);
-	    Input_fd = fd;
 	    memcpy(&PCM_dest_address,&dest_temp,sizeof(dest_temp));
+	    Input_ready = 1;
 	    pthread_cond_broadcast(&Input_ready_cond);
 	    pthread_mutex_unlock(&Input_ready_mutex);
 	    
@@ -470,6 +487,15 @@ void * status(void *p){
 	    setsockopt(Status_fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
 	  }
 	  break;
+	case OUTPUT_SHM: // radio also has its streams in shared memory; the main loop will switch to it
+	  if(!Shm_fixed){
+	    char name[sizeof(Shm_name)];
+	    decode_string(cp,optlen,name,sizeof(name));
+	    pthread_mutex_lock(&Input_ready_mutex);
+	    strlcpy(Shm_name,name,sizeof(Shm_name));
+	    pthread_mutex_unlock(&Input_ready_mutex);
+	  }
+	  break;
 	default:  // Ignore all others for now
 	  break;
 	}
@@ -591,47 +617,18 @@ void *encode(void *arg){
   }
 }
 
-struct session *lookup_session(const struct sockaddr * const sender,const uint32_t ssrc){
-  struct session *sp;
-  pthread_mutex_lock(&Session_protect);
-  for(sp = Sessions; sp != NULL; sp = sp->next){
-    if(sp->rtp_state_in.ssrc == ssrc && memcmp(&sp->sender,sender,sizeof(*sender)) == 0){
-      // Found it
-      if(sp->prev != NULL){
-	// Not at top of list; move it there
-	if(sp->next != NULL)
-	  sp->next->prev = sp->prev;
-
-	sp->prev->next = sp->next;
-	sp->prev = NULL;
-	sp->next = Sessions;
-	Sessions->prev = sp;
-	Sessions = sp;
-      }
-      break;
-    }
-  }
-  pthread_mutex_unlock(&Session_protect);
-  return sp;
-}
-// Create a new session, partly initialize
-struct session *create_session(void){
+// Create a new session, partly initialize, and enter it in the session table
+struct session *create_session(struct sockaddr_storage const * const sender,uint32_t const ssrc){
 
   struct session * const sp = calloc(1,sizeof(*sp));
   assert(sp != NULL); // Shouldn't happen on modern machines!
   
   // Initialize entry
+  memcpy(&sp->sender,sender,sizeof(sp->sender));
   pthread_mutex_init(&sp->qmutex,NULL);
   pthread_cond_init(&sp->qcond,NULL);
 
-  // Put at head of list
-  pthread_mutex_lock(&Session_protect);
-  sp->prev = NULL;
-  sp->next = Sessions;
-  if(sp->next != NULL)
-    sp->next->prev = sp;
-  Sessions = sp;
-  pthread_mutex_unlock(&Session_protect);
+  session_insert(&Sessions,&sp->entry,sp,sender,ssrc,0);
   return sp;
 }
 
@@ -657,31 +654,13 @@ int close_session(struct session ** p){
   pthread_mutex_unlock(&sp->qmutex);
   pthread_mutex_destroy(&sp->qmutex);
 
-  // Remove from linked list of sessions
-  pthread_mutex_lock(&Session_protect);
-  if(sp->next != NULL)
-    sp->next->prev = sp->prev;
-  if(sp->prev != NULL)
-    sp->prev->next = sp->next;
-  else
-    Sessions = sp->next;
-  pthread_mutex_unlock(&Session_protect);
+  session_remove(&Sessions,&sp->entry);
   free(sp);
   *p = NULL;
   return 0;
 }
 void closedown(int s){
-#if 0
-  // Causes deadlock when we get called from a section where Session_protect is already locked
-  // Which is the usual case
-  // Not really necessary anyway, since we're exiting
-  pthread_mutex_lock(&Session_protect);
-  while(Sessions != NULL)
-    close_session(Sessions);
-  pthread_mutex_unlock(&Session_protect);
-#endif
-
-  pthread_mutex_destroy(&Session_protect);
+  // Don't bother closing sessions; the session table lock may be held, and we're exiting anyway
   exit(0);
 }
 // Encode and send one or more Opus frames when we have enough
@@ -764,3 +743,57 @@ int send_samples(struct session * const sp){
   }
   return pcm_samples_written;
 }
+
+// Per-session counters, copied out under the session table lock
+struct session_counts {
+  uint32_t ssrc;
+  long long packets_in;
+  long long drops;
+  long long dupes;
+  long long packets_out;
+};
+struct session_list {
+  struct session_counts *list;
+  int count;
+  int size;
+};
+
+static void copy_counts(void *owner,void *arg){
+  struct session const * const sp = (struct session *)owner;
+  struct session_list * const sl = (struct session_list *)arg;
+  if(sl->count == sl->size){
+    sl->size = 2 * sl->size + 16;
+    sl->list = realloc(sl->list,sl->size * sizeof(*sl->list));
+    assert(sl->list != NULL);
+  }
+  struct session_counts * const cp = &sl->list[sl->count++];
+  cp->ssrc = sp->entry.ssrc;
+  cp->packets_in = sp->rtp_state_in.packets;
+  cp->drops = sp->rtp_state_in.drops;
+  cp->dupes = sp->rtp_state_in.dupes;
+  cp->packets_out = sp->rtp_state_out.packets;
+}
+
+// Collect function for the metrics endpoint (--metrics)
+void opus_metrics(struct metrics * const m,void *arg){
+  metric_family(m,"output_packets_total","counter","Opus packets sent, all sessions");
+  metric(m,"output_packets_total",Output_packets,NULL);
+
+  struct session_list sl = { NULL, 0, 0 };
+  session_walk(&Sessions,copy_counts,&sl);
+  metric_family(m,"sessions","gauge","Streams being encoded");
+  metric(m,"sessions",sl.count,NULL);
+  metric_family(m,"session_packets_in_total","counter","PCM packets received");
+  for(int i=0; i < sl.count; i++)
+    metric(m,"session_packets_in_total",sl.list[i].packets_in,"ssrc=\"%u\"",sl.list[i].ssrc);
+  metric_family(m,"session_drops_total","counter","PCM packets lost or out of sequence");
+  for(int i=0; i < sl.count; i++)
+    metric(m,"session_drops_total",sl.list[i].drops,"ssrc=\"%u\"",sl.list[i].ssrc);
+  metric_family(m,"session_dupes_total","counter","Duplicate PCM packets");
+  for(int i=0; i < sl.count; i++)
+    metric(m,"session_dupes_total",sl.list[i].dupes,"ssrc=\"%u\"",sl.list[i].ssrc);
+  metric_family(m,"session_packets_out_total","counter","Opus packets sent");
+  for(int i=0; i < sl.count; i++)
+    metric(m,"session_packets_out_total",sl.list[i].packets_out,"ssrc=\"%u\"",sl.list[i].ssrc);
+  free(sl.list);
+}
@@ -15,12 +15,13 @@
 #include <netdb.h>
 #include <getopt.h>
 
-#include "osc.h"
 #include "filter.h"
 #include "misc.h"
 #include "multicast.h"
 #include "ax25.h"
 #include "status.h"
+#include "session.h"
+#include "shm.h"
 
 struct hdlc {
   unsigned char frame[16384];
@@ -30,16 +31,53 @@ struct hdlc {
 };
 static int hdlc_process(struct hdlc *hp,int bit);
 
+#define RING_SIZE 65536     // Samples buffered per session, power of 2; > 1 sec @ 48 kHz
+
+// Where a session stands with the worker pool; protected by Work_mutex
+enum work_state {
+  IDLE = 0,   // Not queued; input thread queues us when a block is ready
+  QUEUED,     // On work queue
+  RUNNING,    // A worker has us
+  RERUN,      // More data arrived while running; requeue when done
+};
+
 // Needs to be redone with common RTP receiver module
 struct session {
-  struct session *next; 
+  struct session_entry entry; // Must be first
   
   struct rtp_state rtp_state_in;
   struct rtp_state rtp_state_out;
   int samprate;
-  int write_fd,read_fd;
 
-  pthread_t decode_thread;
+  // Single producer (input thread), single consumer (whichever worker holds the session)
+  int16_t ring[RING_SIZE];    // Host byte order
+  unsigned int ring_head;     // Written only by input thread
+  unsigned int ring_tail;     // Written only by worker
+  unsigned int overruns;      // Samples dropped because ring was full
+
+  enum work_state state;
+  struct session *work_next;  // Work queue link
+  int dead;                   // Reaped; the worker holding it frees it
+
+  // Demodulator state, touched only by the worker holding the session
+  struct filter_in *filter_in;
+  struct filter_out *filter_out;
+  complex float *mark_tab;    // One block of tone replicas, -1200 and -2200 Hz
+  complex float *space_tab;
+  complex float mark_phase;   // Replica phase at start of block
+  complex float space_phase;
+  complex float mark_step;    // Phase advance per block
+  complex float space_step;
+  float complex mark_accum;   // On-time integrators
+  float complex space_accum;
+  float complex mark_offset_accum; // Straddle previous zero crossing
+  float complex space_offset_accum;
+  float last_val;             // Last on-time symbol
+  float mid_val;              // Last zero crossing symbol
+  int symphase;
+  int samppbit;
+  int pad;                    // Blocks of zeroes still to flush through filter
+
   unsigned int decoded_packets;
   struct hdlc hdlc;
 };
@@ -50,17 +88,22 @@ static float const SCALE = 1./32768;
 static int const AL = 960; // 20 ms @ 48 kHz = 1x 20 ms blocks = 24 bit times @ 1200 bps
 static int const AM = 961;
 static float Bitrate = 1200;
+static int const Max_pad = 1920; // Pad only a short interruption, max
 
 // Command line params
 int Verbose;
 int IP_tos = 0;
 int Mcast_ttl = 10;           // Very low intensity output
+static int Nworkers = 2;      // Demodulator threads shared by all sessions
+static int Timeout = 300;     // Reap sessions idle this many seconds; 0 = never
 
 // Global variables
 static int Nfds;          // Number of PCM streams
 static fd_set Fdset_template; // Mask for select()
 static int Max_fd = 2;        // Highest number fd for select()
 static int Input_fd[MAX_MCAST];    // Multicast receive sockets
+static struct sockaddr_storage Input_dest[MAX_MCAST]; // Their groups
+static char const *Shm_name;  // radio's shared-memory segment, read instead of the network when there's one group
 static pthread_t Input_thread;
 
 static int Output_fd = -1;
@@ -68,20 +111,29 @@ static int Status_fd = -1;
 #if 0
 static int Status_out_fd = -1; // Not used yet
 #endif
-static struct session *Session;
+static struct session_table Sessions;
 static pthread_mutex_t Output_mutex;
+
+// Sessions with a block or more of samples waiting, FIFO
+static pthread_mutex_t Work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Work_cond = PTHREAD_COND_INITIALIZER;
+static struct session *Work_head;
+static struct session *Work_tail;
 struct sockaddr_storage Status_dest_address;
 struct sockaddr_storage Status_input_source_address;
 struct sockaddr_storage Local_status_source_address;
 struct sockaddr_storage PCM_dest_address; // From incoming status messages (max 1)
 
-static struct session *lookup_session(const uint32_t ssrc);
-static struct session *create_session(uint32_t ssrc);
-#if 0
+static struct session *create_session(struct sockaddr_storage const *sender,uint32_t ssrc);
 static int close_session(struct session *sp);
-#endif
+static void reap_session(void *arg);
+static void free_session(struct session *sp);
+static void schedule(struct session *sp);
 static void *input(void *arg);
-static void *decode_task(void *arg);
+static void process_packet(unsigned char const *buffer,int size,struct sockaddr_storage const *sender);
+static int ring_put(struct session *sp,unsigned char const *dp,int count);
+static void *worker(void *arg);
+static void demod_block(struct session *sp,int16_t const *samples);
 static void printtime(FILE *fp);
 
 static struct option Options[] =
@@ -91,8 +143,11 @@ static struct option Options[] =
    {"ax25-out", required_argument, NULL, 'R'},
    {"name", required_argument, NULL, 'N'},
    {"status-in", required_argument, NULL, 'S'},
+   {"shm", required_argument, NULL, 'H'},
    {"ttl", required_argument, NULL, 'T'},
+   {"timeout", required_argument, NULL, 't'},
    {"verbose", no_argument, NULL, 'v'},
+   {"workers", required_argument, NULL, 'w'},
 #if 0
    {"samprate",required_argument,NULL,'r'},
    {"samplerate",required_argument,NULL,'r'},
@@ -103,7 +158,7 @@ static struct option Options[] =
    {NULL, 0, NULL, 0},
   };
 
-static char Optstring[] = "A:I:N:R:S:T:vp:";
+static char Optstring[] = "A:H:I:N:R:S:T:t:vp:w:";
 char *Name;
 char *Output;
 char *Input[MAX_MCAST];
@@ -140,7 +195,7 @@ int main(int argc,char *argv[]){
 	break;
       }
       Input[Nfds] = optarg;
-      Input_fd[Nfds] = setup_mcast_in(optarg,NULL,0);
+      Input_fd[Nfds] = setup_mcast_in(optarg,(struct sockaddr *)&Input_dest[Nfds],0);
       if(Input_fd[Nfds] == -1){
 	fprintf(stdout,"Can't set up input %s\n",optarg);
 	break;
@@ -154,6 +209,9 @@ int main(int argc,char *argv[]){
     case 'R':
       Output = optarg;
       break;
+    case 'H':
+      Shm_name = optarg;
+      break;
     case 'S':
       if(Nfds != 0){
 	fprintf(stdout,"--status-in ignored when --pcm-in specified\n");
@@ -184,12 +242,20 @@ n	getsockname(Status_out_fd,(struct sockaddr *)&Local_status_source_address,&len
     case 'T':
       Mcast_ttl = strtol(optarg,NULL,0);
       break;
+    case 't':
+      Timeout = strtol(optarg,NULL,0);
+      break;
+    case 'w':
+      Nworkers = strtol(optarg,NULL,0);
+      if(Nworkers < 1)
+	Nworkers = 1;
+      break;
     case 'v':
       Verbose++;
       break;
       break;
     default:
-      fprintf(stdout,"Usage: %s [--verbose|-v] [--ttl|-T mcast_ttl] [--pcm-in|-I input_mcast_address [--pcm-in|-I address2]] [--ax25-out|-R output_mcast_address] [input_address ...]\n",argv[0]);
+      fprintf(stdout,"Usage: %s [--verbose|-v] [--ttl|-T mcast_ttl] [--workers|-w n] [--timeout|-t sec] [--shm|-H shm-segment] [--pcm-in|-I input_mcast_address [--pcm-in|-I address2]] [--ax25-out|-R output_mcast_address] [input_address ...]\n",argv[0]);
       exit(1);
     }
   }
@@ -201,7 +267,7 @@ n	getsockname(Status_out_fd,(struct sockaddr *)&Local_status_source_address,&len
       break;
     }
     Input[Nfds] = argv[i];
-    Input_fd[Nfds] = setup_mcast_in(Input[Nfds],NULL,0);
+    Input_fd[Nfds] = setup_mcast_in(Input[Nfds],(struct sockaddr *)&Input_dest[Nfds],0);
     if(Input_fd[Nfds] == -1){
       fprintf(stdout,"Can't set up input %s\n",Input[Nfds]);
       continue;
@@ -241,6 +307,11 @@ n	getsockname(Status_out_fd,(struct sockaddr *)&Local_status_source_address,&len
 
 
   pthread_mutex_init(&Output_mutex,NULL);
+  session_table_init(&Sessions,64,Timeout);
+  for(int i=0; i < Nworkers; i++){
+    pthread_t t;
+    pthread_create(&t,NULL,worker,NULL);
+  }
 
   if(Nfds > 0)
     pthread_create(&Input_thread,NULL,input,NULL);
@@ -291,7 +362,8 @@ n	getsockname(Status_out_fd,(struct sockaddr *)&Local_status_source_address,&len
 	      fprintf(stdout,"joining pcm input channel %s\n",formatsock(&PCM_dest_address));
 	    }
 
-	    Input_fd[Nfds] = setup_mcast_in(NULL,(struct sockaddr *)&PCM_dest_address,0);
+	    memcpy(&Input_dest[Nfds],&PCM_dest_address,sizeof(Input_dest[Nfds]));
+	    Input_fd[Nfds] = setup_mcast_in(NULL,(struct sockaddr *)&Input_dest[Nfds],0);
 	    if(Input_fd[Nfds] != -1){
 	      Max_fd = max(Max_fd,Input_fd[Nfds]);
 	      FD_SET(Input_fd[Nfds],&Fdset_template);
@@ -312,308 +384,470 @@ n	getsockname(Status_out_fd,(struct sockaddr *)&Local_status_source_address,&len
 
 // Process input PCM
 // audio input thread
-// Receive audio multicasts, multiplex into sessions
+// Receive audio multicasts, or take them from radio's shared memory, and multiplex into sessions
 static void *input(void *arg){
-
+  if(Shm_name != NULL && Nfds == 1){
+    // A shared-memory reader follows one group, so this works only when we're listening to one
+    struct shm_input in;
+    shm_input_init(&in,Shm_name,&Input_dest[0],Default_mcast_iface,Input_fd[0]);
+    Input_fd[0] = -1; // It's in charge of the socket now
+    while(1){
+      struct sockaddr_storage sender;
+      unsigned char buffer[PKTSIZE];
+      // Wake up now and then to reap idle sessions even if everything's quiet
+      int const size = shm_input_recv(&in,buffer,sizeof(buffer),&sender,1000);
+      if(size < 0)
+	break;
+      session_expire(&Sessions,reap_session);
+      if(size > 0)
+	process_packet(buffer,size,&sender);
+    }
+    shm_input_close(&in);
+    return NULL;
+  }
   while(1){
-    struct rtp_header rtp_hdr;
-    struct sockaddr sender;
+    struct sockaddr_storage sender;
+    unsigned char buffer[PKTSIZE];
 
-    // Wait for traffic to arrive
+    // Wait for traffic to arrive; wake up now and then to reap idle sessions even if everything's quiet
     fd_set fdset = Fdset_template;
-    int s = select(Max_fd+1,&fdset,NULL,NULL,NULL);
+    struct timeval tv = {1,0};
+    int s = select(Max_fd+1,&fdset,NULL,NULL,&tv);
     if(s < 0 && errno != EAGAIN && errno != EINTR)
       break;
-    if(s == 0)
-      continue; // Nothing arrived; probably just an ignored signal
+    session_expire(&Sessions,reap_session);
+    if(s <= 0)
+      continue; // Nothing arrived; timeout or an ignored signal
 
     for(int fd_index = 0;fd_index < Nfds;fd_index++){
       if(Input_fd[fd_index] == -1 || !FD_ISSET(Input_fd[fd_index],&fdset))
 	continue;
 
-      unsigned char buffer[PKTSIZE];
       socklen_t socksize = sizeof(sender);
-      int size = recvfrom(Input_fd[fd_index],buffer,sizeof(buffer),0,&sender,&socksize);
-      if(size == -1){
+      int const len = recvfrom(Input_fd[fd_index],buffer,sizeof(buffer),0,(struct sockaddr *)&sender,&socksize);
+      if(len == -1){
 	if(errno != EINTR){ // Happens routinely
 	  perror("recvfrom");
 	  usleep(1000); // avoid tight loop
 	}
 	continue;
       }
-      if(size < RTP_MIN_SIZE)
-	continue; // Too small to be valid RTP
-
-      // Extract RTP header
-      unsigned char const *dp = buffer;
-      dp = ntoh_rtp(&rtp_hdr,dp);
-      size -= dp - buffer;
-      
-      if(rtp_hdr.pad){
-	// Remove padding
-	size -= dp[size-1];
-	rtp_hdr.pad = 0;
-      }
-      if(size < 0)
-	continue; // garbled RTP header?
-      
-      // Should distinguish between these with different filter balances
-      if(channels_from_pt(rtp_hdr.type) != 1)
-	continue; // Only mono PCM for now
-      
-      struct session *sp = lookup_session(rtp_hdr.ssrc);
-      if(sp == NULL){
-	// Not found
-	if((sp = create_session(rtp_hdr.ssrc)) == NULL){
-	  printtime(stdout);
-	  fprintf(stdout," No room for new session ssrc %u\n",rtp_hdr.ssrc);
-	  fflush(stdout);
-	  continue;
-	}
-	sp->rtp_state_out.ssrc = sp->rtp_state_in.ssrc = rtp_hdr.ssrc;
-	// Extract sample rate (what it if later changes??)
-	sp->samprate = samprate_from_pt(rtp_hdr.type);
-	int fildes[2];
-	if(pipe(fildes) != 0){
-	  if(Verbose)
-	    perror("pipe() failed");
-	  continue;
-	}
-	sp->read_fd = fildes[0]; sp->write_fd = fildes[1];
-
-	pthread_create(&sp->decode_thread,NULL,decode_task,sp); // One decode thread per stream
-	if(Verbose){
-	  printtime(stdout);
-	  fprintf(stdout," New session from %s, ssrc %u\n",formatsock(&sender),sp->rtp_state_in.ssrc);
-	  fflush(stdout);
-	}
-      }
-      int sample_count = size / sizeof(signed short); // 16-bit sample count
-      int skipped_samples = rtp_process(&sp->rtp_state_in,&rtp_hdr,sample_count);
-      if(rtp_hdr.marker)
-	skipped_samples = 0; // Ignore samples skipped before mark
-
-      if(Verbose && skipped_samples != 0){
-	printtime(stdout);
-	fprintf(stdout," skipped samples %d\n",skipped_samples); fflush(stdout);
-      }
-      if(skipped_samples < 0)
-	continue;	// Drop probable duplicate(s)
-
-      if(skipped_samples > 0){
-	// Don't worry too much about skipped samples right now
-	// There's no FEC, and enough are probably dropped that sync wouldn't be maintained anyway
-	int max_skip = min(skipped_samples,1920); // Pad only a short interruption, max
-	int16_t zeroes[max_skip];
-	memset(zeroes,0,sizeof(zeroes));
-	if(write(sp->write_fd,zeroes,sizeof(zeroes)) != sizeof(zeroes))
-	  perror("write zeroes");
-      }
-      if(write(sp->write_fd,dp,sample_count * sizeof(int16_t)) != sample_count * sizeof(int16_t))
-	perror("write samples");
+      process_packet(buffer,len,&sender);
     }
   }
   return NULL; // Never gets here
 }
 
+// Demultiplex one RTP packet into its session's sample ring
+static void process_packet(unsigned char const *buffer,int size,struct sockaddr_storage const *sender){
+  struct rtp_header rtp_hdr;
 
+  if(size < RTP_MIN_SIZE)
+    return; // Too small to be valid RTP
 
-// Find existing session in table, if it exists
-static struct session *lookup_session(const uint32_t ssrc){
-  struct session *sp;
-  for(sp = Session; sp != NULL; sp = sp->next){
-    if(sp->rtp_state_in.ssrc == ssrc)
-      // Found it
-      return sp;
+  // Extract RTP header
+  unsigned char const *dp = buffer;
+  dp = ntoh_rtp(&rtp_hdr,dp);
+  size -= dp - buffer;
+
+  if(rtp_hdr.pad){
+    // Remove padding
+    size -= dp[size-1];
+    rtp_hdr.pad = 0;
   }
-  return NULL;
+  if(size < 0)
+    return; // garbled RTP header?
+
+  // Should distinguish between these with different filter balances
+  if(channels_from_pt(rtp_hdr.type) != 1)
+    return; // Only mono PCM for now
+
+  struct session *sp = session_lookup(&Sessions,sender,rtp_hdr.ssrc,0);
+  if(sp == NULL){
+    // Not found
+    int const samprate = samprate_from_pt(rtp_hdr.type);
+    if(samprate < Bitrate)
+      return; // Unknown or unusable payload type
+    if((sp = create_session(sender,rtp_hdr.ssrc)) == NULL){
+      printtime(stdout);
+      fprintf(stdout," No room for new session ssrc %u\n",rtp_hdr.ssrc);
+      fflush(stdout);
+      return;
+    }
+    sp->rtp_state_out.ssrc = sp->rtp_state_in.ssrc = rtp_hdr.ssrc;
+    // Extract sample rate (what it if later changes??)
+    sp->samprate = samprate;
+    if(Verbose){
+      printtime(stdout);
+      fprintf(stdout," New session from %s, ssrc %u\n",formatsock(sender),sp->rtp_state_in.ssrc);
+      fflush(stdout);
+    }
+  }
+  session_touch(&Sessions,&sp->entry);
+  int sample_count = size / sizeof(signed short); // 16-bit sample count
+  int skipped_samples = rtp_process(&sp->rtp_state_in,&rtp_hdr,sample_count);
+  if(rtp_hdr.marker)
+    skipped_samples = 0; // Ignore samples skipped before mark
+
+  if(Verbose && skipped_samples != 0){
+    printtime(stdout);
+    fprintf(stdout," skipped samples %d\n",skipped_samples); fflush(stdout);
+  }
+  if(skipped_samples < 0)
+    return; // Drop probable duplicate(s)
+
+  // Don't worry too much about skipped samples right now
+  // There's no FEC, and enough are probably dropped that sync wouldn't be maintained anyway
+  if(skipped_samples > 0)
+    ring_put(sp,NULL,min(skipped_samples,Max_pad));
+  if(ring_put(sp,dp,sample_count) >= AL)
+    schedule(sp);
+}
+
+// Append samples in network byte order to a session's ring; dp == NULL appends zeroes
+// Never blocks the input thread: whatever doesn't fit is counted and dropped
+// Returns the number of samples now waiting
+static int ring_put(struct session * const sp,unsigned char const *dp,int count){
+  unsigned int const head = sp->ring_head;
+  unsigned int const tail = __atomic_load_n(&sp->ring_tail,__ATOMIC_ACQUIRE);
+  int const space = RING_SIZE - (head - tail);
+
+  if(count > space){
+    if(Verbose && sp->overruns == 0){
+      printtime(stdout);
+      fprintf(stdout," ssrc %u ring overrun\n",sp->rtp_state_in.ssrc);
+      fflush(stdout);
+    }
+    sp->overruns += count - space;
+    count = space;
+  }
+  for(int i=0; i < count; i++){
+    int16_t sample = 0;
+    if(dp != NULL){
+      sample = (dp[0] << 8) | dp[1];
+      dp += 2;
+    }
+    sp->ring[(head + i) & (RING_SIZE-1)] = sample;
+  }
+  __atomic_store_n(&sp->ring_head,head + count,__ATOMIC_RELEASE);
+  return head + count - tail;
 }
 
 // Create a new session, partly initialize
-static struct session *create_session(uint32_t ssrc){
+static struct session *create_session(struct sockaddr_storage const *sender,uint32_t ssrc){
   struct session *sp;
 
   if((sp = calloc(1,sizeof(*sp))) == NULL)
     return NULL; // Shouldn't happen on modern machines!
   
   sp->rtp_state_in.ssrc = ssrc;
-
-  // Put at head of bucket chain
-  sp->next = Session;
-  Session = sp;
+  sp->state = IDLE;
+  session_insert(&Sessions,&sp->entry,sp,sender,ssrc,0);
   return sp;
 }
 
-#if 0
-// Remove a session entry. Not yet used, so sessions keep growing
+// Remove a session entry from the lookup table
 static int close_session(struct session *sp){
   if(sp == NULL)
     return -1;
   
-  // Remove from linked list
-  struct session *se,*se_prev = NULL;
-  for(se = Session; se && se != sp; se_prev = se,se = se->next)
-    ;
-  if(!se)
-    return -1;
-  
-  if(se == sp){
-    if(se_prev)
-      se_prev->next = sp->next;
-    else
-      Session = se_prev;
+  return session_remove(&Sessions,&sp->entry);
+}
+
+// Called from session_expire() in the input thread after the entry has left the table,
+// so no more samples will arrive. A worker may still hold the session; if so it frees it when done
+static void reap_session(void *arg){
+  struct session * const sp = arg;
+  assert(sp != NULL);
+  if(Verbose){
+    pthread_mutex_lock(&Output_mutex);
+    printtime(stdout);
+    fprintf(stdout," ssrc %u idle, closing; %u packets decoded, %u samples overrun\n",
+	    sp->rtp_state_in.ssrc,sp->decoded_packets,sp->overruns);
+    fflush(stdout);
+    pthread_mutex_unlock(&Output_mutex);
   }
-  return 0;
+  pthread_mutex_lock(&Work_mutex);
+  sp->dead = 1;
+  int const idle = (sp->state == IDLE);
+  pthread_mutex_unlock(&Work_mutex);
+  if(idle)
+    free_session(sp);
 }
-#endif
 
-const float mark_tone = 1200;
-const float space_tone = 2200;
+static void free_session(struct session *sp){
+  if(sp == NULL)
+    return;
+  close_session(sp); // Normally already out of the table
+  delete_filter_output(&sp->filter_out); // Output before input
+  delete_filter_input(&sp->filter_in);
+  fftwf_free(sp->mark_tab);
+  fftwf_free(sp->space_tab);
+  free(sp);
+}
 
-// AFSK demod
-static void *decode_task(void *arg){
-  const float twist = mark_tone/space_tone; // Scale back upper tone from FM demod
+// Put session on the work queue; caller holds Work_mutex
+static void enqueue(struct session * const sp){
+  sp->state = QUEUED;
+  sp->work_next = NULL;
+  if(Work_tail)
+    Work_tail->work_next = sp;
+  else
+    Work_head = sp;
+  Work_tail = sp;
+  pthread_cond_signal(&Work_cond);
+}
 
-  pthread_setname("afsk");
-  struct session *sp = (struct session *)arg;
-  assert(sp != NULL);
+// Called by input thread when a session has at least a block waiting
+static void schedule(struct session * const sp){
+  pthread_mutex_lock(&Work_mutex);
+  switch(sp->state){
+  case IDLE:
+    enqueue(sp);
+    break;
+  case RUNNING:
+    sp->state = RERUN; // Worker might have just checked the ring; make it look again
+    break;
+  default:
+    break;
+  }
+  pthread_mutex_unlock(&Work_mutex);
+}
+
+const float mark_tone = 1200;
+const float space_tone = 2200;
 
-  struct filter_in *filter_in = create_filter_input(AL,AM,REAL);
-  struct filter_out *filter_out = create_filter_output(filter_in,NULL,AL,COMPLEX);
+// Build this session's filter and tone tables on first use, in a worker rather than the input thread
+static int setup_demod(struct session * const sp){
+  sp->filter_in = create_filter_input(AL,AM,REAL);
+  if(sp->filter_in == NULL)
+    return -1;
+  sp->filter_in->inline_fft = 1; // Too many sessions, and too small an FFT, to give each its own thread
+  sp->filter_out = create_filter_output(sp->filter_in,NULL,AL,COMPLEX);
+  if(sp->filter_out == NULL)
+    return -1;
   const float filter_low = min(mark_tone,space_tone) - Bitrate/4;
   const float filter_high = max(mark_tone,space_tone) + Bitrate/4;
-  set_filter(filter_out,filter_low/sp->samprate,filter_high/sp->samprate,3.0); // Creates analytic, band-limited signal
-
-  // Tone replica generators (-1200 and -2200 Hz)
-  struct osc mark;
-  memset(&mark,0,sizeof(mark));
-  set_osc(&mark,-mark_tone/sp->samprate, 0.0);
-  
-  struct osc space;
-  memset(&space,0,sizeof(space));
-  set_osc(&space,-space_tone/sp->samprate, 0.0);  
-    
-  int samppbit = sp->samprate / Bitrate;
-
-  // Tone integrators
-  int symphase = 0;
-  float complex mark_accum = 0; // On-time
-  float complex space_accum = 0;
-  float complex mark_offset_accum = 0; // Straddles previous zero crossing
-  float complex space_offset_accum = 0;
-  float last_val = 0;  // Last on-time symbol
-  float mid_val = 0;   // Last zero crossing symbol
-
-  FILE *fp = fdopen(sp->read_fd,"r");
-  if(fp == NULL){
-    perror("fdopen");
-    return NULL;
+  set_filter(sp->filter_out,filter_low/sp->samprate,filter_high/sp->samprate,3.0); // Creates analytic, band-limited signal
+
+  // Tone replicas for one output block, stored as separate real and imaginary parts for the vector loop
+  // Successive blocks are brought into phase by one complex rotation per block
+  int const olen = sp->filter_out->olen;
+  sp->mark_tab = fftwf_alloc_complex(olen);
+  sp->space_tab = fftwf_alloc_complex(olen);
+  float * const mt = (float *)sp->mark_tab;
+  float * const st = (float *)sp->space_tab;
+  for(int n=0; n < olen; n++){
+    complex double const m = cispi(-2.0 * mark_tone * n / sp->samprate);
+    complex double const s = cispi(-2.0 * space_tone * n / sp->samprate);
+    mt[n] = creal(m);
+    mt[olen + n] = cimag(m);
+    st[n] = creal(s);
+    st[olen + n] = cimag(s);
   }
+  sp->mark_step = cispi(-2.0 * mark_tone * olen / sp->samprate);
+  sp->space_step = cispi(-2.0 * space_tone * olen / sp->samprate);
+  sp->mark_phase = sp->space_phase = 1;
+  sp->samppbit = sp->samprate / Bitrate;
+  return 0;
+}
 
-  int pad = 0;
-
+// Demodulate everything waiting in the session's ring
+static void run_session(struct session * const sp){
+  if(sp->filter_in == NULL && setup_demod(sp) != 0){
+    // Can't demodulate; discard so the ring doesn't just sit full
+    __atomic_store_n(&sp->ring_tail,__atomic_load_n(&sp->ring_head,__ATOMIC_ACQUIRE),__ATOMIC_RELEASE);
+    return;
+  }
   while(1){
-    signed short samples[AL];
-
-    if(pad > 0){
-      pad--;
+    int16_t samples[AL];
+    if(sp->pad > 0){
+      sp->pad--;
       memset(samples,0,sizeof(samples));
-    } else {
-      if(fread(samples,sizeof(samples[0]),AL,fp) != AL){
-	fprintf(stderr,"pipe read error, exiting thread\n");
-	fclose(fp);
- 	break;
-      }
-      // Look for 100 zeroes at end of frame to indicate squelch closing
-      int nonzero = 0;
-      for(int i=AL-100; i < AL; i++)
-	nonzero |= samples[i];
-      if(!nonzero)
-	pad = 5; // flush filters with 5 blocks of padding
+      demod_block(sp,samples);
+      continue;
     }
+    unsigned int const tail = sp->ring_tail;
+    unsigned int const head = __atomic_load_n(&sp->ring_head,__ATOMIC_ACQUIRE);
+    if(head - tail < AL)
+      break;
+    for(int i=0; i < AL; i++)
+      samples[i] = sp->ring[(tail + i) & (RING_SIZE-1)];
+    __atomic_store_n(&sp->ring_tail,tail + AL,__ATOMIC_RELEASE);
+
+    // Look for 100 zeroes at end of frame to indicate squelch closing
+    int nonzero = 0;
+    for(int i=AL-100; i < AL; i++)
+      nonzero |= samples[i];
+    if(!nonzero)
+      sp->pad = 5; // flush filters with 5 blocks of padding
+    demod_block(sp,samples);
+  }
+}
 
-    assert(filter_in->ilen == AL);
-    assert(filter_out->olen == AL);
-    for(int n=0; n < AL; n++){
-      if(write_rfilter(filter_in,ntohs(samples[n]) * SCALE) == 0)
-	continue;
-      execute_filter_output(filter_out,0);    // Shouldn't block
-      for(int n=0; n<filter_out->olen; n++){
-	// Spin down by mark and space frequencies, accumulate each in boxcar (comb) filters
-	// Mark and space each have in-phase and offset integrators for timing recovery
-	float complex s;
-	s = filter_out->output.c[n] * step_osc(&mark);
-	mark_accum += s;
-	mark_offset_accum += s;
-	
-	s = filter_out->output.c[n] * step_osc(&space);
-	space_accum += s;
-	space_offset_accum += s;
-	
-	if(++symphase == samppbit/2){
-	  // Finish offset integrator and reset
-	  mid_val = cnrmf(mark_offset_accum) - twist * cnrmf(space_offset_accum);
-	  mark_offset_accum = space_offset_accum = 0;
-	}
-	if(symphase < samppbit)
-	  continue;
-	
-	// Finished whole bit
-	float cur_val = cnrmf(mark_accum) - twist * cnrmf(space_accum);
-	mark_accum = space_accum = 0;
-	
-	if(cur_val * last_val >= 0){ // cur_val and last_val have same sign; no transition
-	  // No transition == NRZI one
-	  symphase = 0;
-	  hdlc_process(&sp->hdlc,1); // Frame can't end with 1-bit, so don't check return
-	} else {	// transition occurred --> NRZI zero
-	  symphase = ((cur_val - last_val) * mid_val) > 0 ? +1 : -1;	// Gardner-style clock adjust
-	  int bytes = hdlc_process(&sp->hdlc,0);
-	  if(Verbose && bytes < 0){
-	    // Lock output to prevent intermingled output
-	    pthread_mutex_lock(&Output_mutex);
-	    printtime(stdout);
-	    fprintf(stdout," ssrc %u CRC fail\n",sp->rtp_state_in.ssrc);
-	    fflush(stdout);
-	    pthread_mutex_unlock(&Output_mutex);
-	  } else if(bytes > 0){ // Valid frame
-	    if(Verbose){
-	      pthread_mutex_lock(&Output_mutex);
-	      printtime(stdout);
-	      fprintf(stdout," ssrc %u packet %d len %d:\n",sp->rtp_state_in.ssrc,sp->decoded_packets++,bytes);
-	      dump_frame(stdout,sp->hdlc.frame,bytes);
-	      fflush(stdout);
-	      pthread_mutex_unlock(&Output_mutex);
-	    } // Verbose
-	    struct rtp_header rtp_hdr;
-	    memset(&rtp_hdr,0,sizeof(rtp_hdr));
-	    rtp_hdr.version = 2;
-	    rtp_hdr.type = AX25_PT;
-	    rtp_hdr.seq = sp->rtp_state_out.seq++;
-	    // RTP timestamp??
-	    rtp_hdr.timestamp = sp->rtp_state_out.timestamp;
-	    sp->rtp_state_out.timestamp += bytes;
-	    rtp_hdr.ssrc = sp->rtp_state_out.ssrc;
-	    
-	    int plen = bytes + 76 + 10; // Max RTP header is 76 bytes; allow a little slack
-	    unsigned char packet[plen],*dp;
-	    dp = packet;
-	    dp = hton_rtp(dp,&rtp_hdr);
-	    memcpy(dp,sp->hdlc.frame,bytes);
-	    sp->hdlc.frame_bits = 0;
-	    dp += bytes;
-	    send(Output_fd,packet,dp - packet,0); // Check return code?
-	    sp->rtp_state_out.packets++;
-	    sp->rtp_state_out.bytes += bytes;
-	  } // if(bytes > 0
-	}
-	last_val = cur_val;
-      }
+// Demodulator thread; any worker can run any session, but only one at a time
+static void *worker(void *arg){
+  pthread_setname("afsk");
+
+  while(1){
+    pthread_mutex_lock(&Work_mutex);
+    while(Work_head == NULL)
+      pthread_cond_wait(&Work_cond,&Work_mutex);
+    struct session * const sp = Work_head;
+    Work_head = sp->work_next;
+    if(Work_head == NULL)
+      Work_tail = NULL;
+    sp->work_next = NULL;
+    sp->state = RUNNING;
+    pthread_mutex_unlock(&Work_mutex);
+
+    run_session(sp);
+
+    pthread_mutex_lock(&Work_mutex);
+    if(sp->dead){
+      pthread_mutex_unlock(&Work_mutex);
+      free_session(sp);
+      continue;
     }
+    if(sp->state == RERUN)
+      enqueue(sp);
+    else
+      sp->state = IDLE;
+    pthread_mutex_unlock(&Work_mutex);
   }
   return NULL;
 }
 
+// Send a decoded frame as RTP
+static void send_frame(struct session * const sp,int const bytes){
+  if(Verbose){
+    // Lock output to prevent intermingled output
+    pthread_mutex_lock(&Output_mutex);
+    printtime(stdout);
+    fprintf(stdout," ssrc %u packet %d len %d:\n",sp->rtp_state_in.ssrc,sp->decoded_packets,bytes);
+    dump_frame(stdout,sp->hdlc.frame,bytes);
+    fflush(stdout);
+    pthread_mutex_unlock(&Output_mutex);
+  } // Verbose
+  sp->decoded_packets++;
+  struct rtp_header rtp_hdr;
+  memset(&rtp_hdr,0,sizeof(rtp_hdr));
+  rtp_hdr.version = 2;
+  rtp_hdr.type = AX25_PT;
+  rtp_hdr.seq = sp->rtp_state_out.seq++;
+  // RTP timestamp??
+  rtp_hdr.timestamp = sp->rtp_state_out.timestamp;
+  sp->rtp_state_out.timestamp += bytes;
+  rtp_hdr.ssrc = sp->rtp_state_out.ssrc;
+  
+  int plen = bytes + 76 + 10; // Max RTP header is 76 bytes; allow a little slack
+  unsigned char packet[plen],*dp;
+  dp = packet;
+  dp = hton_rtp(dp,&rtp_hdr);
+  memcpy(dp,sp->hdlc.frame,bytes);
+  sp->hdlc.frame_bits = 0;
+  dp += bytes;
+  send(Output_fd,packet,dp - packet,0); // Check return code?
+  sp->rtp_state_out.packets++;
+  sp->rtp_state_out.bytes += bytes;
+}
+
+// AFSK demod of one filter output block
+static void correlate(struct session * const sp){
+  const float twist = mark_tone/space_tone; // Scale back upper tone from FM demod
+  struct filter_out const * const fo = sp->filter_out;
+  int const olen = fo->olen;
+
+  // Spin down by mark and space frequencies
+  // Plain float arrays and no loop-carried state, so this vectorizes
+  float const * restrict const x = (float const *)fo->output.c; // interleaved re, im
+  float const * restrict const mc = (float const *)sp->mark_tab;
+  float const * restrict const ms = mc + olen;
+  float const * restrict const sc = (float const *)sp->space_tab;
+  float const * restrict const ss = sc + olen;
+  float mark_i[olen],mark_q[olen],space_i[olen],space_q[olen];
+  for(int n=0; n < olen; n++){
+    float const xi = x[2*n];
+    float const xq = x[2*n+1];
+    mark_i[n] = xi * mc[n] - xq * ms[n];
+    mark_q[n] = xi * ms[n] + xq * mc[n];
+    space_i[n] = xi * sc[n] - xq * ss[n];
+    space_q[n] = xi * ss[n] + xq * sc[n];
+  }
+  // The tables omit the block's starting phase. Every sample in this block shares it,
+  // so run the integrators in the block's frame and rotate them on the way in and out
+  // Energies (cnrmf) don't depend on the rotation
+  complex float const mrot = sp->mark_phase;
+  complex float const srot = sp->space_phase;
+  complex float mark_accum = sp->mark_accum * conjf(mrot);
+  complex float space_accum = sp->space_accum * conjf(srot);
+  complex float mark_offset_accum = sp->mark_offset_accum * conjf(mrot);
+  complex float space_offset_accum = sp->space_offset_accum * conjf(srot);
+
+  for(int n=0; n < olen; n++){
+    // Accumulate each in boxcar (comb) filters
+    // Mark and space each have in-phase and offset integrators for timing recovery
+    complex float const m = CMPLXF(mark_i[n],mark_q[n]);
+    complex float const s = CMPLXF(space_i[n],space_q[n]);
+    mark_accum += m;
+    mark_offset_accum += m;
+    space_accum += s;
+    space_offset_accum += s;
+
+    if(++sp->symphase == sp->samppbit/2){
+      // Finish offset integrator and reset
+      sp->mid_val = cnrmf(mark_offset_accum) - twist * cnrmf(space_offset_accum);
+      mark_offset_accum = space_offset_accum = 0;
+    }
+    if(sp->symphase < sp->samppbit)
+      continue;
+    
+    // Finished whole bit
+    float cur_val = cnrmf(mark_accum) - twist * cnrmf(space_accum);
+    mark_accum = space_accum = 0;
+    
+    if(cur_val * sp->last_val >= 0){ // cur_val and last_val have same sign; no transition
+      // No transition == NRZI one
+      sp->symphase = 0;
+      hdlc_process(&sp->hdlc,1); // Frame can't end with 1-bit, so don't check return
+    } else {	// transition occurred --> NRZI zero
+      sp->symphase = ((cur_val - sp->last_val) * sp->mid_val) > 0 ? +1 : -1;	// Gardner-style clock adjust
+      int bytes = hdlc_process(&sp->hdlc,0);
+      if(Verbose && bytes < 0){
+	pthread_mutex_lock(&Output_mutex);
+	printtime(stdout);
+	fprintf(stdout," ssrc %u CRC fail\n",sp->rtp_state_in.ssrc);
+	fflush(stdout);
+	pthread_mutex_unlock(&Output_mutex);
+      } else if(bytes > 0) // Valid frame
+	send_frame(sp,bytes);
+    }
+    sp->last_val = cur_val;
+  }
+  sp->mark_accum = mark_accum * mrot;
+  sp->space_accum = space_accum * srot;
+  sp->mark_offset_accum = mark_offset_accum * mrot;
+  sp->space_offset_accum = space_offset_accum * srot;
+
+  // Advance replica phases to the next block, keeping them on the unit circle
+  sp->mark_phase = mrot * sp->mark_step;
+  sp->mark_phase /= cabsf(sp->mark_phase);
+  sp->space_phase = srot * sp->space_step;
+  sp->space_phase /= cabsf(sp->space_phase);
+}
+
+// Feed one block of PCM through the filter and demodulator
+static void demod_block(struct session * const sp,int16_t const *samples){
+  assert(sp->filter_in->ilen == AL);
+  assert(sp->filter_out->olen == AL);
+  for(int n=0; n < AL; n++){
+    if(write_rfilter(sp->filter_in,samples[n] * SCALE) == 0)
+      continue;
+    execute_filter_output(sp->filter_out,0);    // Doesn't block; the FFT ran in this thread
+    correlate(sp);
+  }
+}
+
 // Process incoming HDLC bit
 // Return nonzero byte count if there's a complete valid frame
 // Caller recovers frame (including 2-byte CRC) in hp->frame, must set hp->frame_bits = 0 when done
@@ -20,6 +20,7 @@
 #include <locale.h>
 #include <signal.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
@@ -27,7 +28,12 @@
 
 
 #include "attr.h"
+#include "misc.h"
 #include "multicast.h"
+#include "recfile.h"
+#include "session.h"
+#include "metrics.h"
+#include "shm.h"
 
 // Largest Ethernet packet
 // Normally this would be <1500,
@@ -36,9 +42,23 @@
 // But what about IPv6?
 #define MAXPKT 65535
 
-// size of stdio buffer for disk I/O
-// This should be large to minimize write calls, but how big?
+// Size of each session's output buffer, handed to a writer thread when full
+// Multiple of the page size so it can be written with O_DIRECT
 #define BUFFERSIZE (1<<20)
+#define ALIGNMENT 4096
+
+// Files are preallocated in extents this large to keep them contiguous
+// with hundreds of streams going to the same disk
+#define PREALLOC (64LL<<20)
+
+// Limit on data waiting to be written; beyond this we drop buffers rather than block the receive loop
+#define MAX_QUEUED (256LL<<20)
+
+#define MAX_WRITERS 16
+
+#if !defined(linux)
+#define O_DIRECT 0 // Not available; -D has no effect
+#endif
 
 // Simplified .wav file header
 // http://soundfile.sapp.org/doc/WaveFormat/
@@ -62,9 +82,8 @@ struct wav {
 
 // One for each session being recorded
 struct session {
-  struct session *prev;
-  struct session *next;
-  struct sockaddr iq_sender;   // Sender's IP address and source port
+  struct session_entry entry;  // Table linkage, keyed on sender, SSRC and type
+  struct sockaddr_storage iq_sender;   // Sender's IP address and source port
 
   char filename[PATH_MAX];
   struct wav header;
@@ -76,14 +95,28 @@ struct session {
   int channels;                // 1 (PCM_MONO) or 2 (PCM_STEREO)
   unsigned int samprate;       // implicitly 48 kHz in PCM
 
-  FILE *fp;                    // File being recorded
-  void *iobuffer;              // Big buffer to reduce write rate
-  struct timespec last_active;
+  int fd;                      // File being recorded
+  struct writer *writer;       // Thread that does all I/O on fd
+  unsigned char *iobuffer;     // Samples not yet handed to the writer
+  int buf_len;                 // Bytes in iobuffer
+  off_t buf_offset;            // File offset of iobuffer[0]
+  off_t file_size;             // Highest offset queued for writing
+  off_t allocated;             // Preallocated through here (writer thread only)
 
   int SubstantialFile;        // At least one substantial segment has been seen
   int64_t CurrentSegmentSamples; // total samples in this segment without skips in timestamp
   int64_t SamplesWritten;
   int64_t TotalFileSamples;
+
+  // Compressed (-c) recordings only
+  struct recfile_index index;  // Seek points, written at close
+  int16_t *pending;            // Samples not yet encoded into a frame
+  int npending;                // Frames in pending
+  uint32_t pending_ts;         // RTP timestamp of pending[0]
+  uint32_t next_ts;            // RTP timestamp after the last frame encoded
+  uint64_t position;           // Sample frames encoded so far, including gaps
+  uint64_t buf_position;       // Value of position at start of iobuffer
+  uint32_t buf_ts;             // Value of next_ts at start of iobuffer
 };
 
 
@@ -93,17 +126,66 @@ int Verbose;
 char PCM_mcast_address_text[256];
 char const *Recordings = ".";
 int Subdirs; // Place recordings in subdirectories by SSID
+int Compress; // Write compressed framed files (see recfile.h) instead of .wav
 
-struct sockaddr Sender;
+struct sockaddr_storage Sender;
 struct sockaddr Input_mcast_sockaddr;
-int Input_fd;
-struct session *Sessions;
+char const *Shm_name;       // radio's shared-memory segment, if we're to read from it instead of the network
+struct shm_input Input;
+struct session_table Sessions;
 long long Timeout = 20; // 20 seconds max idle time before file close
+char const *Metrics;   // Scrape endpoint, if any
 
 void closedown(int a);
+volatile sig_atomic_t Terminate; // Set by closedown(); the input loop exits and cleanup() runs from exit()
 void input_loop(void);
 void cleanup(void);
 struct session *create_session(struct rtp_header *);
+void close_session(void *);
+
+// Disk writes are done by a small pool of threads so the receive loop never blocks on the disk
+// Each session is bound to one writer so its writes, and its final close, stay in order
+enum wjob_type { WRITE_BUFFER, CLOSE_FILE };
+
+struct wjob {
+  struct wjob *next;
+  enum wjob_type type;
+  struct session *sp;
+  unsigned char *buf;          // WRITE_BUFFER: data to write, freed by the writer
+  int len;
+  off_t offset;
+  long long queued;            // Time enqueued, ns
+};
+
+struct writer {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct wjob *head,*tail;
+  int depth;
+} Writers[MAX_WRITERS];
+
+int Nwriters = 2;
+int Direct;                   // Open files with O_DIRECT
+int Writers_exit;
+
+// Writer statistics, protected by Stats_mutex
+pthread_mutex_t Stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+long long Queued_bytes;       // Bytes waiting in all writer queues
+int Queue_depth;              // Jobs waiting in all writer queues
+int Max_queue_depth;
+long long Writes;
+long long Write_errors;
+long long Dropped_buffers;
+double Total_latency;         // Sum of enqueue-to-completion times, sec
+double Max_latency;
+
+void *writer_thread(void *);
+void enqueue(struct session *,enum wjob_type,unsigned char *,int,off_t);
+void flush_buffer(struct session *);
+void record_frames(struct session *,uint32_t,int16_t const *,int,int);
+void report_stats(void);
+void pcmrecord_metrics(struct metrics *,void *);
 
 
 int main(int argc,char *argv[]){
@@ -122,8 +204,21 @@ int main(int argc,char *argv[]){
 
   // Defaults
   int c;
-  while((c = getopt(argc,argv,"d:l:vt:m:s")) != EOF){
+  while((c = getopt(argc,argv,"cd:l:vt:m:M:S:sw:D")) != EOF){
     switch(c){
+    case 'c':
+      Compress = 1;
+      break;
+    case 'D':
+      Direct = 1;
+      break;
+    case 'w':
+      Nwriters = strtol(optarg,NULL,0);
+      if(Nwriters < 1)
+	Nwriters = 1;
+      if(Nwriters > MAX_WRITERS)
+	Nwriters = MAX_WRITERS;
+      break;
     case 's':
       Subdirs = 1;
       break;
@@ -133,6 +228,12 @@ int main(int argc,char *argv[]){
     case 'm':
       SubstantialFileTime = strtof(optarg,NULL);
       break;
+    case 'M':
+      Metrics = optarg;
+      break;
+    case 'S':
+      Shm_name = optarg;
+      break;
     case 'l':
       locale = optarg;
       break;
@@ -148,7 +249,7 @@ int main(int argc,char *argv[]){
       }
       break;
     default:
-      fprintf(stderr,"Usage: %s [-l locale] [-t timeout] [-v] [-m sec] PCM_multicast_address\n",argv[0]);
+      fprintf(stderr,"Usage: %s [-l locale] [-t timeout] [-v] [-m sec] [-M [host:]port|path] [-S shm-segment] [-w writers] [-D] [-c] PCM_multicast_address\n",argv[0]);
       exit(1);
       break;
     }
@@ -165,20 +266,16 @@ int main(int argc,char *argv[]){
     exit(1);
   }
 
-  // Set up input socket for multicast data stream from front end
+  // Set up input: radio's shared memory if it's there, otherwise the multicast data stream
   {
-    struct sockaddr_storage sock;
+    struct sockaddr_storage dest;
     char iface[1024];
-    resolve_mcast(PCM_mcast_address_text,&sock,DEFAULT_RTP_PORT,iface,sizeof(iface));
-    Input_fd = listen_mcast(&sock,iface);
-  }
-  if(Input_fd == -1){
-    fprintf(stderr,"Can't set up PCM input, exiting\n");
-    exit(1);
+    resolve_mcast(PCM_mcast_address_text,&dest,DEFAULT_RTP_PORT,iface,sizeof(iface));
+    if(shm_input_init(&Input,Shm_name,&dest,iface,-1) == -1){
+      fprintf(stderr,"Can't set up PCM input, exiting\n");
+      exit(1);
+    }
   }
-  int n = 1 << 20; // 1 MB
-  if(setsockopt(Input_fd,SOL_SOCKET,SO_RCVBUF,&n,sizeof(n)) == -1)
-    perror("setsockopt");
 
   // Graceful signal catch
   signal(SIGPIPE,closedown);
@@ -188,47 +285,42 @@ int main(int argc,char *argv[]){
   signal(SIGTERM,closedown);        
   signal(SIGPIPE,SIG_IGN);
 
+  session_table_init(&Sessions,256,Timeout);
+  for(int i=0; i < Nwriters; i++){
+    struct writer *wp = &Writers[i];
+    pthread_mutex_init(&wp->lock,NULL);
+    pthread_cond_init(&wp->cond,NULL);
+    pthread_create(&wp->thread,NULL,writer_thread,wp);
+  }
   atexit(cleanup);
+  if(Metrics != NULL)
+    metrics_start(Metrics,"ka9q_pcmrecord",pcmrecord_metrics,NULL);
 
-  input_loop(); // Doesn't return
+  input_loop(); // Returns only on a signal or an input error
 
-  exit(0);
+  exit(Terminate ? 1 : 0); // Will call cleanup()
 }
 
+// Don't exit from the handler: we might have interrupted the input loop inside the session table,
+// and cleanup() needs the table lock
 void closedown(int a){
   if(Verbose)
     fprintf(stderr,"iqrecord: caught signal %d: %s\n",a,strsignal(a));
 
-  exit(1);  // Will call cleanup()
+  Terminate = 1;
 }
 
-// Read from RTP network socket, assemble blocks of samples
+// Read RTP packets, assemble blocks of samples
 void input_loop(){
+  long long last_report = session_time();
 
-  while(1){
-    struct timespec current_time;
-    clock_gettime(CLOCK_REALTIME,&current_time);
-
+  while(!Terminate){
     // Receive data
-    fd_set fdset;
-    FD_ZERO(&fdset);
-    FD_SET(Input_fd,&fdset);
-    struct timespec polltime;
-    polltime.tv_sec = 1;
-    polltime.tv_nsec = 0; // force return after 1 second max
-    
-    int n = pselect(Input_fd + 1,&fdset,NULL,NULL,&polltime,NULL);
-    if(n < 0)
+    unsigned char buffer[MAXPKT];
+    int size = shm_input_recv(&Input,buffer,sizeof(buffer),&Sender,1000);
+    if(size < 0)
       break; // error of some kind
-    if(FD_ISSET(Input_fd,&fdset)){
-      unsigned char buffer[MAXPKT];
-      socklen_t socksize = sizeof(Sender);
-      int size = recvfrom(Input_fd,buffer,sizeof(buffer),0,&Sender,&socksize);
-      if(size <= 0){    // ??
-	perror("recvfrom");
-	usleep(50000);
-	continue;
-      }
+    if(size > 0){
       if(size < RTP_MIN_SIZE)
 	continue; // Too small for RTP, ignore
       
@@ -246,16 +338,10 @@ void input_loop(){
       signed short *samples = (signed short *)dp;
       size -= (dp - buffer);
       
-      struct session *sp;
-      for(sp = Sessions;sp != NULL;sp=sp->next){
-	if(sp->ssrc == rtp.ssrc
-	   && rtp.type  == sp->type
-	   && memcmp(&sp->iq_sender,&Sender,sizeof(sp->iq_sender)) == 0)
-	  break;
-      }
+      struct session *sp = session_lookup(&Sessions,&Sender,rtp.ssrc,rtp.type);
       if(sp == NULL) // Not found; create new one
 	sp = create_session(&rtp);
-      if(sp == NULL || sp->fp == NULL)
+      if(sp == NULL || sp->fd == -1)
 	continue; // Couldn't create new session
 
 
@@ -270,12 +356,38 @@ void input_loop(){
       for(int n = 0; n < samp_count; n++)
 	samples[n] = ntohs(samples[n]);
 
+      if(Compress){
+	if(offset < 0)
+	  continue; // Late or duplicate; frames are written in timestamp order
+	if(offset > 0)
+	  sp->CurrentSegmentSamples = 0;
+	sp->TotalFileSamples += samp_count + offset * sp->channels;
+	sp->CurrentSegmentSamples += samp_count;
+	sp->SamplesWritten += samp_count;
+	if(sp->CurrentSegmentSamples >= SubstantialFileTime * sp->samprate)
+	  sp->SubstantialFile = 1;
+	record_frames(sp,rtp.timestamp,samples,frame_count,offset);
+	session_touch(&Sessions,&sp->entry);
+	continue;
+      }
       // The seek offset relative to the current position in the file is the signed (modular) difference between
       // the actual and expected RTP timestamps. This should automatically handle
       // 32-bit RTP timestamp wraps, which occur every ~1 days at 48 kHz and only 6 hr @ 192 kHz
       // Should I limit the range on this?
       if(offset){
-	fseeko(sp->fp,offset * sizeof(*samples) * sp->channels,SEEK_CUR); // offset is in bytes
+	off_t const skip = offset * (off_t)sizeof(*samples) * sp->channels; // in bytes
+	if(skip > 0 && skip <= BUFFERSIZE - sp->buf_len){
+	  // Short gap: fill with silence so the buffer stays contiguous
+	  memset(sp->iobuffer + sp->buf_len,0,skip);
+	  sp->buf_len += skip;
+	} else {
+	  // Long gap or backward jump: start a new buffer at the new position
+	  off_t newpos = sp->buf_offset + sp->buf_len + skip;
+	  flush_buffer(sp);
+	  if(newpos < (off_t)sizeof(sp->header))
+	    newpos = sizeof(sp->header);
+	  sp->buf_offset = newpos;
+	}
 	if(offset > 0)
 	  sp->CurrentSegmentSamples = 0;
       }
@@ -285,72 +397,358 @@ void input_loop(){
       if(sp->CurrentSegmentSamples >= SubstantialFileTime * sp->samprate)
 	sp->SubstantialFile = 1;
 
-      fwrite(samples,1,size,sp->fp);
-      clock_gettime(CLOCK_REALTIME,&sp->last_active);
+      unsigned char const *cp = (unsigned char const *)samples;
+      while(size > 0){
+	int chunk = min(size,BUFFERSIZE - sp->buf_len);
+	memcpy(sp->iobuffer + sp->buf_len,cp,chunk);
+	sp->buf_len += chunk;
+	cp += chunk;
+	size -= chunk;
+	if(sp->buf_len == BUFFERSIZE)
+	  flush_buffer(sp);
+      }
+      session_touch(&Sessions,&sp->entry);
     } // end of packet processing
 
-    // Walk through list, close idle sessions
-    // should we do this on every packet? seems inefficient
-    // Could be in a separate thread, but that creates synchronization issues
-    struct session *next;
-    for(struct session *sp = Sessions;sp != NULL; sp = next){
-      next = sp->next;
-      long long idle = 1000000000 * (current_time.tv_sec - sp->last_active.tv_sec) + (current_time.tv_nsec - sp->last_active.tv_nsec);
-      if(idle > Timeout * 1000000000){
-	// Close idle session
-	if(!sp->SubstantialFile){
-	  unlink(sp->filename);
-	  if(Verbose)
-	    printf("deleting %s %'.1f/%'.1f sec\n",sp->filename,
-		   (float)sp->SamplesWritten / sp->samprate,
-		   (float)sp->TotalFileSamples / sp->samprate);
-	} else
-	  if(Verbose)
-	    printf("closing %s %'.1f/%'.1f sec\n",sp->filename,
-		   (float)sp->SamplesWritten / sp->samprate,
-		   (float)sp->TotalFileSamples / sp->samprate);
-	
-	if(sp->SubstantialFile){ // Don't bother for non-substantial files
-	  // Get final file size, write .wav header with sizes
-	  fflush(sp->fp);
-	  struct stat statbuf;
-	  fstat(fileno(sp->fp),&statbuf);
-	  sp->header.ChunkSize = statbuf.st_size - 8;
-	  sp->header.Subchunk2Size = statbuf.st_size - sizeof(sp->header);
-	  rewind(sp->fp);
-	  fwrite(&sp->header,sizeof(sp->header),1,sp->fp);
-	  fflush(sp->fp);
-	}
-	fclose(sp->fp);
-	sp->fp = NULL;
-	free(sp->iobuffer);
-	sp->iobuffer = NULL;
-	if(sp->prev)
-	  sp->prev->next = sp->next;
-	else
-	  Sessions = sp->next;
-	if(sp->next)
-	  sp->next->prev = sp->prev;
-	free(sp);
-	sp = NULL;
-      }
+    // Close idle sessions. The timer wheel only looks at sessions due to expire
+    // in the seconds elapsed since the last call, so this is cheap on every packet
+    session_expire(&Sessions,close_session);
+
+    if(Verbose && session_time() >= last_report + 60){
+      last_report = session_time();
+      report_stats();
     }
   }
 }
+
+// Make sure there's room in the session buffer for len more bytes
+static void reserve(struct session *sp,int len){
+  if(BUFFERSIZE - sp->buf_len < len)
+    flush_buffer(sp);
+}
+
+// Compress the pending samples into a DATA frame
+static void encode_pending(struct session *sp){
+  if(sp->npending == 0)
+    return;
+  reserve(sp,recfile_max_data(sp->npending,sp->channels,16));
+  recfile_index_note(&sp->index,sp->position,sp->buf_offset + sp->buf_len,sp->pending_ts,sp->samprate);
+  int const n = recfile_encode_data(sp->iobuffer + sp->buf_len,BUFFERSIZE - sp->buf_len,sp->pending_ts,
+				    sp->pending,sp->npending,sp->channels,16);
+  assert(n > 0);
+  sp->buf_len += n;
+  sp->position += sp->npending;
+  sp->next_ts = sp->pending_ts + sp->npending;
+  sp->npending = 0;
+}
+
+// Mark frames lost in the network (or dropped by us) with a GAP frame
+static void encode_gap(struct session *sp,uint32_t timestamp,uint32_t nframes){
+  encode_pending(sp);
+  reserve(sp,RECFILE_FRAME_HEADER_SIZE);
+  recfile_index_note(&sp->index,sp->position,sp->buf_offset + sp->buf_len,timestamp,sp->samprate);
+  sp->buf_len += recfile_encode_gap(sp->iobuffer + sp->buf_len,timestamp,nframes);
+  sp->position += nframes;
+  sp->next_ts = timestamp + nframes;
+}
+
+// Add a packet of host-order samples to a compressed recording
+// skipped = frames missing before this packet, from rtp_process()
+void record_frames(struct session *sp,uint32_t timestamp,int16_t const *samples,int nframes,int skipped){
+  if(skipped > 0)
+    encode_gap(sp,timestamp - skipped,skipped);
+
+  while(nframes > 0){
+    if(sp->npending == 0)
+      sp->pending_ts = timestamp;
+    int const chunk = min(nframes,RECFILE_MAX_FRAMES - sp->npending);
+    memcpy(sp->pending + sp->npending * sp->channels,samples,chunk * sp->channels * sizeof(*samples));
+    sp->npending += chunk;
+    samples += chunk * sp->channels;
+    timestamp += chunk;
+    nframes -= chunk;
+    if(sp->npending == RECFILE_MAX_FRAMES)
+      encode_pending(sp);
+  }
+}
+
+// Buffer couldn't be queued. A framed file can't have holes, so back up to the start
+// of the frames in the buffer and replace them all with one GAP frame
+// The first buffer also holds the file header, which has to stay
+static void drop_frames(struct session *sp){
+  int const keep = sp->buf_offset < RECFILE_HEADER_SIZE ? RECFILE_HEADER_SIZE - sp->buf_offset : 0;
+  struct recfile_index * const ip = &sp->index;
+  while(ip->count > 0 && ip->entries[ip->count-1].offset >= (uint64_t)(sp->buf_offset + keep))
+    ip->count--;
+  ip->last = ip->count > 0 ? ip->entries[ip->count-1].position : 0;
+  sp->buf_len = keep;
+  if(sp->position > sp->buf_position){
+    recfile_index_note(ip,sp->buf_position,sp->buf_offset + keep,sp->buf_ts,0);
+    sp->buf_len += recfile_encode_gap(sp->iobuffer + keep,sp->buf_ts,sp->position - sp->buf_position);
+  }
+}
+
+static long long ns_time(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Hand a job to the session's writer thread. Never blocks on I/O
+void enqueue(struct session *sp,enum wjob_type type,unsigned char *buf,int len,off_t offset){
+  struct wjob *jp = calloc(1,sizeof(*jp));
+  if(jp == NULL){
+    free(buf);
+    return;
+  }
+  jp->type = type;
+  jp->sp = sp;
+  jp->buf = buf;
+  jp->len = len;
+  jp->offset = offset;
+  jp->queued = ns_time();
+
+  pthread_mutex_lock(&Stats_mutex);
+  Queued_bytes += len;
+  Queue_depth++;
+  if(Queue_depth > Max_queue_depth)
+    Max_queue_depth = Queue_depth;
+  pthread_mutex_unlock(&Stats_mutex);
+
+  struct writer * const wp = sp->writer;
+  pthread_mutex_lock(&wp->lock);
+  if(wp->tail)
+    wp->tail->next = jp;
+  else
+    wp->head = jp;
+  wp->tail = jp;
+  wp->depth++;
+  pthread_cond_signal(&wp->cond);
+  pthread_mutex_unlock(&wp->lock);
+}
+
+// Pass the session's buffer to its writer and start a new one right after it
+void flush_buffer(struct session *sp){
+  if(sp->buf_len == 0)
+    return;
+
+  off_t const end = sp->buf_offset + sp->buf_len;
+  pthread_mutex_lock(&Stats_mutex);
+  int const full = Queued_bytes + sp->buf_len > MAX_QUEUED;
+  if(full)
+    Dropped_buffers++;
+  pthread_mutex_unlock(&Stats_mutex);
+
+  unsigned char *newbuf = NULL;
+  if(!full && posix_memalign((void **)&newbuf,ALIGNMENT,BUFFERSIZE) == 0){
+    enqueue(sp,WRITE_BUFFER,sp->iobuffer,sp->buf_len,sp->buf_offset);
+    sp->iobuffer = newbuf;
+    if(end > sp->file_size)
+      sp->file_size = end;
+  } else if(Compress){
+    drop_frames(sp);
+    return;
+  }
+  // else disk can't keep up; discard this buffer and reuse it. The gap reads back as silence
+  sp->buf_offset = end;
+  sp->buf_len = 0;
+  sp->buf_position = sp->position;
+  sp->buf_ts = sp->next_ts;
+}
+
+// Finish a compressed recording: last frame, then the seek index and trailer
+static void finish_recfile(struct session *sp){
+  encode_pending(sp);
+  int const len = sp->buf_len + recfile_index_size(&sp->index);
+  unsigned char *buf = NULL;
+  if(posix_memalign((void **)&buf,ALIGNMENT,len) != 0){
+    flush_buffer(sp); // No index; readers will rebuild it
+    return;
+  }
+  memcpy(buf,sp->iobuffer,sp->buf_len);
+  int const n = recfile_encode_index(buf + sp->buf_len,&sp->index,sp->buf_offset + sp->buf_len);
+  enqueue(sp,WRITE_BUFFER,buf,sp->buf_len + n,sp->buf_offset);
+  if(sp->buf_offset + sp->buf_len + n > sp->file_size)
+    sp->file_size = sp->buf_offset + sp->buf_len + n;
+  sp->buf_offset += sp->buf_len + n;
+  sp->buf_len = 0;
+}
+
+// Write one buffer, preallocating ahead of it. Runs in the writer thread
+static void do_write(struct session *sp,unsigned char const *buf,int len,off_t offset){
+  off_t const end = offset + len;
+#if defined(linux)
+  if(end > sp->allocated){
+    off_t const extent = ((end - sp->allocated + PREALLOC - 1) / PREALLOC) * PREALLOC;
+    if(fallocate(sp->fd,FALLOC_FL_KEEP_SIZE,sp->allocated,extent) == 0)
+      sp->allocated += extent;
+    else
+      sp->allocated = LLONG_MAX; // Not supported here; don't keep trying
+  }
+#endif
+  int const flags = fcntl(sp->fd,F_GETFL);
+  int const direct = O_DIRECT != 0 && flags != -1 && (flags & O_DIRECT);
+  int retry = 0;
+  while(len > 0){
+    int n = len;
+    int buffered = retry;
+    if(direct && !buffered){
+      // O_DIRECT wants the offset, address and length all aligned. Write the aligned middle directly and only the
+      // unaligned head and tail (WAV header, short final buffer) through the page cache. After a timestamp jump
+      // the offset and address may be misaligned differently, leaving no aligned part
+      int const head = (ALIGNMENT - offset % ALIGNMENT) % ALIGNMENT;
+      if(((uintptr_t)offset - (uintptr_t)buf) % ALIGNMENT != 0 || len < head + ALIGNMENT)
+	buffered = 1;
+      else if(head != 0){
+	buffered = 1;
+	n = head;
+      } else
+	n = len & ~(ALIGNMENT - 1);
+    }
+    if(direct && buffered)
+      fcntl(sp->fd,F_SETFL,flags & ~O_DIRECT);
+    ssize_t const r = pwrite(sp->fd,buf,n,offset);
+    if(direct && buffered)
+      fcntl(sp->fd,F_SETFL,flags); // Back to O_DIRECT for the rest
+    if(r == -1 && errno == EINVAL && direct && !buffered){
+      retry = 1; // Rejected anyway; write this buffer through the cache
+      continue;
+    }
+    if(r <= 0){
+      if(r == -1 && errno == EINTR)
+	continue;
+      pthread_mutex_lock(&Stats_mutex);
+      Write_errors++;
+      pthread_mutex_unlock(&Stats_mutex);
+      if(Verbose)
+	fprintf(stderr,"write %s: %s\n",sp->filename,strerror(errno));
+      return;
+    }
+    buf += r;
+    len -= r;
+    offset += r;
+  }
+}
+
+// Fix up the .wav header, release unused preallocation and close. Runs in the writer thread
+static void do_close(struct session *sp){
+  if(sp->SubstantialFile && !Compress){
+    sp->header.ChunkSize = sp->file_size - 8;
+    sp->header.Subchunk2Size = sp->file_size - sizeof(sp->header);
+    do_write(sp,(unsigned char const *)&sp->header,sizeof(sp->header),0);
+  }
+#if defined(linux)
+  // Blocks preallocated past the end of the file are freed only by truncation; ext4 won't punch holes beyond EOF
+  if(sp->allocated > sp->file_size && sp->allocated != LLONG_MAX && ftruncate(sp->fd,sp->file_size) == -1 && Verbose)
+    fprintf(stderr,"ftruncate %s: %s\n",sp->filename,strerror(errno));
+#endif
+  close(sp->fd);
+  sp->fd = -1;
+  if(!sp->SubstantialFile)
+    unlink(sp->filename);
+  free(sp->iobuffer);
+  sp->iobuffer = NULL;
+  free(sp->pending);
+  recfile_index_free(&sp->index);
+  free(sp);
+}
+
+void *writer_thread(void *arg){
+  struct writer * const wp = (struct writer *)arg;
+  pthread_setname("pcmwrite");
+
+  while(1){
+    pthread_mutex_lock(&wp->lock);
+    while(wp->head == NULL && !Writers_exit)
+      pthread_cond_wait(&wp->cond,&wp->lock);
+    struct wjob *jp = wp->head;
+    if(jp == NULL){
+      pthread_mutex_unlock(&wp->lock);
+      break; // Exiting and queue drained
+    }
+    wp->head = jp->next;
+    if(wp->head == NULL)
+      wp->tail = NULL;
+    wp->depth--;
+    pthread_mutex_unlock(&wp->lock);
+
+    int const len = jp->len;
+    switch(jp->type){
+    case WRITE_BUFFER:
+      do_write(jp->sp,jp->buf,jp->len,jp->offset);
+      free(jp->buf);
+      break;
+    case CLOSE_FILE:
+      do_close(jp->sp);
+      break;
+    }
+    double const latency = (ns_time() - jp->queued) * 1e-9;
+    free(jp);
+
+    pthread_mutex_lock(&Stats_mutex);
+    Queued_bytes -= len;
+    Queue_depth--;
+    Writes++;
+    Total_latency += latency;
+    if(latency > Max_latency)
+      Max_latency = latency;
+    pthread_mutex_unlock(&Stats_mutex);
+  }
+  return NULL;
+}
+
+void report_stats(void){
+  pthread_mutex_lock(&Stats_mutex);
+  printf("sessions %d; writer queue %d jobs %'lld bytes, max %d; writes %'lld, errors %'lld, dropped buffers %'lld; latency avg %.1f max %.1f ms\n",
+	 Sessions.count,Queue_depth,Queued_bytes,Max_queue_depth,Writes,Write_errors,Dropped_buffers,
+	 Writes > 0 ? 1000 * Total_latency / Writes : 0.0, 1000 * Max_latency);
+  Max_queue_depth = Queue_depth;
+  Max_latency = 0;
+  pthread_mutex_unlock(&Stats_mutex);
+  fflush(stdout);
+}
+
+// Close an idle session; called from session_expire() or session_drain() after it has been removed from the table
+void close_session(void *p){
+  struct session *sp = (struct session *)p;
+  if(sp == NULL)
+    return;
+
+  if(!sp->SubstantialFile){
+    unlink(sp->filename);
+    if(Verbose)
+      printf("deleting %s %'.1f/%'.1f sec\n",sp->filename,
+	     (float)sp->SamplesWritten / sp->samprate,
+	     (float)sp->TotalFileSamples / sp->samprate);
+  } else
+    if(Verbose)
+      printf("closing %s %'.1f/%'.1f sec\n",sp->filename,
+	     (float)sp->SamplesWritten / sp->samprate,
+	     (float)sp->TotalFileSamples / sp->samprate);
+  
+  // Header fixup (or unlink), close and free are done by the writer after the last buffer
+  if(Compress)
+    finish_recfile(sp);
+  else
+    flush_buffer(sp);
+  enqueue(sp,CLOSE_FILE,NULL,0,0);
+}
  
 void cleanup(void){
-  while(Sessions){
-    // Flush and close each write stream
-    // Be anal-retentive about freeing and clearing stuff even though we're about to exit
-    struct session *next_s = Sessions->next;
-    fflush(Sessions->fp);
-    fclose(Sessions->fp);
-    Sessions->fp = NULL;
-    free(Sessions->iobuffer);
-    Sessions->iobuffer = NULL;
-    free(Sessions);
-    Sessions = next_s;
+  // Flush and close each write stream. Under the table lock, since the metrics thread may be walking it
+  session_drain(&Sessions,close_session);
+  // Let the writers drain their queues
+  for(int i=0; i < Nwriters; i++){
+    struct writer *wp = &Writers[i];
+    pthread_mutex_lock(&wp->lock);
+    Writers_exit = 1;
+    pthread_cond_signal(&wp->cond);
+    pthread_mutex_unlock(&wp->lock);
   }
+  for(int i=0; i < Nwriters; i++)
+    pthread_join(Writers[i].thread,NULL);
+  if(Verbose)
+    report_stats();
 }
 struct session *create_session(struct rtp_header *rtp){
 
@@ -372,14 +770,19 @@ struct session *create_session(struct rtp_header *rtp){
   struct tm *tm = gmtime(&current_time.tv_sec);
   // yyyy-mm-dd-hh:mm:ss so it will sort properly
   
-  sp->fp = NULL;
+  char const * const suffix = Compress ? "rec" : "wav";
+  static int next_writer;
+  sp->writer = &Writers[next_writer++ % Nwriters];
+  int const flags = O_RDWR|O_CREAT|O_TRUNC|(Direct ? O_DIRECT : 0);
+
+  sp->fd = -1;
   if(Subdirs){
     char dir[PATH_MAX];
     snprintf(dir,sizeof(dir),"%u",sp->ssrc);
     if(mkdir(dir,0777) == -1 && errno != EEXIST)
       fprintf(stderr,"can't create directory %s: %s\n",dir,strerror(errno));
     // Try to create file in directory whether or not the mkdir succeeded
-    snprintf(sp->filename,sizeof(sp->filename),"%u/%uk%4d-%02d-%02dT%02d:%02d:%02d.%dZ.wav",
+    snprintf(sp->filename,sizeof(sp->filename),"%u/%uk%4d-%02d-%02dT%02d:%02d:%02d.%dZ.%s",
 	     sp->ssrc,
 	     sp->ssrc,
 	     tm->tm_year+1900,
@@ -388,15 +791,16 @@ struct session *create_session(struct rtp_header *rtp){
 	     tm->tm_hour,
 	     tm->tm_min,
 	     tm->tm_sec,
-	     (int)(current_time.tv_nsec / 100000000));
-    sp->fp = fopen(sp->filename,"w+");
-    if(sp->fp == NULL)
+	     (int)(current_time.tv_nsec / 100000000),
+	     suffix);
+    sp->fd = open(sp->filename,flags,0666);
+    if(sp->fd == -1)
       fprintf(stderr,"can't create/write file %s: %s\n",sp->filename,strerror(errno));
   }
   // (1) Subdirs not specified, or
   // (2) Subdirs specified but couldn't create directory or create file in directory; create in current dir
-  if(!sp->fp){
-    snprintf(sp->filename,sizeof(sp->filename),"%uk%4d-%02d-%02dT%02d:%02d:%02d.%dZ.wav",
+  if(sp->fd == -1){
+    snprintf(sp->filename,sizeof(sp->filename),"%uk%4d-%02d-%02dT%02d:%02d:%02d.%dZ.%s",
 	     sp->ssrc,
 	     tm->tm_year+1900,
 	     tm->tm_mon+1,
@@ -404,32 +808,32 @@ struct session *create_session(struct rtp_header *rtp){
 	     tm->tm_hour,
 	     tm->tm_min,
 	     tm->tm_sec,
-	     (int)(current_time.tv_nsec / 100000000));
-    sp->fp = fopen(sp->filename,"w+");
+	     (int)(current_time.tv_nsec / 100000000),
+	     suffix);
+    sp->fd = open(sp->filename,flags,0666);
   }    
-  if(sp->fp == NULL){
+  if(sp->fd == -1){
     fprintf(stderr,"can't create/write file %s: %s\n",sp->filename,strerror(errno));
     free(sp);
     sp = NULL;
     return NULL;
   }
-  // file create succeded, now put us at top of list
-  sp->prev = NULL;
-  sp->next = Sessions;
-  
-  if(sp->next)
-    sp->next->prev = sp;
-  
-  Sessions = sp;
+  // file create succeded, now put us in the table
+  session_insert(&Sessions,&sp->entry,sp,&sp->iq_sender,sp->ssrc,sp->type);
 
   if(Verbose)
     fprintf(stderr,"creating %s\n",sp->filename);
   
-  sp->iobuffer = malloc(BUFFERSIZE);
-  setbuffer(sp->fp,sp->iobuffer,BUFFERSIZE);
-  
-  int const fd = fileno(sp->fp);
-  fcntl(fd,F_SETFL,O_NONBLOCK); // Let's see if this keeps us from losing data
+  if(posix_memalign((void **)&sp->iobuffer,ALIGNMENT,BUFFERSIZE) != 0
+     || (Compress && (sp->pending = malloc(RECFILE_MAX_FRAMES * sp->channels * sizeof(*sp->pending))) == NULL)){
+    free(sp->iobuffer);
+    session_remove(&Sessions,&sp->entry);
+    close(sp->fd);
+    unlink(sp->filename);
+    free(sp);
+    return NULL;
+  }
+  int const fd = sp->fd;
   
   attrprintf(fd,"samplerate","%lu",(unsigned long)sp->samprate);
   attrprintf(fd,"channels","%d",sp->channels);
@@ -451,8 +855,23 @@ struct session *create_session(struct rtp_header *rtp){
   sp->header.BitsPerSample = 16;
   memcpy(sp->header.SubChunk2ID,"data",4);
   sp->header.Subchunk2Size = 0xffffffff; // Temporary
-  fwrite(&sp->header,sizeof(sp->header),1,sp->fp);
-  fflush(sp->fp); // get at least the header out there
+  // Header goes out with the first buffer; data starts right after it
+  if(Compress){
+    struct recfile_info info;
+    memset(&info,0,sizeof(info));
+    info.samprate = sp->samprate;
+    info.ssrc = sp->ssrc;
+    info.channels = sp->channels;
+    info.bitspersample = 16;
+    info.start_time = current_time.tv_sec * 1000000000LL + current_time.tv_nsec;
+    sp->buf_len = recfile_encode_header(sp->iobuffer,&info);
+    sp->next_ts = sp->buf_ts = rtp->timestamp;
+    attrprintf(fd,"format","recfile");
+  } else {
+    memcpy(sp->iobuffer,&sp->header,sizeof(sp->header));
+    sp->buf_len = sizeof(sp->header);
+  }
+  sp->buf_offset = 0;
 
   char sender_text[NI_MAXHOST];
   // Don't wait for an inverse resolve that might cause us to lose data
@@ -465,3 +884,66 @@ struct session *create_session(struct rtp_header *rtp){
   attrprintf(fd,"unixstarttime","%ld.%09ld",(long)ts.tv_sec,(long)ts.tv_nsec);
   return sp;
 }
+
+// Per-session counters, copied out under the session table lock
+struct session_counts {
+  uint32_t ssrc;
+  long long packets;
+  long long drops;
+  long long dupes;
+  int64_t samples;
+};
+struct session_list {
+  struct session_counts *list;
+  int count;
+  int size;
+};
+
+static void copy_counts(void *owner,void *arg){
+  struct session const * const sp = (struct session *)owner;
+  struct session_list * const sl = (struct session_list *)arg;
+  if(sl->count == sl->size){
+    sl->size = 2 * sl->size + 16;
+    sl->list = realloc(sl->list,sl->size * sizeof(*sl->list));
+    assert(sl->list != NULL);
+  }
+  struct session_counts * const cp = &sl->list[sl->count++];
+  cp->ssrc = sp->ssrc;
+  cp->packets = sp->rtp_state.packets;
+  cp->drops = sp->rtp_state.drops;
+  cp->dupes = sp->rtp_state.dupes;
+  cp->samples = sp->SamplesWritten;
+}
+
+// Collect function for the metrics endpoint (-M)
+// The writer statistics are read without Stats_mutex; a scrape can be a write or two behind
+void pcmrecord_metrics(struct metrics * const m,void *arg){
+  metric_family(m,"writes_total","counter","Buffers written to disk");
+  metric(m,"writes_total",Writes,NULL);
+  metric_family(m,"write_errors_total","counter","Failed disk writes");
+  metric(m,"write_errors_total",Write_errors,NULL);
+  metric_family(m,"dropped_buffers_total","counter","Buffers dropped because the write queues were full");
+  metric(m,"dropped_buffers_total",Dropped_buffers,NULL);
+  metric_family(m,"queued_bytes","gauge","Bytes waiting to be written");
+  metric(m,"queued_bytes",Queued_bytes,NULL);
+  metric_family(m,"queue_depth","gauge","Buffers waiting to be written");
+  metric(m,"queue_depth",Queue_depth,NULL);
+
+  struct session_list sl = { NULL, 0, 0 };
+  session_walk(&Sessions,copy_counts,&sl);
+  metric_family(m,"sessions","gauge","Streams being recorded");
+  metric(m,"sessions",sl.count,NULL);
+  metric_family(m,"session_packets_total","counter","RTP packets received");
+  for(int i=0; i < sl.count; i++)
+    metric(m,"session_packets_total",sl.list[i].packets,"ssrc=\"%u\"",sl.list[i].ssrc);
+  metric_family(m,"session_drops_total","counter","RTP packets lost or out of sequence");
+  for(int i=0; i < sl.count; i++)
+    metric(m,"session_drops_total",sl.list[i].drops,"ssrc=\"%u\"",sl.list[i].ssrc);
+  metric_family(m,"session_dupes_total","counter","Duplicate RTP packets");
+  for(int i=0; i < sl.count; i++)
+    metric(m,"session_dupes_total",sl.list[i].dupes,"ssrc=\"%u\"",sl.list[i].ssrc);
+  metric_family(m,"session_samples_total","counter","Samples written");
+  for(int i=0; i < sl.count; i++)
+    metric(m,"session_samples_total",sl.list[i].samples,"ssrc=\"%u\"",sl.list[i].ssrc);
+  free(sl.list);
+}
@@ -22,18 +22,17 @@
 #include "multicast.h"
 #include "status.h"
 #include "iir.h"
+#include "session.h"
 
 struct session {
-  struct session *prev;       // Linked list pointers
-  struct session *next; 
+  struct session_entry entry; // Session table linkage
   int type;                 // input RTP type (10,11)
   
-  struct sockaddr sender;
+  struct sockaddr_storage sender;
   char addr[NI_MAXHOST];    // RTP Sender IP address
   char port[NI_MAXSERV];    // RTP Sender source port
 
   FILE *pipe;
-  struct timespec last_active;
  
   struct rtp_state rtp_state; // RTP input state
 
@@ -45,6 +44,7 @@ struct session {
 
 // Command line params
 int Verbose;                  // Verbosity flag (currently unused)
+int Timeout;                  // Close idle sessions after this many seconds; 0 = never
 
 // Global variables
 pthread_t Status_thread;
@@ -54,16 +54,15 @@ pthread_cond_t Input_ready_cond;
 int Status_fd = -1;           // Reading from radio status
 int Status_out_fd = -1;       // Writing to radio status
 int Input_fd = -1;            // Multicast receive socket
-struct session *Sessions;
-pthread_mutex_t Session_protect;
+struct session_table Sessions;
 char *Command;
 char *Input;
 char *Status;
 
 void closedown(int);
-struct session *lookup_session(const struct sockaddr *,uint32_t,int);
-struct session *create_session(void);
+struct session *create_session(struct sockaddr_storage const *,uint32_t,int);
 int close_session(struct session *);
+void reap_session(void *);
 int send_samples(struct session *sp);
 void *status(void *);
 
@@ -73,12 +72,13 @@ struct option Options[] =
    {"pcm-in", required_argument, NULL, 'I'},
    {"name", required_argument, NULL, 'N'},
    {"status-in", required_argument, NULL, 'S'},
+   {"timeout", required_argument, NULL, 't'},
    {"verbose", no_argument, NULL, 'v'},
    {NULL, 0, NULL, 0},
 
   };
    
-char Optstring[] = "A:I:N:S:v";
+char Optstring[] = "A:I:N:S:t:v";
 
 struct sockaddr_storage Status_dest_address;
 struct sockaddr_storage Status_input_source_address;
@@ -105,6 +105,9 @@ int main(int argc,char * const argv[]){
     case 'S':
       Status = optarg;
       break;
+    case 't':
+      Timeout = labs(strtol(optarg,NULL,0));
+      break;
     case 'v':
       Verbose++;
       break;
@@ -156,7 +159,7 @@ int main(int argc,char * const argv[]){
   signal(SIGTERM,closedown);
   signal(SIGPIPE,SIG_IGN);
 
-  pthread_mutex_init(&Session_protect,NULL);
+  session_table_init(&Sessions,256,Timeout);
   
   // Loop forever processing and dispatching incoming PCM packets
   // Process incoming RTP packets, demux to per-SSRC thread
@@ -196,15 +199,14 @@ int main(int argc,char * const argv[]){
       continue; // Used to be an assert, but would be triggered by bogus packets
     
     // Find appropriate session; create new one if necessary
-    struct session *sp = lookup_session((const struct sockaddr *)&sender,pkt->rtp.ssrc,pkt->rtp.type);
+    struct session *sp = session_lookup(&Sessions,&sender,pkt->rtp.ssrc,pkt->rtp.type);
     if(!sp){
       // Not found; create new session
-      sp = create_session();
+      sp = create_session(&sender,pkt->rtp.ssrc,pkt->rtp.type);
       assert(sp != NULL);
       // Initialize
       getnameinfo((struct sockaddr *)&sender,sizeof(sender),sp->addr,sizeof(sp->addr),
 		    sp->port,sizeof(sp->port),NI_NOFQDN|NI_DGRAM);
-      memcpy(&sp->sender,&sender,sizeof(struct sockaddr));
       sp->rtp_state.ssrc = pkt->rtp.ssrc;
       sp->rtp_state.seq = pkt->rtp.seq; // Can cause a spurious drop indication if # pcm pkts != # opus pkts
       sp->rtp_state.timestamp = pkt->rtp.timestamp;
@@ -231,7 +233,7 @@ int main(int argc,char * const argv[]){
       }
     }
     sp->packets++; // Count all packets, regardless of type
-    clock_gettime(CLOCK_REALTIME,&sp->last_active); // for reaping long-idle sessions
+    session_touch(&Sessions,&sp->entry); // for reaping long-idle sessions
 
 
     int const channels = channels_from_pt(sp->type);
@@ -263,6 +265,8 @@ int main(int argc,char * const argv[]){
   endloop:;
     free(pkt);
     pkt = NULL;
+    // Close the pipes of sessions idle longer than Timeout
+    session_expire(&Sessions,reap_session);
   }
 }
 
@@ -369,76 +373,35 @@ void * status(void *p){
 
 
 
-struct session *lookup_session(const struct sockaddr * const sender,const uint32_t ssrc,int type){
-  struct session *sp;
-  pthread_mutex_lock(&Session_protect);
-  for(sp = Sessions; sp != NULL; sp = sp->next){
-    if(sp->rtp_state.ssrc == ssrc && memcmp(&sp->sender,sender,sizeof(*sender)) == 0
-       && sp->type == type){
-      // Found it
-      if(sp->prev != NULL){
-	// Not at top of list; move it there
-	if(sp->next != NULL)
-	  sp->next->prev = sp->prev;
-
-	sp->prev->next = sp->next;
-	sp->prev = NULL;
-	sp->next = Sessions;
-	Sessions->prev = sp;
-	Sessions = sp;
-      }
-      break;
-    }
-  }
-  pthread_mutex_unlock(&Session_protect);
-  return sp;
-}
-// Create a new session, partly initialize
-struct session *create_session(void){
+// Create a new session, partly initialize, and enter it in the session table
+struct session *create_session(struct sockaddr_storage const * const sender,uint32_t const ssrc,int const type){
 
   struct session * const sp = calloc(1,sizeof(*sp));
   assert(sp != NULL); // Shouldn't happen on modern machines!
   
   // Initialize entry
-
-  // Put at head of list
-  pthread_mutex_lock(&Session_protect);
-  sp->prev = NULL;
-  sp->next = Sessions;
-  if(sp->next != NULL)
-    sp->next->prev = sp;
-  Sessions = sp;
-  pthread_mutex_unlock(&Session_protect);
+  memcpy(&sp->sender,sender,sizeof(sp->sender));
+  session_insert(&Sessions,&sp->entry,sp,sender,ssrc,type);
   return sp;
 }
 
 int close_session(struct session * const sp){
   assert(sp != NULL);
   
-  // Remove from linked list of sessions
-  pthread_mutex_lock(&Session_protect);
-  if(sp->next != NULL)
-    sp->next->prev = sp->prev;
-  if(sp->prev != NULL)
-    sp->prev->next = sp->next;
-  else
-    Sessions = sp->next;
-  pthread_mutex_unlock(&Session_protect);
-  pclose(sp->pipe);
-  free(sp);
+  session_remove(&Sessions,&sp->entry);
+  reap_session(sp);
   return 0;
 }
+// Release a session already removed from the table; also called from session_expire() on idle sessions
+void reap_session(void *p){
+  struct session * const sp = (struct session *)p;
+  if(Verbose)
+    fprintf(stderr,"Closing session %s:%s ssrc %u\n",sp->addr,sp->port,sp->rtp_state.ssrc);
+  if(sp->pipe)
+    pclose(sp->pipe);
+  free(sp);
+}
 void closedown(int s){
-#if 0
-  // Causes deadlock when we get called from a section where Session_protect is already locked
-  // Which is the usual case
-  // Not really necessary anyway, since we're exiting
-  pthread_mutex_lock(&Session_protect);
-  while(Sessions != NULL)
-    close_session(Sessions);
-  pthread_mutex_unlock(&Session_protect);
-#endif
-
-  pthread_mutex_destroy(&Session_protect);
+  // Don't bother closing sessions; the session table lock may be held, and we're exiting anyway
   exit(0);
 }
@@ -17,11 +17,12 @@
 #include <fftw3.h>
 #undef I
 #include <netinet/in.h>
+#include <sys/mman.h>
 
 // For SAP/SDP
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
-#include <pwd.h>
 #include <uuid/uuid.h>
 
 #include "misc.h"
@@ -31,7 +32,8 @@
 #include "status.h"
 
 float Blocktime;
-struct frontend Frontend;
+struct frontend Frontends[MAX_FRONTENDS];
+int Nfrontends;
 
 pthread_mutex_t Demod_mutex;
 int const Demod_alloc_quantum = 1000;
@@ -39,6 +41,19 @@ struct demod *Demod_list; // Contiguous array
 int Demod_list_length; // Length of array
 int Active_demod_count; // Active demods
 
+// Find a front end by its config section name; NULL or empty name gets the first one
+struct frontend *lookup_frontend(char const * const name){
+  if(Nfrontends == 0)
+    return NULL;
+  if(name == NULL || strlen(name) == 0)
+    return &Frontends[0];
+  for(int i=0; i < Nfrontends; i++){
+    if(strcasecmp(Frontends[i].name,name) == 0) // iniparser lowercases section names
+      return &Frontends[i];
+  }
+  return NULL;
+}
+
 
 // thread for first half of demodulator
 // Preprocessing of samples performed for all demodulators
@@ -71,8 +86,8 @@ struct demod *alloc_demod(void){
     memset(demod,0,sizeof(struct demod));
     demod->inuse = 1;
     Active_demod_count++;
-    pthread_mutex_unlock(&Demod_mutex);
   }
+  pthread_mutex_unlock(&Demod_mutex);
   return demod;
 }
 
@@ -90,10 +105,16 @@ void free_demod(struct demod **demod){
 }
 
 void *estimate_n0(void *arg){
-  pthread_setname("estn0");
+  struct frontend * const frontend = (struct frontend *)arg;
+  assert(frontend != NULL);
+  {
+    char name[100];
+    snprintf(name,sizeof(name),"estn0 %s",frontend->name);
+    pthread_setname(name);
+  }
 
   int init = 0;
-  struct filter_in * const master = Frontend.in;
+  struct filter_in * const master = frontend->in;
   unsigned int blocknum = 0;
 
   // bins is points/2 +1 in case of real input, so min/max IF must both be neg or positive
@@ -101,9 +122,9 @@ void *estimate_n0(void *arg){
   float avg_pwrs[master->bins];
   memset(avg_pwrs,0,sizeof(avg_pwrs));
 
-  assert(Frontend.sdr.samprate != 0); // main should have waited until it isn't
-  int first_bin = master->bins * Frontend.sdr.min_IF / Frontend.sdr.samprate;
-  int last_bin = master->bins * Frontend.sdr.max_IF / Frontend.sdr.samprate;
+  assert(frontend->sdr.samprate != 0); // main should have waited until it isn't
+  int first_bin = master->bins * frontend->sdr.min_IF / frontend->sdr.samprate;
+  int last_bin = master->bins * frontend->sdr.max_IF / frontend->sdr.samprate;
   int bincnt = last_bin - first_bin;
   if(bincnt < 0)
     bincnt += master->bins;
@@ -129,7 +150,7 @@ void *estimate_n0(void *arg){
     
     // Update average bin powers
     float min_bin_power = INFINITY;
-    complex float * const fdomain = master->fdomain[blocknum % ND];
+    complex float * const fdomain = master->fdomain[(blocknum - 1) % ND]; // Most recently published block
     if(init){
       int bin = first_bin;
       for(int i=0; i < bincnt; i++){
@@ -152,21 +173,27 @@ void *estimate_n0(void *arg){
     }
     // Not sure of the math here. Doubling N0 when the front end is real seems to give the right result;
     // it was 3dB low without it, probably because there are only half as many bins as in complex
-    Frontend.n0 = (Frontend.sdr.isreal ? 2 : 1)
-      * 2 * min_bin_power / ((float)master->bins * Frontend.sdr.samprate);
+    frontend->n0 = (frontend->sdr.isreal ? 2 : 1)
+      * 2 * min_bin_power / ((float)master->bins * frontend->sdr.samprate);
 #if 0
     if((blocknum & 0xff) == 0)
-      fprintf(stdout,"min_IF %.1f max_IF %.1f bins %d first_bin %d last_bin %d Frontend.n0 = %g (%.2f dB)\n",
-	      Frontend.sdr.min_IF,Frontend.sdr.max_IF,
+      fprintf(stdout,"min_IF %.1f max_IF %.1f bins %d first_bin %d last_bin %d n0 = %g (%.2f dB)\n",
+	      frontend->sdr.min_IF,frontend->sdr.max_IF,
 	      master->bins,first_bin,last_bin,
-	      Frontend.n0,power2dB(Frontend.n0));
+	      frontend->n0,power2dB(frontend->n0));
 #endif
   }
 }
 
 
 void *proc_samples(void *arg){
-  pthread_setname("procsamp");
+  struct frontend * const frontend = (struct frontend *)arg;
+  assert(frontend != NULL);
+  {
+    char name[100];
+    snprintf(name,sizeof(name),"procsamp %s",frontend->name);
+    pthread_setname(name);
+  }
 
   while(1){
     // Packet consists of Ethernet, IP and UDP header (already stripped)
@@ -181,255 +208,585 @@ void *proc_samples(void *arg){
 
     struct packet pkt;
 
-    socklen_t socksize = sizeof(Frontend.input.data_source_address);
-    int size = recvfrom(Frontend.input.data_fd,pkt.content,sizeof(pkt.content),0,(struct sockaddr *)&Frontend.input.data_source_address,&socksize);
+    socklen_t socksize = sizeof(frontend->input.data_source_address);
+    int size = recvfrom(frontend->input.data_fd,pkt.content,sizeof(pkt.content),0,(struct sockaddr *)&frontend->input.data_source_address,&socksize);
     if(size <= 0){    // ??
       perror("recvfrom");
       usleep(50000);
       continue;
     }
-    if(size < RTP_MIN_SIZE)
-      continue; // Too small for RTP, ignore
+    proc_packet(frontend,pkt.content,size);
+  } // end of main loop
+}
 
-    uint8_t const * restrict dp = ntoh_rtp(&pkt.rtp,pkt.content);
-    size -= (dp - pkt.content);
-    
-    if(pkt.rtp.pad){
-      // Remove padding
-      size -= dp[size-1];
-      pkt.rtp.pad = 0;
-    }
-    if(size <= 0)
-      continue; // Bogus RTP header?
+// Convert one RTP packet of front end samples and write them to the front end's input filter
+// 'packet' starts with the RTP header; returns the samples written, or -1 if the packet was discarded
+// Also used to feed samples from somewhere other than the network, e.g., the synthetic front end in bench.c
+int proc_packet(struct frontend * const frontend,uint8_t const * const packet,int size){
+  if(size < RTP_MIN_SIZE)
+    return -1; // Too small for RTP, ignore
+
+  long long const start = timing_now();
+  struct rtp_header rtp;
+  uint8_t const * restrict dp = ntoh_rtp(&rtp,packet);
+  size -= (dp - packet);
+
+  if(rtp.pad){
+    // Remove padding
+    size -= dp[size-1];
+    rtp.pad = 0;
+  }
+  if(size <= 0)
+    return -1; // Bogus RTP header?
 
-    int sc = 0;
-    switch(pkt.rtp.type){
-    case IQ_FLOAT:
-      sc = size / (sizeof(complex float));
-      break;
-    case AIRSPY_PACKED:
-      sc = 2 * size / (3 * sizeof(int8_t));
-      break;
-    case PCM_MONO_PT: // 16-bit real
-      sc = size / sizeof(int16_t);
-      break;
-    case REAL_PT12: // 12-bit real
-      sc = 2 * size / (3 * sizeof(int8_t));
-      break;
-    case REAL_PT8:  // 8-bit real
-      sc = size / sizeof(int8_t);
-      break;
-    case IQ_PT8: // 8-bit ints no metadata
-      sc = size / (2 * sizeof(int8_t));
-      break;
-    case PCM_STEREO_PT: // Big-endian 16 bits, no metadata header
-      sc = size / (2 * sizeof(int16_t));
-      break;
-    case IQ_PT12:       // Big endian packed 12 bits, no metadata
-      sc = size / (3 * sizeof(int8_t));
-      break;
-    }
-    int const sampcount = sc; // gets used a lot, flag it const
-    if(pkt.rtp.ssrc != Frontend.input.rtp.ssrc){
-      // SSRC changed; reset sample count.
-      // rtp_process will reset packet count
-      Frontend.input.samples = 0;
+  int sc = 0;
+  switch(rtp.type){
+  case IQ_FLOAT:
+    sc = size / (sizeof(complex float));
+    break;
+  case AIRSPY_PACKED:
+    sc = 2 * size / (3 * sizeof(int8_t));
+    break;
+  case PCM_MONO_PT: // 16-bit real
+    sc = size / sizeof(int16_t);
+    break;
+  case REAL_PT12: // 12-bit real
+    sc = 2 * size / (3 * sizeof(int8_t));
+    break;
+  case REAL_PT8:  // 8-bit real
+    sc = size / sizeof(int8_t);
+    break;
+  case IQ_PT8: // 8-bit ints no metadata
+    sc = size / (2 * sizeof(int8_t));
+    break;
+  case PCM_STEREO_PT: // Big-endian 16 bits, no metadata header
+    sc = size / (2 * sizeof(int16_t));
+    break;
+  case IQ_PT12:       // Big endian packed 12 bits, no metadata
+    sc = size / (3 * sizeof(int8_t));
+    break;
+  }
+  int const sampcount = sc; // gets used a lot, flag it const
+  if(rtp.ssrc != frontend->input.rtp.ssrc){
+    // SSRC changed; reset sample count.
+    // rtp_process will reset packet count
+    frontend->input.samples = 0;
+  }
+  int const time_step = rtp_process(&frontend->input.rtp,&rtp,sampcount);
+  if(time_step < 0 || time_step > 192000){ // NOTE HARDWIRED SAMPRATE
+    // Old samples, or too big a jump; drop. Shouldn't happen if sequence number isn't old
+    return -1;
+  } else if(time_step > 0){
+    // Samples were lost. Inject enough zeroes to keep the sample count and LO phase correct
+    // Arbitrary 1 sec limit just to keep things from blowing up
+    // Good enough for the occasional lost packet or two
+    // Note: we don't use marker bits since we don't suppress silence
+    frontend->input.samples += time_step;
+    if(frontend->in->input.r != NULL){
+      for(int i=0;i < time_step; i++)
+	write_rfilter(frontend->in,0);
+    } else if(frontend->in->input.c != NULL){
+      for(int i=0;i < time_step; i++)
+	write_cfilter(frontend->in,0);
     }
-    int const time_step = rtp_process(&Frontend.input.rtp,&pkt.rtp,sampcount);
-    if(time_step < 0 || time_step > 192000){ // NOTE HARDWIRED SAMPRATE
-      // Old samples, or too big a jump; drop. Shouldn't happen if sequence number isn't old
-      continue;
-    } else if(time_step > 0){
-      // Samples were lost. Inject enough zeroes to keep the sample count and LO phase correct
-      // Arbitrary 1 sec limit just to keep things from blowing up
-      // Good enough for the occasional lost packet or two
-      // Note: we don't use marker bits since we don't suppress silence
-      Frontend.input.samples += time_step;
-      if(Frontend.in->input.r != NULL){
-	for(int i=0;i < time_step; i++)
-	  write_rfilter(Frontend.in,0);
-      } else if(Frontend.in->input.c != NULL){
-	for(int i=0;i < time_step; i++)
-	  write_cfilter(Frontend.in,0);
+  }
+  // Convert and scale samples to internal float-32 format
+  frontend->input.samples += sampcount;
+
+  switch(rtp.type){
+  case IQ_FLOAT:
+    if(frontend->in->input.c != NULL){
+      float const inv_gain = 1.0 / frontend->sdr.gain;
+      float f_energy = 0; // energy accumulator
+      complex float const *up = (complex float *)dp;
+      for(int i=0; i < sampcount; i++){
+	complex float s = *up++;
+	f_energy += cnrmf(s);
+	write_cfilter(frontend->in,s*inv_gain); // undo front end analog gain
       }
+      frontend->sdr.output_level = f_energy / sampcount; // average A/D level, not including analog gain
     }
-    // Convert and scale samples to internal float-32 format
-    Frontend.input.samples += sampcount;
-
-    switch(pkt.rtp.type){
-    case IQ_FLOAT:
-      if(Frontend.in->input.c != NULL){
-	float const inv_gain = 1.0 / Frontend.sdr.gain;
-	float f_energy = 0; // energy accumulator
-	complex float const *up = (complex float *)dp;
-	for(int i=0; i < sampcount; i++){
-	  complex float s = *up++;
-	  f_energy += cnrmf(s);
-	  write_cfilter(Frontend.in,s*inv_gain); // undo front end analog gain
+    break;
+  case AIRSPY_PACKED:
+    if(frontend->in->input.r != NULL){    // Ensure the data is the right type for the filter to avoid segfaults
+      // idiosyncratic packed format from Airspy-R2
+      // Some tricky optimizations here.
+      // Input samples are 12 bits encoded in excess-2048, which makes them
+      // unsigned. 'up' is also unsigned to avoid unwanted sign extension on right shift
+      // Probably assumes little-endian byte order
+      float const inv_gain = SCALE12 / frontend->sdr.gain;
+      uint64_t in_energy = 0; // Accumulate as integer for efficiency
+      uint32_t const *up = (uint32_t *)dp;
+      for(int i=0; i<sampcount; i+= 8){ // assumes multiple of 8
+	int s[8];
+	s[0] =  *up >> 20;
+	s[1] =  *up >> 8;
+	s[2] =  *up++ << 4;
+	s[2] |= *up >> 28;
+	s[3] =  *up >> 16;
+	s[4] =  *up >> 4;
+	s[5] =  *up++ << 8;
+	s[5] |= *up >> 24;
+	s[6] =  *up >> 12;
+	s[7] =  *up++;
+	for(int j=0; j < 8; j++){
+	  int const x = (s[j] & 0xfff) - 2048; // not actually necessary for s[0]
+	  in_energy += x * x;
+	  write_rfilter(frontend->in,x*inv_gain);
 	}
-	Frontend.sdr.output_level = f_energy / sampcount; // average A/D level, not including analog gain
       }
-      break;
-    case AIRSPY_PACKED:
-      if(Frontend.in->input.r != NULL){    // Ensure the data is the right type for the filter to avoid segfaults
-	// idiosyncratic packed format from Airspy-R2
-	// Some tricky optimizations here.
-	// Input samples are 12 bits encoded in excess-2048, which makes them
-	// unsigned. 'up' is also unsigned to avoid unwanted sign extension on right shift
-	// Probably assumes little-endian byte order
-	float const inv_gain = SCALE12 / Frontend.sdr.gain;
-	uint64_t in_energy = 0; // Accumulate as integer for efficiency
-	uint32_t const *up = (uint32_t *)dp;
-	for(int i=0; i<sampcount; i+= 8){ // assumes multiple of 8
-	  int s[8];
-	  s[0] =  *up >> 20;
-	  s[1] =  *up >> 8;
-	  s[2] =  *up++ << 4;
-	  s[2] |= *up >> 28;
-	  s[3] =  *up >> 16;
-	  s[4] =  *up >> 4;
-	  s[5] =  *up++ << 8;
-	  s[5] |= *up >> 24;
-	  s[6] =  *up >> 12;
-	  s[7] =  *up++;
-	  for(int j=0; j < 8; j++){
-	    int const x = (s[j] & 0xfff) - 2048; // not actually necessary for s[0]
-	    in_energy += x * x;
-	    write_rfilter(Frontend.in,x*inv_gain);
-	  }
-	}
-	Frontend.sdr.output_level = 2 * in_energy * SCALE12 * SCALE12 / sampcount;
+      frontend->sdr.output_level = 2 * in_energy * SCALE12 * SCALE12 / sampcount;
+    }
+    break;
+  case REAL_PT12: // 12-bit packed integer real
+    if(frontend->in->input.r != NULL){    // Ensure the data is the right type for the filter to avoid segfaults
+      uint64_t in_energy = 0; // A/D energy accumulator for integer formats only
+      float const inv_gain = SCALE12 / frontend->sdr.gain;
+      for(int i=0; i<sampcount; i+=2){
+	int16_t const s0 = ((dp[0] << 8) | dp[1]) & 0xfff0;
+	int16_t const s1 = ((dp[1] << 8) | dp[2]) << 4;
+	in_energy += s0 * s0;
+	in_energy += s1 * s1;
+	write_rfilter(frontend->in,s0*inv_gain);
+	write_rfilter(frontend->in,s1*inv_gain);
+	dp += 3;
       }
-      break;
-    case REAL_PT12: // 12-bit packed integer real
-      if(Frontend.in->input.r != NULL){    // Ensure the data is the right type for the filter to avoid segfaults
-	uint64_t in_energy = 0; // A/D energy accumulator for integer formats only
-	float const inv_gain = SCALE12 / Frontend.sdr.gain;
-	for(int i=0; i<sampcount; i+=2){
-	  int16_t const s0 = ((dp[0] << 8) | dp[1]) & 0xfff0;
-	  int16_t const s1 = ((dp[1] << 8) | dp[2]) << 4;
-	  in_energy += s0 * s0;
-	  in_energy += s1 * s1;
-	  write_rfilter(Frontend.in,s0*inv_gain);
-	  write_rfilter(Frontend.in,s1*inv_gain);
-	  dp += 3;
-	}
-	Frontend.sdr.output_level = 2 * in_energy * SCALE12 * SCALE12 / sampcount;
+      frontend->sdr.output_level = 2 * in_energy * SCALE12 * SCALE12 / sampcount;
+    }
+    break;
+  case PCM_MONO_PT: // 16 bits big-endian integer real
+    if(frontend->in->input.r != NULL){
+      uint64_t in_energy = 0; // A/D energy accumulator for integer formats only      
+      float const inv_gain = SCALE16 / frontend->sdr.gain;
+      uint16_t const *sp = (uint16_t *)dp;
+      for(int i=0; i<sampcount; i++){
+	// ntohs() returns UNSIGNED so the cast is necessary!
+	int const s = (int16_t)ntohs(*sp++);
+	in_energy += s * s;
+	write_rfilter(frontend->in,s * inv_gain);
       }
-      break;
-    case PCM_MONO_PT: // 16 bits big-endian integer real
-      if(Frontend.in->input.r != NULL){
-	uint64_t in_energy = 0; // A/D energy accumulator for integer formats only	
-	float const inv_gain = SCALE16 / Frontend.sdr.gain;
-	uint16_t const *sp = (uint16_t *)dp;
-	for(int i=0; i<sampcount; i++){
-	  // ntohs() returns UNSIGNED so the cast is necessary!
-	  int const s = (int16_t)ntohs(*sp++);
-	  in_energy += s * s;
-	  write_rfilter(Frontend.in,s * inv_gain);
-	}
-	Frontend.sdr.output_level = 2 * in_energy * SCALE16 * SCALE16 / sampcount;
+      frontend->sdr.output_level = 2 * in_energy * SCALE16 * SCALE16 / sampcount;
+    }
+    break;
+  case REAL_PT8: // 8 bit integer real
+    if(frontend->in->input.r != NULL){
+      float const inv_gain = SCALE8 / frontend->sdr.gain;
+      uint64_t in_energy = 0; // A/D energy accumulator for integer formats only              
+      for(int i=0; i<sampcount; i++){
+	int16_t const s = (int8_t)*dp++;
+	in_energy += s * s;
+	write_rfilter(frontend->in,s * inv_gain);
       }
-      break;
-    case REAL_PT8: // 8 bit integer real
-      if(Frontend.in->input.r != NULL){
-	float const inv_gain = SCALE8 / Frontend.sdr.gain;
-	uint64_t in_energy = 0; // A/D energy accumulator for integer formats only		
-	for(int i=0; i<sampcount; i++){
-	  int16_t const s = (int8_t)*dp++;
-	  in_energy += s * s;
-	  write_rfilter(Frontend.in,s * inv_gain);
-	}
-	Frontend.sdr.output_level = 2 * in_energy * SCALE8 * SCALE8 / sampcount;
+      frontend->sdr.output_level = 2 * in_energy * SCALE8 * SCALE8 / sampcount;
+    }
+    break;
+  default: // shuts up lint
+  case IQ_PT12:      // two 12-bit signed integers (one complex sample) packed big-endian into 3 bytes
+    if(frontend->in->input.c != NULL){
+      uint64_t in_energy = 0; // A/D energy accumulator for integer formats only      
+      float const inv_gain = SCALE12 / frontend->sdr.gain;
+      for(int i=0; i<sampcount; i++){
+	int16_t const rs = ((dp[0] << 8) | dp[1]) & 0xfff0;
+	int16_t const is = ((dp[1] << 8) | dp[2]) << 4;
+	in_energy += rs * rs + is * is;
+	complex float samp;
+	__real__ samp = rs;
+	__imag__ samp = is;
+	write_cfilter(frontend->in,samp * inv_gain);
+	dp += 3;
       }
-      break;
-    default: // shuts up lint
-    case IQ_PT12:      // two 12-bit signed integers (one complex sample) packed big-endian into 3 bytes
-      if(Frontend.in->input.c != NULL){
-	uint64_t in_energy = 0; // A/D energy accumulator for integer formats only	
-	float const inv_gain = SCALE12 / Frontend.sdr.gain;
-	for(int i=0; i<sampcount; i++){
-	  int16_t const rs = ((dp[0] << 8) | dp[1]) & 0xfff0;
-	  int16_t const is = ((dp[1] << 8) | dp[2]) << 4;
-	  in_energy += rs * rs + is * is;
-	  complex float samp;
-	  __real__ samp = rs;
-	  __imag__ samp = is;
-	  write_cfilter(Frontend.in,samp * inv_gain);
-	  dp += 3;
-	}
-	Frontend.sdr.output_level = in_energy * SCALE12 * SCALE12 / sampcount;
+      frontend->sdr.output_level = in_energy * SCALE12 * SCALE12 / sampcount;
+    }
+    break;
+  case PCM_STEREO_PT:      // Two 16-bit signed integers, **BIG ENDIAN** (network order)
+    if(frontend->in->input.c != NULL){
+      uint64_t in_energy = 0; // A/D energy accumulator for integer formats only              
+      float const inv_gain = SCALE16 / frontend->sdr.gain;
+      int16_t const *sp = (int16_t *)dp;
+      for(int i=0; i<sampcount; i++){
+	// ntohs() returns UNSIGNED
+	int const rs = (int16_t)ntohs(*sp++);
+	int const is = (int16_t)ntohs(*sp++);
+	in_energy += rs * rs + is * is;
+	complex float samp;
+	__real__ samp = rs;
+	__imag__ samp = is;
+	write_cfilter(frontend->in,samp * inv_gain);
       }
-      break;
-    case PCM_STEREO_PT:      // Two 16-bit signed integers, **BIG ENDIAN** (network order)
-      if(Frontend.in->input.c != NULL){
-	uint64_t in_energy = 0; // A/D energy accumulator for integer formats only		
-	float const inv_gain = SCALE16 / Frontend.sdr.gain;
-	int16_t const *sp = (int16_t *)dp;
-	for(int i=0; i<sampcount; i++){
-	  // ntohs() returns UNSIGNED
-	  int const rs = (int16_t)ntohs(*sp++);
-	  int const is = (int16_t)ntohs(*sp++);
-	  in_energy += rs * rs + is * is;
-	  complex float samp;
-	  __real__ samp = rs;
-	  __imag__ samp = is;
-	  write_cfilter(Frontend.in,samp * inv_gain);
-	}
-	Frontend.sdr.output_level = in_energy * SCALE16 * SCALE16 / sampcount;
+      frontend->sdr.output_level = in_energy * SCALE16 * SCALE16 / sampcount;
+    }
+    break;
+  case IQ_PT8:      // Two signed 8-bit integers
+    if(frontend->in->input.c != NULL){
+      uint64_t in_energy = 0; // A/D energy accumulator for integer formats only      
+      float const inv_gain = SCALE8 / frontend->sdr.gain;
+      for(int i=0; i<sampcount; i++){
+	int16_t const rs = (int8_t)*dp++;
+	int16_t const is = (int8_t)*dp++;
+	in_energy += rs * rs + is * is;
+	complex float samp;
+	__real__ samp = rs;
+	__imag__ samp = is;
+	write_cfilter(frontend->in,samp * inv_gain);
       }
+      frontend->sdr.output_level = in_energy * SCALE8 * SCALE8 / sampcount;
+    }
+    break;
+  }
+  timing_add(&frontend->input.timing,timing_now() - start);
+  return sampcount;
+}
+
+// Oldest block a demod on this front end has yet to read (or with 'output', to send output for), or 'newest' if none is behind
+// A demod tuned outside the front end's coverage waits for it to retune instead of reading blocks, so it doesn't count
+static unsigned int slowest(struct frontend * const frontend,unsigned int const newest,bool const output){
+  struct filter_in const * const master = frontend->in;
+  int const N = master->ilen + master->impulse_length - 1;
+  unsigned int min = newest;
+  pthread_mutex_lock(&Demod_mutex);
+  for(int i=0; i < Demod_list_length; i++){
+    struct demod const * const demod = &Demod_list[i];
+    if(!demod->inuse || demod->frontend != frontend)
+      continue;
+    struct filter_out const * const f = demod->filter.out;
+    if(f == NULL || f->master != master)
+      continue;
+    double const freq = demod->tune.doppler + frontend->sdr.frequency - demod->tune.freq;
+    if(compute_tuning(N,master->impulse_length,frontend->sdr.samprate,NULL,NULL,NULL,freq) != 0)
+      continue;
+    unsigned int const blocknum = output ? demod->output.block : f->blocknum;
+    if((int)(min - blocknum) > 0)
+      min = blocknum;
+  }
+  pthread_mutex_unlock(&Demod_mutex);
+  return min;
+}
+
+unsigned int slowest_demod(struct frontend * const frontend,unsigned int const newest){
+  return slowest(frontend,newest,false);
+}
+
+// Like slowest_demod(), but the next block whose output hasn't been sent yet
+unsigned int slowest_output(struct frontend * const frontend,unsigned int const newest){
+  return slowest(frontend,newest,true);
+}
+
+// For sources that can wait, unlike a live front end: call before writing 'samples' more to the input filter
+// If they'd finish a block that the slowest demod would have to drop, wait until it catches up
+void wait_for_demods(struct frontend * const frontend,int const samples){
+  struct filter_in const * const master = frontend->in;
+  if(master->wcnt + samples < master->ilen)
+    return;
+  int const depth = ND - (master->fft_workers > 0 ? master->fft_workers : 1);
+  while((int)(master->jobnum - slowest_demod(frontend,master->jobnum)) >= depth - 1){
+    struct timespec const ts = { 0, 20000 };
+    nanosleep(&ts,NULL);
+  }
+}
+
+// Demod lifecycle
+// Idle lifetimes run on a timer wheel of one-second slots, so each tick of demod_reaper() looks only at
+// the demods due in that second rather than the whole table. Expired demods are handed to a separate
+// teardown thread, so one slow kill_demod() (joining the thread, deleting filters) doesn't hold up the rest.
+// Demod thread stacks are recycled through a small pool, and filter_out objects are pooled by filter.c
+#define DEMOD_WHEEL_SLOTS 256   // Seconds; longer lifetimes just go around again
+static struct demod *Wheel[DEMOD_WHEEL_SLOTS];
+static long long Wheel_time;    // Last second processed
+static pthread_mutex_t Wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct demod *Teardown;  // Expired demods waiting for the teardown thread, linked through wheel_next
+static pthread_mutex_t Teardown_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Teardown_cond = PTHREAD_COND_INITIALIZER;
+
+#define STACK_POOL_SIZE 64
+static size_t Stack_size;       // Including guard page
+static size_t const Stack_guard = 4096;
+static void *Stack_pool[STACK_POOL_SIZE];
+static int Stack_pool_count;
+static pthread_mutex_t Stack_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t Restart_mutex = PTHREAD_MUTEX_INITIALIZER; // For demod->restart and demod->running
+
+// New demod threads that haven't got their filters yet, so startup can wait for them without polling
+static pthread_mutex_t Ready_mutex = PTHREAD_MUTEX_INITIALIZER; // Also for demod->starting
+static pthread_cond_t Ready_cond = PTHREAD_COND_INITIALIZER;
+static int Starting;
+
+static long long wheel_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec;
+}
+
+// Caller holds Wheel_mutex
+static void wheel_unlink(struct demod * const demod){
+  if(!demod->on_wheel)
+    return;
+  int const slot = demod->wheel_slot;
+  if(demod->wheel_next)
+    demod->wheel_next->wheel_prev = demod->wheel_prev;
+  if(demod->wheel_prev)
+    demod->wheel_prev->wheel_next = demod->wheel_next;
+  else
+    Wheel[slot] = demod->wheel_next;
+  demod->wheel_next = demod->wheel_prev = NULL;
+  demod->on_wheel = false;
+}
+
+// Caller holds Wheel_mutex
+static void wheel_link(struct demod * const demod){
+  int const slot = demod->expires % DEMOD_WHEEL_SLOTS;
+  demod->wheel_prev = NULL;
+  demod->wheel_next = Wheel[slot];
+  if(demod->wheel_next)
+    demod->wheel_next->wheel_prev = demod;
+  Wheel[slot] = demod;
+  demod->wheel_slot = slot;
+  demod->on_wheel = true;
+}
+
+// Set or restart a demod's idle lifetime; 0 = live forever
+// Cheap enough to call on every command: a demod already on the wheel only gets a new expiration time,
+// and demod_reaper() moves it to the right slot when its old one comes up
+void set_demod_lifetime(struct demod * const demod,int const seconds){
+  assert(demod != NULL);
+  pthread_mutex_lock(&Wheel_mutex);
+  if(demod->dying){
+    pthread_mutex_unlock(&Wheel_mutex);
+    return;
+  }
+  long long const expires = wheel_now() + seconds;
+  if(demod->on_wheel && seconds > 0 && expires >= demod->expires){
+    // Its slot comes up no later than the new expiration time, so it can stay there
+    demod->lifetime = seconds;
+    demod->expires = expires;
+  } else {
+    wheel_unlink(demod);
+    demod->lifetime = seconds;
+    if(seconds > 0){
+      demod->expires = expires;
+      wheel_link(demod);
+    }
+  }
+  pthread_mutex_unlock(&Wheel_mutex);
+}
+
+// Get a demod thread stack from the pool, or make a new one; NULL means use the system default
+static void *get_stack(void){
+  pthread_mutex_lock(&Stack_mutex);
+  if(Stack_size == 0){
+    // Same size the system would give us
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&Stack_size);
+    pthread_attr_destroy(&attr);
+    Stack_size += Stack_guard;
+  }
+  void *stack = NULL;
+  if(Stack_pool_count > 0)
+    stack = Stack_pool[--Stack_pool_count];
+  pthread_mutex_unlock(&Stack_mutex);
+  if(stack != NULL)
+    return stack;
+
+  stack = mmap(NULL,Stack_size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK|MAP_NORESERVE,-1,0);
+  if(stack == MAP_FAILED)
+    return NULL;
+  mprotect(stack,Stack_guard,PROT_NONE); // Stacks grow down; catch overflows
+  return stack;
+}
+
+// Return the stack of a joined thread to the pool
+static void put_stack(void *stack){
+  if(stack == NULL)
+    return;
+  pthread_mutex_lock(&Stack_mutex);
+  if(Stack_pool_count < STACK_POOL_SIZE){
+    Stack_pool[Stack_pool_count++] = stack;
+    stack = NULL;
+  }
+  pthread_mutex_unlock(&Stack_mutex);
+  if(stack != NULL)
+    munmap(stack,Stack_size);
+}
+
+// Tears down expired demods one at a time, off the reaper's schedule
+static void *demod_teardown(void *arg){
+  pthread_setname("teardown");
+  while(1){
+    pthread_mutex_lock(&Teardown_mutex);
+    while(Teardown == NULL)
+      pthread_cond_wait(&Teardown_cond,&Teardown_mutex);
+    struct demod *demod = Teardown;
+    Teardown = demod->wheel_next;
+    pthread_mutex_unlock(&Teardown_mutex);
+    demod->wheel_next = NULL;
+    if(Verbose > 1)
+      fprintf(stdout,"reaping ssrc %u\n",demod->output.rtp.ssrc);
+    kill_demod(&demod);
+  }
+  return NULL;
+}
+
+// The demod's thread has its filter, or has given up on getting one
+static void demod_ready(struct demod * const demod){
+  pthread_mutex_lock(&Ready_mutex);
+  if(demod->starting){
+    demod->starting = false;
+    if(--Starting == 0)
+      pthread_cond_broadcast(&Ready_cond);
+  }
+  pthread_mutex_unlock(&Ready_mutex);
+}
+
+// Wait up to timeout_ms for every demod thread started so far to set up its filter
+// Returns the number still starting
+int wait_demods_ready(int const timeout_ms){
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME,&deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+  if(deadline.tv_nsec >= BILLION){
+    deadline.tv_sec++;
+    deadline.tv_nsec -= BILLION;
+  }
+  pthread_mutex_lock(&Ready_mutex);
+  while(Starting > 0 && pthread_cond_timedwait(&Ready_cond,&Ready_mutex,&deadline) == 0)
+    ;
+  int const starting = Starting;
+  pthread_mutex_unlock(&Ready_mutex);
+  return starting;
+}
+
+// Runs the demodulator selected by demod_type, switching to another in place when start_demod() asks
+static void *demod_thread(void *arg){
+  struct demod * const demod = (struct demod *)arg;
+  assert(demod != NULL);
+  while(1){
+    switch(demod->demod_type){
+    case WFM_DEMOD:
+      demod_wfm(demod);
       break;
-    case IQ_PT8:      // Two signed 8-bit integers
-      if(Frontend.in->input.c != NULL){
-	uint64_t in_energy = 0; // A/D energy accumulator for integer formats only	
-	float const inv_gain = SCALE8 / Frontend.sdr.gain;
-	for(int i=0; i<sampcount; i++){
-	  int16_t const rs = (int8_t)*dp++;
-	  int16_t const is = (int8_t)*dp++;
-	  in_energy += rs * rs + is * is;
-	  complex float samp;
-	  __real__ samp = rs;
-	  __imag__ samp = is;
-	  write_cfilter(Frontend.in,samp * inv_gain);
-	}
-	Frontend.sdr.output_level = in_energy * SCALE8 * SCALE8 / sampcount;
-      }
+    case FM_DEMOD:
+      demod_fm(demod);
+      break;
+    case LINEAR_DEMOD:
+      demod_linear(demod);
+      break;
+    default:
       break;
     }
-
-    
-  } // end of main loop
+    demod_ready(demod); // In case it quit before setup_demod_filter()
+    pthread_mutex_lock(&Restart_mutex);
+    if(!demod->restart || demod->terminate){
+      demod->running = false;
+      pthread_mutex_unlock(&Restart_mutex);
+      break;
+    }
+    demod->restart = 0;
+    pthread_mutex_unlock(&Restart_mutex);
+  }
+  delete_filter_output(&demod->filter.out);
+  return NULL;
 }
 
 // start demodulator thread on already-initialized demod structure
 int start_demod(struct demod * demod){
-  if(demod == NULL)
+  if(demod == NULL || demod->frontend == NULL)
     return -1;
 
-  // Stop previous demodulator, if any
-  if(demod->demod_thread != (pthread_t)0){
-#if 1
-    demod->terminate = 1;
-    pthread_join(demod->demod_thread,NULL);
-    demod->terminate = 0;
-#else
-    pthread_cancel(demod->demod_thread);
+  if(demod->task){
+    // Run by the executor; stopping it is cheap, and it may go back there with its new mode
+    exec_stop(demod);
+  } else if(demod->demod_thread != (pthread_t)0){
+    // Cheap path for mode changes: the running thread returns from its demodulator and enters the new one
+    pthread_mutex_lock(&Restart_mutex);
+    if(demod->running){
+      demod->restart = 1;
+      pthread_mutex_unlock(&Restart_mutex);
+      return 0;
+    }
+    pthread_mutex_unlock(&Restart_mutex);
+    // It exited on its own (e.g., lost its output stream); start over
     pthread_join(demod->demod_thread,NULL);
-#endif    
+    // Its stack is free again; keep it for the new thread
+  } else {
+    demod->stack = NULL; // Any stack pointer was copied from a template along with everything else
+    demod->starting = false; // Likewise
   }
 
-  // Start demodulators; only one actually runs at a time
-  switch(demod->demod_type){
-  case WFM_DEMOD:
-    pthread_create(&demod->demod_thread,NULL,demod_wfm,demod);
-    break;
-  case FM_DEMOD:
-    pthread_create(&demod->demod_thread,NULL,demod_fm,demod);
-    break;
-  case LINEAR_DEMOD:
-    pthread_create(&demod->demod_thread,NULL,demod_linear,demod);
-    break;
+  if(Executor_threads > 0 && demod->demod_thread == (pthread_t)0 && exec_start(demod) == 0)
+    return 0;
+
+  if(demod->stack == NULL)
+    demod->stack = get_stack();
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if(demod->stack != NULL)
+    pthread_attr_setstack(&attr,(char *)demod->stack + Stack_guard,Stack_size - Stack_guard);
+
+  demod->terminate = 0;
+  demod->restart = 0;
+  demod->running = true;
+  pthread_mutex_lock(&Ready_mutex);
+  if(!demod->starting){
+    demod->starting = true;
+    Starting++;
   }
+  pthread_mutex_unlock(&Ready_mutex);
+  pthread_create(&demod->demod_thread,&attr,demod_thread,demod);
+  pthread_attr_destroy(&attr);
+  return 0;
+}
+
+// Compute the demod's tuning against its front end's current frequency
+// Returns -1, after zeroing our power and level, when the front end doesn't cover any of our passband
+int demod_tuning(struct demod * const demod,int * const flip,int * const rotate,double * const remainder){
+  struct frontend * const frontend = demod->frontend;
+  pthread_mutex_lock(&frontend->sdr.status_mutex);
+  demod->tune.second_LO = frontend->sdr.frequency - demod->tune.freq;
+  double const freq = demod->tune.doppler + demod->tune.second_LO; // Total logical oscillator frequency
+  int const r = compute_tuning(frontend->in->ilen + frontend->in->impulse_length - 1,
+			       frontend->in->impulse_length,
+			       frontend->sdr.samprate,
+			       flip,rotate,remainder,freq);
+  if(r != 0){
+    demod->sig.bb_power = 0;
+    demod->output.level = 0;
+  }
+  pthread_mutex_unlock(&frontend->sdr.status_mutex);
+  return r == 0 ? 0 : -1;
+}
+
+// Block until the front end status changes, e.g., it retunes to cover us
+// Times out after a second so a demod thread still polls its terminate flag without front end status messages
+void demod_wait_frontend(struct demod * const demod){
+  struct frontend * const frontend = demod->frontend;
+  struct timespec timeout; // Needed to avoid deadlock if no front end is available
+  clock_gettime(CLOCK_REALTIME,&timeout);
+  timeout.tv_sec += 1; // 1 sec in the future
+  pthread_mutex_lock(&frontend->sdr.status_mutex);
+  pthread_cond_timedwait(&frontend->sdr.status_cond,&frontend->sdr.status_mutex,&timeout);
+  pthread_mutex_unlock(&frontend->sdr.status_mutex);
+}
+
+// Give the demod an output filter of 'blocksize' samples and its current passband
+// The filter it already has is kept if it has the same geometry, e.g., when only the mode changed
+int setup_demod_filter(struct demod * const demod,int const blocksize){
+  struct filter_out * const f = demod->filter.out;
+  if(f == NULL || f->master != demod->frontend->in || f->olen != blocksize || f->out_type != COMPLEX){
+    delete_filter_output(&demod->filter.out);
+    demod->filter.out = create_filter_output(demod->frontend->in,NULL,blocksize,COMPLEX);
+    if(demod->filter.out == NULL){
+      fprintf(stdout,"unable to create filter for ssrc %lu\n",(unsigned long)demod->output.rtp.ssrc);
+      demod_ready(demod); // Gave up
+      return -1;
+    }
+  }
+  set_filter(demod->filter.out,
+	     demod->filter.min_IF/demod->output.samprate,
+	     demod->filter.max_IF/demod->output.samprate,
+	     demod->filter.kaiser_beta);
+  demod_ready(demod);
   return 0;
 }
 
@@ -440,22 +797,31 @@ int kill_demod(struct demod **p){
   if(demod == NULL)
     return -1;
 
+  pthread_mutex_lock(&Wheel_mutex);
+  wheel_unlink(demod);
+  demod->dying = true;
+  pthread_mutex_unlock(&Wheel_mutex);
 #if 1
   demod->terminate = 1;
 #else
   if(demod->demod_thread != (pthread_t)0)
     pthread_cancel(demod->demod_thread);
 #endif
-  pthread_join(demod->demod_thread,NULL);
+  if(demod->task)
+    exec_stop(demod);
+  if(demod->demod_thread != (pthread_t)0){
+    pthread_join(demod->demod_thread,NULL);
+    put_stack(demod->stack);
+  }
+  demod->stack = NULL;
   if(demod->filter.out)
     delete_filter_output(&demod->filter.out);
-  if(demod->rtcp_thread != (pthread_t)0){
-    pthread_cancel(demod->rtcp_thread);
-    pthread_join(demod->rtcp_thread,NULL);
-  }
-  if(demod->sap_thread != (pthread_t)0){
-    pthread_cancel(demod->sap_thread);
-    pthread_join(demod->sap_thread,NULL);
+  stop_reports(demod);
+  shm_ring_put(Shm,demod->output.shm,&demod->output.shm_missing);
+  demod->output.shm = NULL;
+  if(demod->output.file_dir[0] != '\0' && demod->output.file_fd > 2){
+    close(demod->output.file_fd); // Unlike the sockets, never shared
+    demod->output.file_fd = -1;
   }
     
 #if 0
@@ -489,19 +855,19 @@ double set_freq(struct demod * const demod,double const f){
     return f;
 
   // Determine new IF
-  double new_if = f - Frontend.sdr.frequency;
+  double new_if = f - demod->frontend->sdr.frequency;
 
   // Flip sign to convert LO2 frequency to IF carrier frequency
   // Tune an extra kHz to account for front end roundoff
   // Ideally the front end would just round in a preferred direction
   // but it doesn't know where our IF will be so it can't make the right choice
   double const fudge = 1000;
-  if(new_if > Frontend.sdr.max_IF - demod->filter.max_IF){
+  if(new_if > demod->frontend->sdr.max_IF - demod->filter.max_IF){
     // Retune LO1 as little as possible
-    new_if = Frontend.sdr.max_IF - demod->filter.max_IF - fudge;
-  } else if(new_if < Frontend.sdr.min_IF - demod->filter.min_IF){
+    new_if = demod->frontend->sdr.max_IF - demod->filter.max_IF - fudge;
+  } else if(new_if < demod->frontend->sdr.min_IF - demod->filter.min_IF){
     // Also retune LO1 as little as possible
-    new_if = Frontend.sdr.min_IF - demod->filter.min_IF + fudge;
+    new_if = demod->frontend->sdr.min_IF - demod->filter.min_IF + fudge;
   } else
     return f; // OK where it is
 
@@ -521,7 +887,7 @@ double set_first_LO(struct demod const * const demod,double const first_LO){
   if(demod == NULL)
     return NAN;
 
-  double const current_lo1 = Frontend.sdr.frequency;
+  double const current_lo1 = demod->frontend->sdr.frequency;
 
   // Just return actual frequency without changing anything
   if(first_LO == current_lo1 || first_LO <= 0)
@@ -531,18 +897,18 @@ double set_first_LO(struct demod const * const demod,double const first_LO){
   memset(packet,0,sizeof(packet));
   bp = packet;
   *bp++ = 1; // Command
-  Frontend.sdr.command_tag = random();
-  encode_int32(&bp,COMMAND_TAG,Frontend.sdr.command_tag);
+  demod->frontend->sdr.command_tag = random();
+  encode_int32(&bp,COMMAND_TAG,demod->frontend->sdr.command_tag);
   encode_double(&bp,RADIO_FREQUENCY,first_LO);
   encode_eol(&bp);
   int len = bp - packet;
-  send(Frontend.input.ctl_fd,packet,len,0);
+  send(demod->frontend->input.ctl_fd,packet,len,0);
   return first_LO;
 }  
 
 // Compute noise spectral density - experimental
 float const compute_n0(struct demod const * const demod){
-  return Frontend.n0;
+  return demod->frontend->n0;
 }
 
 // Compute FFT bin shift and time-domain fine tuning offset for specified LO frequency
@@ -554,8 +920,10 @@ float const compute_n0(struct demod const * const demod){
 // freq = frequency to mix by (double)
 int compute_tuning(int N, int M, int samprate,int *flip,int *rotate,double *remainder, double freq){
   double const hzperbin = (double)samprate / N;
-  int const quantum = N / (M - 1);       // rotate by multiples of this number of bins due to overlap-save
-                                         // check for non-zero remainder and warn?
+  // Rotate by multiples of this number of bins due to overlap-save, so the phase advances
+  // an integral number of cycles per block of L = N - M + 1 new samples
+  // Same as N/(M-1) when M-1 divides L, the classic geometry; setup_frontend() may pick others
+  int const quantum = N / gcd(N,N - M + 1);
   int const r = quantum * round(freq/(hzperbin * quantum));
   if(rotate)
     *rotate = r;
@@ -574,165 +942,61 @@ int compute_tuning(int N, int M, int samprate,int *flip,int *rotate,double *rema
     return -1; // Demod thread will wait for the front end status to change
   return 0;
 }
-/* Session announcement protocol - highly experimental, off by default
-   The whole point was to make it easy to use VLC and similar tools, but they either don't actually implement SAP (e.g. in iOS)
-   or implement some vague subset that you have to guess how to use
-   Will probably work better with Opus streams from the opus transcoder, since they're always 48000 Hz stereo; no switching midstream
-*/
-void *sap_send(void *p){
-  struct demod *demod = (struct demod *)p;
-  assert(demod != NULL);
-
-  long long start_time;
-  {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME,&ts);
-    start_time = ts.tv_sec + NTP_EPOCH;
-  }
-  // These should change when a change is made elsewhere
-  uint16_t const id = random(); // Should be a hash, but it changes every time anyway
-  int const sess_version = 1;
-
-  for(;;){
-    char message[1500],*wp;
-    int space = sizeof(message);
-    wp = message;
-    
-    *wp++ = 0x20; // SAP version 1, ipv4 address, announce, not encrypted, not compressed
-    *wp++ = 0; // No authentication
-    *wp++ = id >> 8;
-    *wp++ = id & 0xff;
-    space -= 4;
-    
-    // our sending ipv4 address
-    struct sockaddr_in const *sin = (struct sockaddr_in *)&demod->output.data_source_address;
-    uint32_t *src = (uint32_t *)wp;
-    *src = sin->sin_addr.s_addr; // network byte order
-    wp += 4;
-    space -= 4;
-    
-    int len = snprintf(wp,space,"application/sdp");
-    wp += len + 1; // allow space for the trailing null
-    space -= (len + 1);
-    
-    // End of SAP header, beginning of SDP
-    
-    // Version v=0 (always)
-    len = snprintf(wp,space,"v=0\r\n");
-    wp += len;
-    space -= len;
-    
-    {
-      // Originator o=
-      char hostname[128];
-      gethostname(hostname,sizeof(hostname));
-      
-      struct passwd pwd,*result = NULL;
-      char buf[1024];
-      
-      getpwuid_r(getuid(),&pwd,buf,sizeof(buf),&result);
-      len = snprintf(wp,space,"o=%s %lld %d IN IP4 %s\r\n",
-		     result ? result->pw_name : "-",
-		     start_time,sess_version,hostname);
-      
-      wp += len;
-      space -= len;
-    }
-    
-    // s= (session name)
-    len = snprintf(wp,space,"s=radio %s\r\n",Frontend.sdr.description);
-    wp += len;
-    space -= len;
-    
-    // i= (human-readable session information)
-    len = snprintf(wp,space,"i=PCM output stream from ka9q-radio on %s\r\n",Frontend.sdr.description);
-    wp += len;
-    space -= len;
-    
-    {
-      char mcast[128];
-      strlcpy(mcast,formatsock(&demod->output.data_dest_address),sizeof(mcast));
-      // Remove :port field, confuses the vlc listener
-      char *cp = strchr(mcast,':');
-      if(cp)
-	*cp = '\0';
-      len = snprintf(wp,space,"c=IN IP4 %s/%d\r\n",mcast,Mcast_ttl);
-      wp += len;
-      space -= len;
-    }  
-    
-
-#if 0 // not currently used
-    long long current_time;
-    {
-      struct timespec ts;
-      clock_gettime(CLOCK_REALTIME,&ts);
-      current_time = ts.tv_sec + NTP_EPOCH;
-    }
-#endif
-
-    // t= (time description)
-    len = snprintf(wp,space,"t=%lld %lld\r\n",start_time,0LL); // unbounded
-    wp += len;
-    space -= len;
-    
-    // m = media description
-#if 1  
-    {
-      // Demod type can change, but not the sample rate
-      int mono_type = pt_from_info(demod->output.samprate,1);
-      int stereo_type = pt_from_info(demod->output.samprate,2);
-      int fm_type = pt_from_info(demod->output.samprate,1);
-      
-      len = snprintf(wp,space,"m=audio 5004/1 RTP/AVP %d %d %d\r\n",mono_type,stereo_type,fm_type);
-      wp += len;
-      space -= len;
-      
-      len = snprintf(wp,space,"a=rtpmap:%d L16/%d/%d\r\n",mono_type,demod->output.samprate,1);
-      wp += len;
-      space -= len;
-      
-      len = snprintf(wp,space,"a=rtpmap:%d L16/%d/%d\r\n",stereo_type,demod->output.samprate,2);
-      wp += len;
-      space -= len;
-      
-      len = snprintf(wp,space,"a=rtpmap:%d L16/%d/%d\r\n",fm_type,demod->output.samprate,1);
-      wp += len;
-      space -= len;
-    }
-#else
-    {
-      // set from current state. This will require changing the session version and IDs, and
-      // it's not clear that clients like VLC will do the right thing anyway
-      int type = pt_from_info(demod->output.samprate,demod->output.channels,demod->demod_type);
-
-      len = snprintf(wp,space,"m=audio 5004/1 RTP/AVP %d\r\n",type);
-      wp += len;
-      space -= len;
-      
-      len = snprintf(wp,space,"a=rtpmap:%d L16/%d/%d\r\n",type,demod->output.samprate,demod->output.channels);
-      wp += len;
-      space -= len;
-    }
-#endif    
-    send(demod->output.sap_fd,message,wp - message,0);
-    sleep(5);
-  }
-}
-
+// Lifecycle timer: once a second, expire the demods in the slots for the seconds just past
 void *demod_reaper(void *arg){
+  pthread_setname("reaper");
+  pthread_t teardown_thread;
+  pthread_create(&teardown_thread,NULL,demod_teardown,NULL);
+
+  pthread_mutex_lock(&Wheel_mutex);
+  Wheel_time = wheel_now();
+  pthread_mutex_unlock(&Wheel_mutex);
   while(1){
-    for(int i=0;i<Demod_list_length;i++){
-      struct demod *demod = &Demod_list[i];
-      if(demod->inuse && demod->tune.freq == 0 && demod->lifetime > 0){
-	demod->lifetime--;
-	if(demod->lifetime == 0){
-	  kill_demod(&demod);
+    sleep(1);
+    long long const now = wheel_now();
+    struct demod *expired = NULL;
+
+    pthread_mutex_lock(&Wheel_mutex);
+    if(now - Wheel_time > DEMOD_WHEEL_SLOTS)
+      Wheel_time = now - DEMOD_WHEEL_SLOTS; // Long stall; visit each slot once
+    while(Wheel_time < now){
+      Wheel_time++;
+      int const slot = Wheel_time % DEMOD_WHEEL_SLOTS;
+      struct demod *next;
+      for(struct demod *demod = Wheel[slot]; demod != NULL; demod = next){
+	next = demod->wheel_next;
+	if(demod->expires > now){
+	  // Restarted since it was scheduled, or not due until a later lap
+	  if(demod->expires % DEMOD_WHEEL_SLOTS != slot){
+	    wheel_unlink(demod);
+	    wheel_link(demod);
+	  }
+	  continue;
+	}
+	wheel_unlink(demod);
+	// Only dynamic demods still parked at 0 Hz, and those started by a detector, time out
+	if(demod->inuse && (demod->tune.freq == 0 || demod->detector != NULL)){
+	  demod->dying = true;
+	  demod->wheel_next = expired;
+	  expired = demod;
+	} else if(demod->lifetime > 0){
+	  demod->expires = now + demod->lifetime; // Not eligible yet; look again later
+	  wheel_link(demod);
 	}
       }
-
     }
-    sleep(1);
+    pthread_mutex_unlock(&Wheel_mutex);
+
+    if(expired != NULL){
+      pthread_mutex_lock(&Teardown_mutex);
+      struct demod *tail = expired;
+      while(tail->wheel_next != NULL)
+	tail = tail->wheel_next;
+      tail->wheel_next = Teardown;
+      Teardown = expired;
+      pthread_cond_signal(&Teardown_cond);
+      pthread_mutex_unlock(&Teardown_mutex);
+    }
   }
   return NULL;
 }
@@ -20,10 +20,12 @@
 #include "osc.h"
 #include "status.h"
 #include "filter.h"
+#include "shm.h"
 
 // Multicast network connection with front end hardware
-// Only one off these, shared with all demod instances
+// One per [frontend:NAME] config section (or [global] input), shared by the demods bound to it
 struct frontend {
+  char name[64];    // Config section name, for binding demods and in log messages
 
   // Stuff we maintain about our upstream source
   struct {
@@ -41,6 +43,8 @@ struct frontend {
     char data_dest_string[_POSIX_HOST_NAME_MAX+20];  // Allow room for :portnum
     struct rtp_state rtp; // State of the I/Q RTP receiver
     uint64_t samples;     // Count of raw I/Q samples received
+    struct file_source *file; // Recording read instead of a multicast stream, or NULL (see filesource.c)
+    struct timing timing; // proc_packet(), per packet: sample conversion, and any wait to hand off a block
   } input;
 
   int M;            // Impulse length of input filter
@@ -80,15 +84,66 @@ struct frontend {
   float tp2;
   struct filter_in * restrict in;
   pthread_t status_thread;
-};
 
-extern struct frontend Frontend; // Only one per radio instance
+  // Optional averaged spectrum stream, computed from 'in' (see spectrum.c)
+  struct {
+    int fd;                // Output socket, or -1 if not enabled
+    struct sockaddr_storage dest_address;
+    char dest_string[_POSIX_HOST_NAME_MAX+20];
+    int bins;              // Output bins per frame
+    float rate;            // Frames/sec
+    int format;            // Bits per bin, 8 or 16
+    uint32_t ssrc;
+    uint16_t seq;
+    uint64_t frames;
+    pthread_t thread;
+  } spectrum;
+
+  struct demod *tasks;     // Demods run by the executor on blocks from 'in' (see executor.c)
+};
 
+#define MAX_FRONTENDS 8
+extern struct frontend Frontends[MAX_FRONTENDS];
+extern int Nfrontends;
+struct frontend *lookup_frontend(char const *name);
+
+
+// Wideband activity detector: watches a band in a front end's forward FFT and
+// starts a demod, cloned from 'template', on each raster channel that becomes busy
+struct detector {
+  char name[64];               // Config section
+  struct frontend *frontend;
+  struct demod *template;      // Never started itself
+  double low,high;             // Band edges (channel centers), Hz
+  double raster;               // Channel spacing, Hz; channels are at low + k * raster
+  float on,off;                // Power ratios to noise in the channel bandwidth for turning a channel on and off
+  float alpha;                 // Smoothing factor per block
+  int hold;                    // Demod lifetime after activity stops, sec
+  int nchan;
+  struct {
+    double freq;
+    float ratio;               // Smoothed power/noise
+    bool active;
+  } *chan;
+  uint64_t spawned;            // Demods started
+  pthread_t thread;
+};
 
 // Demodulator state block; there can be many of these
 struct demod {
   int inuse;
-  int lifetime;          // Remaining lifetime, seconds
+  struct frontend *frontend; // Source of our samples; set before start_demod()
+  struct detector *detector; // Spawned by this detector, which keeps 'lifetime' topped up while the channel is busy
+  char section[64];      // Config section we (or our template) came from, for metrics labels
+  int lifetime;          // Idle lifetime, seconds, 0 = forever; set and restarted with set_demod_lifetime()
+
+  // Lifecycle manager state (radio.c)
+  long long expires;     // When demod_reaper() next looks at us, sec
+  bool on_wheel;
+  int wheel_slot;
+  bool dying;            // Queued for teardown; ignore further set_demod_lifetime() calls
+  struct demod *wheel_next,*wheel_prev;
+  void *stack;           // demod_thread's stack, from a pool
   // Tuning parameters
   struct {
     double freq;         // Desired carrier frequency (settable)
@@ -146,6 +201,8 @@ struct demod {
 
   struct {               // Used only in FM demodulator
     float pdeviation;    // Peak frequency deviation Hz (FM)
+    complex float state; // Demodulator input phase memory
+    int squelch_state;   // Number of blocks for which squelch remains open
   } fm;
 
   // Output
@@ -164,11 +221,17 @@ struct demod {
     int data_fd;    // File descriptor for multicast output
     int rtcp_fd;    // File descriptor for RTP control protocol
     int sap_fd;     // Session announcement protocol (SAP) - experimental
+    char file_dir[256]; // If set, write PCM to a file in this directory instead of multicasting it
+    int file_fd;        // Opened on the first output
+    struct shm_ring *shm; // Our ring in the shared-memory segment, taken on the first output
+    bool shm_missing;     // They were all taken, and readers have been told
+    unsigned int block;   // filter.out->blocknum as of the last output sent, for sources that wait for it
     int channels;   // 1 = mono, 2 = stereo (settable)
     float level;    // Output level
     float deemph_state_left;
     float deemph_state_right;
     uint64_t samples;
+    struct timing timing; // send_mono_output() or send_stereo_output(), per block
   } output;
 
   // Used only when FM deemphasis is enabled
@@ -181,12 +244,23 @@ struct demod {
     float rate;
   } deemph;
 
-  pthread_t sap_thread;
-  pthread_t rtcp_thread;
   pthread_t demod_thread;
   // Set this flag to ask demod_thread to terminate.
   // pthread_cancel() can't be used because we're usually waiting inside of a mutex, and deadlock will occur
   int terminate;
+  // Set by start_demod() to ask a running demod_thread to switch to the current demod_type in place,
+  // keeping the thread and, when the geometry is unchanged, its filter
+  int restart;
+  bool running;          // demod_thread is inside a demodulator, so 'restart' will be seen
+  bool starting;         // New demod_thread hasn't set up its filter yet; counted by wait_demods_ready()
+
+  // Executor state (executor.c): when 'task' is set, the demod has no thread of its own
+  bool task;
+  bool task_queued;      // On the ready queue
+  bool task_busy;        // An executor thread is running a block for us
+  struct demod *task_next;  // Ready queue
+  struct demod *tasks_next; // Front end's list of tasks
+  struct timing timing;     // Demodulator proper, per block: from the filter output to handing audio to the output
   float tp1,tp2; // Spare test points
 };
 
@@ -206,6 +280,7 @@ extern float Blocktime; // Common to all receiver slices
 extern uint64_t Metadata_packets;
 extern uint64_t Commands;
 extern uint32_t Command_tag; // Echoed in responses to commands (settable)
+extern struct shm_segment *Shm; // Shared-memory copy of the PCM streams, if configured
 
 // Functions/methods to control a demod instance
 struct demod *alloc_demod(void);
@@ -216,17 +291,29 @@ int preset_mode(struct demod * restrict,const char * restrict);
 int compute_tuning(int N, int M, int samprate,int *flip,int *rotate,double *remainder, double freq);
 //int compute_tuning(const struct demod * restrict const demod,int * restrict flip,int * restrict rotate,double * restrict remainder, double freq);
 int start_demod(struct demod * restrict demod);
+int wait_demods_ready(int timeout_ms);
 int kill_demod(struct demod ** restrict demod);
+void set_demod_lifetime(struct demod *demod,int seconds);
+int start_reports(struct demod *demod,bool rtcp,bool sap);
+void stop_reports(struct demod *demod);
 int init_demod_streams(struct demod * restrict demod);
 double set_first_LO(struct demod const * restrict, double);
 
 void *proc_samples(void *);
+int proc_packet(struct frontend *frontend,uint8_t const *packet,int size);
+unsigned int slowest_demod(struct frontend *frontend,unsigned int newest);
+unsigned int slowest_output(struct frontend *frontend,unsigned int newest);
+void wait_for_demods(struct frontend *frontend,int samples);
+int open_file_source(struct frontend *frontend,char const *path);
+void *file_source(void *);
 void *estimate_n0(void *);
-void *rtcp_send(void *);
-void *sap_send(void *);
+void *spectrum_send(void *);
+void *detector_run(void *);
 void *radio_status(void *);
 void *sdr_status(void *);
 void *demod_reaper(void *);
+struct metrics;
+void radio_metrics(struct metrics *,void *);
 
 const float compute_n0(struct demod const * restrict);
 
@@ -235,6 +322,19 @@ const float compute_n0(struct demod const * restrict);
 void *demod_fm(void *);
 void *demod_wfm(void *);
 void *demod_linear(void *);
+int setup_demod_filter(struct demod *demod,int blocksize);
+int demod_tuning(struct demod *demod,int *flip,int *rotate,double *remainder);
+void demod_wait_frontend(struct demod *demod);
+
+// One block at a time, for the executor; see linear_block()
+int fm_setup(struct demod *demod);
+int fm_block(struct demod *demod);
+int linear_setup(struct demod *demod);
+int linear_block(struct demod *demod);
+
+extern int Executor_threads;
+int exec_start(struct demod *demod);
+void exec_stop(struct demod *demod);
 void *demod_null(void *);
 
 int send_mono_output(struct demod * restrict ,const float * restrict,int,int);
@@ -26,6 +26,7 @@
 #include "filter.h"
 #include "multicast.h"
 #include "status.h"
+#include "metrics.h"
 
 int Status_fd;  // File descriptor for receiver status
 int Ctl_fd;     // File descriptor for receiving user commands
@@ -52,7 +53,7 @@ void *radio_status(void *arg){
     for(int i = 0; i < Demod_list_length; i++){
       if(Demod_list[i].inuse == 0)
 	continue;
-      send_radio_status(&Frontend,&Demod_list[i],1); // Send status in response	
+      send_radio_status(Demod_list[i].frontend,&Demod_list[i],1); // Send status in response	
       usleep(5000); // arbitrary 5ms interval to avoid flooding the net
     }
     pthread_mutex_unlock(&Demod_mutex);
@@ -85,20 +86,26 @@ void *radio_status(void *arg){
 	extern struct demod *Dynamic_demod;
 	memcpy(demod,Dynamic_demod,sizeof(*demod));
 	demod->demod_thread = (pthread_t)0;
+	demod->filter.out = NULL; // The template's, not ours
 	demod->tune.freq = 0;
-	demod->lifetime = 20;
 	demod->output.rtp.ssrc = ssrc;
+	demod->output.file_fd = -1; // The template's, if it has one
+	demod->output.shm = NULL;
+	demod->output.shm_missing = false;
+	memset(&demod->timing,0,sizeof(demod->timing));
+	memset(&demod->output.timing,0,sizeof(demod->output.timing));
 
 	set_freq(demod,demod->tune.freq);
 	start_demod(demod);
+	set_demod_lifetime(demod,20);
 	if(Verbose)
 	  fprintf(stdout,"dynamically started ssrc %u\n",ssrc);
       }
       if(demod != NULL){
 	if(demod->lifetime != 0)
-	  demod->lifetime = 20; // Restart self-destruct timer
+	  set_demod_lifetime(demod,20); // Restart self-destruct timer
 	decode_radio_commands(demod,buffer+1,length-1);
-	send_radio_status(&Frontend,demod,1); // Send status in response
+	send_radio_status(demod->frontend,demod,1); // Send status in response
       }
     } else {
       // Doesn't scale; rethink this
@@ -107,7 +114,7 @@ void *radio_status(void *arg){
       pthread_mutex_lock(&Demod_mutex);
       for(int i=0; i < Demod_list_length; i++){
 	if(Demod_list[i].inuse)
-	  send_radio_status(&Frontend,&Demod_list[i],1); // Send status in response	
+	  send_radio_status(Demod_list[i].frontend,&Demod_list[i],1); // Send status in response	
 	usleep(5000); // But not too quickly
       }
       pthread_mutex_unlock(&Demod_mutex);
@@ -265,11 +272,7 @@ static int decode_radio_commands(struct demod *demod,unsigned char const *buffer
 	enum demod_type const i = decode_int(cp,optlen);
 	if(i >= 0 && i < Ndemod && i != demod->demod_type){
 	  demod->demod_type = i;
-	  demod->terminate = 1;
-	  pthread_join(demod->demod_thread,NULL);
-	  demod->terminate = 0;
-	  demod->demod_thread = (pthread_t)0;
-	  start_demod(demod);
+	  start_demod(demod); // Switches the running thread over
 	}
       }
       break;
@@ -362,6 +365,52 @@ static int decode_radio_commands(struct demod *demod,unsigned char const *buffer
   return 0;
 }
   
+// A stage's median, 99th percentile and maximum processing times, as the three consecutive types starting at 'p50'
+static void encode_timing(unsigned char **bp,enum status_type const p50,struct timing const *t){
+  encode_int64(bp,p50,timing_percentile(t,0.5));
+  encode_int64(bp,p50 + 1,timing_percentile(t,0.99));
+  encode_int64(bp,p50 + 2,timing_max(t));
+}
+
+// Status fields sent as is, in the units they're kept in
+static struct status_field const Fe_status_schema[] = {
+  STATUS_FIELD(GPS_TIME,struct frontend,SF_INT,sdr.timestamp),         // Echoed from the source
+  STATUS_FIELD(DESCRIPTION,struct frontend,SF_STRING,sdr.description),
+  STATUS_FIELD(INPUT_DATA_SOURCE_SOCKET,struct frontend,SF_SOCKET,input.data_source_address),
+  STATUS_FIELD(INPUT_DATA_DEST_SOCKET,struct frontend,SF_SOCKET,input.data_dest_address),
+  STATUS_FIELD(INPUT_METADATA_SOURCE_SOCKET,struct frontend,SF_SOCKET,input.metadata_source_address),
+  STATUS_FIELD(INPUT_METADATA_DEST_SOCKET,struct frontend,SF_SOCKET,input.metadata_dest_address),
+  STATUS_FIELD(INPUT_SSRC,struct frontend,SF_UINT,input.rtp.ssrc),
+  STATUS_FIELD(INPUT_SAMPRATE,struct frontend,SF_INT,sdr.samprate),    // Hz
+  STATUS_FIELD(INPUT_METADATA_PACKETS,struct frontend,SF_UINT,input.metadata_packets),
+  STATUS_FIELD(INPUT_DATA_PACKETS,struct frontend,SF_INT,input.rtp.packets),
+  STATUS_FIELD(INPUT_SAMPLES,struct frontend,SF_UINT,input.samples),
+  STATUS_FIELD(INPUT_DROPS,struct frontend,SF_INT,input.rtp.drops),
+  STATUS_FIELD(INPUT_DUPES,struct frontend,SF_INT,input.rtp.dupes),
+  STATUS_FIELD(FIRST_LO_FREQUENCY,struct frontend,SF_DOUBLE,sdr.frequency), // Hz
+  { EOL },
+};
+
+static struct status_field const Demod_status_schema[] = {
+  STATUS_FIELD(OUTPUT_DATA_SOURCE_SOCKET,struct demod,SF_SOCKET,output.data_source_address),
+  STATUS_FIELD(OUTPUT_DATA_DEST_SOCKET,struct demod,SF_SOCKET,output.data_dest_address),
+  STATUS_FIELD(OUTPUT_SSRC,struct demod,SF_UINT,output.rtp.ssrc),
+  STATUS_FIELD(OUTPUT_SAMPRATE,struct demod,SF_INT,output.samprate),   // Hz
+  STATUS_FIELD(OUTPUT_DATA_PACKETS,struct demod,SF_INT,output.rtp.packets),
+  STATUS_FIELD(RADIO_FREQUENCY,struct demod,SF_DOUBLE,tune.freq),      // Hz
+  STATUS_FIELD(SECOND_LO_FREQUENCY,struct demod,SF_DOUBLE,tune.second_LO),
+  STATUS_FIELD(DOPPLER_FREQUENCY,struct demod,SF_DOUBLE,tune.doppler),
+  STATUS_FIELD(DOPPLER_FREQUENCY_RATE,struct demod,SF_DOUBLE,tune.doppler_rate),
+  STATUS_FIELD(LOW_EDGE,struct demod,SF_FLOAT,filter.min_IF),          // Hz
+  STATUS_FIELD(HIGH_EDGE,struct demod,SF_FLOAT,filter.max_IF),         // Hz
+  STATUS_FIELD(KAISER_BETA,struct demod,SF_FLOAT,filter.kaiser_beta),  // Dimensionless
+  STATUS_FIELD(DEMOD_TYPE,struct demod,SF_UINT,demod_type),
+  STATUS_FIELD(OUTPUT_CHANNELS,struct demod,SF_INT,output.channels),
+  STATUS_FIELD(FREQ_OFFSET,struct demod,SF_FLOAT,sig.foffset),         // Hz; used differently in linear and fm
+  STATUS_FIELD(OUTPUT_SAMPLES,struct demod,SF_UINT,output.samples),
+  { EOL },
+};
+
 // Encode contents of frontend and demod structures as command or status packet
 // packet argument must be long enough!!
 // Convert values from internal to engineering units
@@ -374,46 +423,18 @@ static int encode_radio_status(struct frontend *frontend,struct demod const *dem
   // parameters valid in all modes
   encode_int32(&bp,COMMAND_TAG,Command_tag); // at top to make it easier to spot in dumps
   encode_int64(&bp,CMD_CNT,Commands); // integer
-  if(strlen(frontend->sdr.description) > 0)
-    encode_string(&bp,DESCRIPTION,frontend->sdr.description,strlen(frontend->sdr.description));
-  
-  // Echo timestamp from source
-  encode_int64(&bp,GPS_TIME,frontend->sdr.timestamp); // integer
-  // Who's sending us I/Q data
-  encode_socket(&bp,INPUT_DATA_SOURCE_SOCKET,&frontend->input.data_source_address);
-  // Destination address for I/Q data
-  encode_socket(&bp,INPUT_DATA_DEST_SOCKET,&frontend->input.data_dest_address);
-  // Source of metadata
-  encode_socket(&bp,INPUT_METADATA_SOURCE_SOCKET,&frontend->input.metadata_source_address);
-  // Destination address (usually multicast) and port on which we're getting metadata
-  encode_socket(&bp,INPUT_METADATA_DEST_SOCKET,&frontend->input.metadata_dest_address);
-  encode_int32(&bp,INPUT_SSRC,frontend->input.rtp.ssrc);
-  encode_int32(&bp,INPUT_SAMPRATE,frontend->sdr.samprate); // integer Hz
-  encode_int64(&bp,INPUT_METADATA_PACKETS,frontend->input.metadata_packets); // integer
-  encode_int64(&bp,INPUT_DATA_PACKETS,frontend->input.rtp.packets);
-  encode_int64(&bp,INPUT_SAMPLES,frontend->input.samples);
-  encode_int64(&bp,INPUT_DROPS,frontend->input.rtp.drops);
-  encode_int64(&bp,INPUT_DUPES,frontend->input.rtp.dupes);
-  
-  // Source address we're using to send data
-  encode_socket(&bp,OUTPUT_DATA_SOURCE_SOCKET,&demod->output.data_source_address);
-  // Where we're sending PCM output
-  encode_socket(&bp,OUTPUT_DATA_DEST_SOCKET,&demod->output.data_dest_address);
-  
-  encode_int32(&bp,OUTPUT_SSRC,demod->output.rtp.ssrc);
   encode_int32(&bp,OUTPUT_TTL,Mcast_ttl);
-  encode_int32(&bp,OUTPUT_SAMPRATE,demod->output.samprate); // Hz
-  encode_int64(&bp,OUTPUT_DATA_PACKETS,demod->output.rtp.packets);
   encode_int64(&bp,OUTPUT_METADATA_PACKETS,Metadata_packets);
-  
+  // Everything that's just a copy of a member
+  encode_struct(&bp,Fe_status_schema,frontend);
+  encode_struct(&bp,Demod_status_schema,demod);
+
   if(frontend->in){
     encode_int32(&bp,FILTER_BLOCKSIZE,frontend->in->ilen);
     encode_int32(&bp,FILTER_FIR_LENGTH,frontend->in->impulse_length);
+    encode_int32(&bp,FILTER_PAGES,frontend->in->pages);
   }
   // Filtering
-  encode_float(&bp,LOW_EDGE,demod->filter.min_IF); // Hz
-  encode_float(&bp,HIGH_EDGE,demod->filter.max_IF); // Hz
-  encode_float(&bp,KAISER_BETA,demod->filter.kaiser_beta); // Dimensionless
   if(demod->filter.out)
     encode_int32(&bp,FILTER_DROPS,demod->filter.out->block_drops);  // count
   
@@ -424,25 +445,9 @@ static int encode_radio_status(struct frontend *frontend,struct demod const *dem
   encode_float(&bp,NOISE_DENSITY,power2dB(frontend->n0)); // power -> dB
 
   encode_float(&bp,OUTPUT_LEVEL,power2dB(demod->output.level)); // power ratio -> dB
-  encode_int64(&bp,OUTPUT_SAMPLES,demod->output.samples);
   encode_float(&bp,HEADROOM,voltage2dB(demod->output.headroom)); // amplitude -> dB
 
-
-  // Tuning
-  encode_double(&bp,RADIO_FREQUENCY,demod->tune.freq); // Hz
-  encode_double(&bp,SECOND_LO_FREQUENCY,demod->tune.second_LO); // Hz
-  encode_double(&bp,FIRST_LO_FREQUENCY,frontend->sdr.frequency); // Hz
-
-  // Doppler info
-  encode_double(&bp,DOPPLER_FREQUENCY,demod->tune.doppler); // Hz
-  encode_double(&bp,DOPPLER_FREQUENCY_RATE,demod->tune.doppler_rate); // Hz
-  
-  // Demodulation mode
-  encode_byte(&bp,DEMOD_TYPE,demod->demod_type);
-  encode_int32(&bp,OUTPUT_CHANNELS,demod->output.channels);
-
   encode_float(&bp,DEMOD_SNR,power2dB(demod->sig.snr)); // abs ratio -> dB
-  encode_float(&bp,FREQ_OFFSET,demod->sig.foffset);     // Hz; used differently in linear and fm
   encode_float(&bp,GAIN,voltage2dB(demod->output.gain)); // linear amplitude -> dB; fixed in FM
   encode_float(&bp,SQUELCH_OPEN,power2dB(demod->squelch_open));
   encode_float(&bp,SQUELCH_CLOSE,power2dB(demod->squelch_close));
@@ -474,6 +479,22 @@ static int encode_radio_status(struct frontend *frontend,struct demod const *dem
     encode_float(&bp,PEAK_DEVIATION,demod->fm.pdeviation); // Hz
     break;
   }
+  // Where the time goes, stage by stage
+  encode_timing(&bp,INGEST_TIME_P50,&frontend->input.timing);
+  if(frontend->in != NULL && frontend->in->fft_workers > 0){
+    struct timing fft;
+    memset(&fft,0,sizeof(fft));
+    for(int i=0; i < frontend->in->fft_workers; i++)
+      timing_merge(&fft,&frontend->in->workers[i].timing);
+    encode_timing(&bp,FFT_TIME_P50,&fft);
+  }
+  if(demod->filter.out)
+    encode_timing(&bp,FILTER_TIME_P50,&demod->filter.out->timing);
+  encode_timing(&bp,DEMOD_TIME_P50,&demod->timing);
+  encode_timing(&bp,OUTPUT_TIME_P50,&demod->output.timing);
+  if(Shm != NULL)
+    encode_string(&bp,OUTPUT_SHM,Shm->name,strlen(Shm->name)); // Local readers can take our streams from here instead
+
   // Don't send test points unless they're in use
   if(!isnan(demod->tp1))
     encode_float(&bp,TP1,demod->tp1);
@@ -483,3 +504,90 @@ static int encode_radio_status(struct frontend *frontend,struct demod const *dem
 
   return bp - packet;
 }
+
+// Collect function for the metrics endpoint ('metrics =' in [global]), called from its thread
+// Reads the same counters as the status encoders, without taking any lock the sample paths use
+void radio_metrics(struct metrics * const m,void *arg){
+  metric_family(m,"status_packets_total","counter","Status packets sent");
+  metric(m,"status_packets_total",Metadata_packets,NULL);
+  metric_family(m,"commands_total","counter","Commands received");
+  metric(m,"commands_total",Commands,NULL);
+  metric_family(m,"demods","gauge","Active demodulators");
+  metric(m,"demods",Active_demod_count,NULL);
+
+  metric_family(m,"input_packets_total","counter","RTP packets received from the front end");
+  for(int i=0; i < Nfrontends; i++)
+    metric(m,"input_packets_total",Frontends[i].input.rtp.packets,"frontend=\"%s\"",Frontends[i].name);
+  metric_family(m,"input_drops_total","counter","RTP packets from the front end lost or out of sequence");
+  for(int i=0; i < Nfrontends; i++)
+    metric(m,"input_drops_total",Frontends[i].input.rtp.drops,"frontend=\"%s\"",Frontends[i].name);
+  metric_family(m,"input_dupes_total","counter","Duplicate RTP packets from the front end");
+  for(int i=0; i < Nfrontends; i++)
+    metric(m,"input_dupes_total",Frontends[i].input.rtp.dupes,"frontend=\"%s\"",Frontends[i].name);
+  metric_family(m,"input_samples_total","counter","Samples received from the front end");
+  for(int i=0; i < Nfrontends; i++)
+    metric(m,"input_samples_total",Frontends[i].input.samples,"frontend=\"%s\"",Frontends[i].name);
+  metric_family(m,"frontend_status_packets_total","counter","Status packets received from the front end");
+  for(int i=0; i < Nfrontends; i++)
+    metric(m,"frontend_status_packets_total",Frontends[i].input.metadata_packets,"frontend=\"%s\"",Frontends[i].name);
+  metric_family(m,"input_stalls_total","counter","Times the input waited for a free FFT buffer");
+  for(int i=0; i < Nfrontends; i++){
+    if(Frontends[i].in != NULL)
+      metric(m,"input_stalls_total",Frontends[i].in->input_stalls,"frontend=\"%s\"",Frontends[i].name);
+  }
+  metric_family(m,"fft_buffer_pages","gauge","Pages under the FFT buffers: 0 normal, 1 transparent huge requested, 2 explicit huge");
+  for(int i=0; i < Nfrontends; i++){
+    if(Frontends[i].in != NULL)
+      metric(m,"fft_buffer_pages",Frontends[i].in->pages,"frontend=\"%s\"",Frontends[i].name);
+  }
+
+  // Copy out the demods first so Demod_mutex is held only briefly
+  struct {
+    uint32_t ssrc;
+    char section[64];
+    char const *frontend;
+    long long packets;
+    uint64_t samples;
+    int block_drops;
+    float snr;
+    float bb_power;
+  } *dp = NULL;
+  int n = 0;
+  pthread_mutex_lock(&Demod_mutex);
+  if(Demod_list_length > 0)
+    dp = calloc(Demod_list_length,sizeof(*dp));
+  for(int i=0; dp != NULL && i < Demod_list_length; i++){
+    struct demod const * const demod = &Demod_list[i];
+    if(!demod->inuse)
+      continue;
+    dp[n].ssrc = demod->output.rtp.ssrc;
+    strlcpy(dp[n].section,demod->section,sizeof(dp[n].section));
+    dp[n].frontend = demod->frontend != NULL ? demod->frontend->name : "";
+    dp[n].packets = demod->output.rtp.packets;
+    dp[n].samples = demod->output.samples;
+    dp[n].block_drops = demod->filter.out != NULL ? demod->filter.out->block_drops : 0;
+    dp[n].snr = demod->sig.snr;
+    dp[n].bb_power = demod->sig.bb_power;
+    n++;
+  }
+  pthread_mutex_unlock(&Demod_mutex);
+
+#define DEMOD_LABELS "ssrc=\"%u\",section=\"%s\",frontend=\"%s\"",dp[i].ssrc,dp[i].section,dp[i].frontend
+  metric_family(m,"output_packets_total","counter","RTP packets sent by the demodulator");
+  for(int i=0; i < n; i++)
+    metric(m,"output_packets_total",dp[i].packets,DEMOD_LABELS);
+  metric_family(m,"output_samples_total","counter","Audio samples produced by the demodulator");
+  for(int i=0; i < n; i++)
+    metric(m,"output_samples_total",dp[i].samples,DEMOD_LABELS);
+  metric_family(m,"block_drops_total","counter","Filter blocks the demodulator fell too far behind to process");
+  for(int i=0; i < n; i++)
+    metric(m,"block_drops_total",dp[i].block_drops,DEMOD_LABELS);
+  metric_family(m,"snr_db","gauge","Demodulator signal to noise ratio");
+  for(int i=0; i < n; i++)
+    metric(m,"snr_db",power2dB(dp[i].snr),DEMOD_LABELS);
+  metric_family(m,"baseband_power_db","gauge","Power in the channel filter passband");
+  for(int i=0; i < n; i++)
+    metric(m,"baseband_power_db",power2dB(dp[i].bb_power),DEMOD_LABELS);
+#undef DEMOD_LABELS
+  free(dp);
+}
@@ -22,14 +22,14 @@
 #include "status.h"
 #include "filter.h"
 #include "iir.h"
+#include "session.h"
 
 #define BUFFERSIZE 16384  // Tune this
 
 struct session {
-  struct session *prev;       // Linked list pointers
-  struct session *next; 
+  struct session_entry entry; // Session table linkage
   
-  struct sockaddr sender;
+  struct sockaddr_storage sender;
   char addr[NI_MAXHOST];    // RTP Sender IP address
   char port[NI_MAXSERV];    // RTP Sender source port
 
@@ -69,13 +69,11 @@ char *Input;
 char *Output;
 char *Status;
 char *Name = "rds";
-struct session *Audio;
-pthread_mutex_t Audio_protect;
+struct session_table Audio;
 uint64_t Output_packets;
 
 void closedown(int);
-struct session *lookup_session(const struct sockaddr *,uint32_t);
-struct session *create_session(void);
+struct session *create_session(struct sockaddr_storage const *,uint32_t);
 int close_session(struct session *);
 int send_samples(struct session *sp);
 void *input(void *arg);
@@ -106,7 +104,7 @@ struct sockaddr_storage Stereo_dest_address;
 int main(int argc,char * const argv[]){
 
   setlocale(LC_ALL,getenv("LANG"));
-  pthread_mutex_init(&Audio_protect,NULL);
+  session_table_init(&Audio,64,0); // Decode threads time out on their own
 
   int c;
   while((c = getopt_long(argc,argv,Optstring,Options,NULL)) != -1){
@@ -134,7 +132,6 @@ int main(int argc,char * const argv[]){
       break;
     default:
       fprintf(stderr,"Usage: %s [-v] [-T mcast_ttl] -I input_mcast_address -R output_mcast_address\n",argv[0]);
-      pthread_mutex_destroy(&Audio_protect);
       exit(1);
     }
   }
@@ -153,7 +150,6 @@ int main(int argc,char * const argv[]){
     Status_fd = listen_mcast(&Status_dest_address,iface);
     if(Status_fd == -1){
       fprintf(stderr,"Can't set up input on %s: %s\n",optarg,strerror(errno));
-      pthread_mutex_destroy(&Audio_protect);
       exit(1);
     }
     Status_out_fd = connect_mcast(&Status_dest_address,iface,Mcast_ttl,IP_tos);
@@ -188,12 +184,10 @@ int main(int argc,char * const argv[]){
   // Set up multicast
   if(Input_fd == -1 && Status_fd == -1){
     fprintf(stderr,"Must specify either --status-in or --pcm-in\n");
-    pthread_mutex_destroy(&Audio_protect);
     exit(1);
   }
   if(Output_fd == -1){
     fprintf(stderr,"Must specify --opus-out\n");
-    pthread_mutex_destroy(&Audio_protect);
     exit(1);
   }
 
@@ -321,15 +315,14 @@ void *input(void *arg){
       continue; // Used to be an assert, but would be triggered by bogus packets
     
     // Find appropriate session; create new one if necessary
-    struct session *sp = lookup_session((const struct sockaddr *)&sender,pkt->rtp.ssrc);
+    struct session *sp = session_lookup(&Audio,&sender,pkt->rtp.ssrc,0);
     if(!sp){
       // Not found
-      sp = create_session();
+      sp = create_session(&sender,pkt->rtp.ssrc);
       assert(sp != NULL);
       // Initialize
       getnameinfo((struct sockaddr *)&sender,sizeof(sender),sp->addr,sizeof(sp->addr),
 		    sp->port,sizeof(sp->port),NI_NOFQDN|NI_DGRAM);
-      memcpy(&sp->sender,&sender,sizeof(struct sockaddr));
       sp->rtp_state_out.ssrc = sp->rtp_state_in.ssrc = pkt->rtp.ssrc;
       sp->rtp_state_in.seq = pkt->rtp.seq;
       sp->rtp_state_in.timestamp = pkt->rtp.timestamp;
@@ -511,47 +504,18 @@ void *decode(void *arg){
   }
 }
 
-struct session *lookup_session(const struct sockaddr * const sender,const uint32_t ssrc){
-  struct session *sp;
-  pthread_mutex_lock(&Audio_protect);
-  for(sp = Audio; sp != NULL; sp = sp->next){
-    if(sp->rtp_state_in.ssrc == ssrc && memcmp(&sp->sender,sender,sizeof(*sender)) == 0){
-      // Found it
-      if(sp->prev != NULL){
-	// Not at top of list; move it there
-	if(sp->next != NULL)
-	  sp->next->prev = sp->prev;
-
-	sp->prev->next = sp->next;
-	sp->prev = NULL;
-	sp->next = Audio;
-	Audio->prev = sp;
-	Audio = sp;
-      }
-      break;
-    }
-  }
-  pthread_mutex_unlock(&Audio_protect);
-  return sp;
-}
-// Create a new session, partly initialize
-struct session *create_session(void){
+// Create a new session, partly initialize, and enter it in the session table
+struct session *create_session(struct sockaddr_storage const * const sender,uint32_t const ssrc){
 
   struct session * const sp = calloc(1,sizeof(*sp));
   assert(sp != NULL); // Shouldn't happen on modern machines!
   
   // Initialize entry
+  memcpy(&sp->sender,sender,sizeof(sp->sender));
   pthread_mutex_init(&sp->qmutex,NULL);
   pthread_cond_init(&sp->qcond,NULL);
 
-  // Put at head of list
-  pthread_mutex_lock(&Audio_protect);
-  sp->prev = NULL;
-  sp->next = Audio;
-  if(sp->next != NULL)
-    sp->next->prev = sp;
-  Audio = sp;
-  pthread_mutex_unlock(&Audio_protect);
+  session_insert(&Audio,&sp->entry,sp,sender,ssrc,0);
   return sp;
 }
 
@@ -569,30 +533,13 @@ int close_session(struct session * const sp){
   pthread_mutex_destroy(&sp->qmutex);
   
 
-  // Remove from linked list of sessions
-  pthread_mutex_lock(&Audio_protect);
-  if(sp->next != NULL)
-    sp->next->prev = sp->prev;
-  if(sp->prev != NULL)
-    sp->prev->next = sp->next;
-  else
-    Audio = sp->next;
-  pthread_mutex_unlock(&Audio_protect);
+  session_remove(&Audio,&sp->entry);
   free(sp);
   return 0;
 }
 void closedown(int s){
-#if 0
-  // Causes deadlock when we get called from a section where Audio_protect is already locked
-  // Which is the usual case
-  // Not really necessary anyway, since we're exiting
-  pthread_mutex_lock(&Audio_protect);
-  while(Audio != NULL)
-    close_session(Audio);
-  pthread_mutex_unlock(&Audio_protect);
-#endif
-
-  pthread_mutex_destroy(&Audio_protect);
+  // Don't bother closing sessions; the session table lock may be held, and we're exiting anyway
+
   exit(0);
 }
 
@@ -0,0 +1,474 @@
+// Framed, losslessly compressed recording format; see recfile.h for the layout
+// Compression is the scheme FLAC uses for its "fixed" subframes: the best of three polynomial
+// predictors is chosen for each channel of each frame and the residuals are Rice coded.
+// Silent and quiet channels, which are most of a band recording, need only a few bits per sample
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "recfile.h"
+
+static uint32_t const Frame_magic = 0x4d52464b; // "KFRM" little-endian
+static int const Escape = 24;  // Unary quotients this long are followed by the raw 32-bit value
+static int const Zero_k = 31;  // Rice parameter meaning "all residuals are zero"
+
+static unsigned char *put16(unsigned char *dp,uint16_t x){
+  *dp++ = x; *dp++ = x >> 8;
+  return dp;
+}
+static unsigned char *put32(unsigned char *dp,uint32_t x){
+  dp = put16(dp,x);
+  return put16(dp,x >> 16);
+}
+static unsigned char *put64(unsigned char *dp,uint64_t x){
+  dp = put32(dp,x);
+  return put32(dp,x >> 32);
+}
+static uint16_t get16(unsigned char const *dp){
+  return dp[0] | dp[1] << 8;
+}
+static uint32_t get32(unsigned char const *dp){
+  return get16(dp) | (uint32_t)get16(dp+2) << 16;
+}
+static uint64_t get64(unsigned char const *dp){
+  return get32(dp) | (uint64_t)get32(dp+4) << 32;
+}
+
+static uint32_t frame_check(int type,int codec,uint32_t timestamp,uint32_t nframes,uint32_t length){
+  return Frame_magic ^ (type << 8 | codec) ^ timestamp ^ (nframes * 2654435761U) ^ length;
+}
+
+static unsigned char *put_frame_header(unsigned char *dp,int type,int codec,int channels,uint32_t timestamp,uint32_t nframes,uint32_t length){
+  dp = put32(dp,Frame_magic);
+  *dp++ = type;
+  *dp++ = codec;
+  dp = put16(dp,channels);
+  dp = put32(dp,timestamp);
+  dp = put32(dp,nframes);
+  dp = put32(dp,length);
+  dp = put32(dp,frame_check(type,codec,timestamp,nframes,length));
+  return dp;
+}
+
+int recfile_encode_header(unsigned char *out,struct recfile_info const *info){
+  memset(out,0,RECFILE_HEADER_SIZE);
+  memcpy(out,RECFILE_MAGIC,8);
+  unsigned char *dp = out + 8;
+  dp = put32(dp,RECFILE_HEADER_SIZE);
+  dp = put32(dp,info->samprate);
+  dp = put32(dp,info->ssrc);
+  dp = put16(dp,info->channels);
+  dp = put16(dp,info->bitspersample);
+  uint64_t f;
+  memcpy(&f,&info->frequency,sizeof(f));
+  dp = put64(dp,f);
+  dp = put64(dp,info->start_time);
+  assert(dp - out <= RECFILE_HEADER_SIZE);
+  return RECFILE_HEADER_SIZE;
+}
+
+// Bit-level writer and reader for the Rice coder
+struct bits {
+  unsigned char *buf;
+  int size;      // bytes available
+  int pos;       // bits used
+};
+
+static int put_bits(struct bits *bp,uint32_t value,int n){
+  if(bp->pos + n > 8 * bp->size)
+    return -1;
+  while(n-- > 0){
+    if(value & (1U << n))
+      bp->buf[bp->pos >> 3] |= 0x80 >> (bp->pos & 7);
+    bp->pos++;
+  }
+  return 0;
+}
+
+static int get_bits(struct bits *bp,int n,uint32_t *value){
+  if(bp->pos + n > 8 * bp->size)
+    return -1;
+  uint32_t x = 0;
+  while(n-- > 0){
+    x = (x << 1) | ((bp->buf[bp->pos >> 3] >> (7 - (bp->pos & 7))) & 1);
+    bp->pos++;
+  }
+  *value = x;
+  return 0;
+}
+
+// Residual of fixed predictor 'order' at sample n of one channel; lower orders are used for the warmup samples
+static inline int32_t residual(int16_t const *x,int stride,int n,int order){
+  if(order > n)
+    order = n;
+  int32_t const s0 = x[n*stride];
+  switch(order){
+  default:
+    return s0;
+  case 1:
+    return s0 - x[(n-1)*stride];
+  case 2:
+    return s0 - 2 * x[(n-1)*stride] + x[(n-2)*stride];
+  }
+}
+
+static inline uint32_t zigzag(int32_t e){
+  return ((uint32_t)e << 1) ^ (uint32_t)(e >> 31);
+}
+
+// Encode one channel of interleaved 16-bit samples, byte aligned
+static int encode_channel(struct bits *bp,int16_t const *x,int stride,int nframes){
+  // Pick the predictor with the smallest total residual
+  int order = 0;
+  uint64_t best = UINT64_MAX;
+  for(int o=0; o <= 2; o++){
+    uint64_t sum = 0;
+    for(int n=0; n < nframes; n++)
+      sum += zigzag(residual(x,stride,n,o));
+    if(sum < best){
+      best = sum;
+      order = o;
+    }
+  }
+  int k = 0;
+  if(best == 0)
+    k = Zero_k;
+  else
+    while(k < 20 && ((uint64_t)nframes << (k+1)) <= best)
+      k++;
+
+  if(put_bits(bp,order << 5 | k,8) == -1)
+    return -1;
+  if(k != Zero_k){
+    for(int n=0; n < nframes; n++){
+      uint32_t const u = zigzag(residual(x,stride,n,order));
+      uint32_t const q = u >> k;
+      if(q < Escape){
+	if(put_bits(bp,1,q+1) == -1 || put_bits(bp,u,k) == -1)
+	  return -1;
+      } else {
+	if(put_bits(bp,0,Escape) == -1 || put_bits(bp,u,32) == -1)
+	  return -1;
+      }
+    }
+  }
+  bp->pos = (bp->pos + 7) & ~7; // byte align next channel
+  return 0;
+}
+
+static int decode_channel(struct bits *bp,int16_t *x,int stride,int nframes){
+  uint32_t hdr;
+  if(get_bits(bp,8,&hdr) == -1)
+    return -1;
+  int const order = hdr >> 5;
+  int const k = hdr & 31;
+  if(order > 2)
+    return -1;
+  for(int n=0; n < nframes; n++){
+    uint32_t u = 0;
+    if(k != Zero_k){
+      int q = 0;
+      uint32_t bit = 0;
+      while(q < Escape){
+	if(get_bits(bp,1,&bit) == -1)
+	  return -1;
+	if(bit)
+	  break;
+	q++;
+      }
+      if(q == Escape){
+	if(get_bits(bp,32,&u) == -1)
+	  return -1;
+      } else {
+	uint32_t low = 0;
+	if(get_bits(bp,k,&low) == -1)
+	  return -1;
+	u = (uint32_t)q << k | low;
+      }
+    }
+    int32_t const e = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+    int o = order > n ? n : order;
+    int32_t pred = 0;
+    if(o == 1)
+      pred = x[(n-1)*stride];
+    else if(o == 2)
+      pred = 2 * x[(n-1)*stride] - x[(n-2)*stride];
+    x[n*stride] = pred + e;
+  }
+  bp->pos = (bp->pos + 7) & ~7;
+  return 0;
+}
+
+// Encode a DATA frame of host-order samples into 'out'; returns bytes used, -1 if it won't fit
+// 16-bit samples are compressed when that's smaller, everything else is stored as-is
+int recfile_encode_data(unsigned char *out,int outsize,uint32_t timestamp,void const *samples,int nframes,int channels,int bitspersample){
+  assert(nframes <= RECFILE_MAX_FRAMES && channels <= RECFILE_MAX_CHANNELS);
+  int const rawsize = (nframes * channels * bitspersample + 7) / 8;
+  if(outsize < RECFILE_FRAME_HEADER_SIZE + rawsize)
+    return -1;
+
+  if(bitspersample == 16){
+    // The raw size is the limit: don't bother with compression that doesn't help
+    struct bits b = { out + RECFILE_FRAME_HEADER_SIZE, rawsize, 0 };
+    memset(b.buf,0,b.size);
+    int ch;
+    for(ch=0; ch < channels; ch++)
+      if(encode_channel(&b,(int16_t const *)samples + ch,channels,nframes) == -1)
+	break;
+
+    if(ch == channels){
+      int const length = b.pos / 8;
+      put_frame_header(out,RECFILE_DATA,RECFILE_RICE,channels,timestamp,nframes,length);
+      return RECFILE_FRAME_HEADER_SIZE + length;
+    }
+  }
+  put_frame_header(out,RECFILE_DATA,RECFILE_RAW,channels,timestamp,nframes,rawsize);
+  memcpy(out + RECFILE_FRAME_HEADER_SIZE,samples,rawsize);
+  return RECFILE_FRAME_HEADER_SIZE + rawsize;
+}
+
+// Record nframes missing sample frames starting at timestamp
+int recfile_encode_gap(unsigned char *out,uint32_t timestamp,uint32_t nframes){
+  put_frame_header(out,RECFILE_GAP,RECFILE_RAW,0,timestamp,nframes,0);
+  return RECFILE_FRAME_HEADER_SIZE;
+}
+
+// Add an index entry if 'interval' sample frames have passed since the last one
+int recfile_index_note(struct recfile_index *index,uint64_t position,uint64_t offset,uint32_t timestamp,unsigned int interval){
+  if(index->count > 0 && position < index->last + interval)
+    return 0;
+  if(index->count == index->size){
+    int const size = index->size ? 2 * index->size : 1024;
+    struct recfile_index_entry *entries = realloc(index->entries,size * sizeof(*entries));
+    if(entries == NULL)
+      return -1; // Index gets sparser; seeking still works
+    index->entries = entries;
+    index->size = size;
+  }
+  struct recfile_index_entry *ep = &index->entries[index->count++];
+  ep->position = position;
+  ep->offset = offset;
+  ep->timestamp = timestamp;
+  index->last = position;
+  return 1;
+}
+
+void recfile_index_free(struct recfile_index *index){
+  free(index->entries);
+  memset(index,0,sizeof(*index));
+}
+
+// Bytes needed by recfile_encode_index()
+int recfile_index_size(struct recfile_index const *index){
+  return RECFILE_FRAME_HEADER_SIZE + index->count * RECFILE_INDEX_ENTRY_SIZE + RECFILE_TRAILER_SIZE;
+}
+
+// Encode the INDEX frame and trailer; index_offset is where they will be written
+int recfile_encode_index(unsigned char *out,struct recfile_index const *index,uint64_t index_offset){
+  int const length = index->count * RECFILE_INDEX_ENTRY_SIZE;
+  unsigned char *dp = put_frame_header(out,RECFILE_INDEX,RECFILE_RAW,0,0,index->count,length);
+  for(int i=0; i < index->count; i++){
+    struct recfile_index_entry const *ep = &index->entries[i];
+    dp = put64(dp,ep->position);
+    dp = put64(dp,ep->offset);
+    dp = put32(dp,ep->timestamp);
+    dp = put32(dp,0);
+  }
+  memcpy(dp,RECFILE_TRAILER_MAGIC,8);
+  dp = put64(dp + 8,index_offset);
+  return dp - out;
+}
+
+// Return 1 if fd is a recfile, leaving the file offset unchanged
+int recfile_is_recfile(int fd){
+  char magic[8];
+  return pread(fd,magic,sizeof(magic),0) == sizeof(magic) && memcmp(magic,RECFILE_MAGIC,sizeof(magic)) == 0;
+}
+
+struct frame_header {
+  int type;
+  int codec;
+  int channels;
+  uint32_t timestamp;
+  uint32_t nframes;
+  uint32_t length;
+};
+
+static int read_frame_header(int fd,off_t offset,struct frame_header *fh){
+  unsigned char buf[RECFILE_FRAME_HEADER_SIZE];
+  if(pread(fd,buf,sizeof(buf),offset) != sizeof(buf))
+    return -1;
+  if(get32(buf) != Frame_magic)
+    return -1;
+  fh->type = buf[4];
+  fh->codec = buf[5];
+  fh->channels = get16(buf+6);
+  fh->timestamp = get32(buf+8);
+  fh->nframes = get32(buf+12);
+  fh->length = get32(buf+16);
+  if(get32(buf+20) != frame_check(fh->type,fh->codec,fh->timestamp,fh->nframes,fh->length))
+    return -1;
+  return 0;
+}
+
+// Load the index written at close, if any
+static int load_index(struct recfile_reader *rp,off_t size){
+  unsigned char trailer[RECFILE_TRAILER_SIZE];
+  if(size < RECFILE_HEADER_SIZE + RECFILE_TRAILER_SIZE
+     || pread(rp->fd,trailer,sizeof(trailer),size - RECFILE_TRAILER_SIZE) != sizeof(trailer)
+     || memcmp(trailer,RECFILE_TRAILER_MAGIC,8) != 0)
+    return -1;
+
+  off_t const index_offset = get64(trailer+8);
+  struct frame_header fh;
+  if(index_offset < RECFILE_HEADER_SIZE || index_offset >= size
+     || read_frame_header(rp->fd,index_offset,&fh) == -1 || fh.type != RECFILE_INDEX
+     || fh.length != fh.nframes * RECFILE_INDEX_ENTRY_SIZE)
+    return -1;
+
+  unsigned char *buf = malloc(fh.length + 1);
+  if(buf == NULL || pread(rp->fd,buf,fh.length,index_offset + RECFILE_FRAME_HEADER_SIZE) != fh.length){
+    free(buf);
+    return -1;
+  }
+  for(uint32_t i=0; i < fh.nframes; i++){
+    unsigned char const *dp = buf + i * RECFILE_INDEX_ENTRY_SIZE;
+    recfile_index_note(&rp->index,get64(dp),get64(dp+8),get32(dp+16),0);
+  }
+  free(buf);
+  rp->data_end = index_offset;
+  return 0;
+}
+
+// No usable index (recording didn't close cleanly); build one by walking the frame headers
+static void rebuild_index(struct recfile_reader *rp,off_t size){
+  off_t offset = RECFILE_HEADER_SIZE;
+  uint64_t position = 0;
+  struct frame_header fh;
+  while(offset + RECFILE_FRAME_HEADER_SIZE <= size && read_frame_header(rp->fd,offset,&fh) == 0
+	&& fh.type != RECFILE_INDEX && offset + RECFILE_FRAME_HEADER_SIZE + fh.length <= size){
+    recfile_index_note(&rp->index,position,offset,fh.timestamp,rp->info.samprate);
+    position += fh.nframes;
+    offset += RECFILE_FRAME_HEADER_SIZE + fh.length;
+  }
+  rp->data_end = offset; // Ignore any partially written frame at the end
+}
+
+int recfile_open(struct recfile_reader *rp,int fd){
+  memset(rp,0,sizeof(*rp));
+  rp->fd = fd;
+  unsigned char buf[RECFILE_HEADER_SIZE];
+  if(pread(fd,buf,sizeof(buf),0) != sizeof(buf) || memcmp(buf,RECFILE_MAGIC,8) != 0)
+    return -1;
+  off_t const header_size = get32(buf+8);
+  rp->info.samprate = get32(buf+12);
+  rp->info.ssrc = get32(buf+16);
+  rp->info.channels = get16(buf+20);
+  rp->info.bitspersample = get16(buf+22);
+  uint64_t f = get64(buf+24);
+  memcpy(&rp->info.frequency,&f,sizeof(f));
+  rp->info.start_time = get64(buf+32);
+  if(header_size < RECFILE_HEADER_SIZE || rp->info.channels < 1 || rp->info.channels > RECFILE_MAX_CHANNELS)
+    return -1;
+
+  struct stat statbuf;
+  if(fstat(fd,&statbuf) == -1)
+    return -1;
+  if(load_index(rp,statbuf.st_size) == -1){
+    recfile_index_free(&rp->index);
+    rebuild_index(rp,statbuf.st_size);
+  }
+  rp->offset = header_size;
+  rp->position = 0;
+  return 0;
+}
+
+// Read the next frame, decoding DATA into buf as host-order samples
+// Returns 1 with *frame filled in, 0 at end of data, -1 on a damaged frame or too small a buffer
+int recfile_read(struct recfile_reader *rp,struct recfile_frame *frame,void *buf,int bufsize){
+  if(rp->offset >= rp->data_end)
+    return 0;
+  struct frame_header fh;
+  if(read_frame_header(rp->fd,rp->offset,&fh) == -1 || fh.type == RECFILE_INDEX)
+    return 0;
+
+  frame->type = fh.type;
+  frame->timestamp = fh.timestamp;
+  frame->nframes = fh.nframes;
+  frame->bytes = 0;
+  off_t const payload_offset = rp->offset + RECFILE_FRAME_HEADER_SIZE;
+  rp->offset = payload_offset + fh.length;
+  rp->position += fh.nframes;
+
+  if(fh.type != RECFILE_DATA)
+    return 1;
+
+  int const channels = rp->info.channels;
+  int const rawsize = (fh.nframes * channels * rp->info.bitspersample + 7) / 8;
+  if(fh.nframes > RECFILE_MAX_FRAMES || rawsize > bufsize || fh.length > (uint32_t)rawsize)
+    return -1;
+
+  if(fh.codec == RECFILE_RAW){
+    if(pread(rp->fd,buf,rawsize,payload_offset) != rawsize)
+      return -1;
+    frame->bytes = rawsize;
+    return 1;
+  }
+  if(fh.codec != RECFILE_RICE || rp->info.bitspersample != 16)
+    return -1;
+  if(rp->payload_size < (int)fh.length){
+    unsigned char *p = realloc(rp->payload,fh.length);
+    if(p == NULL)
+      return -1;
+    rp->payload = p;
+    rp->payload_size = fh.length;
+  }
+  if(pread(rp->fd,rp->payload,fh.length,payload_offset) != fh.length)
+    return -1;
+  struct bits b = { rp->payload, fh.length, 0 };
+  for(int ch=0; ch < channels; ch++)
+    if(decode_channel(&b,(int16_t *)buf + ch,channels,fh.nframes) == -1)
+      return -1;
+  frame->bytes = rawsize;
+  return 1;
+}
+
+// Position the reader at the frame containing sample frame 'position' (counted from the start, including gaps)
+// Returns the position of the start of that frame; the caller discards the difference
+int64_t recfile_seek(struct recfile_reader *rp,uint64_t position){
+  // Binary search for the last index entry at or before position
+  int lo = 0, hi = rp->index.count - 1, found = -1;
+  while(lo <= hi){
+    int const mid = (lo + hi) / 2;
+    if(rp->index.entries[mid].position <= position){
+      found = mid;
+      lo = mid + 1;
+    } else
+      hi = mid - 1;
+  }
+  if(found < 0){
+    rp->offset = RECFILE_HEADER_SIZE;
+    rp->position = 0;
+  } else {
+    rp->offset = rp->index.entries[found].offset;
+    rp->position = rp->index.entries[found].position;
+  }
+  // Walk forward frame by frame, reading only headers
+  struct frame_header fh;
+  while(rp->offset < rp->data_end && read_frame_header(rp->fd,rp->offset,&fh) == 0 && fh.type != RECFILE_INDEX
+	&& rp->position + fh.nframes <= position){
+    rp->position += fh.nframes;
+    rp->offset += RECFILE_FRAME_HEADER_SIZE + fh.length;
+  }
+  return rp->position;
+}
+
+void recfile_close(struct recfile_reader *rp){
+  recfile_index_free(&rp->index);
+  free(rp->payload);
+  rp->payload = NULL;
+  rp->payload_size = 0;
+}
@@ -0,0 +1,100 @@
+// Framed, losslessly compressed recording format used by pcmrecord -c, iqrecord -c and iqplay
+//
+// File layout (all fields little-endian):
+//   file header (RECFILE_HEADER_SIZE bytes)
+//   frames, each with a RECFILE_FRAME_HEADER_SIZE header carrying its RTP timestamp and sample count
+//     DATA frames hold samples, either raw or compressed with a fixed polynomial predictor and Rice codes
+//     GAP frames record lost or missing samples explicitly instead of writing zeroes
+//   INDEX frame: (sample position, file offset, timestamp) about once a second, for fast seeking
+//   trailer: RECFILE_TRAILER_MAGIC and the offset of the INDEX frame
+// A file without a trailer (e.g., recorder killed) is still readable; the index is rebuilt by scanning frame headers
+#ifndef _RECFILE_H
+#define _RECFILE_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define RECFILE_MAGIC "KA9QREC1"
+#define RECFILE_TRAILER_MAGIC "KA9QIDX1"
+#define RECFILE_HEADER_SIZE 64
+#define RECFILE_FRAME_HEADER_SIZE 24
+#define RECFILE_TRAILER_SIZE 16
+#define RECFILE_INDEX_ENTRY_SIZE 24
+#define RECFILE_MAX_FRAMES 4096      // Sample frames (one sample per channel) per DATA frame
+#define RECFILE_MAX_CHANNELS 2
+
+enum recfile_frame_type {
+  RECFILE_DATA = 0,
+  RECFILE_GAP,
+  RECFILE_INDEX,
+};
+
+enum recfile_codec {
+  RECFILE_RAW = 0,     // Samples as given
+  RECFILE_RICE,        // 16-bit samples, fixed predictor + Rice codes
+};
+
+// Stream description carried in the file header
+struct recfile_info {
+  unsigned int samprate;
+  uint32_t ssrc;
+  int channels;
+  int bitspersample;   // Only 16-bit samples are compressed; others are stored raw
+  double frequency;    // RF frequency for I/Q recordings, 0 for audio
+  int64_t start_time;  // Unix time of first sample, ns
+};
+
+struct recfile_index_entry {
+  uint64_t position;   // Sample frames since start of file, including gaps
+  uint64_t offset;     // File offset of the frame starting at 'position'
+  uint32_t timestamp;  // RTP timestamp of that frame
+};
+
+struct recfile_index {
+  struct recfile_index_entry *entries;
+  int count;
+  int size;            // Allocated entries
+  uint64_t last;       // Position of last entry
+};
+
+struct recfile_frame {
+  enum recfile_frame_type type;
+  uint32_t timestamp;
+  int nframes;
+  int bytes;           // Decoded bytes in caller's buffer (DATA only)
+};
+
+// Reader state
+struct recfile_reader {
+  int fd;
+  struct recfile_info info;
+  struct recfile_index index;
+  off_t offset;        // Next frame
+  off_t data_end;      // Start of INDEX frame, or end of file
+  uint64_t position;   // Sample position of next frame
+  unsigned char *payload;
+  int payload_size;
+};
+
+// Writing: these only build bytes in the caller's buffer, so they fit whatever I/O path the recorder uses
+int recfile_encode_header(unsigned char *out,struct recfile_info const *info);
+int recfile_encode_data(unsigned char *out,int outsize,uint32_t timestamp,void const *samples,int nframes,int channels,int bitspersample);
+int recfile_encode_gap(unsigned char *out,uint32_t timestamp,uint32_t nframes);
+int recfile_index_size(struct recfile_index const *index);
+int recfile_encode_index(unsigned char *out,struct recfile_index const *index,uint64_t index_offset);
+int recfile_index_note(struct recfile_index *index,uint64_t position,uint64_t offset,uint32_t timestamp,unsigned int interval);
+void recfile_index_free(struct recfile_index *index);
+
+// Largest encoding of a DATA frame, for sizing buffers
+static inline int recfile_max_data(int nframes,int channels,int bitspersample){
+  return RECFILE_FRAME_HEADER_SIZE + (nframes * channels * bitspersample + 7) / 8;
+}
+
+// Reading
+int recfile_is_recfile(int fd);
+int recfile_open(struct recfile_reader *rp,int fd);
+int recfile_read(struct recfile_reader *rp,struct recfile_frame *frame,void *buf,int bufsize);
+int64_t recfile_seek(struct recfile_reader *rp,uint64_t position);
+void recfile_close(struct recfile_reader *rp);
+
+#endif
@@ -0,0 +1,385 @@
+// RTCP sender reports and SAP announcements for radio, from one scheduler thread
+// Replaces a pair of mostly sleeping threads per demod
+//
+// Each report keeps its packet prebuilt; an RTCP SR+SDES is rebuilt only when the SSRC changes,
+// otherwise just the timestamps and counters in the sender info are patched.
+// A SAP announcement is rebuilt only when the output sample rate changes.
+// Reports sit on a timing wheel of REPORT_TICK_MS slots; the intervals are randomized as in RFC 3550 6.3.1
+// so hundreds of channels don't all report in the same tick, and reports due together are sent in one
+// sendmmsg() per socket where available
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <pwd.h>
+#if defined(linux)
+#include <bsd/string.h>
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "misc.h"
+#include "multicast.h"
+#include "radio.h"
+
+#define REPORT_SLOTS 64
+#define REPORT_TICK_MS 100
+#define REPORT_BATCH 64   // Packets per sendmmsg()
+
+static double const Rtcp_interval = 1.0; // sec, before randomization
+static double const Sap_interval = 5.0;
+static double const Rtcp_compensation = 1.21828; // e - 3/2, RFC 3550 6.3.1
+
+enum report_type {
+  REPORT_RTCP,
+  REPORT_SAP,
+};
+
+struct report {
+  struct report *next;       // Wheel slot chain
+  struct demod *demod;
+  enum report_type type;
+  int fd;
+  long long due;             // CLOCK_MONOTONIC ns
+  uint32_t ssrc;             // What the packet was built for
+  int samprate;
+  int len;                   // 0 when it must be rebuilt
+  unsigned char packet[1500];
+};
+
+static struct report *Wheel[REPORT_SLOTS];
+static long long Wheel_tick;  // Last tick visited
+static pthread_mutex_t Report_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t Report_thread;
+static char Hostname[128];
+static char Username[64];
+static long long Sap_start_time; // NTP seconds, for the o= and t= lines
+static uint16_t Sap_id;
+
+extern struct timespec Starttime; // System clock at RTP timestamp 0
+
+static long long mono_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// RFC 3550 6.3.1: uniform over [0.5,1.5] of the nominal interval, divided by e - 3/2
+// to keep the mean from drifting up. The first one is halved so a new sender is heard quickly
+static long long next_interval(double const interval,bool const first){
+  double t = interval * (0.5 + (double)random() / RAND_MAX) / Rtcp_compensation;
+  if(first)
+    t /= 2;
+  return (long long)(t * 1e9);
+}
+
+// Caller holds Report_mutex
+static void wheel_insert(struct report * const rp){
+  long long tick = rp->due / (REPORT_TICK_MS * 1000000LL);
+  if(tick <= Wheel_tick)
+    tick = Wheel_tick + 1; // Never into a slot already visited this lap
+  int const slot = tick % REPORT_SLOTS;
+  rp->next = Wheel[slot];
+  Wheel[slot] = rp;
+}
+
+static int build_rtcp(struct report * const rp){
+  struct demod const * const demod = rp->demod;
+  struct rtcp_sr sr;
+  memset(&sr,0,sizeof(sr));
+  sr.ssrc = demod->output.rtp.ssrc;
+  unsigned char *dp = gen_sr(rp->packet,sizeof(rp->packet),&sr,NULL,0);
+
+  struct rtcp_sdes sdes[4];
+  memset(sdes,0,sizeof(sdes));
+  sdes[0].type = CNAME;
+  snprintf(sdes[0].message,sizeof(sdes[0].message),"radio@%s",Hostname);
+  sdes[0].mlen = strlen(sdes[0].message);
+
+  sdes[1].type = NAME;
+  strlcpy(sdes[1].message,"KA9Q Radio Program",sizeof(sdes[1].message));
+  sdes[1].mlen = strlen(sdes[1].message);
+
+  sdes[2].type = EMAIL;
+  strlcpy(sdes[2].message,"karn@ka9q.net",sizeof(sdes[2].message));
+  sdes[2].mlen = strlen(sdes[2].message);
+
+  sdes[3].type = TOOL;
+  strlcpy(sdes[3].message,"KA9Q Radio Program",sizeof(sdes[3].message));
+  sdes[3].mlen = strlen(sdes[3].message);
+
+  dp = gen_sdes(dp,sizeof(rp->packet) - (dp - rp->packet),sr.ssrc,sdes,4);
+  if(dp == NULL)
+    return 0;
+  rp->ssrc = sr.ssrc;
+  return rp->len = dp - rp->packet;
+}
+
+// Sender info: SSRC at 4, NTP timestamp at 8, RTP timestamp at 16, packet count at 20, octet count at 24
+static void patch_rtcp(struct report * const rp){
+  struct demod const * const demod = rp->demod;
+  struct timespec ts;
+  uint32_t rtp_time;
+  if(demod->frontend->input.file != NULL){
+    // Reading a recording faster than real time: its time, and the stream's own position in it
+    long long const unix_ns = demod->frontend->sdr.timestamp + (long long)(UNIX_EPOCH - GPS_UTC_OFFSET) * 1000000000LL;
+    ts.tv_sec = unix_ns / 1000000000LL;
+    ts.tv_nsec = unix_ns % 1000000000LL;
+    rtp_time = demod->output.rtp.timestamp;
+  } else {
+    clock_gettime(CLOCK_REALTIME,&ts);
+    double const runtime = (ts.tv_sec - Starttime.tv_sec) + (ts.tv_nsec - Starttime.tv_nsec)/1000000000.;
+    // The zero is to remind me that I start timestamps at zero, but they could start anywhere
+    rtp_time = (uint32_t)(0 + runtime * demod->output.samprate);
+  }
+  long long ntp = ((long long)ts.tv_sec + NTP_EPOCH) << 32;
+  ntp += ((long long)ts.tv_nsec << 32) / 1000000000;
+
+  put32(rp->packet + 8,ntp >> 32);
+  put32(rp->packet + 12,ntp);
+  put32(rp->packet + 16,rtp_time);
+  put32(rp->packet + 20,demod->output.rtp.seq);
+  put32(rp->packet + 24,demod->output.rtp.bytes);
+}
+
+/* Session announcement protocol - highly experimental, off by default
+   The whole point was to make it easy to use VLC and similar tools, but they either don't actually implement SAP (e.g. in iOS)
+   or implement some vague subset that you have to guess how to use
+   Will probably work better with Opus streams from the opus transcoder, since they're always 48000 Hz stereo; no switching midstream
+*/
+static int build_sap(struct report * const rp){
+  struct demod const * const demod = rp->demod;
+  int const sess_version = 1;
+  char * const message = (char *)rp->packet;
+  char *wp = message;
+  int space = sizeof(rp->packet);
+
+  *wp++ = 0x20; // SAP version 1, ipv4 address, announce, not encrypted, not compressed
+  *wp++ = 0; // No authentication
+  *wp++ = Sap_id >> 8;
+  *wp++ = Sap_id & 0xff;
+  space -= 4;
+
+  // our sending ipv4 address
+  struct sockaddr_in const *sin = (struct sockaddr_in *)&demod->output.data_source_address;
+  memcpy(wp,&sin->sin_addr.s_addr,4); // network byte order
+  wp += 4;
+  space -= 4;
+
+  int len = snprintf(wp,space,"application/sdp");
+  wp += len + 1; // allow space for the trailing null
+  space -= (len + 1);
+
+  // End of SAP header, beginning of SDP
+  char mcast[128];
+  strlcpy(mcast,formatsock(&demod->output.data_dest_address),sizeof(mcast));
+  // Remove :port field, confuses the vlc listener
+  char *cp = strchr(mcast,':');
+  if(cp)
+    *cp = '\0';
+
+  // Demod type can change, but not the sample rate
+  int const samprate = demod->output.samprate;
+  int const mono_type = pt_from_info(samprate,1);
+  int const stereo_type = pt_from_info(samprate,2);
+  int const fm_type = pt_from_info(samprate,1);
+
+  len = snprintf(wp,space,
+		 "v=0\r\n"
+		 "o=%s %lld %d IN IP4 %s\r\n"
+		 "s=radio %s\r\n"
+		 "i=PCM output stream from ka9q-radio on %s\r\n"
+		 "c=IN IP4 %s/%d\r\n"
+		 "t=%lld %lld\r\n" // unbounded
+		 "m=audio 5004/1 RTP/AVP %d %d %d\r\n"
+		 "a=rtpmap:%d L16/%d/%d\r\n"
+		 "a=rtpmap:%d L16/%d/%d\r\n"
+		 "a=rtpmap:%d L16/%d/%d\r\n",
+		 Username,Sap_start_time,sess_version,Hostname,
+		 demod->frontend->sdr.description,
+		 demod->frontend->sdr.description,
+		 mcast,Mcast_ttl,
+		 Sap_start_time,0LL,
+		 mono_type,stereo_type,fm_type,
+		 mono_type,samprate,1,
+		 stereo_type,samprate,2,
+		 fm_type,samprate,1);
+  if(len < 0 || len >= space)
+    return 0;
+  wp += len;
+  rp->samprate = samprate;
+  return rp->len = wp - message;
+}
+
+// Bring a due report's packet up to date; false if there's nothing to send yet
+static bool prepare(struct report * const rp){
+  struct demod const * const demod = rp->demod;
+  if(rp->type == REPORT_RTCP){
+    if(demod->output.rtp.ssrc == 0)
+      return false; // Wait until it's set by output RTP subsystem
+    if((rp->len == 0 || rp->ssrc != demod->output.rtp.ssrc) && build_rtcp(rp) == 0)
+      return false;
+    patch_rtcp(rp);
+    return true;
+  }
+  if(rp->len == 0 || rp->samprate != demod->output.samprate)
+    build_sap(rp);
+  return rp->len > 0;
+}
+
+static int by_fd(void const *a,void const *b){
+  struct report const * const x = *(struct report const **)a;
+  struct report const * const y = *(struct report const **)b;
+  return x->fd - y->fd;
+}
+
+// Send n packets, all on the same socket
+static void send_batch(struct report ** const due,int const n){
+#if defined(linux)
+  struct mmsghdr msgs[REPORT_BATCH];
+  struct iovec iov[REPORT_BATCH];
+  for(int i=0; i < n; i++){
+    iov[i].iov_base = due[i]->packet;
+    iov[i].iov_len = due[i]->len;
+    memset(&msgs[i],0,sizeof(msgs[i]));
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  int sent = 0;
+  while(sent < n){
+    int const r = sendmmsg(due[0]->fd,msgs + sent,n - sent,0);
+    if(r <= 0)
+      sent++; // Skip the one that failed, as send() would have
+    else
+      sent += r;
+  }
+#else
+  for(int i=0; i < n; i++)
+    send(due[i]->fd,due[i]->packet,due[i]->len,0);
+#endif
+}
+
+static void *report_thread(void *arg){
+  (void)arg;
+  pthread_setname("reports");
+  int size = 256;
+  struct report **due = malloc(size * sizeof(*due));
+  assert(due != NULL);
+
+  while(1){
+    usleep(REPORT_TICK_MS * 1000);
+    long long const now = mono_ns();
+    long long const tick = now / (REPORT_TICK_MS * 1000000LL);
+    int ndue = 0;
+
+    pthread_mutex_lock(&Report_mutex);
+    if(tick - Wheel_tick > REPORT_SLOTS)
+      Wheel_tick = tick - REPORT_SLOTS; // Long stall; visit each slot once
+    while(Wheel_tick < tick){
+      Wheel_tick++;
+      struct report **rpp = &Wheel[Wheel_tick % REPORT_SLOTS];
+      while(*rpp != NULL){
+	struct report * const rp = *rpp;
+	if(rp->due > now){
+	  rpp = &rp->next; // A later lap
+	  continue;
+	}
+	*rpp = rp->next;
+	if(ndue == size){
+	  size *= 2;
+	  due = realloc(due,size * sizeof(*due));
+	  assert(due != NULL);
+	}
+	due[ndue++] = rp;
+      }
+    }
+    // Reschedule first, then drop the ones with nothing to send
+    int n = 0;
+    for(int i=0; i < ndue; i++){
+      struct report * const rp = due[i];
+      rp->due = now + next_interval(rp->type == REPORT_RTCP ? Rtcp_interval : Sap_interval,false);
+      wheel_insert(rp);
+      if(prepare(rp))
+	due[n++] = rp;
+    }
+    qsort(due,n,sizeof(*due),by_fd);
+    for(int i=0; i < n; ){
+      int j = i + 1;
+      while(j < n && j - i < REPORT_BATCH && due[j]->fd == due[i]->fd)
+	j++;
+      send_batch(due + i,j - i);
+      i = j;
+    }
+    // Still locked so stop_reports() can't free a packet being sent
+    pthread_mutex_unlock(&Report_mutex);
+  }
+  return NULL;
+}
+
+static void add_report(struct demod * const demod,enum report_type const type,int const fd){
+  struct report * const rp = calloc(1,sizeof(*rp));
+  assert(rp != NULL);
+  rp->demod = demod;
+  rp->type = type;
+  rp->fd = fd;
+  rp->due = mono_ns() + next_interval(type == REPORT_RTCP ? Rtcp_interval : Sap_interval,true);
+  wheel_insert(rp);
+}
+
+// Start sending RTCP sender reports and/or SAP announcements for a demod
+// Sockets that aren't open (rtcp_fd, sap_fd < 3) are silently skipped
+int start_reports(struct demod * const demod,bool const rtcp,bool const sap){
+  assert(demod != NULL);
+  pthread_mutex_lock(&Report_mutex);
+  if(Report_thread == (pthread_t)0){
+    gethostname(Hostname,sizeof(Hostname));
+    Hostname[sizeof(Hostname)-1] = '\0';
+    struct passwd pwd,*result = NULL;
+    char buf[1024];
+    getpwuid_r(getuid(),&pwd,buf,sizeof(buf),&result);
+    strlcpy(Username,result ? result->pw_name : "-",sizeof(Username));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME,&ts);
+    Sap_start_time = ts.tv_sec + NTP_EPOCH;
+    Sap_id = random(); // Should be a hash, but it changes every time anyway
+    Wheel_tick = mono_ns() / (REPORT_TICK_MS * 1000000LL);
+    pthread_create(&Report_thread,NULL,report_thread,NULL);
+  }
+  // Don't start any twice
+  bool have_rtcp = false, have_sap = false;
+  for(int i=0; i < REPORT_SLOTS; i++){
+    for(struct report *rp = Wheel[i]; rp != NULL; rp = rp->next){
+      if(rp->demod == demod){
+	have_rtcp |= rp->type == REPORT_RTCP;
+	have_sap |= rp->type == REPORT_SAP;
+      }
+    }
+  }
+  if(rtcp && !have_rtcp && demod->output.rtcp_fd >= 3)
+    add_report(demod,REPORT_RTCP,demod->output.rtcp_fd);
+  if(sap && !have_sap && demod->output.sap_fd >= 3)
+    add_report(demod,REPORT_SAP,demod->output.sap_fd);
+  pthread_mutex_unlock(&Report_mutex);
+  return 0;
+}
+
+// Stop all reports for a demod; on return the scheduler no longer refers to it
+void stop_reports(struct demod * const demod){
+  pthread_mutex_lock(&Report_mutex);
+  for(int i=0; i < REPORT_SLOTS; i++){
+    struct report **rpp = &Wheel[i];
+    while(*rpp != NULL){
+      struct report * const rp = *rpp;
+      if(rp->demod == demod){
+	*rpp = rp->next;
+	free(rp);
+      } else
+	rpp = &rp->next;
+    }
+  }
+  pthread_mutex_unlock(&Report_mutex);
+}
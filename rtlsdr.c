@@ -30,6 +30,7 @@
 #include "multicast.h"
 #include "decimate.h"
 #include "status.h"
+#include "metrics.h"
 
 //#define REMOVE_DC 1
 
@@ -61,6 +62,7 @@ int Verbose;
 int AGC;     // Default to hardware AGC
 int Dev = 0; // Default to device 0
 struct rtlsdr_dev *Device; // Set for benefit of closedown()
+char const *Metrics; // Scrape endpoint, if any
 
 struct sdrstate {
   struct rtlsdr_dev *device;    // Opaque pointer
@@ -121,6 +123,7 @@ static struct option Options[] =
     {"device", required_argument, NULL, 'I'},
     {"serial", required_argument, NULL, 'I'},
     {"linearity",no_argument, NULL, 'L'},
+    {"metrics", required_argument, NULL, 'M'},
     {"status-out", required_argument, NULL, 'R'},
     {"ssrc", required_argument, NULL, 'S'},
     {"data-ttl", required_argument, NULL, 'T'},
@@ -139,7 +142,7 @@ static struct option Options[] =
     {"verbose", no_argument, NULL, 'v'},
     {NULL, 0, NULL, 0},
   };
-static char const Optstring[] = "A:D:I:LR:S:T:abc:f:p:r:t:v";
+static char const Optstring[] = "A:D:I:LM:R:S:T:abc:f:p:r:t:v";
 
 double set_correct_freq(struct sdrstate *sdr,double freq);
 void decode_rtlsdr_commands(struct sdrstate *,unsigned char *,int);
@@ -150,6 +153,7 @@ void *display(void *);
 void *ncmd(void *);
 double true_freq(uint64_t freq);
 static void closedown(int a);
+static void rtlsdr_metrics(struct metrics *,void *);
 
 int main(int argc,char *argv[]){
   umask(02);
@@ -191,6 +195,9 @@ int main(int argc,char *argv[]){
     case 'L':
       sdr->linearity = 1;
       break;
+    case 'M':
+      Metrics = optarg;
+      break;
     case 'R':
       sdr->metadata_dest = optarg;
       break;
@@ -369,6 +376,8 @@ int main(int argc,char *argv[]){
   
   if(sdr->status)
     pthread_create(&sdr->display_thread,NULL,display,sdr);
+  if(Metrics != NULL)
+    metrics_start(Metrics,"ka9q_rtlsdr",rtlsdr_metrics,sdr);
 
   pthread_create(&sdr->ncmd_thread,NULL,ncmd,sdr);
   rtlsdr_reset_buffer(sdr->device);
@@ -774,3 +783,17 @@ static void closedown(int a){
   exit(1);
 }
 
+// Collect function for the metrics endpoint (--metrics)
+static void rtlsdr_metrics(struct metrics * const m,void *arg){
+  struct sdrstate const * const sdr = (struct sdrstate *)arg;
+  metric_family(m,"output_packets_total","counter","RTP data packets sent");
+  metric(m,"output_packets_total",sdr->rtp.packets,"ssrc=\"%u\",device=\"%d\"",sdr->rtp.ssrc,Dev);
+  metric_family(m,"output_bytes_total","counter","RTP data bytes sent");
+  metric(m,"output_bytes_total",sdr->rtp.bytes,"ssrc=\"%u\",device=\"%d\"",sdr->rtp.ssrc,Dev);
+  metric_family(m,"status_packets_total","counter","Status packets sent");
+  metric(m,"status_packets_total",sdr->output_metadata_packets,"ssrc=\"%u\",device=\"%d\"",sdr->rtp.ssrc,Dev);
+  metric_family(m,"commands_total","counter","Commands received");
+  metric(m,"commands_total",sdr->commands,"ssrc=\"%u\",device=\"%d\"",sdr->rtp.ssrc,Dev);
+  metric_family(m,"frequency_hz","gauge","Tuner frequency");
+  metric(m,"frequency_hz",sdr->frequency,"ssrc=\"%u\",device=\"%d\"",sdr->rtp.ssrc,Dev);
+}
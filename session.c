@@ -0,0 +1,314 @@
+// Shared table of incoming RTP sessions
+// Replaces the per-program linked lists that were searched (with a memcmp on the sender) for every packet
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "session.h"
+
+static int const Max_load = 2; // Grow when average chain length exceeds this
+
+// Mix sender address and port, SSRC and type into a 32-bit hash
+static uint32_t session_hash(void const * const s,uint32_t const ssrc,int const type){
+  struct sockaddr const * const sock = s;
+  uint32_t h = 2166136261U; // FNV-1a
+  unsigned char const *dp = NULL;
+  int len = 0;
+  uint16_t port = 0;
+
+  switch(sock->sa_family){
+  case AF_INET:
+    {
+      struct sockaddr_in const *sin = s;
+      dp = (unsigned char const *)&sin->sin_addr;
+      len = sizeof(sin->sin_addr);
+      port = sin->sin_port;
+    }
+    break;
+  case AF_INET6:
+    {
+      struct sockaddr_in6 const *sin6 = s;
+      dp = (unsigned char const *)&sin6->sin6_addr;
+      len = sizeof(sin6->sin6_addr);
+      port = sin6->sin6_port;
+    }
+    break;
+  }
+  for(int i=0; i < len; i++){
+    h ^= dp[i];
+    h *= 16777619U;
+  }
+  h ^= port;
+  h *= 16777619U;
+  h ^= ssrc;
+  h *= 16777619U;
+  h ^= type;
+  h *= 16777619U;
+  return h ^ (h >> 16);
+}
+
+// Compare only the meaningful parts of two socket addresses
+static int same_sender(void const * const a,void const * const b){
+  struct sockaddr const * const sa = a;
+  struct sockaddr const * const sb = b;
+
+  if(sa->sa_family != sb->sa_family)
+    return 0;
+  switch(sa->sa_family){
+  case AF_INET:
+    {
+      struct sockaddr_in const *ia = a;
+      struct sockaddr_in const *ib = b;
+      return ia->sin_port == ib->sin_port && ia->sin_addr.s_addr == ib->sin_addr.s_addr;
+    }
+  case AF_INET6:
+    {
+      struct sockaddr_in6 const *ia = a;
+      struct sockaddr_in6 const *ib = b;
+      return ia->sin6_port == ib->sin6_port && memcmp(&ia->sin6_addr,&ib->sin6_addr,sizeof(ia->sin6_addr)) == 0;
+    }
+  default:
+    return memcmp(a,b,sizeof(struct sockaddr)) == 0;
+  }
+}
+
+static void wheel_unlink(struct session_table * const table,struct session_entry * const entry){
+  if(entry->slot < 0)
+    return;
+  if(entry->wheel_next)
+    entry->wheel_next->wheel_prev = entry->wheel_prev;
+  if(entry->wheel_prev)
+    entry->wheel_prev->wheel_next = entry->wheel_next;
+  else
+    table->wheel[entry->slot] = entry->wheel_next;
+  entry->wheel_prev = entry->wheel_next = NULL;
+  entry->slot = -1;
+}
+
+static void wheel_link(struct session_table * const table,struct session_entry * const entry){
+  int const slot = entry->expires % SESSION_WHEEL_SLOTS;
+  entry->slot = slot;
+  entry->wheel_prev = NULL;
+  entry->wheel_next = table->wheel[slot];
+  if(entry->wheel_next)
+    entry->wheel_next->wheel_prev = entry;
+  table->wheel[slot] = entry;
+}
+
+// Double the bucket count; caller holds lock
+static void rehash(struct session_table * const table){
+  int const nbuckets = 2 * table->nbuckets;
+  struct session_entry **buckets = calloc(nbuckets,sizeof(*buckets));
+  if(buckets == NULL)
+    return; // Keep going with longer chains
+
+  for(int i=0; i < table->nbuckets; i++){
+    struct session_entry *next;
+    for(struct session_entry *sp = table->buckets[i]; sp != NULL; sp = next){
+      next = sp->hash_next;
+      int const b = sp->hash & (nbuckets - 1);
+      sp->hash_next = buckets[b];
+      buckets[b] = sp;
+    }
+  }
+  free(table->buckets);
+  table->buckets = buckets;
+  table->nbuckets = nbuckets;
+}
+
+// nbuckets is rounded up to a power of 2; the table grows as needed
+// timeout = idle time in seconds before session_expire() reaps a session, 0 = never
+int session_table_init(struct session_table * const table,int nbuckets,int const timeout){
+  assert(table != NULL);
+  memset(table,0,sizeof(*table));
+  int n = 16;
+  while(n < nbuckets)
+    n <<= 1;
+  table->buckets = calloc(n,sizeof(*table->buckets));
+  if(table->buckets == NULL)
+    return -1;
+  table->nbuckets = n;
+  table->timeout = timeout;
+  table->wheel_time = session_time();
+  pthread_mutex_init(&table->lock,NULL);
+  return 0;
+}
+
+// Return the owner of the matching session, or NULL
+void *session_lookup(struct session_table * const table,void const * const sender,uint32_t const ssrc,int const type){
+  assert(table != NULL && sender != NULL);
+  uint32_t const hash = session_hash(sender,ssrc,type);
+  void *owner = NULL;
+
+  pthread_mutex_lock(&table->lock);
+  for(struct session_entry *sp = table->buckets[hash & (table->nbuckets - 1)]; sp != NULL; sp = sp->hash_next){
+    if(sp->hash == hash && sp->ssrc == ssrc && sp->type == type && same_sender(&sp->sender,sender)){
+      owner = sp->owner;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&table->lock);
+  return owner;
+}
+
+// Add an entry embedded in 'owner'. The key is copied into the entry
+int session_insert(struct session_table * const table,struct session_entry * const entry,void * const owner,
+		   void const * const sender,uint32_t const ssrc,int const type){
+  assert(table != NULL && entry != NULL && sender != NULL);
+
+  memset(entry,0,sizeof(*entry));
+  entry->owner = owner;
+  memcpy(&entry->sender,sender,((struct sockaddr const *)sender)->sa_family == AF_INET6 ?
+	 sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+  entry->ssrc = ssrc;
+  entry->type = type;
+  entry->hash = session_hash(sender,ssrc,type);
+  entry->slot = -1;
+
+  pthread_mutex_lock(&table->lock);
+  if(table->count >= Max_load * table->nbuckets)
+    rehash(table);
+  int const b = entry->hash & (table->nbuckets - 1);
+  entry->hash_next = table->buckets[b];
+  table->buckets[b] = entry;
+  table->count++;
+  if(table->timeout > 0){
+    entry->expires = session_time() + table->timeout;
+    wheel_link(table,entry);
+  }
+  pthread_mutex_unlock(&table->lock);
+  return 0;
+}
+
+// Remove entry from table; the owner is still the caller's to free
+int session_remove(struct session_table * const table,struct session_entry * const entry){
+  assert(table != NULL && entry != NULL);
+
+  pthread_mutex_lock(&table->lock);
+  struct session_entry **spp;
+  for(spp = &table->buckets[entry->hash & (table->nbuckets - 1)]; *spp != NULL; spp = &(*spp)->hash_next){
+    if(*spp == entry)
+      break;
+  }
+  if(*spp == NULL){
+    pthread_mutex_unlock(&table->lock);
+    return -1; // Not in table
+  }
+  *spp = entry->hash_next;
+  entry->hash_next = NULL;
+  wheel_unlink(table,entry);
+  table->count--;
+  pthread_mutex_unlock(&table->lock);
+  return 0;
+}
+
+// Advance the timer wheel to the current time
+// Each expired session is removed from the table and passed to reap(), which must not call back into the table
+// Only the wheel slots for elapsed seconds are examined, so this is cheap enough to call after every packet
+// Returns the number of sessions reaped
+int session_expire(struct session_table * const table,void (*reap)(void *)){
+  assert(table != NULL);
+  if(table->timeout <= 0)
+    return 0;
+
+  long long const now = session_time();
+
+  struct session_entry *expired = NULL;
+  pthread_mutex_lock(&table->lock);
+  if(now - table->wheel_time > SESSION_WHEEL_SLOTS)
+    table->wheel_time = now - SESSION_WHEEL_SLOTS; // Long stall; visit each slot once
+
+  while(table->wheel_time < now){
+    table->wheel_time++;
+    int const slot = table->wheel_time % SESSION_WHEEL_SLOTS;
+    struct session_entry *next;
+    for(struct session_entry *sp = table->wheel[slot]; sp != NULL; sp = next){
+      next = sp->wheel_next;
+      if(sp->expires > now){
+	// Touched since it was scheduled; move to its new slot if necessary
+	if(sp->expires % SESSION_WHEEL_SLOTS != slot){
+	  wheel_unlink(table,sp);
+	  wheel_link(table,sp);
+	}
+	continue;
+      }
+      // Expired: take out of hash chain and wheel, put on reap list
+      wheel_unlink(table,sp);
+      struct session_entry **spp;
+      for(spp = &table->buckets[sp->hash & (table->nbuckets - 1)]; *spp != NULL && *spp != sp; spp = &(*spp)->hash_next)
+	;
+      if(*spp != NULL)
+	*spp = sp->hash_next;
+      table->count--;
+      sp->hash_next = expired;
+      expired = sp;
+    }
+  }
+  pthread_mutex_unlock(&table->lock);
+
+  int count = 0;
+  struct session_entry *next;
+  for(struct session_entry *sp = expired; sp != NULL; sp = next){
+    next = sp->hash_next;
+    sp->hash_next = NULL;
+    if(reap)
+      (*reap)(sp->owner);
+    count++;
+  }
+  return count;
+}
+
+// Remove every session from the table and pass each to reap(), as session_expire() does, e.g., at shutdown
+// reap() is called after the table is unlocked, so it may take as long as it likes
+// Returns the number of sessions removed
+int session_drain(struct session_table * const table,void (*reap)(void *)){
+  assert(table != NULL);
+
+  struct session_entry *all = NULL;
+  pthread_mutex_lock(&table->lock);
+  for(int i=0; i < table->nbuckets; i++){
+    struct session_entry *next;
+    for(struct session_entry *sp = table->buckets[i]; sp != NULL; sp = next){
+      next = sp->hash_next;
+      wheel_unlink(table,sp);
+      sp->hash_next = all;
+      all = sp;
+    }
+    table->buckets[i] = NULL;
+  }
+  table->count = 0;
+  pthread_mutex_unlock(&table->lock);
+
+  int count = 0;
+  struct session_entry *next;
+  for(struct session_entry *sp = all; sp != NULL; sp = next){
+    next = sp->hash_next;
+    sp->hash_next = NULL;
+    if(reap)
+      (*reap)(sp->owner);
+    count++;
+  }
+  return count;
+}
+
+// Call fn() on every session in the table, with the table locked so none can be reaped meanwhile
+// For occasional reporting only: every session_lookup() waits until we're done, so fn() should just copy
+// out what it needs, and it must not call back into the table
+// Returns the number of sessions visited
+int session_walk(struct session_table * const table,void (*fn)(void *,void *),void * const arg){
+  assert(table != NULL && fn != NULL);
+
+  int count = 0;
+  pthread_mutex_lock(&table->lock);
+  for(int i=0; i < table->nbuckets; i++){
+    for(struct session_entry *sp = table->buckets[i]; sp != NULL; sp = sp->hash_next){
+      (*fn)(sp->owner,arg);
+      count++;
+    }
+  }
+  pthread_mutex_unlock(&table->lock);
+  return count;
+}
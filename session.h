@@ -0,0 +1,67 @@
+// Shared table of incoming RTP sessions, for programs that demultiplex many streams from one multicast group
+// Sessions are hashed on (sender address, SSRC, payload type) so per-packet lookup doesn't grow with the number of streams
+// Idle sessions are found with a timer wheel instead of walking the whole table
+#ifndef _SESSION_H
+#define _SESSION_H 1
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define SESSION_WHEEL_SLOTS 64 // Timer wheel size, seconds; should exceed the usual idle timeout
+
+// Embedded in each program's own session structure
+struct session_entry {
+  struct session_entry *hash_next;   // Hash bucket chain
+  struct session_entry *wheel_prev;  // Timer wheel slot list
+  struct session_entry *wheel_next;
+  void *owner;                       // Containing session structure, returned by lookups
+
+  struct sockaddr_storage sender;    // Key
+  uint32_t ssrc;
+  int type;                          // RTP payload type, or 0 if the program doesn't distinguish by type
+  uint32_t hash;
+
+  long long expires;                 // Time (sec) after which session_expire() reaps us; 0 = never
+  int slot;                          // Current timer wheel slot, -1 if none
+};
+
+struct session_table {
+  pthread_mutex_t lock;
+  struct session_entry **buckets;
+  int nbuckets;                      // Always a power of 2
+  int count;                         // Entries in table
+  int timeout;                       // Idle timeout, sec; 0 disables expiry
+  long long wheel_time;              // Last second processed by session_expire()
+  struct session_entry *wheel[SESSION_WHEEL_SLOTS];
+};
+
+int session_table_init(struct session_table *table,int nbuckets,int timeout);
+void *session_lookup(struct session_table *table,void const *sender,uint32_t ssrc,int type);
+int session_insert(struct session_table *table,struct session_entry *entry,void *owner,void const *sender,uint32_t ssrc,int type);
+int session_remove(struct session_table *table,struct session_entry *entry);
+int session_expire(struct session_table *table,void (*reap)(void *owner));
+int session_drain(struct session_table *table,void (*reap)(void *owner));
+int session_walk(struct session_table *table,void (*fn)(void *owner,void *arg),void *arg);
+
+// Time base for expirations, whole seconds
+static inline long long session_time(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec;
+}
+
+// Note activity on a session. Called on every packet, so it only records the new expiration time;
+// session_expire() moves the entry to its new wheel slot when it next looks at it
+// Takes the table lock since session_expire() reads expires and may free the entry
+static inline void session_touch(struct session_table * const table,struct session_entry * const entry){
+  if(table->timeout <= 0)
+    return;
+  long long const expires = session_time() + table->timeout;
+  pthread_mutex_lock(&table->lock);
+  entry->expires = expires;
+  pthread_mutex_unlock(&table->lock);
+}
+
+#endif
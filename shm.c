@@ -0,0 +1,565 @@
+// Shared-memory transport for PCM streams between processes on the same host
+// The writer never waits for anyone: it copies each packet into its ring, publishes the new write
+// position and rings the doorbell, making a system call only when a reader has gone to sleep on it.
+// Readers take a packet only if the writer can't have overwritten it while they were copying it out
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#if defined(linux)
+#include <bsd/string.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+
+#include "misc.h"
+#include "multicast.h"
+#include "shm.h"
+
+// Ahead of each packet in a ring; packets are padded to a multiple of 8 bytes
+struct shm_record {
+  uint32_t len;
+  uint32_t reserved;
+};
+
+#define MAX_PACKET 65536
+#define MAX_RECORD (sizeof(struct shm_record) + MAX_PACKET)
+#define MIN_RING_SIZE (4 * MAX_RECORD) // So a reader copying one packet out can't be lapped unnoticed
+static long long const Check_interval = BILLION; // How often readers look for a restarted writer, ns
+
+static inline uint64_t record_size(int const len){
+  return sizeof(struct shm_record) + ((len + 7) & ~7);
+}
+
+static inline struct shm_ring *ring_at(struct shm_header const * const h,int const i){
+  return (struct shm_ring *)((uint8_t *)h + SHM_RINGS_START + i * h->ring_stride);
+}
+
+static inline uint8_t *ring_data(struct shm_ring * const ring){
+  return (uint8_t *)ring + SHM_RING_HEADER;
+}
+
+// Copy into and out of a ring, wrapping around its end
+static void ring_write(struct shm_ring * const ring,uint32_t const size,uint64_t const pos,void const * const src,size_t const len){
+  uint8_t * const data = ring_data(ring);
+  size_t const off = pos & (size - 1);
+  size_t const first = min(len,size - off);
+  memcpy(data + off,src,first);
+  memcpy(data,(uint8_t const *)src + first,len - first);
+}
+static void ring_read(struct shm_ring * const ring,uint32_t const size,uint64_t const pos,void * const dst,size_t const len){
+  uint8_t const * const data = ring_data(ring);
+  size_t const off = pos & (size - 1);
+  size_t const first = min(len,size - off);
+  memcpy(dst,data + off,first);
+  memcpy((uint8_t *)dst + first,data,len - first);
+}
+
+// A name with a '/' past the first character is a file, e.g., on a hugetlbfs mount; otherwise it's POSIX shared memory
+static bool is_path(char const * const name){
+  return strchr(name + 1,'/') != NULL;
+}
+static int open_name(char const * const name,int const flags,mode_t const mode){
+  return is_path(name) ? open(name,flags,mode) : shm_open(name,flags,mode);
+}
+static void unlink_name(char const * const name){
+  if(is_path(name))
+    unlink(name);
+  else
+    shm_unlink(name);
+}
+
+static void doorbell_wake(struct shm_header * const h){
+#if defined(linux)
+  syscall(SYS_futex,&h->doorbell,FUTEX_WAKE,INT_MAX,NULL,NULL,0); // Not FUTEX_PRIVATE: the waiters are other processes
+#else
+  (void)h; // Readers poll
+#endif
+}
+
+// Sleep until the doorbell moves off 'value', or for up to 'timeout' ns
+static void doorbell_wait(struct shm_header * const h,uint32_t const value,long long const timeout){
+#if defined(linux)
+  struct timespec ts;
+  ts.tv_sec = timeout / BILLION;
+  ts.tv_nsec = timeout % BILLION;
+  syscall(SYS_futex,&h->doorbell,FUTEX_WAIT,value,&ts,NULL,0);
+#else
+  (void)h;
+  (void)value;
+  usleep(min(timeout / 1000,1000)); // At most 1 ms late
+#endif
+}
+
+struct shm_segment *shm_create(char const * const name,int const nrings,int const ring_size){
+  assert(name != NULL);
+  if(nrings <= 0 || nrings > 65536){
+    fprintf(stdout,"shm %s: bad ring count %d\n",name,nrings);
+    return NULL;
+  }
+  uint32_t size = 1;
+  while((size < MIN_RING_SIZE || size < (uint32_t)ring_size) && size < (1U << 30))
+    size <<= 1;
+
+  struct shm_segment * const seg = calloc(1,sizeof(*seg));
+  assert(seg != NULL);
+  strlcpy(seg->name,name,sizeof(seg->name));
+  seg->size = SHM_RINGS_START + (size_t)nrings * (SHM_RING_HEADER + size);
+  if(is_path(name))
+    seg->size = (seg->size + (1 << 21) - 1) & ~(size_t)((1 << 21) - 1); // Whole 2 MB huge pages
+
+  unlink_name(name); // Left over from an earlier run; its readers will notice and come find the new one
+  // Readers map it read/write to note that they're sleeping, and they usually run as other users in our group
+  // (e.g., recordings@.service is User=recordings, Group=radio). Set the mode explicitly, past the umask
+  seg->fd = open_name(name,O_RDWR|O_CREAT|O_EXCL,0660);
+  if(seg->fd == -1){
+    fprintf(stdout,"shm %s: can't create: %s\n",name,strerror(errno));
+    free(seg);
+    return NULL;
+  }
+  if(fchmod(seg->fd,0660) == -1)
+    fprintf(stdout,"shm %s: can't set mode: %s\n",name,strerror(errno));
+  void *p = MAP_FAILED;
+  if(ftruncate(seg->fd,seg->size) == 0)
+    p = mmap(NULL,seg->size,PROT_READ|PROT_WRITE,MAP_SHARED,seg->fd,0);
+  if(p == MAP_FAILED){
+    fprintf(stdout,"shm %s: can't map %lu bytes: %s\n",name,(unsigned long)seg->size,strerror(errno));
+    close(seg->fd);
+    unlink_name(name);
+    free(seg);
+    return NULL;
+  }
+  seg->header = p; // Zeroed by ftruncate, so every ring starts out free
+  struct stat st;
+  if(fstat(seg->fd,&st) == 0){
+    seg->dev = st.st_dev;
+    seg->ino = st.st_ino;
+  }
+  struct shm_header * const h = seg->header;
+  h->version = SHM_VERSION;
+  h->nrings = nrings;
+  h->ring_size = size;
+  h->ring_stride = SHM_RING_HEADER + size;
+  h->pid = getpid();
+  atomic_thread_fence(memory_order_release);
+  h->magic = SHM_MAGIC; // Last, so a reader that sees it sees the rest
+  pthread_mutex_init(&seg->lock,NULL);
+  return seg;
+}
+
+// Take a free ring for a stream; NULL if they're all in use
+struct shm_ring *shm_ring_get(struct shm_segment * const seg,uint32_t const ssrc,struct sockaddr_storage const * const source,struct sockaddr_storage const * const dest,bool * const missing){
+  if(seg == NULL)
+    return NULL;
+  struct shm_header * const h = seg->header;
+  struct shm_ring *ring = NULL;
+  pthread_mutex_lock(&seg->lock);
+  for(unsigned int i=0; i < h->nrings; i++){
+    struct shm_ring * const r = ring_at(h,i);
+    uint32_t const g = atomic_load_explicit(&r->generation,memory_order_relaxed);
+    if(g & 1)
+      continue;
+    r->ssrc = ssrc;
+    if(source != NULL)
+      memcpy(&r->source,source,sizeof(r->source));
+    if(dest != NULL)
+      memcpy(&r->dest,dest,sizeof(r->dest));
+    // The write position carries on from the last user; readers start wherever it is when they see the new generation
+    atomic_store_explicit(&r->generation,g + 1,memory_order_release);
+    ring = r;
+    break;
+  }
+  if(ring == NULL && !*missing){
+    // Tell readers the segment no longer has everything, so they stay on (or go back to) the network
+    *missing = true;
+    uint32_t const m = atomic_fetch_add(&h->missing,1) + 1;
+    fprintf(stdout,"shm %s: all %u rings in use; ssrc %u only on the network (%u streams); raise shm-rings\n",
+	    seg->name,h->nrings,ssrc,m);
+  } else if(ring != NULL && *missing){
+    *missing = false;
+    atomic_fetch_sub(&h->missing,1);
+  }
+  pthread_mutex_unlock(&seg->lock);
+  return ring;
+}
+
+void shm_ring_put(struct shm_segment * const seg,struct shm_ring * const ring,bool * const missing){
+  if(seg == NULL)
+    return;
+  if(*missing){
+    *missing = false;
+    atomic_fetch_sub(&seg->header->missing,1);
+  }
+  if(ring == NULL)
+    return;
+  pthread_mutex_lock(&seg->lock);
+  uint32_t const g = atomic_load_explicit(&ring->generation,memory_order_relaxed);
+  if(g & 1)
+    atomic_store_explicit(&ring->generation,g + 1,memory_order_release);
+  pthread_mutex_unlock(&seg->lock);
+}
+
+// Only the ring's owner may call this; many owners may call it at once on different rings
+void shm_send(struct shm_segment * const seg,struct shm_ring * const ring,void const * const packet,int const len){
+  if(seg == NULL || ring == NULL || len <= 0 || len > MAX_PACKET)
+    return;
+  struct shm_header * const h = seg->header;
+  uint64_t const w = atomic_load_explicit(&ring->write,memory_order_relaxed);
+  struct shm_record const rec = { .len = len, .reserved = 0 };
+  ring_write(ring,h->ring_size,w,&rec,sizeof(rec));
+  ring_write(ring,h->ring_size,w + sizeof(rec),packet,len);
+  atomic_store_explicit(&ring->write,w + record_size(len),memory_order_release);
+  atomic_fetch_add(&h->doorbell,1);
+  if(atomic_load(&h->sleepers) != 0)
+    doorbell_wake(h);
+}
+
+void shm_destroy(struct shm_segment * const seg){
+  if(seg == NULL)
+    return;
+  munmap(seg->header,seg->size);
+  close(seg->fd);
+  unlink_name(seg->name);
+  pthread_mutex_destroy(&seg->lock);
+  free(seg);
+}
+
+// Map an existing segment
+static struct shm_segment *shm_attach(char const * const name){
+  struct shm_segment * const seg = calloc(1,sizeof(*seg));
+  assert(seg != NULL);
+  strlcpy(seg->name,name,sizeof(seg->name));
+  seg->fd = open_name(name,O_RDWR,0); // Readers write 'sleepers'
+  if(seg->fd == -1){
+    free(seg);
+    return NULL;
+  }
+  struct stat st;
+  int const r = fstat(seg->fd,&st);
+  if(r == -1 || st.st_size < SHM_RINGS_START){
+    if(r == 0)
+      errno = EINVAL; // Not a segment, or radio hasn't finished creating it
+    close(seg->fd);
+    free(seg);
+    return NULL;
+  }
+  seg->size = st.st_size;
+  seg->dev = st.st_dev;
+  seg->ino = st.st_ino;
+  void * const p = mmap(NULL,seg->size,PROT_READ|PROT_WRITE,MAP_SHARED,seg->fd,0);
+  if(p == MAP_FAILED){
+    close(seg->fd);
+    free(seg);
+    return NULL;
+  }
+  seg->header = p;
+  struct shm_header const * const h = seg->header;
+  if(h->magic != SHM_MAGIC || h->version != SHM_VERSION || h->ring_size < MIN_RING_SIZE
+     || (h->ring_size & (h->ring_size - 1)) != 0 || h->ring_stride != SHM_RING_HEADER + (uint64_t)h->ring_size
+     || SHM_RINGS_START + h->nrings * h->ring_stride > seg->size){
+    munmap(p,seg->size);
+    close(seg->fd);
+    free(seg);
+    errno = EINVAL;
+    return NULL;
+  }
+  atomic_thread_fence(memory_order_acquire);
+  return seg;
+}
+
+static void shm_detach(struct shm_segment * const seg){
+  if(seg == NULL)
+    return;
+  munmap(seg->header,seg->size);
+  close(seg->fd);
+  free(seg);
+}
+
+struct shm_reader *shm_reader_open(char const * const name,struct sockaddr_storage const * const dest){
+  if(name == NULL || name[0] == '\0')
+    return NULL;
+  struct shm_segment * const seg = shm_attach(name);
+  if(seg == NULL){
+    // A missing segment is normal (radio not up yet, or not configured for it); anything else probably isn't,
+    // e.g., EACCES if we're not in radio's group. Say so once per cause, since callers retry every few seconds
+    static int last_errno;
+    int const e = errno;
+    if(e != ENOENT && e != last_errno)
+      fprintf(stderr,"shm %s: can't open: %s; using the network\n",name,strerror(e));
+    last_errno = e;
+    return NULL;
+  }
+  struct shm_reader * const r = calloc(1,sizeof(*r));
+  assert(r != NULL);
+  r->seg = seg;
+  if(dest != NULL)
+    memcpy(&r->dest,dest,sizeof(r->dest));
+  else
+    r->dest.ss_family = AF_UNSPEC;
+  int const n = seg->header->nrings;
+  r->read = calloc(n,sizeof(*r->read));
+  r->generation = calloc(n,sizeof(*r->generation)); // 0 never matches a ring in use, so we start at each one's write position
+  assert(r->read != NULL && r->generation != NULL);
+  r->checked = timing_now();
+  return r;
+}
+
+void shm_reader_close(struct shm_reader ** const rp){
+  if(rp == NULL || *rp == NULL)
+    return;
+  struct shm_reader * const r = *rp;
+  shm_detach(r->seg);
+  free(r->read);
+  free(r->generation);
+  free(r);
+  *rp = NULL;
+}
+
+// Does a ring's stream go where the reader wants?
+static bool dest_match(struct sockaddr_storage const * const want,struct sockaddr_storage const * const have){
+  if(want->ss_family == AF_UNSPEC)
+    return true;
+  if(want->ss_family != have->ss_family)
+    return false;
+  switch(want->ss_family){
+  case AF_INET:
+    {
+      struct sockaddr_in const * const a = (struct sockaddr_in const *)want;
+      struct sockaddr_in const * const b = (struct sockaddr_in const *)have;
+      return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+    }
+  case AF_INET6:
+    {
+      struct sockaddr_in6 const * const a = (struct sockaddr_in6 const *)want;
+      struct sockaddr_in6 const * const b = (struct sockaddr_in6 const *)have;
+      return memcmp(&a->sin6_addr,&b->sin6_addr,sizeof(a->sin6_addr)) == 0 && a->sin6_port == b->sin6_port;
+    }
+  default:
+    return false;
+  }
+}
+
+// Has the writer gone away, or been replaced by a new one with a new segment of the same name?
+static bool segment_gone(struct shm_segment const * const seg){
+  struct stat st;
+  if(is_path(seg->name)){
+    if(stat(seg->name,&st) == -1)
+      return true;
+  } else {
+    int const fd = shm_open(seg->name,O_RDONLY,0);
+    if(fd == -1)
+      return true;
+    int const r = fstat(fd,&st);
+    close(fd);
+    if(r == -1)
+      return true;
+  }
+  return st.st_dev != seg->dev || st.st_ino != seg->ino;
+}
+
+// Take the next packet from ring i, if there is one
+static int ring_recv(struct shm_reader * const r,int const i,void * const buf,int const bufsize,struct sockaddr_storage * const source){
+  struct shm_header const * const h = r->seg->header;
+  struct shm_ring * const ring = ring_at(h,i);
+  uint32_t const g = atomic_load_explicit(&ring->generation,memory_order_acquire);
+  if(!(g & 1)){
+    r->generation[i] = g;
+    return 0; // Not in use
+  }
+  if(g != r->generation[i]){
+    // New stream in this ring; start with its next packet
+    r->generation[i] = g;
+    r->read[i] = atomic_load_explicit(&ring->write,memory_order_acquire);
+    return 0;
+  }
+  if(!dest_match(&r->dest,&ring->dest))
+    return 0;
+  uint64_t const w = atomic_load_explicit(&ring->write,memory_order_acquire);
+  if(w == r->read[i])
+    return 0;
+  uint64_t const limit = h->ring_size - MAX_RECORD;
+  if(w - r->read[i] > limit){
+    r->read[i] = w; // Lapped; skip to the present, like a full socket buffer
+    r->overruns++;
+    return 0;
+  }
+  struct shm_record rec;
+  ring_read(ring,h->ring_size,r->read[i],&rec,sizeof(rec));
+  int const len = rec.len;
+  if(len <= 0 || len > MAX_PACKET){
+    r->read[i] = w; // Can't happen unless we're lapped; resync
+    r->overruns++;
+    return 0;
+  }
+  int const copy = min(len,bufsize);
+  ring_read(ring,h->ring_size,r->read[i] + sizeof(rec),buf,copy);
+  if(source != NULL)
+    memcpy(source,&ring->source,sizeof(*source));
+
+  // Did the writer get far enough around to overwrite what we just copied?
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t const w2 = atomic_load_explicit(&ring->write,memory_order_relaxed);
+  if(w2 - r->read[i] > limit){
+    r->read[i] = w2;
+    r->overruns++;
+    return 0;
+  }
+  if(atomic_load_explicit(&ring->generation,memory_order_relaxed) != g)
+    return 0; // Given back while we were copying; start over with the new stream
+  r->read[i] += record_size(len);
+  r->packets++;
+  return copy;
+}
+
+int shm_recv(struct shm_reader * const r,void * const buf,int const bufsize,struct sockaddr_storage * const source,int const timeout_ms){
+  if(r == NULL)
+    return -1;
+  struct shm_header * const h = r->seg->header;
+  int const n = h->nrings;
+  long long const deadline = timing_now() + (long long)timeout_ms * 1000000;
+  while(1){
+    long long const now = timing_now();
+    if(now - r->checked >= Check_interval){
+      r->checked = now;
+      if(segment_gone(r->seg))
+	return -1;
+    }
+    // Note the doorbell before looking, so a packet that arrives after we look will wake us
+    uint32_t const bell = atomic_load(&h->doorbell);
+    for(int k=0; k < n; k++){
+      int const i = (r->next + k) % n;
+      int const len = ring_recv(r,i,buf,bufsize,source);
+      if(len > 0){
+	r->next = (i + 1) % n; // Round robin, so a busy stream can't starve the others
+	return len;
+      }
+    }
+    if(now >= deadline)
+      return 0;
+    long long wait = deadline - now;
+    if(wait > Check_interval)
+      wait = Check_interval;
+    atomic_fetch_add(&h->sleepers,1);
+    if(atomic_load(&h->doorbell) == bell)
+      doorbell_wait(h,bell,wait);
+    atomic_fetch_sub(&h->sleepers,1);
+  }
+}
+
+int shm_missing(struct shm_reader const * const r){
+  if(r == NULL)
+    return 0;
+  return atomic_load(&r->seg->header->missing);
+}
+
+// Join the group with room for a burst
+static int input_socket(struct shm_input * const in){
+  int const fd = listen_mcast(&in->dest,in->iface[0] != '\0' ? in->iface : NULL);
+  if(fd == -1)
+    return -1;
+  int const n = 1 << 20; // 1 MB
+  if(setsockopt(fd,SOL_SOCKET,SO_RCVBUF,&n,sizeof(n)) == -1)
+    perror("setsockopt");
+  return fd;
+}
+
+// Switch to the segment if it's there and has every stream radio is sending
+static void input_attach(struct shm_input * const in){
+  in->retry = timing_now() + 5LL * BILLION;
+  if(in->name[0] == '\0' || (in->reader = shm_reader_open(in->name,&in->dest)) == NULL)
+    return;
+  int const missing = shm_missing(in->reader);
+  if(missing > 0){
+    // radio ran out of rings, and the group might have one of those streams; stay on it
+    shm_reader_close(&in->reader);
+    if(!in->incomplete)
+      fprintf(stderr,"%s: shared memory %s is missing %d streams, staying on the network\n",formatsock(&in->dest),in->name,missing);
+    in->incomplete = true;
+    return;
+  }
+  in->incomplete = false;
+  if(in->fd != -1){
+    close(in->fd); // Leave the group; shared memory has everything it would bring
+    in->fd = -1;
+  }
+  fprintf(stderr,"%s: reading from shared memory %s\n",formatsock(&in->dest),in->name);
+}
+
+int shm_input_init(struct shm_input * const in,char const * const name,struct sockaddr_storage const * const dest,char const * const iface,int const fd){
+  memset(in,0,sizeof(*in));
+  if(name != NULL)
+    strlcpy(in->name,name,sizeof(in->name));
+  memcpy(&in->dest,dest,sizeof(in->dest));
+  if(iface != NULL)
+    strlcpy(in->iface,iface,sizeof(in->iface));
+  in->fd = fd;
+  input_attach(in);
+  if(in->reader == NULL && in->fd == -1)
+    in->fd = input_socket(in);
+  return in->reader == NULL && in->fd == -1 ? -1 : 0;
+}
+
+int shm_input_recv(struct shm_input * const in,void * const buf,int const bufsize,struct sockaddr_storage * const sender,int const timeout_ms){
+  long long const now = timing_now();
+  if(in->reader == NULL && now >= in->retry)
+    input_attach(in);
+  if(in->reader != NULL){
+    if(shm_missing(in->reader) > 0){
+      // radio just ran out of rings; go back to the group, which still has every stream
+      fprintf(stderr,"%s: shared memory %s no longer has every stream, back to the network\n",formatsock(&in->dest),in->name);
+      shm_reader_close(&in->reader);
+      in->incomplete = true;
+      in->retry = now + 5LL * BILLION;
+    } else {
+      int const size = shm_recv(in->reader,buf,bufsize,sender,timeout_ms);
+      if(size >= 0)
+	return size;
+      // radio went away, or came back with a new segment; use the network until we can find it again
+      shm_reader_close(&in->reader);
+      in->retry = now + BILLION;
+      fprintf(stderr,"%s: lost shared memory %s, back to the network\n",formatsock(&in->dest),in->name);
+    }
+  }
+  if(in->fd == -1 && (in->fd = input_socket(in)) == -1)
+    return -1;
+
+  fd_set fdset;
+  FD_ZERO(&fdset);
+  FD_SET(in->fd,&fdset);
+  struct timespec const polltime = {
+    .tv_sec = timeout_ms / 1000,
+    .tv_nsec = (timeout_ms % 1000) * 1000000,
+  };
+  int const n = pselect(in->fd + 1,&fdset,NULL,NULL,&polltime,NULL);
+  if(n < 0)
+    return errno == EINTR ? 0 : -1;
+  if(n == 0)
+    return 0;
+  socklen_t socksize = sizeof(*sender);
+  int const size = recvfrom(in->fd,buf,bufsize,0,(struct sockaddr *)sender,&socksize);
+  if(size == -1){
+    if(errno != EINTR){ // Happens routinely, e.g., on signals
+      perror("recvfrom");
+      usleep(1000); // Don't spin
+    }
+    return 0;
+  }
+  return size;
+}
+
+void shm_input_close(struct shm_input * const in){
+  shm_reader_close(&in->reader);
+  if(in->fd != -1)
+    close(in->fd);
+  in->fd = -1;
+}
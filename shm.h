@@ -0,0 +1,104 @@
+// Shared-memory transport for PCM streams between processes on the same host
+// radio puts each demod's RTP packets, exactly as it multicasts them, into a ring of its own in one
+// shared segment named in its config file and announced on its status channel. Local consumers map the segment
+// and take packets straight out of the rings: no system calls unless they run out of packets and have to sleep
+// One writer per ring, any number of readers, no locks. A reader that falls a whole ring behind loses packets,
+// just as it would from a full socket buffer, and the RTP sequence numbers and timestamps tell it so
+// The segment is created mode 0660, so readers must run in radio's group (Group=radio in the systemd units)
+#ifndef _SHM_H
+#define _SHM_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define SHM_MAGIC 0x6b613971 // "ka9q"
+#define SHM_VERSION 2
+#define SHM_RINGS_START 4096 // Offset of the first ring
+#define SHM_RING_HEADER 512  // Ring data starts this far into each ring
+
+// At the start of the segment
+struct shm_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nrings;
+  uint32_t ring_size;         // Data bytes per ring, a power of 2
+  uint64_t ring_stride;       // SHM_RING_HEADER + ring_size
+  int32_t pid;                // Of the writer
+  _Atomic uint32_t doorbell;  // Bumped after every packet; readers sleep on it (a futex on Linux)
+  _Atomic uint32_t sleepers;  // Readers sleeping, or about to, on doorbell
+  _Atomic uint32_t missing;   // Streams the writer couldn't give a ring; while nonzero, the network has more than we do
+};
+
+// One per stream; followed by its data
+struct shm_ring {
+  _Atomic uint32_t generation;    // Odd while in use; bumped when taken and when given back, so readers notice reuse
+  uint32_t ssrc;
+  struct sockaddr_storage source; // The stream's multicast source and destination, so readers can treat packets
+  struct sockaddr_storage dest;   // as if they'd been received, and take only the groups they would have joined
+  _Atomic uint64_t write;         // Bytes ever written; the writer is at write % ring_size
+};
+
+// This process's view of a segment
+struct shm_segment {
+  char name[256];
+  int fd;
+  struct shm_header *header;
+  size_t size;
+  dev_t dev;                  // To notice when the writer restarts with a new segment of the same name
+  ino_t ino;
+  pthread_mutex_t lock;       // Writer only: taking and giving back rings
+};
+
+// A reader's position in each ring of a segment
+struct shm_reader {
+  struct shm_segment *seg;
+  struct sockaddr_storage dest;  // Take only rings for this group; AF_UNSPEC for all
+  uint64_t *read;                // Per ring
+  uint32_t *generation;          // Per ring, as last seen
+  int next;                      // Ring to look at first, for fairness
+  long long checked;             // When we last looked for a new segment, ns
+  uint64_t packets;
+  uint64_t overruns;             // Times a ring lapped us
+};
+
+// Writer (radio)
+struct shm_segment *shm_create(char const *name,int nrings,int ring_size);
+// 'missing' is the caller's flag for its stream: set while it has no ring, and counted in the header's 'missing'
+struct shm_ring *shm_ring_get(struct shm_segment *seg,uint32_t ssrc,struct sockaddr_storage const *source,struct sockaddr_storage const *dest,bool *missing);
+void shm_ring_put(struct shm_segment *seg,struct shm_ring *ring,bool *missing);
+void shm_send(struct shm_segment *seg,struct shm_ring *ring,void const *packet,int len);
+void shm_destroy(struct shm_segment *seg);
+
+// Reader
+// 'name' is a POSIX shared memory name like "/ka9q-radio", or the path of a file, e.g., on a hugetlbfs mount
+struct shm_reader *shm_reader_open(char const *name,struct sockaddr_storage const *dest);
+void shm_reader_close(struct shm_reader **r);
+// Copy the next packet into buf, waiting up to timeout_ms for one. 'source' gets the stream's source address
+// Returns the packet's length, 0 on timeout, -1 if the segment is gone
+int shm_recv(struct shm_reader *r,void *buf,int bufsize,struct sockaddr_storage *source,int timeout_ms);
+// Streams that are only on the network; a reader that wants them all should stay there while this is nonzero
+int shm_missing(struct shm_reader const *r);
+
+// A consumer's PCM input: radio's shared memory whenever it's there, otherwise the multicast group
+// Only one thread may use it
+struct shm_input {
+  char name[256];                // Shared-memory segment; "" for the network only
+  struct sockaddr_storage dest;  // Multicast group; also selects the rings we take
+  char iface[1024];
+  int fd;                        // Group socket; -1 while we're on shared memory
+  struct shm_reader *reader;
+  long long retry;               // When to next try the segment, timing_now()
+  bool incomplete;               // We found it without all the streams and said so
+};
+// 'fd' is a socket already on 'dest', or -1. Returns -1 if neither the segment nor the group could be opened
+int shm_input_init(struct shm_input *in,char const *name,struct sockaddr_storage const *dest,char const *iface,int fd);
+// Wait up to timeout_ms for the next packet; 'sender' gets its source either way
+// Returns the packet's length, 0 if none came, -1 on a network error
+int shm_input_recv(struct shm_input *in,void *buf,int bufsize,struct sockaddr_storage *sender,int timeout_ms);
+void shm_input_close(struct shm_input *in);
+
+#endif
@@ -54,6 +54,10 @@ float Demod_snr = NAN;
 float Headroom;
 float Gain;
 float Output_level;
+// Processing time by stage, ns: median, 99th percentile, max
+static char const *Stage_names[] = { "Ingest/pkt", "FFT", "Filter", "Demod", "Output" };
+#define NSTAGES (sizeof(Stage_names)/sizeof(Stage_names[0]))
+long long Stage_time[NSTAGES][3];
 
 void doscreen(void);
 
@@ -241,6 +245,12 @@ void doscreen(void){
   mvprintw(row++,col,"Gain           %*.1f dB\n",data_indent,Gain);
   mvprintw(row++,col,"Output level   %*.1f dB\n",data_indent,Output_level);
   mvprintw(row++,col,"Headroom       %*.1f dB\n",data_indent,Headroom);
+  hline(0,31);
+  mvprintw(row++,header_indent,"Processing time, us"); // overwrite line
+  mvprintw(row++,col,"%-12s%8s%8s%8s\n","","p50","p99","max");
+  for(int i=0; i < NSTAGES; i++)
+    mvprintw(row++,col,"%-12s%8.1f%8.1f%8.1f\n",Stage_names[i],
+	     1e-3 * Stage_time[i][0],1e-3 * Stage_time[i][1],1e-3 * Stage_time[i][2]);
 
   wnoutrefresh(stdscr);
   doupdate(); 
@@ -351,6 +361,9 @@ int decode_rtp_status(unsigned char const *buffer,int length){
     case OUTPUT_LEVEL:
       Output_level = decode_float(cp,optlen);      
       break;
+    case INGEST_TIME_P50 ... OUTPUT_TIME_MAX:
+      Stage_time[(type - INGEST_TIME_P50) / 3][(type - INGEST_TIME_P50) % 3] = decode_int(cp,optlen);
+      break;
     default:
       ;
     }
@@ -0,0 +1,178 @@
+// Spectrum output for radio: average the front end's forward FFT, which we compute anyway,
+// into a modest number of bins and multicast it at a modest rate for waterfalls and spectrum displays
+// Costs one pass over the bins per block, instead of every display tool re-ingesting and re-transforming the raw I/Q
+//
+// Each frame is sent as one or more RTP packets with payload type SPECTRUM_PT;
+// all packets of a frame share the RTP timestamp (front end sample count, mod 2^32), the last one has the marker bit set
+// Payload, all in network byte order:
+//   0  uint8   version (1)
+//   1  uint8   bits per bin, 8 or 16
+//   2  uint16  index of first bin in this packet
+//   4  uint16  bins in this packet
+//   6  uint16  bins in frame
+//   8  double  center frequency of bin 0, Hz
+//  16  float   bin spacing, Hz
+//  20  float   dB value of 0
+//  24  float   dB per count
+//  28  bins, lowest frequency first; dB = base + step * value
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <math.h>
+#include <complex.h>
+#undef I
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "misc.h"
+#include "multicast.h"
+#include "radio.h"
+#include "filter.h"
+
+static int const Spectrum_version = 1;
+static int const Spectrum_header = 28;
+static int const Spectrum_max_payload = 1400; // Stay under Ethernet MTU
+static float const Step8 = 0.5;   // dB per count, 8-bit format
+static float const Step16 = 0.01; // dB per count, 16-bit format
+
+static uint8_t *putfloat(uint8_t *dp,float x){
+  uint32_t u;
+  memcpy(&u,&x,sizeof(u));
+  return put32(dp,u);
+}
+static uint8_t *putdouble(uint8_t *dp,double x){
+  uint64_t u;
+  memcpy(&u,&x,sizeof(u));
+  dp = put32(dp,u >> 32);
+  return put32(dp,u);
+}
+
+// Send one averaged frame, split across as many packets as needed
+static void send_frame(struct frontend * const frontend,float const * const power,int const nbins,
+		       double const bin0,float const spacing,uint32_t const timestamp){
+  int const bytes = frontend->spectrum.format == 16 ? 2 : 1;
+  float const step = bytes == 2 ? Step16 : Step8;
+  int const maxcount = bytes == 2 ? 65535 : 255;
+
+  // Base on the quietest bin so the noise floor is always representable; strong signals may clip at the top
+  float base = INFINITY;
+  for(int i=0; i < nbins; i++)
+    base = min(base,power[i]);
+  base = step * floorf(power2dB(base > 0 ? base : 1e-30) / step);
+
+  int const per_packet = (Spectrum_max_payload - Spectrum_header) / bytes;
+  for(int first = 0; first < nbins; first += per_packet){
+    int const count = min(per_packet,nbins - first);
+    uint8_t packet[PKTSIZE];
+    struct rtp_header rtp;
+    memset(&rtp,0,sizeof(rtp));
+    rtp.version = RTP_VERS;
+    rtp.type = SPECTRUM_PT;
+    rtp.ssrc = frontend->spectrum.ssrc;
+    rtp.seq = frontend->spectrum.seq++;
+    rtp.timestamp = timestamp;
+    rtp.marker = (first + count == nbins);
+    uint8_t *dp = hton_rtp(packet,&rtp);
+
+    *dp++ = Spectrum_version;
+    *dp++ = 8 * bytes;
+    dp = put16(dp,first);
+    dp = put16(dp,count);
+    dp = put16(dp,nbins);
+    dp = putdouble(dp,bin0);
+    dp = putfloat(dp,spacing);
+    dp = putfloat(dp,base);
+    dp = putfloat(dp,step);
+    for(int i = first; i < first + count; i++){
+      float const db = power2dB(power[i] > 0 ? power[i] : 1e-30);
+      int v = lrintf((db - base) / step);
+      v = v < 0 ? 0 : v > maxcount ? maxcount : v;
+      if(bytes == 2)
+	dp = put16(dp,v);
+      else
+	*dp++ = v;
+    }
+    send(frontend->spectrum.fd,packet,dp - packet,0);
+  }
+  frontend->spectrum.frames++;
+}
+
+// One per front end with 'spectrum =' set
+void *spectrum_send(void *arg){
+  struct frontend * const frontend = (struct frontend *)arg;
+  assert(frontend != NULL);
+  {
+    char name[100];
+    snprintf(name,sizeof(name),"spect %s",frontend->name);
+    pthread_setname(name);
+  }
+  struct filter_in * const master = frontend->in;
+  assert(master != NULL);
+
+  // Bins of a complex FFT are reordered from most negative to most positive frequency;
+  // a real FFT already runs from 0 Hz to samprate/2
+  bool const isreal = master->in_type == REAL;
+  int const N = master->ilen + master->impulse_length - 1;
+  int nbins = frontend->spectrum.bins;
+  if(nbins <= 0 || nbins > master->bins)
+    nbins = master->bins;
+  if(nbins > 65535)
+    nbins = 65535; // Bin indices are 16 bits
+  int const group = master->bins / nbins;                // FFT bins per output bin
+  int const offset = (master->bins - group * nbins) / 2; // Center the bins actually used
+  float const hz_per_fft_bin = (float)frontend->sdr.samprate / N;
+
+  // Blocks per frame
+  float const block_rate = (float)frontend->sdr.samprate / master->ilen;
+  int blocks_per_frame = lrintf(block_rate / frontend->spectrum.rate);
+  if(blocks_per_frame < 1)
+    blocks_per_frame = 1;
+
+  float * const power = calloc(nbins,sizeof(*power));
+  assert(power != NULL);
+  float const scale = 1.0f / ((float)N * N); // Full scale complex sinusoid -> 0 dB
+  unsigned int blocknum = 0;
+  int blocks = 0;
+
+  while(1){
+    pthread_mutex_lock(&master->filter_mutex);
+    while(blocknum == master->blocknum)
+      pthread_cond_wait(&master->filter_cond,&master->filter_mutex);
+    if(blocknum == 0 || (int)(master->blocknum - blocknum) > ND - master->fft_workers)
+      blocknum = master->blocknum - 1; // Fell behind (or just started); the workers may be overwriting older blocks
+    pthread_mutex_unlock(&master->filter_mutex);
+
+    complex float const * const fdomain = master->fdomain[blocknum % ND];
+    blocknum++;
+    int bin = isreal ? offset : (offset + master->bins - master->bins/2) % master->bins;
+    for(int i=0; i < nbins; i++){
+      float sum = 0;
+      for(int j=0; j < group; j++){
+	sum += cnrmf(fdomain[bin]);
+	if(++bin == master->bins)
+	  bin = 0;
+      }
+      power[i] += sum;
+    }
+    if(++blocks < blocks_per_frame)
+      continue;
+
+    // Average over time and the group, then scale
+    float const s = scale / (blocks * group);
+    for(int i=0; i < nbins; i++)
+      power[i] *= s;
+
+    double const lo = frontend->sdr.frequency;
+    double bin0;
+    if(isreal)
+      bin0 = lo + hz_per_fft_bin * (offset + 0.5 * (group - 1));
+    else
+      bin0 = lo + hz_per_fft_bin * (offset - master->bins/2 + 0.5 * (group - 1));
+    send_frame(frontend,power,nbins,bin0,hz_per_fft_bin * group,(uint32_t)((uint64_t)blocknum * master->ilen));
+    memset(power,0,nbins * sizeof(*power));
+    blocks = 0;
+  }
+  return NULL;
+}
@@ -9,6 +9,7 @@
 #include <bsd/string.h>
 #endif
 #include <math.h>
+#include <stdbool.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <stdlib.h>
@@ -226,6 +227,148 @@ struct sockaddr *decode_socket(void *sock,unsigned char const *val,int optlen){
 }
 
 
+// Read a signed or unsigned integer member of any size
+static uint64_t get_int(void const * const p,int const size,bool const sign){
+  switch(size){
+  case 1:
+    return sign ? (uint64_t)*(int8_t const *)p : *(uint8_t const *)p;
+  case 2:
+    return sign ? (uint64_t)*(int16_t const *)p : *(uint16_t const *)p;
+  case 4:
+    return sign ? (uint64_t)*(int32_t const *)p : *(uint32_t const *)p;
+  default:
+    return *(uint64_t const *)p;
+  }
+}
+
+static void put_int(void * const p,int const size,uint64_t const x){
+  switch(size){
+  case 1:
+    *(uint8_t *)p = x;
+    break;
+  case 2:
+    *(uint16_t *)p = x;
+    break;
+  case 4:
+    *(uint32_t *)p = x;
+    break;
+  default:
+    *(uint64_t *)p = x;
+    break;
+  }
+}
+
+// Encode every member of 'base' named in the schema, in schema order, with the same encodings
+// as the individual encode_* functions. The caller's buffer must have room; no bounds are checked, as with encode_*()
+// Returns bytes added
+int encode_struct(unsigned char **bp,struct status_field const *schema,void const * const base){
+  unsigned char const * const start = *bp;
+  for(struct status_field const *f = schema; f->type != EOL; f++){
+    void const * const p = (uint8_t const *)base + f->offset;
+    switch(f->ftype){
+    case SF_NONE:
+      break;
+    case SF_INT:
+    case SF_UINT:
+      encode_int64(bp,f->type,get_int(p,f->size,f->ftype == SF_INT));
+      break;
+    case SF_BOOL:
+      encode_byte(bp,f->type,*(bool const *)p);
+      break;
+    case SF_FLOAT:
+      encode_float(bp,f->type,*(float const *)p);
+      break;
+    case SF_DOUBLE:
+      encode_double(bp,f->type,*(double const *)p);
+      break;
+    case SF_STRING:
+      {
+	int const len = strnlen(p,f->size);
+	if(len > 0)
+	  encode_string(bp,f->type,p,len);
+      }
+      break;
+    case SF_SOCKET:
+      encode_socket(bp,f->type,p);
+      break;
+    }
+  }
+  return *bp - start;
+}
+
+// Store one TLV value into the member of 'base' described by f
+static void decode_member(struct status_field const * const f,void * const base,unsigned char const * const cp,int const optlen){
+  void * const p = (uint8_t *)base + f->offset;
+  switch(f->ftype){
+  case SF_NONE:
+    break;
+  case SF_INT:
+  case SF_UINT:
+    put_int(p,f->size,decode_int(cp,optlen));
+    break;
+  case SF_BOOL:
+    *(bool *)p = decode_int(cp,optlen) != 0;
+    break;
+  case SF_FLOAT:
+    *(float *)p = decode_float(cp,optlen);
+    break;
+  case SF_DOUBLE:
+    *(double *)p = decode_double(cp,optlen);
+    break;
+  case SF_STRING:
+    decode_string(cp,optlen,p,f->size);
+    break;
+  case SF_SOCKET:
+    decode_socket(p,cp,optlen);
+    break;
+  }
+}
+
+// Decode one TLV into its member of 'base', if the schema has it
+// For decoders that also handle some types by hand: returns 1 if taken care of, 0 if not in the schema
+int decode_field(struct status_field const *schema,void * const base,enum status_type const type,
+		 unsigned char const * const cp,int const optlen){
+  for(struct status_field const *f = schema; f->type != EOL && f->type <= type; f++){
+    if(f->type == type){
+      decode_member(f,base,cp,optlen);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Decode a whole status list (after the command/response byte) into 'base' in one pass
+// Senders using encode_struct() emit types in schema order, so the schema is walked alongside the packet
+// rather than searched for each field; a field out of order just restarts the walk
+// Types not in the schema are skipped, so old readers keep working as new types are added
+// Returns the number of members set, or -1 if the list was cut short by a bad length
+int decode_struct(unsigned char const * const buffer,int const length,struct status_field const *schema,void * const base){
+  int count = 0;
+  struct status_field const *f = schema;
+  unsigned char const *cp = buffer;
+  while(cp - buffer < length){
+    enum status_type const type = *cp++;
+    if(type == EOL)
+      return count;
+    if(cp - buffer >= length)
+      return -1;
+    int const optlen = *cp++;
+    if(cp - buffer + optlen > length)
+      return -1;
+    if(f->type == EOL || f->type > type)
+      f = schema;
+    while(f->type != EOL && f->type < type)
+      f++;
+    if(f->type == type){
+      decode_member(f,base,cp,optlen);
+      count++;
+      f++;
+    }
+    cp += optlen;
+  }
+  return count;
+}
+
 // Generate random time uniformly distributed between (now + base, now + base + rrange)
 void random_time(struct timespec *tv,unsigned int base,unsigned int rrange){
   struct timespec now;
@@ -1,6 +1,7 @@
 #ifndef _STATUS_H
 #define _STATUS_H 1
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/time.h>
 
 enum status_type {
@@ -112,6 +113,26 @@ enum status_type {
   OUTPUT_BITS_PER_SAMPLE,
   SQUELCH_OPEN,   // Squelch opening threshold SNR
   SQUELCH_CLOSE,  // and closing
+
+  // Processing time per stage, integer nanoseconds: median, 99th percentile and maximum over the recent past
+  // Each stage's three must stay consecutive and in this order
+  INGEST_TIME_P50, // Front end: sample conversion per input packet
+  INGEST_TIME_P99,
+  INGEST_TIME_MAX,
+  FFT_TIME_P50,    // Front end: forward FFT per block, all workers
+  FFT_TIME_P99,
+  FFT_TIME_MAX,
+  FILTER_TIME_P50, // Demod: filter multiply and inverse FFT per block
+  FILTER_TIME_P99,
+  FILTER_TIME_MAX,
+  DEMOD_TIME_P50,  // Demod: demodulator per block
+  DEMOD_TIME_P99,
+  DEMOD_TIME_MAX,
+  OUTPUT_TIME_P50, // Demod: PCM conversion and send() per block
+  OUTPUT_TIME_P99,
+  OUTPUT_TIME_MAX,
+  OUTPUT_SHM,      // Name of the shared-memory segment also carrying the PCM streams, see shm.h
+  FILTER_PAGES,    // Pages under the front end's FFT buffers: 0 normal, 1 transparent huge requested, 2 explicit huge (enum page_kind)
 };
 
 int encode_string(unsigned char **bp,enum status_type type,void const *buf,int buflen);
@@ -131,6 +152,40 @@ double decode_double(unsigned char const *,int);
 struct sockaddr *decode_socket(void *sock,unsigned char const *,int);
 char *decode_string(unsigned char const *,int,char *,int);
 
+// Table-driven codec: a schema maps status types to members of some C structure,
+// so a whole structure is encoded or decoded in one pass without a hand-written call or case per field
+// A schema lists its fields in increasing type order and ends with an EOL entry, e.g.,
+//   static struct status_field const Schema[] = {
+//     STATUS_FIELD(GPS_TIME,struct frontend,SF_INT,sdr.timestamp),
+//     STATUS_FIELD(DESCRIPTION,struct frontend,SF_STRING,sdr.description),
+//     ...
+//     { EOL },
+//   };
+// Types not in the schema aren't encoded, and are skipped when decoding
+enum status_ftype {
+  SF_NONE = 0,
+  SF_INT,         // Signed integer, 1, 2, 4 or 8 bytes; negative values go out sign-extended, as encode_int() does
+  SF_UINT,        // Unsigned integer, 1, 2, 4 or 8 bytes
+  SF_BOOL,
+  SF_FLOAT,       // Never sent when NAN
+  SF_DOUBLE,      // Never sent when NAN
+  SF_STRING,      // char array; never sent when empty
+  SF_SOCKET,      // struct sockaddr_storage; never sent unless IPv4 or IPv6
+};
+
+struct status_field {
+  enum status_type type;
+  enum status_ftype ftype;
+  uint32_t offset;  // Of the member within the structure
+  uint32_t size;    // Of the member
+};
+
+#define STATUS_FIELD(type,strct,ftype,member) { (type), (ftype), offsetof(strct,member), sizeof(((strct *)0)->member) }
+
+int encode_struct(unsigned char **bp,struct status_field const *schema,void const *base);
+int decode_struct(unsigned char const *buffer,int length,struct status_field const *schema,void *base);
+int decode_field(struct status_field const *schema,void *base,enum status_type type,unsigned char const *cp,int optlen);
+
 void dump_metadata(unsigned char *,int);
 
 void random_time(struct timespec *tv,unsigned int base,unsigned int rrange);
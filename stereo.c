@@ -23,14 +23,14 @@
 #include "status.h"
 #include "filter.h"
 #include "iir.h"
+#include "session.h"
 
 #define BUFFERSIZE 16384  // Tune this
 
 struct session {
-  struct session *prev;       // Linked list pointers
-  struct session *next; 
+  struct session_entry entry; // Session table linkage
   
-  struct sockaddr sender;
+  struct sockaddr_storage sender;
   char addr[NI_MAXHOST];    // RTP Sender IP address
   char port[NI_MAXSERV];    // RTP Sender source port
 
@@ -73,16 +73,14 @@ int Status_fd = -1;           // Reading from radio status
 int Status_out_fd = -1;       // Writing to radio status
 int Input_fd = -1;            // Multicast receive socket
 int Output_fd = -1;           // Multicast send socket
-struct session *Audio;
-pthread_mutex_t Audio_protect;
+struct session_table Audio;
 uint64_t Output_packets;
 char const *Input;
 char const *Output;
 char const *Status;
 char const *Name = "stereo";
 
-struct session *lookup_session(const struct sockaddr *,uint32_t);
-struct session *create_session(void);
+struct session *create_session(struct sockaddr_storage const *,uint32_t);
 int close_session(struct session **);
 int send_samples(struct session *sp);
 void *decode(void *arg);
@@ -210,7 +208,7 @@ int main(int argc,char * const argv[]){
   signal(SIGPIPE,SIG_IGN);
   
   // Set up to receive PCM in RTP/UDP/IP
-  pthread_mutex_init(&Audio_protect,NULL);
+  session_table_init(&Audio,64,0); // Decode threads time out on their own
   // Process incoming RTP packets, demux to per-SSRC thread
   // Warning: we allocate memory for packet buffers and pass them to the decode() threads
   // The decode threads must free these buffers to avoid a memory leak
@@ -251,15 +249,14 @@ int main(int argc,char * const argv[]){
       continue; // Used to be an assert, but would be triggered by bogus packets
     
     // Find appropriate session; create new one if necessary
-    struct session *sp = lookup_session((const struct sockaddr *)&sender,pkt->rtp.ssrc);
+    struct session *sp = session_lookup(&Audio,&sender,pkt->rtp.ssrc,0);
     if(!sp){
       // Not found
-      sp = create_session();
+      sp = create_session(&sender,pkt->rtp.ssrc);
       assert(sp != NULL);
       // Initialize
       getnameinfo((struct sockaddr *)&sender,sizeof(sender),sp->addr,sizeof(sp->addr),
 		    sp->port,sizeof(sp->port),NI_NOFQDN|NI_DGRAM);
-      memcpy(&sp->sender,&sender,sizeof(struct sockaddr));
       sp->rtp_state_out.ssrc = sp->rtp_state_in.ssrc = pkt->rtp.ssrc;
       sp->rtp_state_in.seq = pkt->rtp.seq;
       sp->rtp_state_in.timestamp = pkt->rtp.timestamp;
@@ -515,47 +512,18 @@ void *decode(void *arg){
   }
 }
 
-struct session *lookup_session(const struct sockaddr * const sender,const uint32_t ssrc){
-  struct session *sp;
-  pthread_mutex_lock(&Audio_protect);
-  for(sp = Audio; sp != NULL; sp = sp->next){
-    if(sp->rtp_state_in.ssrc == ssrc && memcmp(&sp->sender,sender,sizeof(*sender)) == 0){
-      // Found it
-      if(sp->prev != NULL){
-	// Not at top of list; move it there
-	if(sp->next != NULL)
-	  sp->next->prev = sp->prev;
-
-	sp->prev->next = sp->next;
-	sp->prev = NULL;
-	sp->next = Audio;
-	Audio->prev = sp;
-	Audio = sp;
-      }
-      break;
-    }
-  }
-  pthread_mutex_unlock(&Audio_protect);
-  return sp;
-}
-// Create a new session, partly initialize
-struct session *create_session(void){
+// Create a new session, partly initialize, and enter it in the session table
+struct session *create_session(struct sockaddr_storage const * const sender,uint32_t const ssrc){
 
   struct session * const sp = calloc(1,sizeof(*sp));
   assert(sp != NULL); // Shouldn't happen on modern machines!
   
   // Initialize entry
+  memcpy(&sp->sender,sender,sizeof(sp->sender));
   pthread_mutex_init(&sp->qmutex,NULL);
   pthread_cond_init(&sp->qcond,NULL);
 
-  // Put at head of list
-  pthread_mutex_lock(&Audio_protect);
-  sp->prev = NULL;
-  sp->next = Audio;
-  if(sp->next != NULL)
-    sp->next->prev = sp;
-  Audio = sp;
-  pthread_mutex_unlock(&Audio_protect);
+  session_insert(&Audio,&sp->entry,sp,sender,ssrc,0);
   return sp;
 }
 
@@ -577,15 +545,7 @@ int close_session(struct session ** p){
   pthread_mutex_destroy(&sp->qmutex);
   
 
-  // Remove from linked list of sessions
-  pthread_mutex_lock(&Audio_protect);
-  if(sp->next != NULL)
-    sp->next->prev = sp->prev;
-  if(sp->prev != NULL)
-    sp->prev->next = sp->next;
-  else
-    Audio = sp->next;
-  pthread_mutex_unlock(&Audio_protect);
+  session_remove(&Audio,&sp->entry);
   free(sp);
   *p = NULL;
   return 0;
@@ -52,17 +52,8 @@ void *demod_wfm(void *arg){
     demod->output.channels = 2; // Default to stereo
 
   int const blocksize = demod->output.samprate * Blocktime / 1000;
-  delete_filter_output(&demod->filter.out);
-  demod->filter.out = create_filter_output(Frontend.in,NULL,blocksize,COMPLEX);
-  if(demod->filter.out == NULL){
-    fprintf(stdout,"unable to create filter for ssrc %lu\n",(unsigned long)demod->output.rtp.ssrc);
-    free_demod(&demod);
-    return NULL;
-  }
-  set_filter(demod->filter.out,
-	     demod->filter.min_IF/demod->output.samprate,
-	     demod->filter.max_IF/demod->output.samprate,
-	     demod->filter.kaiser_beta);
+  if(setup_demod_filter(demod,blocksize) != 0)
+    return NULL; // demod_thread() owns the teardown
   
 
   float lastaudio = 0; // state for impulse noise removal
@@ -119,7 +110,7 @@ void *demod_wfm(void *arg){
   compute_tuning(composite_N,composite_M,Composite_samprate,&subc_flip,&subc_rotate,&subc_remainder,38000.);
   assert(subc_remainder == 0);
 
-  while(!demod->terminate){
+  while(!demod->terminate && !demod->restart){
     if(demod->tune.freq == 0){
       // Special case: idle mode
       execute_filter_output_idle(demod->filter.out);
@@ -127,16 +118,17 @@ void *demod_wfm(void *arg){
     }
 
     // Note: fine shift and tune shift both ignored in WFM mode
-    demod->tune.second_LO = Frontend.sdr.frequency - demod->tune.freq;
+    demod->tune.second_LO = demod->frontend->sdr.frequency - demod->tune.freq;
     double freq = demod->tune.doppler + demod->tune.second_LO; // Total logical oscillator frequency
     double remainder;
     int rotate,flip;
-    compute_tuning(Frontend.in->ilen + Frontend.in->impulse_length - 1,
-		 Frontend.in->impulse_length,
-		 Frontend.sdr.samprate,&flip,&rotate,&remainder,freq);
+    compute_tuning(demod->frontend->in->ilen + demod->frontend->in->impulse_length - 1,
+		 demod->frontend->in->impulse_length,
+		 demod->frontend->sdr.samprate,&flip,&rotate,&remainder,freq);
 
     // Wait for next block of frequency domain data
     execute_filter_output(demod->filter.out,-rotate); // Input is complex, so sign of rotate matters
+    long long const start = timing_now();
 
     for(int n=0; n<composite_L; n++)
       demod->filter.out->output.c[n] *= flip; // Is this really necessary?
@@ -280,6 +272,7 @@ void *demod_wfm(void *arg){
 	  stereo_buffer[n] = s;
 	}
       }
+      timing_add(&demod->timing,timing_now() - start);
       if(send_stereo_output(demod,(const float *)stereo_buffer,audio_L,squelch_state < 0) < 0)
 	break; // No output stream! Terminate
     } else {
@@ -294,6 +287,7 @@ void *demod_wfm(void *arg){
 	  mono->output.r[n] = __real__ demod->deemph.state;
 	}
       }
+      timing_add(&demod->timing,timing_now() - start);
       // mute output unless time is left on the squelch_state timer
       if(send_mono_output(demod,mono->output.r,audio_L,squelch_state < 0) < 0)
 	break; // No output stream! Terminate
@@ -304,6 +298,5 @@ void *demod_wfm(void *arg){
   delete_filter_output(&stereo);
   delete_filter_output(&pilot);
   delete_filter_input(&composite);
-  delete_filter_output(&demod->filter.out);
-  return NULL;
+  return NULL; // demod_thread() keeps or deletes demod->filter.out
 }
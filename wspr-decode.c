@@ -1,5 +1,8 @@
-// $Id: wspr-decode.c,v 1.11 2022/04/15 05:06:16 karn Exp $ 
-// Read and record PCM audio streams
+// $Id: wspr-decode.c,v 1.11 2022/04/15 05:06:16 karn Exp $
+// Record time-aligned cycles of PCM audio streams (e.g., WSPR, FT8) and hand them to a decoder
+// Each stream's current cycle is kept in memory; at the end of the cycle the complete buffers
+// are queued to a bounded pool of decoder threads, so a dozen bands don't all fork decoders
+// and rewrite files in the same second
 // Adapted from iqrecord.c which is out of date
 // Copyright 2021 Phil Karn, KA9Q
 #define _GNU_SOURCE 1
@@ -20,14 +23,18 @@
 #include <locale.h>
 #include <signal.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include "misc.h"
 #include "attr.h"
 #include "multicast.h"
+#include "session.h"
+#include "shm.h"
 
 // Largest Ethernet packet
 // Normally this would be <1500,
@@ -36,9 +43,7 @@
 // But what about IPv6?
 #define MAXPKT 65535
 
-// size of stdio buffer for disk I/O
-// This should be large to minimize write calls, but how big?
-#define BUFFERSIZE (1<<16)
+#define MAX_WORKERS 64
 
 // Simplified .wav file header
 // http://soundfile.sapp.org/doc/WaveFormat/
@@ -60,46 +65,84 @@ struct wav {
   int32_t Subchunk2Size;
 };
 
-// One for each session being recorded
+// One for each stream being recorded
 struct session {
-  struct session *prev;
-  struct session *next;
-  struct sockaddr sender;   // Sender's IP address and source port
-
-  char filename[PATH_MAX];
-  struct wav header;
+  struct session_entry entry;  // Table linkage, keyed on sender, SSRC and type
+  struct sockaddr_storage sender;   // Sender's IP address and source port
 
   uint32_t ssrc;               // RTP stream source ID
-  struct rtp_state rtp_state;
-  
   int type;                    // RTP payload type (with marker stripped)
   int channels;                // 1 (PCM_MONO) or 2 (PCM_STEREO)
   unsigned int samprate;
 
-  FILE *fp;                    // File being recorded
-  void *iobuffer;              // Big buffer to reduce write rate
+  int16_t *buffer;             // Current cycle, host order; NULL until the first packet of a cycle
+  int buffer_frames;           // Capacity of buffer, frames
+  int frames;                  // Highest frame written + 1
+  uint32_t start_ts;           // RTP timestamp corresponding to buffer[0]
+  time_t cycle;                // Start of cycle being recorded, Unix time
 
   int64_t SamplesWritten;
-  int64_t TotalFileSamples;
+  int64_t SamplesLate;         // Arrived after the end of the cycle buffer
+};
+
+// Timing for all the decodes of one cycle
+struct cycle_stats {
+  time_t cycle;                // Start of cycle
+  int jobs;
+  int done;
+  int skipped;                 // Too stale to decode
+  int failed;                  // Decoder exited nonzero
+  double max_wait;             // Queued to start, sec
+  double max_decode;           // Decoder wall clock time, sec
+  double cpu;                  // Total decoder CPU, sec
+  double last_finish;          // Latest completion relative to end of recording, sec
 };
 
+// A complete cycle buffer waiting for a decoder
+struct job {
+  struct job *next;
+  uint32_t ssrc;
+  unsigned int samprate;
+  int channels;
+  int16_t *buffer;             // Freed by the worker
+  int frames;
+  time_t cycle;
+  struct timespec queued;
+  struct cycle_stats *stats;
+};
 
 int Verbose;
 int Keep_wav;
 char PCM_mcast_address_text[256];
 char *Recordings = ".";
 char *Wsprd_command = "wsprd -a %s/%u -o 2 -f %.6lf -w -d %s";
+int Period = 120;              // Cycle length, sec
+int End = 114;                 // Second within cycle when recording stops and decoding starts
+int Nworkers;                  // Decoder concurrency; default half the CPUs
+int Decoder_nice = 0;          // Decoders run at this priority, not ours (we're usually at -10)
+int Timeout = -1;              // Forget streams idle this many seconds; 0 = never, default two cycles
 
-struct sockaddr Sender;
+struct sockaddr_storage Sender;
 struct sockaddr Input_mcast_sockaddr;
-int Input_fd;
-struct session *Sessions;
+char const *Shm_name;       // radio's shared-memory segment, if we're to read from it instead of the network
+struct shm_input Input;
+struct session_table Sessions;
+
+// Decoder queue, protected by Queue_mutex
+pthread_mutex_t Queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t Queue_cond = PTHREAD_COND_INITIALIZER;
+struct job *Queue_head,*Queue_tail;
+int Queue_depth;
+pthread_t Workers[MAX_WORKERS];
 
 void closedown(int a);
+volatile sig_atomic_t Terminate; // Set by closedown(); the input loop exits and cleanup() runs from exit()
 void input_loop(void);
 void cleanup(void);
 struct session *create_session(struct rtp_header *);
-void close_session(struct session **p);
+void close_session(void *);
+void end_cycle(time_t cycle);
+void *decode_worker(void *);
 
 int main(int argc,char *argv[]){
   char const * locale = getenv("LANG");
@@ -107,10 +150,12 @@ int main(int argc,char *argv[]){
 
   // Defaults
   int c;
-  while((c = getopt(argc,argv,"c:d:l:vk")) != EOF){
+  int command_set = 0;
+  while((c = getopt(argc,argv,"c:d:l:vkj:n:m:t:S:")) != EOF){
     switch(c){
     case 'c':
       Wsprd_command = optarg;
+      command_set = 1;
       break;
     case 'd':
       Recordings = optarg;
@@ -124,8 +169,32 @@ int main(int argc,char *argv[]){
     case 'k':
       Keep_wav = 1;
       break;
+    case 'j':
+      Nworkers = strtol(optarg,NULL,0);
+      break;
+    case 'n':
+      Decoder_nice = strtol(optarg,NULL,0);
+      break;
+    case 't':
+      Timeout = labs(strtol(optarg,NULL,0));
+      break;
+    case 'S':
+      Shm_name = optarg;
+      break;
+    case 'm':
+      if(strcasecmp(optarg,"wspr") == 0){
+	Period = 120;
+	End = 114;
+      } else if(strcasecmp(optarg,"ft8") == 0){
+	Period = 15;
+	End = 14;
+      } else {
+	fprintf(stderr,"Unknown mode %s\n",optarg);
+	exit(1);
+      }
+      break;
     default:
-      fprintf(stderr,"Usage: %s [-l locale] [-v] [-k] [-d recdir] PCM_multicast_address\n",argv[0]);
+      fprintf(stderr,"Usage: %s [-l locale] [-v] [-k] [-d recdir] [-c command] [-m wspr|ft8] [-j decoders] [-n nice] [-t timeout] [-S shm-segment] PCM_multicast_address\n",argv[0]);
       exit(1);
       break;
     }
@@ -134,6 +203,10 @@ int main(int argc,char *argv[]){
     fprintf(stderr,"Specify PCM_mcast_address_text_address\n");
     exit(1);
   }
+  if(Period != 120 && !command_set){
+    fprintf(stderr,"Specify decoder command with -c\n");
+    exit(1);
+  }
   strlcpy(PCM_mcast_address_text,argv[optind],sizeof(PCM_mcast_address_text));
   setlocale(LC_ALL,locale);
 
@@ -142,111 +215,88 @@ int main(int argc,char *argv[]){
     exit(1);
   }
 
-  // Set up input socket for multicast data stream from front end
+  // Set up input: radio's shared memory if it's there, otherwise the multicast data stream from the front end
   {
+    struct sockaddr_storage dest;
     char iface[1024];
-    struct sockaddr sock;
-    resolve_mcast(PCM_mcast_address_text,&sock,DEFAULT_RTP_PORT,iface,sizeof(iface));
-    Input_fd = listen_mcast(&sock,iface);
-  }
-
-  if(Input_fd == -1){
-    fprintf(stderr,"Can't set up PCM input from %s, exiting\n",PCM_mcast_address_text);
-    exit(1);
+    resolve_mcast(PCM_mcast_address_text,&dest,DEFAULT_RTP_PORT,iface,sizeof(iface));
+    if(shm_input_init(&Input,Shm_name,&dest,iface,-1) == -1){
+      fprintf(stderr,"Can't set up PCM input, exiting\n");
+      exit(1);
+    }
   }
-  int const n = 1 << 20; // 1 MB
-  if(setsockopt(Input_fd,SOL_SOCKET,SO_RCVBUF,&n,sizeof(n)) == -1)
-    perror("setsockopt");
 
   // Graceful signal catch
-#if 1 // Ignoring child death signals causes system() inside fork() to return errno 10
-  signal(SIGCHLD,SIG_IGN); // Don't let children become zombies
-#endif
-  
+  // SIGCHLD is left alone: the decoder workers reap their own children with wait4()
   signal(SIGPIPE,closedown);
   signal(SIGINT,closedown);
   signal(SIGKILL,closedown);
   signal(SIGQUIT,closedown);
-  signal(SIGTERM,closedown);        
+  signal(SIGTERM,closedown);
   signal(SIGPIPE,SIG_IGN);
 
+  if(Timeout < 0)
+    Timeout = 2 * Period;
+  session_table_init(&Sessions,64,Timeout);
+
+  if(Nworkers <= 0){
+    Nworkers = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+    if(Nworkers < 1)
+      Nworkers = 1;
+  }
+  if(Nworkers > MAX_WORKERS)
+    Nworkers = MAX_WORKERS;
+  for(int i=0; i < Nworkers; i++)
+    pthread_create(&Workers[i],NULL,decode_worker,NULL);
+
+  if(Verbose)
+    fprintf(stderr,"%d second cycles, recording ends at %d sec, %d decoders at nice %d\n",Period,End,Nworkers,Decoder_nice);
+
   atexit(cleanup);
 
-  input_loop();
+  input_loop(); // Returns only on a signal or an input error
 
-  exit(0);
+  exit(Terminate ? 1 : 0); // Will call cleanup()
 }
 
+// Don't exit from the handler: we might have interrupted the input loop inside the session table,
+// and cleanup() needs the table lock
 void closedown(int a){
   if(Verbose)
-    fprintf(stderr,"iqrecord: caught signal %d: %s\n",a,strsignal(a));
+    fprintf(stderr,"wspr-decode: caught signal %d: %s\n",a,strsignal(a));
 
-  exit(1);  // Will call cleanup()
+  Terminate = 1;
 }
 
-// Read from RTP network socket, assemble blocks of samples
+// Read RTP packets, assemble blocks of samples
 void input_loop(){
-  while(1){
-    // Receive network data
-    fd_set fdset;
-    FD_ZERO(&fdset);
-    FD_SET(Input_fd,&fdset);
-    struct timespec polltime;
-    polltime.tv_sec = 1;
-    polltime.tv_nsec = 0; // force return after 1 second max
-    
-    int n = pselect(Input_fd + 1,&fdset,NULL,NULL,&polltime,NULL);
-    if(n < 0)
+  time_t last_ended = 0;
+
+  while(!Terminate){
+    unsigned char buffer[MAXPKT];
+    int size = shm_input_recv(&Input,buffer,sizeof(buffer),&Sender,200);
+    if(size < 0)
       break; // error of some kind
 
     struct timespec now;
     clock_gettime(CLOCK_REALTIME,&now);
-    int sec = now.tv_sec % 120; // second within 0-120 period
-
-    if(sec >= 114){
-      // End of 2-minute frame; process everything
-      for(struct session *sp = Sessions;sp != NULL;){
+    time_t const cycle = now.tv_sec - now.tv_sec % Period; // Start of current cycle
+    int const sec = now.tv_sec - cycle; // second within cycle
 
-	// Finished current period, decode
-	char cmd[16384];
-	snprintf(cmd,sizeof(cmd),Wsprd_command,
-		 Recordings,sp->ssrc,(double)sp->ssrc * 1e-6,sp->filename);
-
-	if(Verbose)
-	  fprintf(stderr,"%s\n",cmd);
-	
-	if(fork() == 0){
-	  // If running at high priority, drop back to normal
-	  if(getpriority(PRIO_PROCESS,0) < 0)
-	    setpriority(PRIO_PROCESS,0,0);
-	  int r = system(cmd);
-	  if(Verbose && r != 0)
-	    fprintf(stderr,"system() returned %d errno %d (%s)\n",r,errno,strerror(errno));
-	  if(!Keep_wav)
-	    unlink(sp->filename);
-	  exit(0);
-	}
-	struct session * const next = sp->next;
-	close_session(&sp);
-	sp = next;
-      }
+    if(sec >= End && last_ended != cycle){
+      // End of cycle; hand everything to the decoders
+      end_cycle(cycle);
+      last_ended = cycle;
     }
-    if(FD_ISSET(Input_fd,&fdset)){
-      unsigned char buffer[MAXPKT];
-      socklen_t socksize = sizeof(Sender);
-      int size = recvfrom(Input_fd,buffer,sizeof(buffer),0,&Sender,&socksize);
-
-      if(sec >= 114)
+    // Forget streams that have gone away
+    session_expire(&Sessions,close_session);
+    if(size > 0){
+      if(sec >= End)
 	continue; // Discard all data until the next cycle
 
-      if(size <= 0){    // ??
-	perror("recvfrom");
-	usleep(50000);
-	continue;
-      }
       if(size < RTP_MIN_SIZE)
 	continue; // Too small for RTP, ignore
-      
+
       unsigned char const * dp = buffer;
       struct rtp_header rtp;
       dp = ntoh_rtp(&rtp,dp);
@@ -257,203 +307,336 @@ void input_loop(){
       }
       if(size <= 0)
 	continue; // Bogus RTP header
-      
+
       int16_t const * const samples = (int16_t *)dp;
       size -= (dp - buffer);
 
-      struct session *sp;
-      for(sp = Sessions;sp != NULL;sp=sp->next){
-	if(sp->ssrc == rtp.ssrc
-	   && rtp.type == sp->type
-	   && memcmp(&sp->sender,&Sender,sizeof(sp->sender)) == 0)
-	  break;
-      }
+      struct session *sp = session_lookup(&Sessions,&Sender,rtp.ssrc,rtp.type);
       if(sp == NULL)
-	sp = create_session(&rtp);	// create new session only if we're not in the dead time
+	sp = create_session(&rtp);
 
       if(!sp)
 	continue;
+      session_touch(&Sessions,&sp->entry);
 
       // A "sample" is a single audio sample, usually 16 bits.
       // A "frame" is the same as a sample for mono. It's two audio samples for stereo
       int const samp_count = size / sizeof(*samples); // number of individual audio samples (not frames)
       int const frame_count = samp_count / sp->channels; // 1 every sample period (e.g., 4 for stereo 16-bit)
-      off_t const offset = rtp_process(&sp->rtp_state,&rtp,frame_count); // rtp timestamps refer to frames
-      
-      // The seek offset relative to the current position in the file is the signed (modular) difference between
-      // the actual and expected RTP timestamps. This should automatically handle
-      // 32-bit RTP timestamp wraps, which occur every ~1 days at 48 kHz and only 6 hr @ 192 kHz
-      // Should I limit the range on this?
-      if(offset)
-	fseeko(sp->fp,offset * sizeof(*samples) * sp->channels,SEEK_CUR); // offset is in bytes
-
-      sp->TotalFileSamples += samp_count + offset;
-      sp->SamplesWritten += samp_count;
-      
-      // Packet samples are in big-endian order; write to .wav file in little-endian order
-      for(int n = 0; n < samp_count; n++){
-	fputc(samples[n] >> 8,sp->fp);
-	fputc(samples[n],sp->fp);
+
+      if(sp->buffer == NULL || sp->cycle != cycle){
+	// First packet of a new cycle. Align the buffer with the start of the cycle by
+	// working backward from the current time, as the old file-based version did with fseeko()
+	// This is redone every cycle so sample clock drift doesn't accumulate
+	free(sp->buffer); // Only if the end_cycle() was missed
+	sp->buffer_frames = Period * sp->samprate;
+	sp->buffer = calloc(sp->buffer_frames * sp->channels,sizeof(*sp->buffer));
+	if(sp->buffer == NULL)
+	  continue;
+	long long const into_cycle = (now.tv_sec - cycle) * 1000000000LL + now.tv_nsec;
+	sp->start_ts = rtp.timestamp - (uint32_t)((into_cycle * sp->samprate) / 1000000000);
+	sp->cycle = cycle;
+	sp->frames = 0;
       }
+      // Place by RTP timestamp; lost packets stay as zeroes and reordered ones land in the right place
+      uint32_t const index = rtp.timestamp - sp->start_ts;
+      int count = frame_count;
+      if(index >= (uint32_t)sp->buffer_frames)
+	count = 0;
+      else if(index + count > (uint32_t)sp->buffer_frames)
+	count = sp->buffer_frames - index;
+      if(count < frame_count)
+	sp->SamplesLate += (frame_count - count) * sp->channels;
+
+      // Packet samples are in big-endian order; keep in host order
+      int16_t *wp = sp->buffer + index * sp->channels;
+      for(int n = 0; n < count * sp->channels; n++)
+	wp[n] = ntohs(samples[n]);
+      if(count > 0 && index + count > (uint32_t)sp->frames)
+	sp->frames = index + count;
+      sp->SamplesWritten += count * sp->channels;
     } // end of packet processing
-  }      
-}
-void cleanup(void){
-  while(Sessions){
-    // Flush and close each write stream
-    // Be anal-retentive about freeing and clearing stuff even though we're about to exit
-    struct session * const next_s = Sessions->next;
-    fflush(Sessions->fp);
-    fclose(Sessions->fp);
-    Sessions->fp = NULL;
-    free(Sessions->iobuffer);
-    Sessions->iobuffer = NULL;
-    free(Sessions);
-    Sessions = next_s;
   }
 }
-struct session *create_session(struct rtp_header *rtp){
 
-  struct session * const sp = calloc(1,sizeof(*sp));
-  if(sp == NULL)
-    return NULL; // unlikely
-  
-  memcpy(&sp->sender,&Sender,sizeof(sp->sender));
-  sp->type = rtp->type;
-  sp->ssrc = rtp->ssrc;
-  
-  sp->channels = channels_from_pt(sp->type);
-  sp->samprate = samprate_from_pt(sp->type);
-  
-  struct timespec current_time;
-  clock_gettime(CLOCK_REALTIME,&current_time);
-  // Microsecond within 2-minute (120 sec) period
-  long long const start_offset_nsec = (current_time.tv_nsec + 1000000000 * current_time.tv_sec) % 120000000000LL;
-  
-  // Use the previous 120-second point as the start of this file
-  struct timespec start_time;
-  start_time.tv_sec = current_time.tv_sec - (start_offset_nsec / 1000000000);
-  start_time.tv_nsec = start_offset_nsec % 1000000000;
-  struct tm const * const tm = gmtime(&start_time.tv_sec);
-  
-  int fd = -1;
+// Queue one stream's buffer for the cycle that just ended; called from session_walk() with Queue_mutex held
+static void queue_session(void *owner,void *arg){
+  struct session * const sp = owner;
+  struct cycle_stats * const stats = arg;
+  if(sp->buffer == NULL || sp->cycle != stats->cycle || sp->frames == 0)
+    return; // Nothing this cycle
+
+  struct job *jp = calloc(1,sizeof(*jp));
+  if(jp == NULL)
+    return;
+  jp->ssrc = sp->ssrc;
+  jp->samprate = sp->samprate;
+  jp->channels = sp->channels;
+  jp->buffer = sp->buffer;
+  jp->frames = sp->frames;
+  jp->cycle = stats->cycle;
+  clock_gettime(CLOCK_REALTIME,&jp->queued);
+  jp->stats = stats;
+  sp->buffer = NULL; // Next cycle gets a new one
+
+  if(Queue_tail)
+    Queue_tail->next = jp;
+  else
+    Queue_head = jp;
+  Queue_tail = jp;
+  Queue_depth++;
+  stats->jobs++;
+}
+
+// Queue every stream's buffer for the cycle that just ended
+void end_cycle(time_t cycle){
+  struct cycle_stats *stats = calloc(1,sizeof(*stats));
+  if(stats == NULL)
+    return;
+  stats->cycle = cycle;
+
+  // Hold the queue until every job is on it, so the cycle isn't reported complete early
+  pthread_mutex_lock(&Queue_mutex);
+  session_walk(&Sessions,queue_session,stats);
+  if(stats->jobs == 0)
+    free(stats);
+  else
+    pthread_cond_broadcast(&Queue_cond);
+  int const depth = Queue_depth;
+  pthread_mutex_unlock(&Queue_mutex);
+  if(Verbose)
+    fprintf(stderr,"cycle %ld ended, decode queue %d\n",(long)cycle,depth);
+}
+
+static double elapsed(struct timespec const *a,struct timespec const *b){
+  return (b->tv_sec - a->tv_sec) + 1e-9 * (b->tv_nsec - a->tv_nsec);
+}
+
+// Write the cycle buffer as a .wav file for the decoder; returns 0 on success
+static int write_wav(struct job const *jp,char *filename,int len){
+  struct tm tm;
+  gmtime_r(&jp->cycle,&tm);
   char dir[PATH_MAX];
-  snprintf(dir,sizeof(dir),"%u",sp->ssrc);
+  snprintf(dir,sizeof(dir),"%u",jp->ssrc);
   if(mkdir(dir,0777) == -1 && errno != EEXIST)
     fprintf(stderr,"can't create directory %s: %s\n",dir,strerror(errno));
   // Try to create file in directory whether or not the mkdir succeeded
-  snprintf(sp->filename,sizeof(sp->filename),"%s/%u/%02d%02d%02d_%02d%02d.wav",
+  snprintf(filename,len,"%s/%u/%02d%02d%02d_%02d%02d.wav",
 	   Recordings,
-	   sp->ssrc,
-	   (tm->tm_year+1900) % 100,
-	   tm->tm_mon+1,
-	   tm->tm_mday,
-	   tm->tm_hour,
-	   tm->tm_min);
-  fd = open(sp->filename,O_RDWR|O_CREAT,0777);
+	   jp->ssrc,
+	   (tm.tm_year+1900) % 100,
+	   tm.tm_mon+1,
+	   tm.tm_mday,
+	   tm.tm_hour,
+	   tm.tm_min);
+  int fd = open(filename,O_RDWR|O_CREAT|O_TRUNC,0777);
   if(fd == -1){
     // couldn't create directory or create file in directory; create in current dir
-    fprintf(stderr,"can't create/write file %s: %s\n",sp->filename,strerror(errno));
-    snprintf(sp->filename,sizeof(sp->filename),"%02d%02d%02d_%02d%02d.wav",
-	     (tm->tm_year+1900) % 100,
-	     tm->tm_mon+1,
-	     tm->tm_mday,
-	     tm->tm_hour,
-	     tm->tm_min);
-    fd = open(sp->filename,O_RDWR|O_CREAT,0777);
-  }    
+    fprintf(stderr,"can't create/write file %s: %s\n",filename,strerror(errno));
+    snprintf(filename,len,"%02d%02d%02d_%02d%02d.wav",
+	     (tm.tm_year+1900) % 100,
+	     tm.tm_mon+1,
+	     tm.tm_mday,
+	     tm.tm_hour,
+	     tm.tm_min);
+    fd = open(filename,O_RDWR|O_CREAT|O_TRUNC,0777);
+  }
   if(fd == -1){
-    fprintf(stderr,"can't create/write file %s: %s\n",sp->filename,strerror(errno));
-    free(sp);
-    return NULL;
+    fprintf(stderr,"can't create/write file %s: %s\n",filename,strerror(errno));
+    return -1;
   }
-  // Use fdopen on a file descriptor instead of fopen(,"w+") to avoid the implicit truncation
-  // This allows testing where we're killed and rapidly restarted in the same cycle
-  sp->fp = fdopen(fd,"w+");
-  if(Verbose)
-    fprintf(stderr,"creating %s\n",sp->filename);
-
-  // file create succeded, now put us at top of list
-  sp->prev = NULL;
-  sp->next = Sessions;
-  
-  if(sp->next)
-    sp->next->prev = sp;
-  
-  Sessions = sp;
-  
-  sp->iobuffer = malloc(BUFFERSIZE);
-  setbuffer(sp->fp,sp->iobuffer,BUFFERSIZE);
-  
-  fcntl(fd,F_SETFL,O_NONBLOCK); // Let's see if this keeps us from losing data
-  
-  attrprintf(fd,"samplerate","%lu",(unsigned long)sp->samprate);
-  attrprintf(fd,"channels","%d",sp->channels);
-  attrprintf(fd,"ssrc","%u",rtp->ssrc);
+  int const data_bytes = jp->frames * jp->channels * sizeof(int16_t);
+  struct wav header;
+  memcpy(header.ChunkID,"RIFF", 4);
+  header.ChunkSize = sizeof(header) - 8 + data_bytes;
+  memcpy(header.Format,"WAVE",4);
+  memcpy(header.Subchunk1ID,"fmt ",4);
+  header.Subchunk1Size = 16;
+  header.AudioFormat = 1;
+  header.NumChannels = jp->channels;
+  header.SampleRate = jp->samprate;
+  header.ByteRate = jp->samprate * jp->channels * 16/8;
+  header.BlockAlign = jp->channels * 16/8;
+  header.BitsPerSample = 16;
+  memcpy(header.SubChunk2ID,"data",4);
+  header.Subchunk2Size = data_bytes;
+
+  int r = 0;
+  if(write(fd,&header,sizeof(header)) != sizeof(header) || write(fd,jp->buffer,data_bytes) != data_bytes){
+    fprintf(stderr,"write %s: %s\n",filename,strerror(errno));
+    r = -1;
+  }
+  attrprintf(fd,"samplerate","%lu",(unsigned long)jp->samprate);
+  attrprintf(fd,"channels","%d",jp->channels);
+  attrprintf(fd,"ssrc","%u",jp->ssrc);
   attrprintf(fd,"sampleformat","s16le");
-  
-  // Write .wav header, skipping size fields
-  memcpy(sp->header.ChunkID,"RIFF", 4);
-  sp->header.ChunkSize = 0xffffffff; // Temporary
-  memcpy(sp->header.Format,"WAVE",4);
-  memcpy(sp->header.Subchunk1ID,"fmt ",4);
-  sp->header.Subchunk1Size = 16;
-  sp->header.AudioFormat = 1;
-  sp->header.NumChannels = sp->channels;
-  sp->header.SampleRate = sp->samprate;
-  
-  sp->header.ByteRate = sp->samprate * sp->channels * 16/8;
-  sp->header.BlockAlign = sp->channels * 16/8;
-  sp->header.BitsPerSample = 16;
-  memcpy(sp->header.SubChunk2ID,"data",4);
-  sp->header.Subchunk2Size = 0xffffffff; // Temporary
-  fwrite(&sp->header,sizeof(sp->header),1,sp->fp);
-  fflush(sp->fp); // get at least the header out there
-
-  char sender_text[NI_MAXHOST];
-  // Don't wait for an inverse resolve that might cause us to lose data
-  getnameinfo((struct sockaddr *)&Sender,sizeof(Sender),sender_text,sizeof(sender_text),NULL,0,NI_NOFQDN|NI_DGRAM|NI_NUMERICHOST);
-  attrprintf(fd,"source","%s",sender_text);
   attrprintf(fd,"multicast","%s",PCM_mcast_address_text);
-  attrprintf(fd,"unixstarttime","%ld.%09ld",(long)start_time.tv_sec,(long)start_time.tv_nsec);
+  attrprintf(fd,"unixstarttime","%ld.%09ld",(long)jp->cycle,0L);
+  close(fd);
+  return r;
+}
 
-  // Seek into the file for the first write
-  // The parentheses are carefully drawn to ensure the result is on a block boundary despite truncations
-  fseeko(sp->fp,((start_offset_nsec * sp->samprate)/ 1000000000) * sp->header.BlockAlign,SEEK_CUR); // offset is in bytes
-  return sp;
+// Run the decoder on one file at the configured priority; returns its exit status and CPU time
+static int run_decoder(char const *cmd,double *cpu){
+  pid_t const pid = fork();
+  if(pid == -1){
+    perror("fork");
+    return -1;
+  }
+  if(pid == 0){
+    setpriority(PRIO_PROCESS,0,Decoder_nice);
+    execl("/bin/sh","sh","-c",cmd,(char *)NULL);
+    _exit(127);
+  }
+  int status = 0;
+  struct rusage usage;
+  memset(&usage,0,sizeof(usage));
+  while(wait4(pid,&status,0,&usage) == -1){
+    if(errno != EINTR){
+      perror("wait4");
+      return -1;
+    }
+  }
+  *cpu = usage.ru_utime.tv_sec + 1e-6 * usage.ru_utime.tv_usec + usage.ru_stime.tv_sec + 1e-6 * usage.ru_stime.tv_usec;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
 }
 
-void close_session(struct session **p){
-  if(p == NULL)
-    return;
-  struct session * const sp = *p;
+// Decoder pool thread
+void *decode_worker(void *arg){
+  pthread_setname("decode");
+
+  while(1){
+    pthread_mutex_lock(&Queue_mutex);
+    while(Queue_head == NULL)
+      pthread_cond_wait(&Queue_cond,&Queue_mutex);
+    struct job * const jp = Queue_head;
+    Queue_head = jp->next;
+    if(Queue_head == NULL)
+      Queue_tail = NULL;
+    Queue_depth--;
+    pthread_mutex_unlock(&Queue_mutex);
+
+    struct timespec start;
+    clock_gettime(CLOCK_REALTIME,&start);
+    double const wait = elapsed(&jp->queued,&start);
+    double decode = 0,cpu = 0;
+    int skipped = 0,failed = 0;
+
+    if(start.tv_sec >= jp->cycle + 2 * Period){
+      // A whole cycle behind; decoding it would only make the next one late too
+      skipped = 1;
+      if(Verbose)
+	fprintf(stderr,"ssrc %u cycle %ld: too late to decode, skipped\n",jp->ssrc,(long)jp->cycle);
+    } else {
+      char filename[PATH_MAX];
+      if(write_wav(jp,filename,sizeof(filename)) == 0){
+	char cmd[16384];
+	snprintf(cmd,sizeof(cmd),Wsprd_command,
+		 Recordings,jp->ssrc,(double)jp->ssrc * 1e-6,filename);
+	if(Verbose)
+	  fprintf(stderr,"%s\n",cmd);
+	struct timespec t0,t1;
+	clock_gettime(CLOCK_REALTIME,&t0);
+	int const r = run_decoder(cmd,&cpu);
+	clock_gettime(CLOCK_REALTIME,&t1);
+	decode = elapsed(&t0,&t1);
+	if(r != 0){
+	  failed = 1;
+	  if(Verbose)
+	    fprintf(stderr,"decoder returned %d\n",r);
+	}
+	if(Verbose)
+	  fprintf(stderr,"ssrc %u cycle %ld: wait %.2f decode %.2f cpu %.2f sec\n",jp->ssrc,(long)jp->cycle,wait,decode,cpu);
+      } else
+	failed = 1;
+      if(!Keep_wav)
+	unlink(filename);
+    }
+    free(jp->buffer);
+
+    struct timespec finish;
+    clock_gettime(CLOCK_REALTIME,&finish);
+    // Relative to the end of recording
+    double const finished = finish.tv_sec - (jp->cycle + End) + 1e-9 * finish.tv_nsec;
+
+    struct cycle_stats * const stats = jp->stats;
+    free(jp);
+    pthread_mutex_lock(&Queue_mutex);
+    stats->done++;
+    stats->skipped += skipped;
+    stats->failed += failed;
+    stats->max_wait = max(stats->max_wait,wait);
+    stats->max_decode = max(stats->max_decode,decode);
+    stats->cpu += cpu;
+    stats->last_finish = max(stats->last_finish,finished);
+    int const complete = stats->done == stats->jobs;
+    pthread_mutex_unlock(&Queue_mutex);
+
+    if(complete){
+      // Last decode of the cycle; log how close we came to the next one
+      struct tm tm;
+      gmtime_r(&stats->cycle,&tm);
+      printf("cycle %02d:%02d:%02d: %d streams, %d skipped, %d failed; max wait %.1f s, max decode %.1f s, cpu %.1f s; done %.1f s after end (%.1f s to spare)%s\n",
+	     tm.tm_hour,tm.tm_min,tm.tm_sec,
+	     stats->jobs,stats->skipped,stats->failed,
+	     stats->max_wait,stats->max_decode,stats->cpu,
+	     stats->last_finish,Period - stats->last_finish,
+	     stats->last_finish > Period ? " LATE" : "");
+      fflush(stdout);
+      free(stats);
+    }
+  }
+  return NULL;
+}
+
+// Free a session at exit; called from session_drain()
+static void free_session(void *owner){
+  struct session * const sp = owner;
+  if(Verbose)
+    printf("ssrc %u: %'lld samples, %'lld late\n",sp->ssrc,(long long)sp->SamplesWritten,(long long)sp->SamplesLate);
+  free(sp->buffer);
+  free(sp);
+}
+
+void cleanup(void){
+  // Free the partial cycle buffers; decodes in progress are abandoned
+  // Be anal-retentive about freeing and clearing stuff even though we're about to exit
+  session_drain(&Sessions,free_session);
+}
+
+struct session *create_session(struct rtp_header *rtp){
+
+  struct session * const sp = calloc(1,sizeof(*sp));
   if(sp == NULL)
-    return;
+    return NULL; // unlikely
 
+  memcpy(&sp->sender,&Sender,sizeof(sp->sender));
+  sp->type = rtp->type;
+  sp->ssrc = rtp->ssrc;
+
+  sp->channels = channels_from_pt(sp->type);
+  sp->samprate = samprate_from_pt(sp->type);
+  if(sp->channels <= 0 || sp->samprate == 0){
+    free(sp);
+    return NULL; // Not a PCM stream
+  }
+  session_insert(&Sessions,&sp->entry,sp,&sp->sender,sp->ssrc,sp->type);
+
+  if(Verbose){
+    char sender_text[NI_MAXHOST];
+    // Don't wait for an inverse resolve that might cause us to lose data
+    getnameinfo((struct sockaddr *)&Sender,sizeof(Sender),sender_text,sizeof(sender_text),NULL,0,NI_NOFQDN|NI_DGRAM|NI_NUMERICHOST);
+    fprintf(stderr,"new stream ssrc %u from %s, %u Hz, %d channels\n",sp->ssrc,sender_text,sp->samprate,sp->channels);
+  }
+  return sp;
+}
+
+// Forget an idle stream; called from session_expire() after it has been removed from the table
+// Any buffer it still holds is a partial cycle end_cycle() didn't take
+void close_session(void *arg){
+  struct session * const sp = arg;
   if(Verbose)
-    printf("closing %s %'.1f/%'.1f sec\n",sp->filename,
-	   (float)sp->SamplesWritten / sp->samprate,
-	   (float)sp->TotalFileSamples / sp->samprate);
-  
-  // Get final file size, write .wav header with sizes
-  fflush(sp->fp);
-  struct stat statbuf;
-  fstat(fileno(sp->fp),&statbuf);
-  sp->header.ChunkSize = statbuf.st_size - 8;
-  sp->header.Subchunk2Size = statbuf.st_size - sizeof(sp->header);
-  rewind(sp->fp);
-  fwrite(&sp->header,sizeof(sp->header),1,sp->fp);
-  fflush(sp->fp);
-  fclose(sp->fp);
-  sp->fp = NULL;
-  free(sp->iobuffer);
-  sp->iobuffer = NULL;
-  if(sp->prev)
-    sp->prev->next = sp->next;
-  else
-    Sessions = sp->next;
-  if(sp->next)
-    sp->next->prev = sp->prev;
+    fprintf(stderr,"ssrc %u idle, closing; %'lld samples, %'lld late\n",sp->ssrc,(long long)sp->SamplesWritten,(long long)sp->SamplesLate);
+  free(sp->buffer);
   free(sp);
-  *p = NULL;
 }